@@ -19,6 +19,7 @@ enum action
 	ACTION_DIFF,
 	ACTION_DIFF_LONG,
 	ACTION_MONITOR,
+	ACTION_JOURNAL,
 };
 
 #endif
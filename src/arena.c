@@ -0,0 +1,116 @@
+#include "burp.h"
+#include "alloc.h"
+#include "arena.h"
+#include "log.h"
+
+static uint64_t arenas=0;
+static uint64_t blocks=0;
+static uint64_t allocations=0;
+static uint64_t bytes=0;
+static uint64_t resets=0;
+
+#define ARENA_ALIGN(x)	(((x)+7) & ~((size_t)7))
+#define BLOCK_HEADER	ARENA_ALIGN(sizeof(struct arena_block))
+
+static char *block_data(struct arena_block *b)
+{
+	return (char *)b+BLOCK_HEADER;
+}
+
+struct arena *arena_alloc(void)
+{
+	struct arena *arena;
+	if(!(arena=(struct arena *)calloc_w(1, sizeof(struct arena), __func__)))
+		return NULL;
+	arenas++;
+	return arena;
+}
+
+void arena_free(struct arena **arena)
+{
+	struct arena_block *b;
+	struct arena_block *next;
+	if(!arena || !*arena) return;
+	for(b=(*arena)->head; b; b=next)
+	{
+		next=b->next;
+		free_v((void **)&b);
+	}
+	free_v((void **)arena);
+}
+
+static struct arena_block *block_alloc(size_t size)
+{
+	struct arena_block *b;
+	if(!(b=(struct arena_block *)malloc_w(BLOCK_HEADER+size, __func__)))
+		return NULL;
+	b->next=NULL;
+	b->size=size;
+	b->used=0;
+	blocks++;
+	return b;
+}
+
+void *arena_malloc(struct arena *arena, size_t size)
+{
+	char *ret;
+	struct arena_block *b;
+
+	size=ARENA_ALIGN(size);
+	// Look for room in the current block, then in any after it that are
+	// left over from before the last reset.
+	for(b=arena->current; b; b=b->next)
+	{
+		if(b->size-b->used>=size)
+			break;
+		if(b->next)
+			b->next->used=0;
+	}
+	if(!b)
+	{
+		if(!(b=block_alloc(size>ARENA_BLOCK_SIZE?
+			size:ARENA_BLOCK_SIZE)))
+				return NULL;
+		if(arena->current)
+		{
+			b->next=arena->current->next;
+			arena->current->next=b;
+		}
+		else
+			arena->head=b;
+	}
+	arena->current=b;
+	ret=block_data(b)+b->used;
+	b->used+=size;
+	allocations++;
+	bytes+=size;
+	return ret;
+}
+
+// Everything handed out so far becomes invalid, but the blocks are kept
+// for reuse.
+void arena_reset(struct arena *arena)
+{
+	if(!arena->head) return;
+	arena->head->used=0;
+	arena->current=arena->head;
+	resets++;
+}
+
+int arena_owns(struct arena *arena, const void *ptr)
+{
+	struct arena_block *b;
+	const char *p=(const char *)ptr;
+	for(b=arena->head; b; b=b->next)
+		if(p>=block_data(b) && p<block_data(b)+b->size)
+			return 1;
+	return 0;
+}
+
+void arena_print_stats(void)
+{
+	if(!arenas) return;
+	logp("Arenas: %" PRIu64 ", blocks: %" PRIu64 ", allocations: %" PRIu64
+		", bytes: %" PRIu64 ", resets: %" PRIu64 "\n",
+		arenas, blocks, allocations, bytes, resets);
+}
@@ -0,0 +1,33 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include "burp.h"
+
+// A simple bump allocator. Memory is handed out from big blocks and is
+// only given back all at once, by resetting or freeing the arena.
+
+#define ARENA_BLOCK_SIZE	65536
+
+struct arena_block
+{
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+};
+
+struct arena
+{
+	struct arena_block *head;
+	struct arena_block *current;
+};
+
+extern struct arena *arena_alloc(void);
+extern void arena_free(struct arena **arena);
+
+extern void *arena_malloc(struct arena *arena, size_t size);
+extern void arena_reset(struct arena *arena);
+extern int arena_owns(struct arena *arena, const void *ptr);
+
+extern void arena_print_stats(void);
+
+#endif
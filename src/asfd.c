@@ -2,6 +2,7 @@
 #include "alloc.h"
 #include "asfd.h"
 #include "async.h"
+#include "budget.h"
 #include "cmd.h"
 #include "fsops.h"
 #include "handy.h"
@@ -150,9 +151,24 @@ static int asfd_do_write_ncurses(struct asfd *asfd)
 }
 #endif
 
+// Only the connection between a server child and its client counts towards
+// the server-wide network budget.
+static int check_budget(struct asfd *asfd)
+{
+	if(asfd->fdtype!=ASFD_FD_CHILD_MAIN) return 0;
+	return budget_wait(BUDGET_NETWORK);
+}
+
+static void charge_budget(struct asfd *asfd, ssize_t bytes)
+{
+	if(asfd->fdtype!=ASFD_FD_CHILD_MAIN || bytes<=0) return;
+	budget_charge(BUDGET_NETWORK, (size_t)bytes);
+}
+
 static int asfd_do_read(struct asfd *asfd)
 {
 	ssize_t r;
+	if(check_budget(asfd)) return 0;
 	r=read(asfd->fd,
 		asfd->readbuf+asfd->readbuflen, bufmaxsize-asfd->readbuflen);
 	if(r<0)
@@ -170,6 +186,7 @@ static int asfd_do_read(struct asfd *asfd)
 		goto error;
 	}
 	asfd->readbuflen+=r;
+	charge_budget(asfd, r);
 	return 0;
 error:
 	truncate_readbuf(asfd);
@@ -183,6 +200,7 @@ static int asfd_do_read_ssl(struct asfd *asfd)
 
 	asfd->read_blocked_on_write=0;
 
+	if(check_budget(asfd)) return 0;
 	ERR_clear_error();
 	r=SSL_read(asfd->ssl,
 		asfd->readbuf+asfd->readbuflen, bufmaxsize-asfd->readbuflen);
@@ -192,6 +210,7 @@ static int asfd_do_read_ssl(struct asfd *asfd)
 		case SSL_ERROR_NONE:
 			asfd->readbuflen+=r;
 			asfd->readbuf[asfd->readbuflen]='\0';
+			charge_budget(asfd, r);
 			break;
 		case SSL_ERROR_ZERO_RETURN:
 			// End of data.
@@ -262,6 +281,7 @@ static int asfd_do_write(struct asfd *asfd)
 {
 	ssize_t w;
 	if(asfd->ratelimit && check_ratelimit(asfd)) return 0;
+	if(check_budget(asfd)) return 0;
 
 	w=write(asfd->fd, asfd->writebuf, asfd->writebuflen);
 	if(w<0)
@@ -278,6 +298,7 @@ static int asfd_do_write(struct asfd *asfd)
 		return -1;
 	}
 	if(asfd->ratelimit) asfd->rlbytes+=w;
+	charge_budget(asfd, w);
 /*
 {
 char buf[100000]="";
@@ -299,6 +320,7 @@ static int asfd_do_write_ssl(struct asfd *asfd)
 	asfd->write_blocked_on_read=0;
 
 	if(asfd->ratelimit && check_ratelimit(asfd)) return 0;
+	if(check_budget(asfd)) return 0;
 	ERR_clear_error();
 	w=SSL_write(asfd->ssl, asfd->writebuf, asfd->writebuflen);
 
@@ -313,6 +335,7 @@ printf("wrote %d: %s\n", w, buf);
 }
 */
 			if(asfd->ratelimit) asfd->rlbytes+=w;
+			charge_budget(asfd, w);
 			memmove(asfd->writebuf,
 				asfd->writebuf+w, asfd->writebuflen-w);
 			asfd->writebuflen-=w;
@@ -39,6 +39,7 @@
 #include "burp.h"
 #include "attribs.h"
 #include "alloc.h"
+#include "arena.h"
 #include "base64.h"
 #include "berrno.h"
 #include "cmd.h"
@@ -46,6 +47,97 @@
 #include "log.h"
 #include "sbuf.h"
 
+static int binary=0;
+
+// Set once both ends have agreed to use binary attributes.
+void attribs_set_binary(int value)
+{
+	binary=value;
+}
+
+int attribs_is_binary(struct iobuf *attr)
+{
+	return attr->buf && attr->len && *attr->buf==ATTRIBS_BINARY;
+}
+
+// Zigzag, so that small negative numbers stay small, then seven bits at a
+// time with the top bit set on all but the last byte.
+static char *put_varint(char *p, int64_t value)
+{
+	uint64_t val=((uint64_t)value<<1)^(uint64_t)(value>>63);
+	while(val>=0x80)
+	{
+		*p++=(char)(val|0x80);
+		val>>=7;
+	}
+	*p++=(char)val;
+	return p;
+}
+
+// Anything missing off the end comes out as zero.
+static const char *get_varint(const char *p, const char *end, int64_t *value)
+{
+	int shift=0;
+	uint8_t c;
+	uint64_t val=0;
+	while(p<end && shift<64)
+	{
+		c=(uint8_t)*p++;
+		val|=(uint64_t)(c&0x7F)<<shift;
+		if(!(c&0x80))
+			break;
+		shift+=7;
+	}
+	*value=(int64_t)(val>>1)^-(int64_t)(val&1);
+	return p;
+}
+
+// The same fields in the same order as the base64 version, but each one is
+// a varint, with no separators.
+static void attribs_encode_binary(struct sbuf *sb)
+{
+	char *p=sb->attr.buf;
+	struct stat *statp=&sb->statp;
+
+	*p++=ATTRIBS_BINARY;
+	*p++=ATTRIBS_BINARY_VERSION;
+	if(sb->protocol2)
+	{
+		p=put_varint(p, sb->protocol2->index);
+		p=put_varint(p, sb->compression);
+		p=put_varint(p, sb->protocol2->encryption);
+	}
+	p=put_varint(p, statp->st_dev);
+	p=put_varint(p, statp->st_ino);
+	p=put_varint(p, statp->st_mode);
+	p=put_varint(p, statp->st_nlink);
+	p=put_varint(p, statp->st_uid);
+	p=put_varint(p, statp->st_gid);
+	p=put_varint(p, statp->st_rdev);
+	p=put_varint(p, statp->st_size);
+#ifdef HAVE_WIN32
+	p=put_varint(p, 0); // place holder
+	p=put_varint(p, 0); // place holder
+#else
+	p=put_varint(p, statp->st_blksize);
+	p=put_varint(p, statp->st_blocks);
+#endif
+	p=put_varint(p, statp->st_atime);
+	p=put_varint(p, statp->st_mtime);
+	p=put_varint(p, statp->st_ctime);
+#ifdef HAVE_CHFLAGS
+	p=put_varint(p, statp->st_flags);
+#else
+	p=put_varint(p, 0); // place holder
+#endif
+	p=put_varint(p, sb->winattr);
+	if(sb->protocol1)
+		p=put_varint(p, sb->compression);
+	*p=0;
+
+	sb->attr.len=p-sb->attr.buf;
+}
+
 // Encode a stat structure into a base64 character string.
 int attribs_encode(struct sbuf *sb)
 {
@@ -58,6 +150,11 @@ int attribs_encode(struct sbuf *sb)
 		if(!(sb->attr.buf=(char *)malloc_w(256, __func__)))
 			return -1;
 	}
+	if(binary)
+	{
+		attribs_encode_binary(sb);
+		return 0;
+	}
 	p=sb->attr.buf;
 	statp=&sb->statp;
 
@@ -146,6 +243,71 @@ int attribs_encode(struct sbuf *sb)
 	#endif
 #endif
 
+static void attribs_decode_binary(struct sbuf *sb)
+{
+	int64_t val;
+	const char *p=sb->attr.buf+2;
+	const char *end=sb->attr.buf+sb->attr.len;
+	struct stat *statp=&sb->statp;
+
+	// Later versions may only add fields on the end.
+	if(sb->protocol2)
+	{
+		p=get_varint(p, end, &val);
+		sb->protocol2->index=val;
+		p=get_varint(p, end, &val);
+		sb->compression=val;
+		p=get_varint(p, end, &val);
+		sb->protocol2->encryption=val;
+	}
+	p=get_varint(p, end, &val);
+	plug(statp->st_dev, val);
+	p=get_varint(p, end, &val);
+	plug(statp->st_ino, val);
+	p=get_varint(p, end, &val);
+	plug(statp->st_mode, val);
+	p=get_varint(p, end, &val);
+	plug(statp->st_nlink, val);
+	p=get_varint(p, end, &val);
+	plug(statp->st_uid, val);
+	p=get_varint(p, end, &val);
+	plug(statp->st_gid, val);
+	p=get_varint(p, end, &val);
+	plug(statp->st_rdev, val);
+	p=get_varint(p, end, &val);
+	plug(statp->st_size, val);
+	p=get_varint(p, end, &val);
+#ifndef HAVE_WIN32
+	plug(statp->st_blksize, val);
+#endif
+	p=get_varint(p, end, &val);
+#ifndef HAVE_WIN32
+	plug(statp->st_blocks, val);
+#endif
+	p=get_varint(p, end, &val);
+	plug(statp->st_atime, val);
+	p=get_varint(p, end, &val);
+	plug(statp->st_mtime, val);
+	p=get_varint(p, end, &val);
+	plug(statp->st_ctime, val);
+	p=get_varint(p, end, &val);
+#ifdef HAVE_CHFLAGS
+	plug(statp->st_flags, val);
+#endif
+	p=get_varint(p, end, &val);
+	sb->winattr=val;
+	if(sb->protocol1)
+	{
+		if(p<end)
+		{
+			p=get_varint(p, end, &val);
+			sb->compression=val;
+		}
+		else
+			sb->compression=-1;
+	}
+}
+
 // Decode a stat packet from base64 characters.
 void attribs_decode(struct sbuf *sb)
 {
@@ -154,6 +316,11 @@ void attribs_decode(struct sbuf *sb)
 	static struct stat *statp;
 
 	if(!(p=sb->attr.buf)) return;
+	if(*p==ATTRIBS_BINARY)
+	{
+		attribs_decode_binary(sb);
+		return;
+	}
 	statp=&sb->statp;
 
 	if(sb->protocol2)
@@ -281,9 +448,38 @@ static int set_file_times(struct asfd *asfd,
 	return 0;
 }
 
+// Encode into a new buffer, because the one that the attributes were read
+// into might not be big enough for the result.
+int attribs_reencode(struct sbuf *sb)
+{
+	if(sb->arena && sb->attr.buf && arena_owns(sb->arena, sb->attr.buf))
+	{
+		if(!(sb->attr.buf=(char *)arena_malloc(sb->arena, 256)))
+			return -1;
+	}
+	else
+		free_w(&sb->attr.buf);
+	return attribs_encode(sb);
+}
+
+// Attributes from a manifest may be binary when binary attributes are not
+// in use for the current connection, so convert them before sending them
+// to the peer.
+int attribs_for_peer(struct sbuf *sb)
+{
+	if(binary || !attribs_is_binary(&sb->attr))
+		return 0;
+	return attribs_reencode(sb);
+}
+
 uint64_t decode_file_no(struct iobuf *iobuf)
 {
 	int64_t val;
+	if(attribs_is_binary(iobuf))
+	{
+		get_varint(iobuf->buf+2, iobuf->buf+iobuf->len, &val);
+		return (uint64_t)val;
+	}
 	from_base64(&val, iobuf->buf);
 	return (uint64_t)val;
 }
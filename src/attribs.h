@@ -3,9 +3,19 @@
 
 #include "sbuf.h"
 
+// Binary attributes start with this byte, which cannot start the base64
+// form, followed by a version byte.
+#define ATTRIBS_BINARY		0x01
+#define ATTRIBS_BINARY_VERSION	0x01
+
+extern void attribs_set_binary(int value);
+extern int attribs_is_binary(struct iobuf *attr);
+
 extern int attribs_encode(struct sbuf *sb);
 
 extern void attribs_decode(struct sbuf *sb);
+extern int attribs_reencode(struct sbuf *sb);
+extern int attribs_for_peer(struct sbuf *sb);
 
 extern int attribs_set(struct asfd *asfd, const char *path, struct stat *statp,
 	uint64_t winattr, struct cntr *cntr);
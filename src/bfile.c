@@ -8,8 +8,56 @@
 #include <sys/paths.h>
 #endif
 
+// How many of the files coming up to ask the OS to start reading, and how
+// much of each one. Zero files means off.
+static int read_ahead_files=0;
+static uint64_t read_ahead_size=0;
+
+void bfile_set_read_ahead(int files, uint64_t size)
+{
+	read_ahead_files=files;
+	read_ahead_size=size;
+}
+
+int bfile_read_ahead_files(void)
+{
+	return read_ahead_files;
+}
+
+// Restored file data arrives in small pieces, so it is gathered up here and
+// written out in big chunks. Only one file is ever being restored at a time,
+// so there is a single buffer, which belongs to whichever BFILE got it first.
+static char *wbuf=NULL;
+static size_t wbuf_size=0;
+static size_t wbuf_len=0;
+static BFILE *wbuf_owner=NULL;
+static int preallocate=0;
+
+void bfile_set_restore_writes(uint64_t buffer_size, int prealloc)
+{
+	preallocate=prealloc;
+	if(wbuf_size==buffer_size) return;
+	free_w(&wbuf);
+	wbuf_size=buffer_size;
+	wbuf_len=0;
+	wbuf_owner=NULL;
+}
+
+#ifndef HAVE_WIN32
+static int wbuf_owner_flush(void);
+#endif
+
 void bfile_free(BFILE **bfd)
 {
+#ifndef HAVE_WIN32
+	// Callers close first, but do not leave the buffer pointing at
+	// freed memory if one did not.
+	if(bfd && *bfd && *bfd==wbuf_owner && wbuf_owner_flush())
+	{
+		wbuf_owner=NULL;
+		wbuf_len=0;
+	}
+#endif
 	free_v((void **)bfd);
 }
 
@@ -414,11 +462,54 @@ static ssize_t bfile_write(BFILE *bfd, void *buf, size_t count)
 
 #else
 
+static int write_all(int fd, const char *buf, size_t count)
+{
+	ssize_t w;
+	while(count)
+	{
+		if((w=write(fd, buf, count))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		buf+=w;
+		count-=(size_t)w;
+	}
+	return 0;
+}
+
+static int wbuf_flush(BFILE *bfd)
+{
+	size_t len=wbuf_len;
+	if(wbuf_owner!=bfd || !len) return 0;
+	wbuf_len=0;
+	return write_all(bfd->fd, wbuf, len);
+}
+
+// The buffer belongs to a file that has not been closed yet. Write out
+// what it has for that file before somebody else takes the buffer over.
+static int wbuf_owner_flush(void)
+{
+	if(!wbuf_owner) return 0;
+	if(wbuf_flush(wbuf_owner))
+	{
+		logp("Could not write buffered data to %s: %s\n",
+			wbuf_owner->path, strerror(errno));
+		return -1;
+	}
+	wbuf_owner=NULL;
+	return 0;
+}
+
 static int bfile_close(BFILE *bfd, struct asfd *asfd)
 {
+	int flushed;
 	if(!bfd || bfd->mode==BF_CLOSED) return 0;
 
-	if(!close(bfd->fd))
+	flushed=wbuf_flush(bfd);
+	if(wbuf_owner==bfd) wbuf_owner=NULL;
+
+	if(!close(bfd->fd) && !flushed)
 	{
 		if(bfd->mode==BF_WRITE)
 			attribs_set(asfd, bfd->path,
@@ -428,22 +519,55 @@ static int bfile_close(BFILE *bfd, struct asfd *asfd)
 		free_w(&bfd->path);
 		return 0;
 	}
+	if(flushed)
+	{
+		// The fd is gone either way, so do not try closing it again.
+		bfd->mode=BF_CLOSED;
+		bfd->fd=-1;
+	}
 	free_w(&bfd->path);
 	return -1;
 }
 
+static void bfile_advise(int fd, uint64_t size, int sequential)
+{
+#ifdef POSIX_FADV_WILLNEED
+	if(sequential)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, 0, (off_t)size, POSIX_FADV_WILLNEED);
+#endif
+}
+
 static int bfile_open(BFILE *bfd,
 	struct asfd *asfd, const char *fname, int flags, mode_t mode)
 {
 	if(!bfd) return 0;
 	if(bfd->mode!=BF_CLOSED && bfd->close(bfd, asfd))
 		return -1;
+	if((flags & O_CREAT || flags & O_WRONLY)
+	  && wbuf_owner_flush())
+		return -1;
 	if((bfd->fd=open(fname, flags, mode))<0)
 		return -1;
 	if(flags & O_CREAT || flags & O_WRONLY)
+	{
 		bfd->mode=BF_WRITE;
+		if(wbuf_size)
+		{
+			if(!wbuf && !(wbuf=(char *)
+				malloc_w(wbuf_size, __func__)))
+					return -1;
+			wbuf_owner=bfd;
+		}
+	}
 	else
+	{
 		bfd->mode=BF_READ;
+		// Let the kernel keep several big reads on the go, rather
+		// than waiting on each small one.
+		if(read_ahead_files)
+			bfile_advise(bfd->fd, read_ahead_size, 1);
+	}
 	if(!(bfd->path=strdup_w(fname, __func__)))
 		return -1;
 	return 0;
@@ -456,10 +580,58 @@ static ssize_t bfile_read(BFILE *bfd, void *buf, size_t count)
 
 static ssize_t bfile_write(BFILE *bfd, void *buf, size_t count)
 {
-	return write(bfd->fd, buf, count);
+	if(wbuf_owner!=bfd)
+		return write(bfd->fd, buf, count);
+	if(wbuf_len+count>wbuf_size && wbuf_flush(bfd))
+		return -1;
+	if(count>=wbuf_size)
+	{
+		if(write_all(bfd->fd, (const char *)buf, count))
+			return -1;
+		return (ssize_t)count;
+	}
+	memcpy(wbuf+wbuf_len, buf, count);
+	wbuf_len+=count;
+	return (ssize_t)count;
+}
+
+#endif
+
+// Reserve the space for a file that is being restored, now that its size
+// is known from the attributes. The file size itself is left alone, so a
+// restore that stops part way through does not leave junk on the end.
+void bfile_preallocate(BFILE *bfd)
+{
+#if !defined(HAVE_WIN32) && defined(FALLOC_FL_KEEP_SIZE)
+	if(!preallocate
+	  || !bfd
+	  || bfd->mode!=BF_WRITE
+	  || !S_ISREG(bfd->statp.st_mode)
+	  || bfd->statp.st_size<=0)
+		return;
+	// Not every file system can do it, and that is fine.
+	fallocate(bfd->fd, FALLOC_FL_KEEP_SIZE, 0, bfd->statp.st_size);
+#endif
 }
 
+// Start the OS reading a file that we will want soon. It is done in the
+// background by the kernel, so the file can be closed again straight away,
+// and several files can be on the go at once.
+void bfile_read_ahead(const char *path, int atime)
+{
+#if !defined(HAVE_WIN32) && defined(POSIX_FADV_WILLNEED)
+	int fd;
+	if(!read_ahead_files) return;
+	if((fd=open(path, O_RDONLY|O_NONBLOCK
+#ifdef O_NOATIME
+		|(atime?0:O_NOATIME)
 #endif
+		, 0))<0)
+			return;
+	bfile_advise(fd, read_ahead_size, 0);
+	close(fd);
+#endif
+}
 
 static int bfile_open_for_send(BFILE *bfd, struct asfd *asfd,
 	const char *fname, int64_t winattr, int atime,
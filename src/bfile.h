@@ -55,6 +55,14 @@ extern void bfile_free(BFILE **bfd);
 extern void bfile_init(BFILE *bfd, int64_t winattr, struct cntr *cntr);
 extern void bfile_setup_funcs(BFILE *bfd);
 
+extern void bfile_set_read_ahead(int files, uint64_t size);
+extern int bfile_read_ahead_files(void);
+extern void bfile_read_ahead(const char *path, int atime);
+
+// A buffer size of 0 means write restored data straight out.
+extern void bfile_set_restore_writes(uint64_t buffer_size, int prealloc);
+extern void bfile_preallocate(BFILE *bfd);
+
 #ifdef HAVE_WIN32
 extern int have_win32_api(void);
 #endif
@@ -0,0 +1,167 @@
+#include "burp.h"
+#include "log.h"
+#include "budget.h"
+
+#ifndef HAVE_WIN32
+#include <sys/mman.h>
+#endif
+
+// A token bucket. Tokens are bytes, and the bucket holds at most one
+// second's worth of them. It is allowed to go negative, so that a big
+// write is paid for afterwards by everybody waiting a bit longer.
+struct bucket
+{
+	uint64_t rate;
+	int64_t tokens;
+	uint64_t stamp; // Microseconds, when the tokens were last topped up.
+};
+
+// Shared with forked children, so only ever touched with atomic builtins.
+static struct bucket *buckets=NULL;
+static float budget_weight=0;
+
+#define BUDGET_MIN_SLEEP	1000
+#define BUDGET_MAX_SLEEP	100000
+
+static uint64_t budget_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000000+tv.tv_usec;
+}
+
+int budget_init(void)
+{
+#ifdef HAVE_WIN32
+	return 0;
+#else
+	void *p;
+	if(buckets) return 0;
+	if((p=mmap(NULL, sizeof(struct bucket)*BUDGET_MAX,
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0))
+			==MAP_FAILED)
+	{
+		logp("Could not mmap budgets: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(p, 0, sizeof(struct bucket)*BUDGET_MAX);
+	buckets=(struct bucket *)p;
+	return 0;
+#endif
+}
+
+void budget_free(void)
+{
+#ifndef HAVE_WIN32
+	if(!buckets) return;
+	munmap(buckets, sizeof(struct bucket)*BUDGET_MAX);
+	buckets=NULL;
+#endif
+}
+
+void budget_set_rate(enum budget_type type, float rate)
+{
+	struct bucket *b;
+	uint64_t r=rate>0?(uint64_t)rate:0;
+	if(!buckets) return;
+	b=&buckets[type];
+	if(__atomic_exchange_n(&b->rate, r, __ATOMIC_SEQ_CST)==r)
+		return;
+	// Start again with a full bucket.
+	__atomic_store_n(&b->stamp, budget_now(), __ATOMIC_SEQ_CST);
+	__atomic_store_n(&b->tokens, (int64_t)r, __ATOMIC_SEQ_CST);
+}
+
+void budget_set_weight(float weight)
+{
+	budget_weight=weight;
+}
+
+static void budget_refill(struct bucket *b, uint64_t rate)
+{
+	int64_t add;
+	int64_t tokens;
+	int64_t full;
+	uint64_t now=budget_now();
+	uint64_t last=__atomic_load_n(&b->stamp, __ATOMIC_SEQ_CST);
+
+	if(now==last) return;
+	// Only one process gets to add the tokens for each bit of time.
+	if(!__atomic_compare_exchange_n(&b->stamp, &last, now,
+		0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return;
+	// The clock went back in time.
+	if(now<last) return;
+
+	full=(int64_t)rate;
+	if(now-last>=1000000) add=full;
+	else add=(int64_t)(rate*(now-last)/1000000);
+	tokens=__atomic_load_n(&b->tokens, __ATOMIC_SEQ_CST);
+	do
+	{
+		if(tokens>=full) return;
+	} while(!__atomic_compare_exchange_n(&b->tokens, &tokens,
+		tokens+add>full?full:tokens+add,
+		0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+// About as long as it will take to get out of debt. Every byte is charged
+// in full, so the total stays within the rate. A process with more weight
+// waits for less of that time, so it tends to get in first when the bucket
+// fills up again.
+#ifndef UTEST
+static
+#endif
+uint64_t budget_sleep_time(int64_t tokens, uint64_t rate)
+{
+	uint64_t sleeptime;
+	sleeptime=(uint64_t)((1-tokens)*1000000/rate/budget_weight);
+	if(sleeptime<BUDGET_MIN_SLEEP) sleeptime=BUDGET_MIN_SLEEP;
+	if(sleeptime>BUDGET_MAX_SLEEP) sleeptime=BUDGET_MAX_SLEEP;
+	return sleeptime;
+}
+
+int budget_wait(enum budget_type type)
+{
+	uint64_t rate;
+	int64_t tokens;
+	uint64_t sleeptime;
+	struct bucket *b;
+
+	if(!buckets || budget_weight<=0) return 0;
+	b=&buckets[type];
+	if(!(rate=__atomic_load_n(&b->rate, __ATOMIC_SEQ_CST))) return 0;
+
+	budget_refill(b, rate);
+	if((tokens=__atomic_load_n(&b->tokens, __ATOMIC_SEQ_CST))>0)
+		return 0;
+
+	sleeptime=budget_sleep_time(tokens, rate);
+#ifdef HAVE_WIN32
+	Sleep(sleeptime/1000);
+#else
+	usleep(sleeptime);
+#endif
+	return 1;
+}
+
+void budget_block(enum budget_type type)
+{
+	while(budget_wait(type)) { }
+}
+
+void budget_charge(enum budget_type type, size_t bytes)
+{
+	if(!buckets || budget_weight<=0 || !bytes) return;
+	if(!__atomic_load_n(&buckets[type].rate, __ATOMIC_SEQ_CST)) return;
+	__atomic_sub_fetch(&buckets[type].tokens,
+		(int64_t)bytes, __ATOMIC_SEQ_CST);
+}
+
+#ifdef UTEST
+int64_t budget_tokens(enum budget_type type)
+{
+	if(!buckets) return 0;
+	return __atomic_load_n(&buckets[type].tokens, __ATOMIC_SEQ_CST);
+}
+#endif
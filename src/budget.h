@@ -0,0 +1,40 @@
+#ifndef _BUDGET_H
+#define _BUDGET_H
+
+#include "burp.h"
+
+// Server-wide bandwidth budgets. The buckets live in memory that is shared
+// by the server and all of its children, so the limits apply to the total,
+// rather than to each connection like ratelimit does.
+
+enum budget_type
+{
+	BUDGET_NETWORK=0,
+	BUDGET_STORAGE,
+
+	BUDGET_MAX
+};
+
+extern int budget_init(void);
+extern void budget_free(void);
+
+// Bytes per second, 0 for no limit. Children see changes straight away.
+extern void budget_set_rate(enum budget_type type, float rate);
+
+// Only processes with a weight above zero are held to the budgets. Every
+// byte counts the same, but when the bucket is empty, a process with weight
+// 2 waits half as long as one with weight 1 before trying again.
+extern void budget_set_weight(float weight);
+
+// Returns 0 if it is OK to do I/O now, or sleeps for a bit and returns 1
+// if the bucket is empty.
+extern int budget_wait(enum budget_type type);
+extern void budget_block(enum budget_type type);
+extern void budget_charge(enum budget_type type, size_t bytes);
+
+#ifdef UTEST
+extern uint64_t budget_sleep_time(int64_t tokens, uint64_t rate);
+extern int64_t budget_tokens(enum budget_type type);
+#endif
+
+#endif
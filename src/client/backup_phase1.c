@@ -39,11 +39,16 @@
 #include "../attribs.h"
 #include "../cmd.h"
 #include "../cntr.h"
+#include "../fsops.h"
+#include "../iobuf.h"
 #include "../linkhash.h"
 #include "../log.h"
 #include "../strlist.h"
+#include "../protocol1/dirdigest.h"
 #include "extrameta.h"
 #include "find.h"
+#include "journal.h"
+#include "scanahead.h"
 
 static enum cmd filesymbol=CMD_FILE;
 static enum cmd dirsymbol=CMD_DIRECTORY;
@@ -61,7 +66,7 @@ static int usual_stuff(struct asfd *asfd,
 	struct cntr *cntr, const char *path, const char *link,
 	struct sbuf *sb, enum cmd cmd)
 {
-	if(asfd->write_str(asfd, CMD_ATTRIBS, sb->attr.buf)
+	if(asfd->write(asfd, &sb->attr)
 	  || asfd->write_str(asfd, cmd, path)
 	  || ((cmd==CMD_HARD_LINK || cmd==CMD_SOFT_LINK)
 		&& asfd->write_str(asfd, cmd, link)))
@@ -205,6 +210,66 @@ static int send_file(struct asfd *asfd, FF_PKT *ff, struct conf **confs)
 	}
 }
 
+// The server sends the digests of the directories in the previous backup
+// before the scan starts.
+static int recv_dirdigests(struct asfd *asfd)
+{
+	int ret=-1;
+	int enc=0;
+	int plain=0;
+	size_t i;
+	size_t n;
+	size_t count=0;
+	struct dirdigest *tmp;
+	struct dirdigest *list=NULL;
+	struct iobuf *rbuf=asfd->rbuf;
+
+	while(1)
+	{
+		iobuf_free_content(rbuf);
+		if(asfd->read(asfd))
+			goto end;
+		if(rbuf->cmd==CMD_DIR_DIGESTS
+		  && rbuf->len
+		  && !(rbuf->len%DIRDIGEST_WIRE_LEN))
+		{
+			n=rbuf->len/DIRDIGEST_WIRE_LEN;
+			if(!(tmp=(struct dirdigest *)realloc_w(list,
+				(count+n)*sizeof(struct dirdigest), __func__)))
+					goto end;
+			list=tmp;
+			for(i=0; i<n; i++)
+				dirdigest_from_wire(&list[count++],
+				  (uint8_t *)rbuf->buf+i*DIRDIGEST_WIRE_LEN);
+		}
+		else if(rbuf->cmd==CMD_GEN
+		  && !strcmp(rbuf->buf, "dirdigests end"))
+			break;
+		else if(rbuf->cmd!=CMD_GEN
+		  || sscanf(rbuf->buf, "dirdigests %d %d", &enc, &plain)!=2)
+		{
+			iobuf_log_unexpected(rbuf, __func__);
+			goto end;
+		}
+	}
+
+	// The digests do not say whether files were encrypted.
+	if(filesymbol==CMD_ENC_FILE?plain:enc)
+		logp("Encryption changed since the last backup, so not using directory digests\n");
+	else
+	{
+		logp("Got %lu directory digests\n", (unsigned long)count);
+		dirdigest_sort(list, count);
+		find_files_set_dirdigests(list, count);
+		list=NULL;
+	}
+	ret=0;
+end:
+	iobuf_free_content(rbuf);
+	free_v((void **)&list);
+	return ret;
+}
+
 int backup_phase1_client(struct asfd *asfd, struct conf **confs, int estimate)
 {
 	int ret=-1;
@@ -235,14 +300,23 @@ int backup_phase1_client(struct asfd *asfd, struct conf **confs, int estimate)
 		dirsymbol=CMD_DIRECTORY;
 #endif
 
-	if(!(ff=find_files_init(send_file))) goto end;
+	if(!(ff=find_files_init(send_file))
+	  || (!estimate && get_int(confs[OPT_DIR_DIGESTS])
+		&& recv_dirdigests(asfd))
+	  || scanahead_start(get_int(confs[OPT_SCAN_WORKERS]),
+		get_int(confs[OPT_ATIME]))
+	  || (!estimate && journal_scan_begin(confs)))
+			goto end;
 	for(l=get_strlist(confs[OPT_STARTDIR]); l; l=l->next) if(l->flag)
 		if(find_files_begin(asfd, ff, confs, l->path)) goto end;
 	ret=0;
 end:
+	if(journal_scan_end(!ret)) ret=-1;
+	dentries_log_stats();
 	cntr_print_end_phase1(get_cntr(confs));
 	if(ret) logp("Error in phase 1\n");
 	logp("Phase 1 end (file system scan)\n");
+	scanahead_stop();
 	find_files_free(&ff);
 
 	return ret;
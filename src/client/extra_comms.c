@@ -1,6 +1,7 @@
 #include "../burp.h"
 #include "../asfd.h"
 #include "../async.h"
+#include "../attribs.h"
 #include "../cmd.h"
 #include "../conf.h"
 #include "../conffile.h"
@@ -10,6 +11,7 @@
 #include "../iobuf.h"
 #include "../log.h"
 #include "autoupgrade.h"
+#include "restore_streams.h"
 
 #ifndef HAVE_WIN32
 #include <sys/utsname.h>
@@ -28,6 +30,38 @@ static const char *server_supports_autoupgrade(const char *feat)
 	return server_supports(feat, ":autoupgrade:");
 }
 
+// Protocol1 backups can send several files at once. The server says how many
+// it will take.
+static int backup_streams(struct asfd *asfd, const char *feat,
+	enum action action, struct conf **confs)
+{
+#ifndef HAVE_WIN32
+	char msg[64]="";
+	const char *cp=NULL;
+	int streams=get_int(confs[OPT_BACKUP_STREAMS]);
+#endif
+	set_int(confs[OPT_BACKUP_STREAMS], 1);
+#ifndef HAVE_WIN32
+	if(action!=ACTION_BACKUP
+	  && action!=ACTION_BACKUP_TIMED
+	  && action!=ACTION_TIMER_CHECK)
+		return 0;
+	if(get_protocol(confs)!=PROTO_1
+	  || streams<2
+	  || !(cp=server_supports(feat, ":backup_streams=")))
+		return 0;
+	cp+=strlen(":backup_streams=");
+	if(streams>atoi(cp)) streams=atoi(cp);
+	if(streams<2) return 0;
+	snprintf(msg, sizeof(msg), "backup_streams=%d", streams);
+	if(asfd->write_str(asfd, CMD_GEN, msg))
+		return -1;
+	set_int(confs[OPT_BACKUP_STREAMS], streams);
+	logp("Sending up to %d files at once\n", streams);
+#endif
+	return 0;
+}
+
 int extra_comms(struct async *as, struct conf **confs,
 	enum action *action, char **incexc)
 {
@@ -70,7 +104,9 @@ int extra_comms(struct async *as, struct conf **confs,
 		goto end;
 
 	// :srestore: means that the server wants to do a restore.
-	if(server_supports(feat, ":srestore:"))
+	// The extra streams of a restore leave that to the main one.
+	if(server_supports(feat, ":srestore:")
+	  && !restore_streams_part())
 	{
 		logp("Server wants to initiate a restore\n");
 		if(*action==ACTION_MONITOR)
@@ -212,6 +248,47 @@ int extra_comms(struct async *as, struct conf **confs,
 		set_protocol(confs, PROTO_2);
 	}
 
+	// Not for Windows, where phase1 sends things that the digests do not
+	// know about.
+	set_int(confs[OPT_DIR_DIGESTS], 0);
+#ifndef HAVE_WIN32
+	if(server_supports(feat, ":dirdigests:")
+	  && get_protocol(confs)==PROTO_1)
+	{
+		set_int(confs[OPT_DIR_DIGESTS], 1);
+		if(asfd->write_str(asfd, CMD_GEN, "dirdigests"))
+			goto end;
+	}
+#endif
+
+	if(backup_streams(asfd, feat, *action, confs))
+		goto end;
+
+#ifndef HAVE_WIN32
+	// Protocol2 restores can be spread over several connections.
+	if(*action==ACTION_RESTORE
+	  && get_protocol(confs)==PROTO_2
+	  && server_supports(feat, ":restore_streams:")
+	  && (restore_streams_part()
+		|| get_int(confs[OPT_RESTORE_STREAMS])>1))
+	{
+		char msg[64]="";
+		snprintf(msg, sizeof(msg), "restore_streams=%d/%d",
+			restore_streams_part(),
+			restore_streams_part()?restore_streams_count():
+				get_int(confs[OPT_RESTORE_STREAMS]));
+		if(asfd->write_str(asfd, CMD_GEN, msg))
+			goto end;
+	}
+#endif
+
+	if(server_supports(feat, ":binattribs:"))
+	{
+		attribs_set_binary(1);
+		if(asfd->write_str(asfd, CMD_GEN, "binattribs"))
+			goto end;
+	}
+
 	if(server_supports(feat, ":msg:"))
 	{
 		set_int(confs[OPT_MESSAGE], 1);
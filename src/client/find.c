@@ -46,15 +46,20 @@
 
 #include "../burp.h"
 #include "../alloc.h"
+#include "../asfd.h"
 #include "../conf.h"
 #include "../fsops.h"
+#include "../iobuf.h"
 #include "../linkhash.h"
 #include "../log.h"
 #include "../pathcmp.h"
 #include "../prepend.h"
 #include "../regexp.h"
 #include "../strlist.h"
+#include "../protocol1/dirdigest.h"
 #include "find.h"
+#include "journal.h"
+#include "scanahead.h"
 
 #ifdef HAVE_LINUX_OS
 #include <sys/statfs.h>
@@ -62,6 +67,10 @@
 
 static int (*send_file)(struct asfd *, FF_PKT *, struct conf **);
 
+// Digests of the directories in the previous backup, from the server.
+static struct dirdigest *dirdigests=NULL;
+static size_t dirdigests_count=0;
+
 // Initialize the find files "global" variables
 FF_PKT *find_files_init(
 	int callback(struct asfd *asfd, FF_PKT *ff, struct conf **confs))
@@ -79,9 +88,17 @@ FF_PKT *find_files_init(
 void find_files_free(FF_PKT **ff)
 {
 	linkhash_free();
+	find_files_set_dirdigests(NULL, 0);
 	free_v((void **)ff);
 }
 
+void find_files_set_dirdigests(struct dirdigest *list, size_t count)
+{
+	free_v((void **)&dirdigests);
+	dirdigests=list;
+	dirdigests_count=count;
+}
+
 // Return 1 to include the file, 0 to exclude it.
 static int in_include_ext(struct strlist *incext, const char *fname)
 {
@@ -280,8 +297,11 @@ static int file_size_match(FF_PKT *ff_pkt, struct conf **confs)
 }
 
 // Last checks before actually processing the file system entry.
-int send_file_w(struct asfd *asfd, FF_PKT *ff, bool top_level, struct conf **confs)
+// Returns 1 if it should be sent to the server, 0 if not, -1 on error.
+static int file_checks(FF_PKT *ff, bool top_level, struct conf **confs)
 {
+	if(journal_scan_record(ff)) return -1;
+
 	if(!file_is_included(confs, ff->fname, top_level)) return 0;
 
 	// Doing the file size match here also catches hard links.
@@ -319,6 +339,13 @@ int send_file_w(struct asfd *asfd, FF_PKT *ff, bool top_level, struct conf **con
 		}
 	}
 
+	return 1;
+}
+
+int send_file_w(struct asfd *asfd, FF_PKT *ff, bool top_level, struct conf **confs)
+{
+	int ret;
+	if((ret=file_checks(ff, top_level, confs))<=0) return ret;
 	return send_file(asfd, ff, confs);
 }
 
@@ -401,36 +428,71 @@ static void windows_reparse_point_fiddling(FF_PKT *ff_pkt)
 }
 #endif
 
+static void set_other_type(FF_PKT *ff_pkt, struct conf **confs)
+{
+#ifdef HAVE_FREEBSD_OS
+	/*
+	 * On FreeBSD, all block devices are character devices, so
+	 *   to be able to read a raw disk, we need the check for
+	 *   a character device.
+	 * crw-r----- 1 root  operator - 116, 0x00040002 Jun 9 19:32 /dev/ad0s3
+	 * crw-r----- 1 root  operator - 116, 0x00040002 Jun 9 19:32 /dev/rad0s3
+	 */
+	if((S_ISBLK(ff_pkt->statp.st_mode) || S_ISCHR(ff_pkt->statp.st_mode))
+		&& need_to_read_blockdev(confs, ff_pkt->fname))
+	{
+#else
+	if(S_ISBLK(ff_pkt->statp.st_mode)
+		&& need_to_read_blockdev(confs, ff_pkt->fname))
+	{
+#endif
+		/* raw partition */
+		ff_pkt->type=FT_RAW;
+	}
+	else if(S_ISFIFO(ff_pkt->statp.st_mode)
+		&& need_to_read_fifo(confs, ff_pkt->fname))
+	{
+		ff_pkt->type=FT_FIFO;
+	}
+	else
+	{
+		/* The only remaining are special (character, ...) files */
+		ff_pkt->type=FT_SPEC;
+	}
+}
+
 // Prototype because process_entries_in_directory() recurses using find_files().
 static int find_files(struct asfd *asfd, FF_PKT *ff_pkt, struct conf **confs,
 	char *fname, dev_t parent_device, bool top_level);
 
-static int process_entries_in_directory(struct asfd *asfd, struct dirent **nl,
-	int count, char **link, size_t len, size_t *link_len,
+// Put the name of a directory entry after the directory part of link.
+static int entry_path(FF_PKT *ff_pkt, char **link, size_t len,
+	size_t *link_len, const char *name)
+{
+	size_t l=strlen(name);
+
+	if(l+len>=*link_len)
+	{
+		*link_len=len+l+1;
+		if(!(*link=(char *)
+		  realloc_w(*link, (*link_len)+1, __func__)))
+			return -1;
+	}
+	memcpy((*link)+len, name, l+1);
+	ff_pkt->flen=l;
+	return 0;
+}
+
+static int process_entries_in_directory(struct asfd *asfd,
+	struct dentries *d, char **link, size_t len, size_t *link_len,
 	struct conf **confs, FF_PKT *ff_pkt, dev_t our_device)
 {
 	int m=0;
 	int ret=0;
-	for(m=0; m<count; m++)
+	for(m=0; m<d->count; m++)
 	{
-		size_t i;
-		char *p=NULL;
-		char *q=NULL;
-
-		p=nl[m]->d_name;
-
-		if(strlen(p)+len>=*link_len)
-		{
-			*link_len=len+strlen(p)+1;
-			if(!(*link=(char *)
-			  realloc_w(*link, (*link_len)+1, __func__)))
-				return -1;
-		}
-		q=(*link)+len;
-		for(i=0; i<strlen(nl[m]->d_name); i++)
-			*q++=*p++;
-		*q=0;
-		ff_pkt->flen=i;
+		if(entry_path(ff_pkt, link, len, link_len, d->name[m]))
+			return -1;
 
 		if(file_is_included_no_incext(confs, *link))
 		{
@@ -463,25 +525,253 @@ static int process_entries_in_directory(struct asfd *asfd, struct dirent **nl,
 				}
 			}
 		}
-		free_v((void **)&(nl[m]));
 		if(ret) break;
 	}
 	return ret;
 }
 
+// Tell the scan ahead workers about the subdirectories that are coming up,
+// so that they can be read while we deal with the ones before them.
+static void hint_subdirectories(struct conf **confs, const char *link,
+	size_t len, struct dentries *d)
+{
+#ifdef _DIRENT_HAVE_D_TYPE
+	int m;
+	size_t l;
+	char *tmp=NULL;
+	char *path=NULL;
+	for(m=0; m<d->count; m++)
+	{
+		if(dentries_type(d, m)!=DT_DIR) continue;
+		l=len+strlen(d->name[m])+1;
+		if(!(tmp=(char *)realloc_w(path, l, __func__)))
+			break;
+		path=tmp;
+		snprintf(path, l, "%s%s", link, d->name[m]);
+		if(file_is_included_no_incext(confs, path))
+			scanahead_hint(path);
+	}
+	free_w(&path);
+#endif
+}
+
+#ifndef HAVE_WIN32
+// Prototype because unchanged_entries() recurses using found_directory().
 static int found_directory(struct asfd *asfd,
 	FF_PKT *ff_pkt, struct conf **confs,
-	char *fname, dev_t parent_device, bool top_level)
+	char *fname, dev_t parent_device, bool top_level, bool unchanged);
+
+// What is known about a directory entry while deciding whether the
+// directory is unchanged.
+struct uentry
+{
+	int skip;
+	struct stat statp;
+	char *link;
+};
+
+static int is_blockdev_link(struct conf **confs, const char *fname)
+{
+	struct strlist *l;
+	for(l=get_strlist(confs[OPT_BLOCKDEVS]); l; l=l->next)
+		if(!strcmp(l->path, fname))
+			return 1;
+	return 0;
+}
+
+// Works out the digest of the entries that would be sent for a directory,
+// in the same way as the server does from the previous manifest.
+// Returns 1 if the directory has something in it that the digests cannot
+// deal with, so it needs to be scanned as usual.
+static int digest_entries(struct dentries *d,
+	char **link, size_t len, size_t *link_len,
+	struct conf **confs, FF_PKT *ff_pkt, dev_t our_device,
+	struct uentry *entries, uint64_t *digest)
+{
+	int m;
+	int nbret;
+	ssize_t size;
+	MD5_CTX md5;
+	struct uentry *e;
+	struct strlist *x;
+	char *buffer=(char *)alloca(fs_full_path_max+102);
+
+	if(dirdigest_init(&md5))
+		return -1;
+	for(m=0; m<d->count; m++)
+	{
+		e=&entries[m];
+		if(entry_path(ff_pkt, link, len, link_len, d->name[m]))
+			return -1;
+		ff_pkt->fname=*link;
+
+		if(!file_is_included_no_incext(confs, *link))
+		{
+			// An included subdirectory further down would be
+			// sent out of order.
+			for(x=get_strlist(confs[OPT_INCEXCDIR]); x; x=x->next)
+				if(x->flag && is_subdir(*link, x->path))
+					return 1;
+			e->skip=1;
+			continue;
+		}
+		if(lstat(*link, &e->statp))
+			return 1;
+		ff_pkt->statp=e->statp;
+
+		if(S_ISDIR(e->statp.st_mode))
+		{
+			// Crossing file systems has its own rules.
+			if(e->statp.st_dev!=our_device)
+				return 1;
+			if((nbret=nobackup_directory(
+				get_strlist(confs[OPT_NOBACKUP]), *link))<0)
+					return -1;
+			if(nbret)
+			{
+				e->skip=1;
+				continue;
+			}
+			// Its contents get scanned even if it is not included.
+			if(!file_is_included(confs, *link, false))
+				continue;
+		}
+		else if(S_ISLNK(e->statp.st_mode))
+		{
+			if(is_blockdev_link(confs, *link)
+			  || (size=readlink(*link, buffer,
+				fs_full_path_max+101))<0)
+					return 1;
+			buffer[size]=0;
+			if(!(e->link=strdup_w(buffer, __func__)))
+				return -1;
+			if(!file_is_included(confs, *link, false))
+				continue;
+		}
+		else if(!file_is_included(confs, *link, false)
+		  || (S_ISREG(e->statp.st_mode)
+			&& !file_size_match(ff_pkt, confs)))
+				continue;
+
+		dirdigest_add(&md5, d->name[m], &e->statp, e->link);
+	}
+	*digest=dirdigest_final(&md5);
+	return 0;
+}
+
+// Goes through the entries of an unchanged directory in the same way as a
+// usual scan, but without sending them, because the server already has
+// them.
+static int unchanged_entries(struct asfd *asfd, struct dentries *d,
+	char **link, size_t len, size_t *link_len,
+	struct conf **confs, FF_PKT *ff_pkt, dev_t our_device,
+	struct uentry *entries)
+{
+	int m;
+	int ret=0;
+	struct uentry *e;
+	for(m=0; m<d->count; m++)
+	{
+		e=&entries[m];
+		if(!e->skip)
+		{
+			if(entry_path(ff_pkt, link, len, link_len, d->name[m]))
+				return -1;
+			ff_pkt->fname=*link;
+			ff_pkt->link=*link;
+			ff_pkt->statp=e->statp;
+			if(S_ISDIR(e->statp.st_mode))
+				ret=found_directory(asfd, ff_pkt, confs, *link,
+					our_device, false, true /*unchanged*/);
+			else
+			{
+				if(S_ISREG(e->statp.st_mode))
+					ff_pkt->type=FT_REG;
+				else if(S_ISLNK(e->statp.st_mode))
+				{
+					ff_pkt->link=e->link;
+					ff_pkt->type=FT_LNK_S;
+				}
+				else
+					set_other_type(ff_pkt, confs);
+				// For the hard link and journal bookkeeping.
+				if(file_checks(ff_pkt, false, confs)<0)
+					ret=-1;
+			}
+		}
+		if(ret) break;
+	}
+	return ret;
+}
+
+// If the directory has the same digest as it had in the previous backup,
+// tell the server that it is unchanged instead of sending its entries.
+// Returns 1 if that happened, 0 if it needs to be scanned as usual, -1 on
+// error.
+static int try_unchanged_directory(struct asfd *asfd, struct dentries *d,
+	char **link, size_t len, size_t *link_len,
+	struct conf **confs, FF_PKT *ff_pkt, dev_t our_device)
+{
+	int m;
+	int ret=-1;
+	size_t klen;
+	uint64_t digest=0;
+	struct iobuf wbuf;
+	struct dirdigest *dd;
+	struct uentry *entries=NULL;
+
+	// The server knows the directory without the trailing slash.
+	klen=len>1?len-1:len;
+	if(!d->count
+	  || !(dd=dirdigest_find(dirdigests, dirdigests_count,
+		dirdigest_path(*link, klen))))
+			return 0;
+
+	if(!(entries=(struct uentry *)calloc_w(d->count,
+		sizeof(struct uentry), __func__)))
+			goto end;
+	switch(digest_entries(d, link, len, link_len,
+		confs, ff_pkt, our_device, entries, &digest))
+	{
+		case 0:
+			if(digest==dd->digest)
+				break;
+			// Fall through.
+		case 1:
+			ret=0;
+			goto end;
+		default:
+			goto end;
+	}
+
+	iobuf_set(&wbuf, CMD_DIR_UNCHANGED, *link, klen);
+	if(asfd->write(asfd, &wbuf)
+	  || unchanged_entries(asfd, d, link, len, link_len,
+		confs, ff_pkt, our_device, entries))
+			goto end;
+	ret=1;
+end:
+	if(entries)
+		for(m=0; m<d->count; m++)
+			free_w(&entries[m].link);
+	free_v((void **)&entries);
+	return ret;
+}
+#endif
+
+static int found_directory(struct asfd *asfd,
+	FF_PKT *ff_pkt, struct conf **confs,
+	char *fname, dev_t parent_device, bool top_level, bool unchanged)
 {
 	int ret=-1;
 	char *link=NULL;
 	size_t link_len;
 	size_t len;
 	int nbret=0;
-	int count=0;
 	dev_t our_device;
-	struct dirent **nl=NULL;
+	struct dentries d;
 
+	memset(&d, 0, sizeof(d));
 	our_device=ff_pkt->statp.st_dev;
 
 	if((nbret=nobackup_directory(get_strlist(confs[OPT_NOBACKUP]),
@@ -512,7 +802,13 @@ static int found_directory(struct asfd *asfd,
 	windows_reparse_point_fiddling(ff_pkt);
 #endif
 
-	if(send_file_w(asfd, ff_pkt, top_level, confs))
+	if(unchanged)
+	{
+		// The server already has it from the previous backup.
+		if(file_checks(ff_pkt, top_level, confs)<0)
+			goto end;
+	}
+	else if(send_file_w(asfd, ff_pkt, top_level, confs))
 		goto end;
 	if(ff_pkt->type==FT_REPARSE || ff_pkt->type==FT_JUNCTION)
 	{
@@ -544,9 +840,21 @@ static int found_directory(struct asfd *asfd,
 
 	ff_pkt->link=ff_pkt->fname;
 
+	if(journal_scan_unchanged(fname, ff_pkt->statp.st_dev))
+	{
+		// Nothing below here has changed since the last scan, so
+		// send what that found.
+		int r;
+		while((r=journal_scan_next(fname, ff_pkt))>0)
+			if(send_file_w(asfd, ff_pkt, false, confs))
+				goto end;
+		if(!r) ret=0;
+		goto end;
+	}
+
 	errno=0;
-	switch(entries_in_directory_alphasort(fname,
-		&nl, &count, get_int(confs[OPT_ATIME])))
+	switch(dentries_read(fname,
+		&d, get_int(confs[OPT_ATIME]), 1 /*sort*/))
 	{
 		case 0: break;
 		case 1:
@@ -556,51 +864,33 @@ static int found_directory(struct asfd *asfd,
 			goto end;
 	}
 
-	if(nl)
+	if(d.count)
 	{
-		if(process_entries_in_directory(asfd, nl, count,
+		hint_subdirectories(confs, link, len, &d);
+#ifndef HAVE_WIN32
+		switch(try_unchanged_directory(asfd, &d,
+			&link, len, &link_len, confs, ff_pkt, our_device))
+		{
+			case 0: break;
+			case 1: ret=0; // Fall through.
+			default: goto end;
+		}
+#endif
+		if(process_entries_in_directory(asfd, &d,
 			&link, len, &link_len, confs, ff_pkt, our_device))
 				goto end;
 	}
 	ret=0;
 end:
 	free_w(&link);
-	free_v((void **)&nl);
+	dentries_free(&d);
 	return ret;
 }
 
 static int found_other(struct asfd *asfd, FF_PKT *ff_pkt, struct conf **confs,
 	char *fname, bool top_level)
 {
-#ifdef HAVE_FREEBSD_OS
-	/*
-	 * On FreeBSD, all block devices are character devices, so
-	 *   to be able to read a raw disk, we need the check for
-	 *   a character device.
-	 * crw-r----- 1 root  operator - 116, 0x00040002 Jun 9 19:32 /dev/ad0s3
-	 * crw-r----- 1 root  operator - 116, 0x00040002 Jun 9 19:32 /dev/rad0s3
-	 */
-	if((S_ISBLK(ff_pkt->statp.st_mode) || S_ISCHR(ff_pkt->statp.st_mode))
-		&& need_to_read_blockdev(confs, ff_pkt->fname))
-	{
-#else
-	if(S_ISBLK(ff_pkt->statp.st_mode)
-		&& need_to_read_blockdev(confs, ff_pkt->fname))
-	{
-#endif
-		/* raw partition */
-		ff_pkt->type=FT_RAW;
-	}
-	else if(S_ISFIFO(ff_pkt->statp.st_mode)
-		&& need_to_read_fifo(confs, ff_pkt->fname))
-	{
-		ff_pkt->type=FT_FIFO;
-	}
-	else
-	{
-		/* The only remaining are special (character, ...) files */
-		ff_pkt->type=FT_SPEC;
-	}
+	set_other_type(ff_pkt, confs);
 	return send_file_w(asfd, ff_pkt, top_level, confs);
 }
 
@@ -645,7 +935,7 @@ static int find_files(struct asfd *asfd, FF_PKT *ff_pkt, struct conf **confs,
 	}
 	else if(S_ISDIR(ff_pkt->statp.st_mode))
 		return found_directory(asfd, ff_pkt, confs, fname,
-			parent_device, top_level);
+			parent_device, top_level, false);
 	else
 		return found_other(asfd, ff_pkt, confs, fname, top_level);
 }
@@ -81,9 +81,14 @@ struct FF_PKT
 	int type;		/* FT_ type from above */
 };
 
+struct dirdigest;
+
 extern FF_PKT *find_files_init(
 	int callback(struct asfd *asfd, FF_PKT *ff, struct conf **confs));
 extern void find_files_free(FF_PKT **ff);
+// Takes ownership of the list of digests of directories in the previous
+// backup, so that unchanged directories can be skipped.
+extern void find_files_set_dirdigests(struct dirdigest *list, size_t count);
 extern int find_files_begin(struct asfd *asfd,
 	FF_PKT *ff_pkt, struct conf **confs, char *fname);
 // Returns the level of compression.
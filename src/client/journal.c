@@ -0,0 +1,965 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../attribs.h"
+#include "../conf.h"
+#include "../fsops.h"
+#include "../fzp.h"
+#include "../handy.h"
+#include "../hexmap.h"
+#include "../log.h"
+#include "../pathcmp.h"
+#include "../prepend.h"
+#include "../sbuf.h"
+#include "../strlist.h"
+#include "journal.h"
+
+#ifndef HAVE_WIN32
+#include <sys/file.h>
+#endif
+#ifdef HAVE_SYS_FANOTIFY_H
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#endif
+
+// The journal is a text file. The first line identifies the run of the
+// watcher that wrote it, followed by the devices of the file systems that
+// it is watching. Each line after that is either 'd <path>', meaning that
+// the entries of a directory changed, or 't <path>', meaning that a whole
+// directory tree appeared. Paths are always the real ones, with no
+// symlinks in them.
+// The watcher holds an exclusive flock() on the journal for as long as it
+// runs, so that the scan can tell whether anybody is still keeping it up
+// to date.
+#define JOURNAL_MAGIC		"burp journal"
+#define JOURNAL_CACHE_MAGIC	"burp scan cache 1"
+#define JOURNAL_LINE_MAX	(2*PATH_MAX+8)
+#define JOURNAL_GEN_MAX		1024
+// When the journal gets this big, the watcher starts a new one, and the
+// next backup has to walk everything again.
+#define JOURNAL_MAX		(64*1024*1024)
+
+struct jlist
+{
+	char **paths;
+	size_t count;
+	size_t alloc;
+};
+
+static int jlist_add(struct jlist *l, const char *path)
+{
+	if(l->count==l->alloc)
+	{
+		char **tmp;
+		size_t alloc=l->alloc?l->alloc*2:64;
+		if(!(tmp=(char **)realloc_w(l->paths,
+			alloc*sizeof(char *), __func__)))
+				return -1;
+		l->paths=tmp;
+		l->alloc=alloc;
+	}
+	if(!(l->paths[l->count]=strdup_w(path, __func__)))
+		return -1;
+	l->count++;
+	return 0;
+}
+
+static int jlist_cmp(const void *a, const void *b)
+{
+	return pathcmp(*(char **)a, *(char **)b);
+}
+
+static void jlist_sort(struct jlist *l)
+{
+	size_t i;
+	size_t n=0;
+	if(!l->count) return;
+	qsort(l->paths, l->count, sizeof(char *), jlist_cmp);
+	for(i=1; i<l->count; i++)
+	{
+		if(!pathcmp(l->paths[n], l->paths[i]))
+			free_w(&l->paths[i]);
+		else
+			l->paths[++n]=l->paths[i];
+	}
+	l->count=n+1;
+}
+
+static void jlist_free(struct jlist *l)
+{
+	size_t i;
+	for(i=0; i<l->count; i++)
+		free_w(&l->paths[i]);
+	free_v((void **)&l->paths);
+	l->count=0;
+	l->alloc=0;
+}
+
+// Index of the first path that does not sort before the given one.
+static size_t jlist_lower(struct jlist *l, const char *path)
+{
+	size_t lo=0;
+	size_t hi=l->count;
+	while(lo<hi)
+	{
+		size_t mid=lo+(hi-lo)/2;
+		if(pathcmp(l->paths[mid], path)<0)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return lo;
+}
+
+static int jlist_has(struct jlist *l, const char *path)
+{
+	size_t i=jlist_lower(l, path);
+	return i<l->count && !pathcmp(l->paths[i], path);
+}
+
+// State for the scan.
+static struct jlist changed;
+static struct jlist trees;
+static struct fzp *cache_in=NULL;
+static struct fzp *cache_out=NULL;
+static char *cache_path=NULL;
+static char *cache_tmp=NULL;
+static struct sbuf *wsb=NULL;
+// A cached entry that has been read, but not used yet.
+static struct sbuf *psb=NULL;
+static int ptype=0;
+static int pending=0;
+// The file systems that the watcher is watching. Changes anywhere else are
+// never journalled.
+static dev_t *marked=NULL;
+static int mcount=0;
+// Includes that are not where they really are, because of symlinks on the
+// way to them.
+struct jinclude
+{
+	char *path;
+	char *real;
+};
+static struct jinclude *includes=NULL;
+static int icount=0;
+
+static int marked_load(const char *gen)
+{
+	char *cp;
+	dev_t *tmp;
+	unsigned long long dev;
+	// The first word is the run of the watcher.
+	if(!(gen=strchr(gen, ' '))) return 0;
+	while(*gen)
+	{
+		dev=strtoull(gen, &cp, 10);
+		if(cp==gen) break;
+		gen=cp;
+		if(!(tmp=(dev_t *)realloc_w(marked,
+			(mcount+1)*sizeof(dev_t), __func__)))
+				return -1;
+		marked=tmp;
+		marked[mcount++]=(dev_t)dev;
+	}
+	return 0;
+}
+
+static int is_marked(dev_t dev)
+{
+	int i;
+	for(i=0; i<mcount; i++)
+		if(marked[i]==dev) return 1;
+	return 0;
+}
+
+static int includes_load(struct conf **confs)
+{
+#ifndef HAVE_WIN32
+	int ret=0;
+	char *real;
+	struct strlist *l;
+	struct jinclude *tmp;
+	for(l=get_strlist(confs[OPT_STARTDIR]); l && !ret; l=l->next)
+	{
+		if(!l->flag) continue;
+		// If it is not there, the scan will not find anything below
+		// it either.
+		if(!(real=realpath(l->path, NULL)))
+			continue;
+		if(strcmp(real, l->path))
+		{
+			if(!(tmp=(struct jinclude *)realloc_w(includes,
+				(icount+1)*sizeof(struct jinclude), __func__)))
+					ret=-1;
+			else
+			{
+				includes=tmp;
+				tmp=&includes[icount++];
+				tmp->path=strdup_w(l->path, __func__);
+				tmp->real=strdup_w(real, __func__);
+				if(!tmp->path || !tmp->real)
+					ret=-1;
+			}
+		}
+		free(real);
+	}
+	return ret;
+#else
+	return 0;
+#endif
+}
+
+static void includes_free(void)
+{
+	int i;
+	for(i=0; i<icount; i++)
+	{
+		free_w(&includes[i].path);
+		free_w(&includes[i].real);
+	}
+	free_v((void **)&includes);
+	icount=0;
+}
+
+// The journal only has real paths in it, so the paths that the scan comes
+// across have to be turned into those before looking them up.
+static char *journal_real_path(const char *path)
+{
+	int i;
+	int best=-1;
+	size_t len;
+	size_t blen=0;
+	for(i=0; i<icount; i++)
+	{
+		len=strlen(includes[i].path);
+		if(len>blen && is_subdir(includes[i].path, path))
+		{
+			best=i;
+			blen=len;
+		}
+	}
+	if(best<0)
+		return strdup_w(path, __func__);
+	return prepend(includes[best].real, path+blen);
+}
+
+// The watcher keeps an exclusive lock on the journal for as long as it
+// runs. If it has gone, for whatever reason, nothing is recording changes
+// any more.
+static int journal_watched(const char *journal)
+{
+#ifdef HAVE_WIN32
+	return 0;
+#else
+	int fd;
+	int ret=0;
+	if((fd=open(journal, O_RDONLY))<0)
+		return 0;
+	if(flock(fd, LOCK_SH|LOCK_NB) && errno==EWOULDBLOCK)
+		ret=1;
+	close(fd);
+	return ret;
+#endif
+}
+
+// Any change to the includes, excludes and so on means that what was
+// cached may no longer be what the scan would find.
+static int conf_fingerprint(struct conf **confs, char *out, size_t len)
+{
+	int i;
+	char tmp[32];
+	MD5_CTX md5;
+	struct strlist *l;
+	uint8_t checksum[MD5_DIGEST_LENGTH];
+
+	if(!MD5_Init(&md5))
+	{
+		logp("MD5_Init() failed\n");
+		return -1;
+	}
+	for(i=0; i<OPT_MAX; i++)
+	{
+		if(!(confs[i]->flags & CONF_FLAG_INCEXC)) continue;
+		MD5_Update(&md5, confs[i]->field, strlen(confs[i]->field)+1);
+		switch(confs[i]->conf_type)
+		{
+			case CT_STRING:
+				if(get_string(confs[i]))
+					MD5_Update(&md5, get_string(confs[i]),
+						strlen(get_string(confs[i]))+1);
+				break;
+			case CT_STRLIST:
+				for(l=get_strlist(confs[i]); l; l=l->next)
+				{
+					snprintf(tmp, sizeof(tmp), "%ld:",
+						l->flag);
+					MD5_Update(&md5, tmp, strlen(tmp));
+					MD5_Update(&md5, l->path,
+						strlen(l->path)+1);
+				}
+				break;
+			case CT_UINT:
+				snprintf(tmp, sizeof(tmp), "%u",
+					get_int(confs[i]));
+				MD5_Update(&md5, tmp, strlen(tmp)+1);
+				break;
+			case CT_SSIZE_T:
+				snprintf(tmp, sizeof(tmp), "%" PRIu64,
+					get_uint64_t(confs[i]));
+				MD5_Update(&md5, tmp, strlen(tmp)+1);
+				break;
+			default:
+				break;
+		}
+	}
+	if(!MD5_Final(checksum, &md5))
+	{
+		logp("MD5_Final() failed\n");
+		return -1;
+	}
+	snprintf(out, len, "%s", bytes_to_md5str(checksum));
+	return 0;
+}
+
+static int get_line(struct fzp *fzp, char *buf, size_t len)
+{
+	size_t l;
+	if(!fzp_gets(fzp, buf, len)) return 1;
+	l=strlen(buf);
+	// An incomplete line is still being written.
+	if(!l || buf[l-1]!='\n') return 1;
+	buf[l-1]='\0';
+	return 0;
+}
+
+// Reads the journal from the given offset, noting the paths if asked to.
+// Returns the generation of the journal and the offset of its end.
+static int journal_load(const char *path, off_t from, int collect,
+	char *gen, size_t genlen, off_t *end)
+{
+	int ret=-1;
+	off_t offset;
+	struct fzp *fzp=NULL;
+	char buf[JOURNAL_LINE_MAX];
+
+	if(!(fzp=fzp_open(path, "rb")))
+		return -1;
+	if(get_line(fzp, buf, sizeof(buf))
+	  || strncmp(buf, JOURNAL_MAGIC " ", strlen(JOURNAL_MAGIC)+1))
+	{
+		logp("%s does not look like a journal\n", path);
+		goto end;
+	}
+	if(strlen(buf+strlen(JOURNAL_MAGIC)+1)>=genlen)
+	{
+		logp("header of %s is too long\n", path);
+		goto end;
+	}
+	snprintf(gen, genlen, "%s", buf+strlen(JOURNAL_MAGIC)+1);
+	offset=strlen(buf)+1;
+	if(from>offset)
+	{
+		if(fzp_seek(fzp, from, SEEK_SET))
+			goto end;
+		offset=from;
+	}
+	while(!get_line(fzp, buf, sizeof(buf)))
+	{
+		offset+=strlen(buf)+1;
+		if(!collect) continue;
+		if(strlen(buf)<3 || buf[1]!=' ')
+		{
+			logp("bad line in %s: %s\n", path, buf);
+			goto end;
+		}
+		if(buf[0]=='t')
+		{
+			if(jlist_add(&trees, buf+2)) goto end;
+		}
+		else if(jlist_add(&changed, buf+2))
+			goto end;
+	}
+	*end=offset;
+	ret=0;
+end:
+	fzp_close(&fzp);
+	return ret;
+}
+
+static int read_cache_header(struct fzp *fzp,
+	char *gen, size_t genlen, off_t *offset, char *fp, size_t fplen)
+{
+	char buf[256];
+	unsigned long long o;
+	if(get_line(fzp, buf, sizeof(buf))
+	  || strcmp(buf, JOURNAL_CACHE_MAGIC)
+	  || get_line(fzp, gen, genlen)
+	  || get_line(fzp, buf, sizeof(buf))
+	  || sscanf(buf, "%llu", &o)!=1
+	  || get_line(fzp, fp, fplen))
+		return -1;
+	*offset=(off_t)o;
+	return 0;
+}
+
+static int read_record(void);
+
+// Anything in the cache that is on a file system that is not being watched
+// has to be walked again, and so do the directories that it is in.
+static int cache_unwatched(void)
+{
+	int r;
+	char *path;
+	char gen[JOURNAL_GEN_MAX];
+	char fp[64];
+	off_t offset;
+	while(!(r=read_record()))
+	{
+		if(!S_ISDIR(psb->statp.st_mode)
+		  || is_marked(psb->statp.st_dev))
+			continue;
+		if(!(path=journal_real_path(psb->path.buf)))
+			return -1;
+		r=jlist_add(&changed, path);
+		free_w(&path);
+		if(r) return -1;
+	}
+	if(r<0) return -1;
+	// Back to the start, for the scan.
+	fzp_close(&cache_in);
+	if(!(cache_in=fzp_gzopen(cache_path, "rb"))
+	  || read_cache_header(cache_in, gen, sizeof(gen),
+		&offset, fp, sizeof(fp)))
+			return -1;
+	return 0;
+}
+
+int journal_scan_begin(struct conf **confs)
+{
+	off_t end=0;
+	off_t offset=0;
+	int usable=0;
+	char gen[JOURNAL_GEN_MAX]="";
+	char oldgen[JOURNAL_GEN_MAX]="";
+	char fp[64]="";
+	char oldfp[64]="";
+	struct stat statp;
+	const char *journal=get_string(confs[OPT_JOURNAL]);
+	const char *cname=get_string(confs[OPT_CNAME]);
+
+	if(!journal) return 0;
+	if(!cname) cname="client";
+	if(lstat(journal, &statp))
+	{
+		logp("%s does not exist - is 'burp -a j' running?\n", journal);
+		return 0;
+	}
+
+	if(conf_fingerprint(confs, fp, sizeof(fp))
+	  || !(cache_path=prepend_n(journal, cname, strlen(cname), "."))
+	  || !(cache_tmp=prepend_n(cache_path, "tmp", strlen("tmp"), "."))
+	  || !(wsb=sbuf_alloc(PROTO_1))
+	  || !(psb=sbuf_alloc(PROTO_1)))
+		goto error;
+
+	// The cache can only be trusted if the watcher has been running
+	// the whole time since it was written.
+	if(!access(cache_path, F_OK)
+	  && (cache_in=fzp_gzopen(cache_path, "rb")))
+	{
+		if(read_cache_header(cache_in, oldgen, sizeof(oldgen),
+			&offset, oldfp, sizeof(oldfp)))
+				logp("could not read header of %s\n", cache_path);
+		else
+			usable=!strcmp(fp, oldfp) && statp.st_size>=offset;
+	}
+	if(usable && !journal_watched(journal))
+	{
+		logp("%s is not locked - is 'burp -a j' running?\n", journal);
+		usable=0;
+	}
+	if(journal_load(journal, usable?offset:0, usable,
+		gen, sizeof(gen), &end))
+			goto error;
+	if(usable && strcmp(gen, oldgen))
+	{
+		usable=0;
+		jlist_free(&changed);
+		jlist_free(&trees);
+		// Get the end of the journal again, from the beginning.
+		if(journal_load(journal, 0, 0, gen, sizeof(gen), &end))
+			goto error;
+	}
+	if(usable
+	  && (marked_load(gen)
+		|| includes_load(confs)
+		|| cache_unwatched()))
+	{
+		logp("could not use %s\n", cache_path);
+		usable=0;
+		jlist_free(&changed);
+		jlist_free(&trees);
+	}
+	if(usable)
+	{
+		jlist_sort(&changed);
+		jlist_sort(&trees);
+		logp("Journal: %lu changed directories since the last scan\n",
+			(unsigned long)(changed.count+trees.count));
+	}
+	else
+	{
+		logp("Journal: no usable record since the last scan\n");
+		fzp_close(&cache_in);
+	}
+
+	if(!(cache_out=fzp_gzopen(cache_tmp, "wb1"))
+	  || fzp_printf(cache_out, "%s\n%s\n%llu\n%s\n", JOURNAL_CACHE_MAGIC,
+		gen, (unsigned long long)end, fp)<0)
+			goto error;
+	return 0;
+error:
+	journal_scan_end(0);
+	return -1;
+}
+
+int journal_scan_end(int ok)
+{
+	int ret=0;
+	fzp_close(&cache_in);
+	if(cache_out)
+	{
+		if(fzp_close(&cache_out))
+		{
+			logp("error closing %s\n", cache_tmp);
+			ok=0;
+		}
+		if(ok)
+		{
+			if(do_rename(cache_tmp, cache_path))
+				ret=-1;
+		}
+		else
+			unlink(cache_tmp);
+	}
+	jlist_free(&changed);
+	jlist_free(&trees);
+	free_v((void **)&marked);
+	mcount=0;
+	includes_free();
+	sbuf_free(&wsb);
+	sbuf_free(&psb);
+	free_w(&cache_path);
+	free_w(&cache_tmp);
+	pending=0;
+	return ret;
+}
+
+int journal_scan_record(FF_PKT *ff)
+{
+	const char *link="";
+	if(!cache_out) return 0;
+	if(ff->type==FT_LNK_S && ff->link)
+		link=ff->link;
+	wsb->statp=ff->statp;
+	wsb->winattr=ff->winattr;
+	wsb->compression=0;
+	if(attribs_encode(wsb)
+	  || fzp_printf(cache_out, "%d %lu %lu %lu\n", ff->type,
+		(unsigned long)wsb->attr.len,
+		(unsigned long)strlen(ff->fname),
+		(unsigned long)strlen(link))<0
+	  || fzp_write(cache_out, wsb->attr.buf, wsb->attr.len)
+		!=wsb->attr.len
+	  || fzp_write(cache_out, ff->fname, strlen(ff->fname))
+		!=strlen(ff->fname)
+	  || fzp_write(cache_out, link, strlen(link))!=strlen(link))
+	{
+		// Not fatal, the next backup will just walk everything.
+		logp("could not write to %s - giving up on it\n", cache_tmp);
+		fzp_close(&cache_out);
+		unlink(cache_tmp);
+	}
+	return 0;
+}
+
+int journal_scan_unchanged(const char *dir, dev_t dev)
+{
+	size_t i;
+	char *cp;
+	char *copy=NULL;
+	int ret=0;
+
+	if(!cache_in) return 0;
+
+	// Nothing would have noticed it changing.
+	if(!is_marked(dev)) return 0;
+
+	if(!(copy=journal_real_path(dir)))
+		return 0;
+
+	// Something changed in or below it.
+	i=jlist_lower(&changed, copy);
+	if(i<changed.count && is_subdir(copy, changed.paths[i]))
+		goto end;
+
+	// It, or one of the directories it is in, appeared from elsewhere.
+	while(1)
+	{
+		if(jlist_has(&trees, copy))
+			goto end;
+		if(!(cp=strrchr(copy, '/')) || cp==copy)
+			break;
+		*cp='\0';
+	}
+	ret=1;
+end:
+	free_w(&copy);
+	return ret;
+}
+
+static int read_buf(struct iobuf *iobuf, size_t len)
+{
+	iobuf_free_content(iobuf);
+	if(!(iobuf->buf=(char *)malloc_w(len+1, __func__)))
+		return -1;
+	if(len && fzp_read_ensure(cache_in, iobuf->buf, len, __func__))
+		return -1;
+	iobuf->buf[len]='\0';
+	iobuf->len=len;
+	return 0;
+}
+
+// Returns 0 on success, 1 at the end of the cache, -1 on error.
+static int read_record(void)
+{
+	char buf[256];
+	unsigned long alen;
+	unsigned long plen;
+	unsigned long llen;
+
+	if(get_line(cache_in, buf, sizeof(buf)))
+		return 1;
+	if(sscanf(buf, "%d %lu %lu %lu", &ptype, &alen, &plen, &llen)!=4
+	  || !plen
+	  || read_buf(&psb->attr, alen)
+	  || read_buf(&psb->path, plen)
+	  || read_buf(&psb->link, llen))
+	{
+		logp("bad entry in %s\n", cache_path);
+		return -1;
+	}
+	attribs_decode(psb);
+	return 0;
+}
+
+int journal_scan_next(const char *dir, FF_PKT *ff)
+{
+	int r;
+	while(cache_in)
+	{
+		if(!pending)
+		{
+			if((r=read_record()))
+			{
+				fzp_close(&cache_in);
+				return r<0?-1:0;
+			}
+			pending=1;
+		}
+		if(pathcmp(psb->path.buf, dir)<=0)
+		{
+			// Already dealt with by walking the file system.
+			pending=0;
+			continue;
+		}
+		if(!is_subdir(dir, psb->path.buf))
+			return 0;
+		pending=0;
+		ff->fname=psb->path.buf;
+		ff->link=psb->link.len?psb->link.buf:psb->path.buf;
+		ff->statp=psb->statp;
+		ff->winattr=psb->winattr;
+		ff->type=ptype;
+		return 1;
+	}
+	return 0;
+}
+
+#if defined(HAVE_SYS_FANOTIFY_H) && defined(FAN_REPORT_DFID_NAME)
+
+struct jmount
+{
+	fsid_t fsid;
+	int fd;
+};
+
+static char *last_written=NULL;
+
+static struct fzp *journal_new(const char *path, const char *marks)
+{
+	static int count=0;
+	struct fzp *fzp=NULL;
+	// A new journal gets a new generation, so that the scan can tell
+	// that there may be changes that are not recorded in it.
+	if(!(fzp=fzp_open(path, "wb"))
+	  || fzp_printf(fzp, "%s %ld.%d.%d%s\n", JOURNAL_MAGIC,
+		(long)time(NULL), (int)getpid(), count++, marks)<0
+	  || fzp_flush(fzp))
+	{
+		logp("could not start journal %s\n", path);
+		fzp_close(&fzp);
+	}
+	free_w(&last_written);
+	return fzp;
+}
+
+static int journal_write(struct fzp *fzp, char type, char *path)
+{
+	char *cp;
+	// Newlines would break the journal. Fall back to walking all of
+	// the tree above the awkward name.
+	if((cp=strchr(path, '\n')))
+	{
+		*cp='\0';
+		if(!(cp=strrchr(path, '/')) || cp==path) return 0;
+		*cp='\0';
+		type='t';
+	}
+	if(type=='d' && last_written && !strcmp(last_written, path))
+		return 0;
+	if(fzp_printf(fzp, "%c %s\n", type, path)<0)
+		return -1;
+	free_w(&last_written);
+	if(type=='d' && !(last_written=strdup_w(path, __func__)))
+		return -1;
+	return 0;
+}
+
+static int journal_event(struct fzp *fzp, struct fanotify_event_metadata *m,
+	struct jmount *mounts, int mcount)
+{
+	int i;
+	int dfd;
+	ssize_t plen;
+	char proc[64];
+	char *cp;
+	const char *name;
+	char path[PATH_MAX+NAME_MAX+2];
+	struct file_handle *handle;
+	struct fanotify_event_info_fid *fid;
+
+	fid=(struct fanotify_event_info_fid *)(m+1);
+	if(m->event_len<sizeof(*m)+sizeof(*fid)
+	  || fid->hdr.info_type!=FAN_EVENT_INFO_TYPE_DFID_NAME)
+		return 0;
+	handle=(struct file_handle *)fid->handle;
+	name=(const char *)handle->f_handle+handle->handle_bytes;
+
+	for(i=0; i<mcount; i++)
+		if(!memcmp(&mounts[i].fsid, &fid->fsid, sizeof(fsid_t)))
+			break;
+	if(i==mcount) return 0;
+
+	// If the directory has gone already, its removal will be recorded
+	// against its parent.
+	if((dfd=open_by_handle_at(mounts[i].fd, handle, O_RDONLY|O_PATH))<0)
+		return 0;
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dfd);
+	plen=readlink(proc, path, PATH_MAX);
+	close(dfd);
+	if(plen<=0) return 0;
+	path[plen]='\0';
+
+	if(!strcmp(name, "."))
+	{
+		// Something happened to the directory itself, so its entry
+		// in its parent changed.
+		if(journal_write(fzp, 'd', path)) return -1;
+		if((cp=strrchr(path, '/')) && cp!=path)
+		{
+			*cp='\0';
+			return journal_write(fzp, 'd', path);
+		}
+		return 0;
+	}
+	if(journal_write(fzp, 'd', path)) return -1;
+	if((m->mask & FAN_ONDIR) && (m->mask & (FAN_CREATE|FAN_MOVED_TO)))
+	{
+		// A directory that was moved in comes with everything
+		// inside it.
+		snprintf(path+plen, sizeof(path)-plen, "/%s", name);
+		return journal_write(fzp, 't', path);
+	}
+	return 0;
+}
+
+static int has_mark(const char *marks, const char *dev)
+{
+	size_t len=strlen(dev);
+	for(; (marks=strstr(marks, dev)); marks++)
+		if(marks[len]==' ' || !marks[len])
+			return 1;
+	return 0;
+}
+
+int journal_watch(struct conf **confs)
+{
+	int i;
+	int ret=-1;
+	int fd=-1;
+	int lockfd=-1;
+	ssize_t len;
+	int mcount=0;
+	char *real=NULL;
+	char marks[JOURNAL_GEN_MAX-64]="";
+	struct strlist *l;
+	struct fzp *fzp=NULL;
+	struct jmount *mounts=NULL;
+	struct fanotify_event_metadata *m;
+	char buf[65536] __attribute__ ((aligned(__alignof__(
+		struct fanotify_event_metadata))));
+	const char *journal=get_string(confs[OPT_JOURNAL]);
+	uint64_t mask=FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO
+		|FAN_MODIFY|FAN_ATTRIB|FAN_DELETE_SELF|FAN_MOVE_SELF
+		|FAN_ONDIR;
+
+	if(!journal)
+	{
+		logp("journal is not set in the configuration\n");
+		return -1;
+	}
+	// Held until we go, however that happens, which tells the scan that
+	// the journal is being kept up to date.
+	if((lockfd=open(journal, O_WRONLY|O_CREAT, 0600))<0
+	  || flock(lockfd, LOCK_EX|LOCK_NB))
+	{
+		logp("could not lock %s - is another 'burp -a j' running?\n",
+			journal);
+		goto end;
+	}
+	if((fd=fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME,
+		O_RDONLY|O_LARGEFILE))<0)
+	{
+		logp("fanotify_init failed: %s\n", strerror(errno));
+		goto end;
+	}
+	for(l=get_strlist(confs[OPT_STARTDIR]); l; l=l->next)
+	{
+		int mfd;
+		char dev[32];
+		struct stat statp;
+		struct statfs sfs;
+		struct jmount *tmp;
+		if(!l->flag) continue;
+		// Events come with real paths, so watch the real place.
+		free(real);
+		if(!(real=realpath(l->path, NULL))
+		  || (mfd=open(real, O_RDONLY|O_DIRECTORY))<0)
+		{
+			logp("could not open %s: %s\n",
+				l->path, strerror(errno));
+			goto end;
+		}
+		if(fstat(mfd, &statp)
+		  || fstatfs(mfd, &sfs)
+		  || fanotify_mark(fd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM,
+			mask, AT_FDCWD, real))
+		{
+			logp("could not watch %s: %s\n",
+				l->path, strerror(errno));
+			close(mfd);
+			goto end;
+		}
+		// The scan walks anything on other file systems, because
+		// nothing is watching them.
+		snprintf(dev, sizeof(dev), " %llu",
+			(unsigned long long)statp.st_dev);
+		if(!has_mark(marks, dev))
+		{
+			if(strlen(marks)+strlen(dev)>=sizeof(marks))
+			{
+				logp("too many file systems to watch\n");
+				close(mfd);
+				goto end;
+			}
+			strcat(marks, dev);
+		}
+		if(!(tmp=(struct jmount *)realloc_w(mounts,
+			(mcount+1)*sizeof(struct jmount), __func__)))
+		{
+			close(mfd);
+			goto end;
+		}
+		mounts=tmp;
+		mounts[mcount].fsid=sfs.f_fsid;
+		mounts[mcount++].fd=mfd;
+	}
+	if(!mcount)
+	{
+		logp("nothing to watch\n");
+		goto end;
+	}
+
+	if(!(fzp=journal_new(journal, marks)))
+		goto end;
+	logp("Recording changes in %s\n", journal);
+
+	while(1)
+	{
+		if((len=read(fd, buf, sizeof(buf)))<0)
+		{
+			if(errno==EINTR) continue;
+			logp("error reading fanotify events: %s\n",
+				strerror(errno));
+			goto end;
+		}
+		for(m=(struct fanotify_event_metadata *)buf;
+			FAN_EVENT_OK(m, len); m=FAN_EVENT_NEXT(m, len))
+		{
+			if(m->vers!=FANOTIFY_METADATA_VERSION)
+			{
+				logp("unexpected fanotify version\n");
+				goto end;
+			}
+			if(m->mask & FAN_Q_OVERFLOW)
+			{
+				logp("fanotify events were lost - starting a new journal\n");
+				fzp_close(&fzp);
+				if(!(fzp=journal_new(journal, marks)))
+					goto end;
+				continue;
+			}
+			if(journal_event(fzp, m, mounts, mcount))
+				goto end;
+		}
+		if(fzp_flush(fzp))
+			goto end;
+		if(fzp_tell(fzp)>JOURNAL_MAX)
+		{
+			logp("%s is full - starting a new journal\n", journal);
+			fzp_close(&fzp);
+			if(!(fzp=journal_new(journal, marks)))
+				goto end;
+		}
+	}
+end:
+	fzp_close(&fzp);
+	close_fd(&fd);
+	close_fd(&lockfd);
+	free(real);
+	for(i=0; i<mcount; i++)
+		close(mounts[i].fd);
+	free_v((void **)&mounts);
+	free_w(&last_written);
+	return ret;
+}
+
+#else
+
+int journal_watch(struct conf **confs)
+{
+	logp("%s is not supported on this platform\n", __func__);
+	return -1;
+}
+
+#endif
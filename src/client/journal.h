@@ -0,0 +1,26 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include "find.h"
+
+// A record of the directories that have changed since the last backup,
+// kept by 'burp -a j' running in the background, plus a cache of what the
+// last phase1 scan found. Together, these let the scan skip walking the
+// subtrees that have not changed, sending what it found last time instead.
+
+// Runs until killed, appending changed directories to the journal.
+extern int journal_watch(struct conf **confs);
+
+extern int journal_scan_begin(struct conf **confs);
+extern int journal_scan_end(int ok);
+
+// Called for everything the scan finds, so that it can be cached.
+extern int journal_scan_record(FF_PKT *ff);
+// Returns 1 if the entries below dir, which is on device dev, can come from
+// the cache.
+extern int journal_scan_unchanged(const char *dir, dev_t dev);
+// Fills in ff with the next cached entry below dir. Returns 1 when it did,
+// 0 when there are no more, -1 on error.
+extern int journal_scan_next(const char *dir, FF_PKT *ff);
+
+#endif
@@ -2,43 +2,33 @@
 #include "../action.h"
 #include "../asfd.h"
 #include "../async.h"
+#include "../bfile.h"
 #include "../cmd.h"
 #include "../cntr.h"
 #include "../fsops.h"
 #include "../handy.h"
 #include "../iobuf.h"
 #include "../log.h"
+#include "../pdeflate.h"
 #include "../run_script.h"
 #include "auth.h"
 #include "backup.h"
 #include "ca.h"
 #include "delete.h"
 #include "extra_comms.h"
+#include "journal.h"
 #include "list.h"
+#include "main.h"
 #include "monitor.h"
 #include "monitor/status_client_ncurses.h"
 #include "protocol2/restore.h"
 #include "restore.h"
+#include "restore_streams.h"
 
 #ifndef HAVE_WIN32
 #include <sys/utsname.h>
 #endif
 
-// These will also be used as the exit codes of the program and are therefore
-// unsigned integers.
-// Remember to update the man page if you update these.
-enum cliret
-{
-	CLIENT_OK=0,
-	CLIENT_ERROR=1,
-	CLIENT_RESTORE_WARNINGS=2,
-	CLIENT_SERVER_TIMER_NOT_MET=3,
-	CLIENT_COULD_NOT_CONNECT=4,
-	// This one happens after a successful certificate signing request so
-	// that it connects again straight away with the new key/certificate.
-	CLIENT_RECONNECT=100
-};
-
 struct tchk
 {
 	int resume;
@@ -197,7 +187,9 @@ static int s_server_session_id_context=1;
 static int ssl_setup(int *rfd, SSL **ssl, SSL_CTX **ctx,
 	enum action action, struct conf **confs)
 {
+	int resuming=0;
 	BIO *sbio=NULL;
+	const char *ssl_session_cache=get_string(confs[OPT_SSL_SESSION_CACHE]);
 	ssl_load_globals();
 	if(!(*ctx=ssl_initialise_ctx(confs)))
 	{
@@ -221,11 +213,17 @@ static int ssl_setup(int *rfd, SSL **ssl, SSL_CTX **ctx,
 		return -1;
 	}
 	SSL_set_bio(*ssl, sbio, sbio);
+	resuming=ssl_session_load(*ssl, ssl_session_cache);
 	if(SSL_connect(*ssl)<=0)
 	{
 		logp_ssl_err("SSL connect error\n");
+		// Do not offer the same session again next time, in case it
+		// was the problem.
+		if(resuming) unlink(ssl_session_cache);
 		return -1;
 	}
+	if(SSL_session_reused(*ssl))
+		logp("Resumed SSL session\n");
 	return 0;
 }
 
@@ -235,6 +233,7 @@ static enum cliret initial_comms(struct async *as,
 	struct asfd *asfd;
 	char *server_version=NULL;
 	enum cliret ret=CLIENT_OK;
+	const char *ssl_session_cache=get_string(confs[OPT_SSL_SESSION_CACHE]);
 	asfd=as->asfd;
 
 	if(authorise_client(asfd, &server_version,
@@ -257,6 +256,7 @@ static enum cliret initial_comms(struct async *as,
 				// Certificate signed successfully.
 				// Everything is OK, but we will reconnect now,
 				// in order to use the new keys/certificates.
+				if(ssl_session_cache) unlink(ssl_session_cache);
 				goto reconnect;
 			default:
 				logp("Error with cert signing request\n");
@@ -272,6 +272,11 @@ static enum cliret initial_comms(struct async *as,
 		goto error;
 	}
 
+	// Keep the session, so that the next connection can skip most of
+	// the handshake.
+	if(ssl_session_save(asfd->ssl, ssl_session_cache))
+		logp("Could not save ssl_session_cache\n");
+
 	if(extra_comms(as, confs, action, incexc))
 	{
 		logp("extra comms failed\n");
@@ -295,6 +300,10 @@ static enum cliret restore_wrapper(struct asfd *asfd, enum action action,
 	const char *r_script_pre=get_string(confs[OPT_R_SCRIPT_PRE]);
 	const char *r_script_post=get_string(confs[OPT_R_SCRIPT_POST]);
 
+	// The scripts run once, around the main restore stream.
+	if(restore_streams_part())
+		r_script_pre=r_script_post=NULL;
+
 	if(r_script_pre)
 	{
 		int a=0;
@@ -380,6 +389,13 @@ static enum cliret do_client(struct conf **confs,
 		goto end;
 	}
 
+	// The journal watcher runs locally until it is killed.
+	if(action==ACTION_JOURNAL)
+	{
+		if(journal_watch(confs)) ret=CLIENT_ERROR;
+		goto end;
+	}
+
 	if(!(cntr=cntr_alloc())
 	  || cntr_init(cntr, get_string(confs[OPT_CNAME]))) goto error;
 	set_cntr(confs[OPT_CNTR], cntr);
@@ -396,6 +412,19 @@ static enum cliret do_client(struct conf **confs,
 			goto end;
 	as->asfd_add(as, asfd);
 
+	pdeflate_set_workers(get_int(confs[OPT_COMPRESSION_WORKERS]),
+		get_uint64_t(confs[OPT_COMPRESSION_WORKERS_MIN_SIZE]));
+#ifndef HAVE_WIN32
+	// A compression worker that dies should give us an error, not kill
+	// us. The server ignores SIGPIPE from startup already.
+	if(get_int(confs[OPT_COMPRESSION_WORKERS])>1)
+		signal(SIGPIPE, SIG_IGN);
+#endif
+	bfile_set_read_ahead(get_int(confs[OPT_READ_AHEAD_FILES]),
+		get_uint64_t(confs[OPT_READ_AHEAD_SIZE]));
+	bfile_set_restore_writes(get_uint64_t(confs[OPT_RESTORE_WRITE_BUFFER]),
+		get_int(confs[OPT_RESTORE_PREALLOCATE]));
+
 	// Set quality of service bits on backup packets.
 	if(act==ACTION_BACKUP
 	  || act==ACTION_BACKUP_TIMED
@@ -472,6 +501,7 @@ end:
 	free_w(&incexc);
 	set_cntr(confs[OPT_CNTR], NULL);
 	cntr_free(&cntr);
+	bfile_set_restore_writes(0, 0);
 
 	//logp("end client\n");
 	return ret;
@@ -1,6 +1,21 @@
 #ifndef _CLIENT_MAIN_H
 #define _CLIENT_MAIN_H
 
+// These will also be used as the exit codes of the program and are therefore
+// unsigned integers.
+// Remember to update the man page if you update these.
+enum cliret
+{
+	CLIENT_OK=0,
+	CLIENT_ERROR=1,
+	CLIENT_RESTORE_WARNINGS=2,
+	CLIENT_SERVER_TIMER_NOT_MET=3,
+	CLIENT_COULD_NOT_CONNECT=4,
+	// This one happens after a successful certificate signing request so
+	// that it connects again straight away with the new key/certificate.
+	CLIENT_RECONNECT=100
+};
+
 extern int client(struct conf **confs, enum action act, int vss_restore);
 
 #endif
@@ -12,6 +12,7 @@
 #include "../../protocol1/msg.h"
 #include "../extrameta.h"
 #include "../find.h"
+#include "backup_streams.h"
 
 static int rs_loadsig_network_run(struct asfd *asfd,
 	rs_job_t *job, struct cntr *cntr)
@@ -262,6 +263,9 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 		{
 			logw(asfd, cntr,
 				"Meta data error for %s\n", sb->path.buf);
+			// Let the server know that nothing is coming, so
+			// that it can free up the stream.
+			if(forget_file(asfd, sb, confs)) goto error;
 			goto end;
 		}
 		if(extrameta)
@@ -278,6 +282,7 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 		{
 			logw(asfd, cntr,
 				"No meta data after all: %s\n", sb->path.buf);
+			if(forget_file(asfd, sb, confs)) goto error;
 			goto end;
 		}
 	}
@@ -379,8 +384,9 @@ static int parse_rbuf(struct asfd *asfd, struct sbuf *sb,
 	return 0;
 }
 
-static int do_backup_phase2_client(struct asfd *asfd,
-	struct conf **confs, int resume)
+// Deal with what the server asks for, until it says that it is finished.
+// With backup streams, each stream runs this in its own process.
+static int send_files(struct asfd *asfd, struct conf **confs)
 {
 	int ret=-1;
 	// For efficiency, open Windows files for the VSS data, and do not
@@ -388,35 +394,15 @@ static int do_backup_phase2_client(struct asfd *asfd,
 	// data is read.
 	BFILE *bfd=NULL;
 	struct sbuf *sb=NULL;
-	struct iobuf *rbuf=NULL;
+	struct iobuf *rbuf=asfd->rbuf;
 	struct cntr *cntr=NULL;
 	if(confs) cntr=get_cntr(confs);
 
-	if(!asfd)
-	{
-		logp("%s() called without asfd!\n", __func__);
-		goto end;
-	}
-	rbuf=asfd->rbuf;
-
 	if(!(bfd=bfile_alloc())
 	  || !(sb=sbuf_alloc(PROTO_1)))
 		goto end;
 	bfile_init(bfd, 0, cntr);
 
-	if(!resume)
-	{
-		// Only do this bit if the server did not tell us to resume.
-		if(asfd->write_str(asfd, CMD_GEN, "backupphase2")
-		  || asfd_read_expect(asfd, CMD_GEN, "ok"))
-			goto end;
-	}
-	else if(get_int(confs[OPT_SEND_CLIENT_CNTR]))
-	{
-		// On resume, the server might update the client with cntr.
-		if(cntr_recv(asfd, confs)) goto end;
-	}
-
 	while(1)
 	{
 		iobuf_free_content(rbuf);
@@ -444,6 +430,36 @@ end:
 	return ret;
 }
 
+static int do_backup_phase2_client(struct asfd *asfd,
+	struct conf **confs, int resume)
+{
+	int streams=1;
+
+	if(!asfd)
+	{
+		logp("%s() called without asfd!\n", __func__);
+		return -1;
+	}
+
+	if(!resume)
+	{
+		// Only do this bit if the server did not tell us to resume.
+		if(asfd->write_str(asfd, CMD_GEN, "backupphase2")
+		  || asfd_read_expect(asfd, CMD_GEN, "ok"))
+			return -1;
+	}
+	else if(get_int(confs[OPT_SEND_CLIENT_CNTR]))
+	{
+		// On resume, the server might update the client with cntr.
+		if(cntr_recv(asfd, confs)) return -1;
+	}
+
+	if(confs) streams=get_int(confs[OPT_BACKUP_STREAMS]);
+	if(streams>1)
+		return backup_streams_client(asfd, confs, streams, send_files);
+	return send_files(asfd, confs);
+}
+
 int backup_phase2_client_protocol1(struct asfd *asfd,
 	struct conf **confs, int resume)
 {
@@ -0,0 +1,360 @@
+#include "../../burp.h"
+#include "../../alloc.h"
+#include "../../asfd.h"
+#include "../../async.h"
+#include "../../cmd.h"
+#include "../../cntr.h"
+#include "../../conf.h"
+#include "../../iobuf.h"
+#include "../../log.h"
+#include "backup_streams.h"
+
+#ifdef HAVE_WIN32
+
+int backup_streams_client(struct asfd *asfd, struct conf **confs,
+	int streams, backup_stream_func *func)
+{
+	// Needs fork().
+	return func(asfd, confs);
+}
+
+#else
+
+struct stream
+{
+	struct asfd *asfd;
+	pid_t pid;
+	// What the file being sent looks like, for the counters.
+	enum cmd cmd;
+	int delta;
+	uint64_t sentbytes;
+	// Still needs to be told that phase2 is over.
+	int end;
+	// Has said that it is finished.
+	int ended;
+};
+
+static struct asfd *stream_asfd(struct async *as, const char *desc,
+	int *fd, pid_t pid, struct conf **confs)
+{
+	struct asfd *asfd;
+	if(!(asfd=setup_asfd(as, desc, fd, NULL,
+		ASFD_STREAM_STANDARD, ASFD_FD_UNSET, pid, confs)))
+			return NULL;
+	// These are only socket pairs, so they can be as quiet and as fast
+	// as they like.
+	asfd->max_network_timeout=0;
+	asfd->network_timeout=0;
+	asfd->ratelimit=0;
+	return asfd;
+}
+
+static void stream_child(struct asfd *asfd, struct conf **confs,
+	struct stream *s, int i, int fd, backup_stream_func *func)
+{
+	int x;
+	struct async *as=NULL;
+	struct asfd *sfd=NULL;
+
+	// Leave the connection to the server, and the other streams, to the
+	// parent.
+	close(asfd->fd);
+	for(x=0; x<i; x++)
+		close(s[x].asfd->fd);
+	// The parent keeps the counters.
+	set_cntr(confs[OPT_CNTR], NULL);
+
+	if(!(as=async_alloc())
+	  || as->init(as, 0)
+	  || !(sfd=stream_asfd(as, "backup stream", &fd, -1, confs)))
+		_exit(1);
+	_exit(func(sfd, confs)?1:0);
+}
+
+static int streams_start(struct asfd *asfd, struct conf **confs,
+	struct stream *s, int count, backup_stream_func *func)
+{
+	int i;
+	int sv[2];
+	char desc[32];
+
+	// A stream that dies is an error, and should not kill us.
+	signal(SIGPIPE, SIG_IGN);
+	for(i=0; i<count; i++)
+	{
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)<0)
+		{
+			logp("socketpair failed in %s: %s\n",
+				__func__, strerror(errno));
+			return -1;
+		}
+		switch((s[i].pid=fork()))
+		{
+			case -1:
+				logp("Could not fork backup stream %d: %s\n",
+					i, strerror(errno));
+				s[i].pid=0;
+				close(sv[0]);
+				close(sv[1]);
+				return -1;
+			case 0:
+				close(sv[0]);
+				stream_child(asfd, confs, s, i, sv[1], func);
+			default:
+				break;
+		}
+		close(sv[1]);
+		snprintf(desc, sizeof(desc), "backup stream %d", i);
+		if(!(s[i].asfd=stream_asfd(asfd->as,
+			desc, &sv[0], s[i].pid, confs)))
+		{
+			close(sv[0]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int streams_stop(struct asfd *asfd,
+	struct stream *s, int count, int ret)
+{
+	int i;
+	int status;
+	for(i=0; i<count; i++)
+	{
+		if(!s[i].asfd) continue;
+		asfd->as->asfd_remove(asfd->as, s[i].asfd);
+		asfd_free(&s[i].asfd);
+	}
+	for(i=0; i<count; i++)
+	{
+		if(s[i].pid<=0) continue;
+		if(ret) kill(s[i].pid, SIGTERM);
+		if(waitpid(s[i].pid, &status, 0)<0
+		  || !WIFEXITED(status)
+		  || WEXITSTATUS(status))
+		{
+			if(!ret) logp("Backup stream %d failed\n", i);
+			ret=-1;
+		}
+	}
+	return ret;
+}
+
+static void stream_count(struct stream *s, struct iobuf *iobuf, size_t len,
+	struct cntr *cntr)
+{
+	uint64_t bytes;
+	switch(iobuf->cmd)
+	{
+		case CMD_DATAPTH:
+			s->delta=1;
+			break;
+		case CMD_APPEND:
+			s->sentbytes+=len;
+			break;
+		case CMD_INTERRUPT:
+			s->delta=0;
+			break;
+		case CMD_WARNING:
+			cntr_add(cntr, CMD_WARNING, 1);
+			break;
+		case CMD_END_FILE:
+			bytes=strtoull(iobuf->buf, NULL, 10);
+			if(s->delta)
+			{
+				cntr_add(cntr, CMD_FILE_CHANGED, 1);
+				cntr_add_sentbytes(cntr, s->sentbytes);
+			}
+			else
+			{
+				cntr_add(cntr, s->cmd, 1);
+				cntr_add_sentbytes(cntr, bytes);
+			}
+			cntr_add_bytes(cntr, bytes);
+			s->delta=0;
+			s->sentbytes=0;
+			break;
+		default:
+			if(iobuf_is_filedata(iobuf)
+			  || iobuf_is_vssdata(iobuf))
+				s->cmd=iobuf->cmd;
+			break;
+	}
+}
+
+// Pass on what the server sent to the stream that it is for. Anything that
+// does not fit yet stays in the read buffer, which stops any more being read
+// from the server until it does.
+static int from_server(struct asfd *asfd, struct stream *s, int count,
+	int *recv, int *ending, struct cntr *cntr)
+{
+	int i;
+	struct asfd *sfd;
+	struct iobuf *rbuf=asfd->rbuf;
+
+	while(rbuf->buf)
+	{
+		if(rbuf->cmd==CMD_MESSAGE
+		  || rbuf->cmd==CMD_WARNING)
+		{
+			log_recvd(rbuf, cntr, 0);
+		}
+		else if(rbuf->cmd==CMD_STREAM)
+		{
+			if((i=atoi(rbuf->buf))<0 || i>=count)
+			{
+				iobuf_log_unexpected(rbuf, __func__);
+				return -1;
+			}
+			*recv=i;
+		}
+		else if(rbuf->cmd==CMD_GEN
+		  && !strcmp(rbuf->buf, "backupphase2end"))
+		{
+			for(i=0; i<count; i++)
+				s[i].end=1;
+			*ending=1;
+		}
+		else
+		{
+			if(*recv<0)
+			{
+				iobuf_log_unexpected(rbuf, __func__);
+				return -1;
+			}
+			sfd=s[*recv].asfd;
+			switch(sfd->append_all_to_write_buffer(sfd, rbuf))
+			{
+				case APPEND_OK: break;
+				case APPEND_BLOCKED: return 0;
+				default: return -1;
+			}
+		}
+		iobuf_free_content(rbuf);
+		// There may be more that has already been read in.
+		if(asfd->parse_readbuf(asfd))
+			return -1;
+	}
+	return 0;
+}
+
+// Pass on what a stream sent to the server, telling the server first if it
+// is from a different stream to last time.
+static int from_stream(struct asfd *asfd, struct stream *s, int i,
+	int *send, struct cntr *cntr)
+{
+	size_t len;
+	char tmp[16];
+	struct iobuf wbuf;
+	struct iobuf *rbuf=s->asfd->rbuf;
+
+	while(rbuf->buf)
+	{
+		if(rbuf->cmd==CMD_GEN
+		  && !strcmp(rbuf->buf, "okbackupphase2end"))
+		{
+			s->ended=1;
+		}
+		else
+		{
+			if(*send!=i)
+			{
+				snprintf(tmp, sizeof(tmp), "%d", i);
+				iobuf_from_str(&wbuf, CMD_STREAM, tmp);
+				switch(asfd->append_all_to_write_buffer(asfd,
+					&wbuf))
+				{
+					case APPEND_OK: break;
+					case APPEND_BLOCKED: return 0;
+					default: return -1;
+				}
+				*send=i;
+			}
+			len=rbuf->len;
+			switch(asfd->append_all_to_write_buffer(asfd, rbuf))
+			{
+				case APPEND_OK: break;
+				case APPEND_BLOCKED: return 0;
+				default: return -1;
+			}
+			stream_count(s, rbuf, len, cntr);
+		}
+		iobuf_free_content(rbuf);
+		if(s->asfd->parse_readbuf(s->asfd))
+			return -1;
+	}
+	return 0;
+}
+
+static int tell_streams_to_end(struct stream *s, int count)
+{
+	int i;
+	struct iobuf wbuf;
+	for(i=0; i<count; i++)
+	{
+		if(!s[i].end) continue;
+		iobuf_from_str(&wbuf, CMD_GEN, (char *)"backupphase2end");
+		switch(s[i].asfd->append_all_to_write_buffer(s[i].asfd, &wbuf))
+		{
+			case APPEND_OK: break;
+			case APPEND_BLOCKED: continue;
+			default: return -1;
+		}
+		s[i].end=0;
+	}
+	return 0;
+}
+
+static int streams_ended(struct stream *s, int count)
+{
+	int i;
+	for(i=0; i<count; i++)
+		if(!s[i].ended) return 0;
+	return 1;
+}
+
+int backup_streams_client(struct asfd *asfd, struct conf **confs,
+	int count, backup_stream_func *func)
+{
+	int i;
+	int ret=-1;
+	int recv=-1;
+	int send=-1;
+	int ending=0;
+	struct stream *s=NULL;
+	struct cntr *cntr=get_cntr(confs);
+
+	if(!(s=(struct stream *)calloc_w(count,
+		sizeof(struct stream), __func__)))
+			return -1;
+	if(streams_start(asfd, confs, s, count, func))
+		goto end;
+	logp("Sending files over %d streams\n", count);
+
+	while(1)
+	{
+		if(asfd->as->read_write(asfd->as)
+		  || from_server(asfd, s, count, &recv, &ending, cntr))
+			goto end;
+		for(i=0; i<count; i++)
+			if(from_stream(asfd, &s[i], i, &send, cntr))
+				goto end;
+		if(!ending)
+			continue;
+		if(tell_streams_to_end(s, count))
+			goto end;
+		if(!streams_ended(s, count))
+			continue;
+		if(asfd->write_str(asfd, CMD_GEN, "okbackupphase2end"))
+			goto end;
+		ret=0;
+		break;
+	}
+end:
+	ret=streams_stop(asfd, s, count, ret);
+	free_v((void **)&s);
+	return ret;
+}
+
+#endif
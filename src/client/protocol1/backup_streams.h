@@ -0,0 +1,16 @@
+#ifndef _BACKUP_STREAMS_CLIENT_H
+#define _BACKUP_STREAMS_CLIENT_H
+
+// Several files on their way to the server at once, all over the one
+// connection. Each stream is a child process that runs the usual phase2
+// code, with its own librsync jobs and compression, and talks to this
+// process over a socket pair. This process passes things between the
+// streams and the server, with a CMD_STREAM marker whenever it switches
+// from one stream to another, and keeps the counters.
+
+typedef int backup_stream_func(struct asfd *asfd, struct conf **confs);
+
+extern int backup_streams_client(struct asfd *asfd, struct conf **confs,
+	int streams, backup_stream_func *func);
+
+#endif
@@ -3,13 +3,16 @@
 #include "../../asfd.h"
 #include "../../async.h"
 #include "../../base64.h"
+#include "../../bfile.h"
 #include "../../cmd.h"
 #include "../../cntr.h"
 #include "../../iobuf.h"
 #include "../../log.h"
 #include "../../protocol2/blk.h"
 #include "../../protocol2/blist.h"
+#include "../../protocol2/flow.h"
 #include "../../protocol2/rabin/rabin.h"
+#include "../../protocol2/rabin/rconf.h"
 #include "../../slist.h"
 
 #define END_SIGS                0x01
@@ -55,7 +58,7 @@ static int add_to_data_requests(struct blist *blist, struct iobuf *rbuf)
 }
 
 static int deal_with_read(struct iobuf *rbuf, struct slist *slist,
-	struct cntr *cntr, uint8_t *end_flags)
+	struct cntr *cntr, uint8_t *end_flags, struct flow *flow)
 {
 	int ret=0;
 	switch(rbuf->cmd)
@@ -68,6 +71,7 @@ static int deal_with_read(struct iobuf *rbuf, struct slist *slist,
 		/* Incoming data block request. */
 		case CMD_DATA_REQ:
 			if(add_to_data_requests(slist->blist, rbuf)) goto error;
+			flow_ack(flow, slist->blist->last_requested->index);
 			goto end;
 
 		/* Incoming control/message stuff. */
@@ -92,6 +96,7 @@ static int deal_with_read(struct iobuf *rbuf, struct slist *slist,
 					wrap_up);
 //				goto error;
 			}
+			flow_ack(flow, (uint64_t)wrap_up);
 			goto end;
 		}
 		case CMD_MESSAGE:
@@ -129,6 +134,29 @@ end:
 	return ret;
 }
 
+// Ask the OS to start reading the next few files that the server wants, so
+// that they are already in memory by the time that we get to them. Only
+// regular files, since opening anything else can block or have side
+// effects.
+static void read_ahead(struct sbuf *sb, struct conf **confs)
+{
+	int i;
+	int atime;
+	int files=bfile_read_ahead_files();
+
+	if(!files || !confs) return;
+	atime=get_int(confs[OPT_ATIME]);
+	for(i=0, sb=sb->next; sb && i<files; i++, sb=sb->next)
+	{
+		if(sb->flags & SBUF_READ_AHEAD) continue;
+		sb->flags|=SBUF_READ_AHEAD;
+		if(lstat(sb->path.buf, &sb->statp)
+		  || !S_ISREG(sb->statp.st_mode))
+			continue;
+		bfile_read_ahead(sb->path.buf, atime);
+	}
+}
+
 static int add_to_blks_list(struct asfd *asfd, struct conf **confs,
 	struct slist *slist)
 {
@@ -157,6 +185,7 @@ static int add_to_blks_list(struct asfd *asfd, struct conf **confs,
 				return -1;
 		}
 		just_opened=1;
+		read_ahead(sb, confs);
 	}
 
 	switch(blks_generate(asfd, confs, sb, slist->blist, just_opened))
@@ -200,7 +229,8 @@ static void free_stuff(struct slist *slist)
 }
 
 static void get_wbuf_from_data(struct conf **confs,
-	struct iobuf *wbuf, struct slist *slist, uint8_t end_flags)
+	struct iobuf *wbuf, struct slist *slist, uint8_t end_flags,
+	struct flow *flow)
 {
 	struct blk *blk;
 	struct blist *blist=slist->blist;
@@ -212,6 +242,7 @@ static void get_wbuf_from_data(struct conf **confs,
 			iobuf_set(wbuf, CMD_DATA, blk->data, blk->length);
 			blk->requested=0;
 			blist->last_sent=blk;
+			flow_data(flow, blk->length);
 			cntr_add(get_cntr(confs), CMD_DATA, 1);
 			cntr_add_sentbytes(get_cntr(confs), blk->length);
 			break;
@@ -241,7 +272,7 @@ static int iobuf_from_blk_data(struct iobuf *wbuf, struct blk *blk)
 }
 
 static int get_wbuf_from_blks(struct iobuf *wbuf,
-	struct slist *slist, uint8_t *end_flags)
+	struct slist *slist, uint8_t *end_flags, struct flow *flow)
 {
 	struct sbuf *sb=slist->blks_to_send;
 
@@ -265,6 +296,7 @@ static int get_wbuf_from_blks(struct iobuf *wbuf,
 	}
 
 	if(iobuf_from_blk_data(wbuf, sb->protocol2->bsighead)) return -1;
+	flow_sig_sent(flow, sb->protocol2->bsighead->index);
 
 	// Move on.
 	if(sb->protocol2->bsighead==sb->protocol2->bend)
@@ -288,8 +320,16 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 	struct iobuf *rbuf=NULL;
 	struct iobuf *wbuf=NULL;
 	struct cntr *cntr=NULL;
+	struct flow *flow=NULL;
+	uint64_t window_memory=(uint64_t)BLKS_MAX_IN_MEM*RABIN_MAX;
 
-	if(confs) cntr=get_cntr(confs);
+	if(confs)
+	{
+		cntr=get_cntr(confs);
+		if(get_uint64_t(confs[OPT_BLK_WINDOW_MEMORY]))
+			window_memory=
+				get_uint64_t(confs[OPT_BLK_WINDOW_MEMORY]);
+	}
 
 	if(!asfd || !asfd->as)
 	{
@@ -302,8 +342,10 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 
 	if(!(slist=slist_alloc())
 	  || !(wbuf=iobuf_alloc())
+	  || !(flow=flow_alloc(window_memory, RABIN_MAX))
 	  || blks_generate_init())
 		goto end;
+	blk_pool_set(1);
 	rbuf=asfd->rbuf;
 
 	if(!resume)
@@ -326,11 +368,11 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 		if(!wbuf->len)
 		{
 			get_wbuf_from_data(confs, wbuf, slist,
-				end_flags);
+				end_flags, flow);
 			if(!wbuf->len)
 			{
 				if(get_wbuf_from_blks(wbuf, slist,
-					&end_flags)) goto end;
+					&end_flags, flow)) goto end;
 			}
 		}
 
@@ -346,14 +388,18 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 			goto end;
 		}
 
-		if(rbuf->buf && deal_with_read(rbuf, slist, cntr, &end_flags))
-			goto end;
+		if(rbuf->buf && deal_with_read(rbuf, slist, cntr, &end_flags,
+			flow)) goto end;
+
+		// Everything before the head of the list has been dealt with.
+		flow_update(flow, slist->blist->head?
+			slist->blist->head->index-1:slist->blist->last_index);
 
 		if(slist->head
 		// Need to limit how many blocks are allocated at once.
 		  && (!slist->blist->head
-		   || slist->blist->tail->index
-			- slist->blist->head->index<BLKS_MAX_IN_MEM)
+		   || flow_is_open(flow, slist->blist->tail->index
+			- slist->blist->head->index))
 		)
 		{
 			if(add_to_blks_list(asfd, confs, slist))
@@ -384,8 +430,16 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 
 	ret=0;
 end:
+	if(flow)
+	{
+		flow_print_stats(flow, "Phase 2 send");
+		flow_free(&flow);
+	}
 	slist_free(&slist);
 	blks_generate_free();
+	blk_print_alloc_stats();
+	blk_pool_free();
+	blk_pool_set(0);
 	if(wbuf)
 	{
 		// Write buffer did not allocate 'buf'.
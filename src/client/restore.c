@@ -15,6 +15,7 @@
 #include "protocol1/restore.h"
 #include "protocol2/restore.h"
 #include "restore.h"
+#include "restore_streams.h"
 
 int restore_interrupt(struct asfd *asfd,
 	struct sbuf *sb, const char *msg, struct cntr *cntr,
@@ -181,6 +182,7 @@ enum ofr_e open_for_restore(struct asfd *asfd, BFILE *bfd, const char *path,
 	// Add attributes to bfd so that they can be set when it is closed.
 	bfd->winattr=sb->winattr;
 	memcpy(&bfd->statp, &sb->statp, sizeof(struct stat));
+	bfile_preallocate(bfd);
 	return OFR_OK;
 }
 
@@ -478,6 +480,7 @@ static int write_data(struct asfd *asfd, BFILE *bfd, struct blk *blk)
 			asfd->write_str(asfd, CMD_ERROR, "write failed");
 			return -1;
 		}
+		restore_streams_add_bytes((size_t)w);
 	}
 	return 0;
 }
@@ -486,12 +489,21 @@ static int write_data(struct asfd *asfd, BFILE *bfd, struct blk *blk)
 #define RESTORE_SPOOL	"restore_spool"
 
 static char *restore_style=NULL;
+static int restore_streams_agreed=1;
 
 static enum asl_ret restore_style_func(struct asfd *asfd,
 	struct conf **confs, void *param)
 {
 	char msg[32]="";
 	restore_style=NULL;
+	restore_streams_agreed=1;
+	if(!strncmp_w(asfd->rbuf->buf, RESTORE_STREAM ":"))
+	{
+		// The server will spread the restore over this many streams.
+		restore_streams_agreed=
+			atoi(asfd->rbuf->buf+strlen(RESTORE_STREAM ":"));
+		asfd->rbuf->buf[strlen(RESTORE_STREAM)]='\0';
+	}
 	if(strcmp(asfd->rbuf->buf, RESTORE_STREAM)
 	   && strcmp(asfd->rbuf->buf, RESTORE_SPOOL))
 	{
@@ -596,7 +608,13 @@ int do_restore_client(struct asfd *asfd,
 			goto error;
 	}
 	else
+	{
 		logp("Streaming restore direct\n");
+		if(restore_streams_agreed>1
+		  && restore_streams_start(confs,
+			restore_streams_agreed, vss_restore))
+				goto error;
+	}
 
 	logf("\n");
 
@@ -644,6 +662,16 @@ int do_restore_client(struct asfd *asfd,
 			{
 				continue;
 			}
+			else if(sb->path.cmd==CMD_GEN)
+			{
+				// The server is holding back the directories
+				// until the other streams have finished.
+				restore_streams_wait();
+				if(asfd->write_str(asfd, CMD_GEN,
+					"restore_streams_done"))
+						goto error;
+				continue;
+			}
 		}
 
 		switch(sb->path.cmd)
@@ -755,6 +783,8 @@ error:
 	bfd->close(bfd, asfd);
 	bfile_free(&bfd);
 
+	if(restore_streams_end()) ret=-1;
+
 	cntr_print_end(cntr);
 	cntr_print(cntr, act);
 
@@ -0,0 +1,141 @@
+#include "../burp.h"
+#include "../action.h"
+#include "../alloc.h"
+#include "../conf.h"
+#include "../log.h"
+#include "main.h"
+#include "restore_streams.h"
+
+#ifndef HAVE_WIN32
+#include <sys/mman.h>
+#endif
+
+static int streams=1;
+static int part=0;
+static pid_t *pids=NULL;
+static int failed=0;
+// Bytes written by each stream. Shared with the forked ones.
+static uint64_t *bytes=NULL;
+static struct timeval start;
+
+int restore_streams_part(void)
+{
+	return part;
+}
+
+int restore_streams_count(void)
+{
+	return streams;
+}
+
+int restore_streams_start(struct conf **confs, int n, int vss_restore)
+{
+#ifdef HAVE_WIN32
+	logp("Restore streams are not supported on Windows\n");
+	return -1;
+#else
+	int i;
+	void *p;
+
+	if(n<=1 || pids) return 0;
+	if(!(pids=(pid_t *)calloc_w(n, sizeof(pid_t), __func__)))
+		return -1;
+	if((p=mmap(NULL, sizeof(uint64_t)*n, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0))==MAP_FAILED)
+	{
+		logp("Could not mmap restore stream counters: %s\n",
+			strerror(errno));
+		free_v((void **)&pids);
+		return -1;
+	}
+	memset(p, 0, sizeof(uint64_t)*n);
+	bytes=(uint64_t *)p;
+	streams=n;
+	gettimeofday(&start, NULL);
+
+	logp("Restoring over %d streams\n", n);
+	for(i=1; i<n; i++)
+	{
+		switch((pids[i]=fork()))
+		{
+			case -1:
+				logp("Could not fork restore stream %d: %s\n",
+					i, strerror(errno));
+				pids[i]=0;
+				return -1;
+			case 0:
+				// Leave everything to do with the main
+				// connection alone, and make a new one.
+				part=i;
+				_exit(client(confs, ACTION_RESTORE,
+					vss_restore));
+			default:
+				break;
+		}
+	}
+	return 0;
+#endif
+}
+
+void restore_streams_add_bytes(size_t count)
+{
+	if(bytes) bytes[part]+=count;
+}
+
+int restore_streams_wait(void)
+{
+	int ret=0;
+#ifndef HAVE_WIN32
+	int i;
+	int status;
+	if(part || !pids) return 0;
+	for(i=1; i<streams; i++)
+	{
+		if(!pids[i]) continue;
+		if(waitpid(pids[i], &status, 0)<0
+		  || !WIFEXITED(status)
+		  || (WEXITSTATUS(status)!=CLIENT_OK
+			&& WEXITSTATUS(status)!=CLIENT_RESTORE_WARNINGS))
+		{
+			logp("Restore stream %d failed\n", i);
+			failed=1;
+		}
+		pids[i]=0;
+	}
+	if(failed) ret=-1;
+#endif
+	return ret;
+}
+
+int restore_streams_end(void)
+{
+	int ret=0;
+#ifndef HAVE_WIN32
+	int i;
+	double secs;
+	uint64_t total=0;
+	struct timeval now;
+
+	if(part || !pids) return 0;
+	ret=restore_streams_wait();
+
+	gettimeofday(&now, NULL);
+	secs=(now.tv_sec-start.tv_sec)+(now.tv_usec-start.tv_usec)/1000000.0;
+	for(i=0; i<streams; i++)
+	{
+		logp("Restore stream %d wrote %" PRIu64 " bytes\n",
+			i, bytes[i]);
+		total+=bytes[i];
+	}
+	logp("Restored %" PRIu64 " bytes over %d streams in %.1fs: %.1f MB/s\n",
+		total, streams, secs,
+		secs>0?total/secs/(1024*1024):0);
+
+	munmap(bytes, sizeof(uint64_t)*streams);
+	bytes=NULL;
+	free_v((void **)&pids);
+	streams=1;
+	failed=0;
+#endif
+	return ret;
+}
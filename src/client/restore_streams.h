@@ -0,0 +1,19 @@
+#ifndef _RESTORE_STREAMS_CLIENT_H
+#define _RESTORE_STREAMS_CLIENT_H
+
+// Which of the restore streams this process is looking after. The main
+// connection is part 0.
+extern int restore_streams_part(void);
+extern int restore_streams_count(void);
+
+// Fork a process for each of the other streams, which connect to the server
+// by themselves.
+extern int restore_streams_start(struct conf **confs,
+	int streams, int vss_restore);
+extern void restore_streams_add_bytes(size_t bytes);
+// Wait for the other streams. Returns -1 if any of them failed.
+extern int restore_streams_wait(void);
+// Wait, log the throughput, and tidy up.
+extern int restore_streams_end(void);
+
+#endif
@@ -0,0 +1,194 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../fsops.h"
+#include "../handy.h"
+#include "../log.h"
+#include "scanahead.h"
+
+#ifdef HAVE_WIN32
+
+int scanahead_start(int workers, int atime)
+{
+	// Needs fork().
+	return 0;
+}
+
+void scanahead_stop(void)
+{
+}
+
+void scanahead_hint(const char *path)
+{
+}
+
+#else
+
+// A hint is a two byte length followed by the path. Hints are always
+// written in one go and are no bigger than PIPE_BUF, so they never get
+// split up.
+#define SCANAHEAD_MAX	(PIPE_BUF-2)
+
+static int scanahead_workers=0;
+static int scanahead_next=0;
+static pid_t *scanahead_pids=NULL;
+static int *scanahead_fds=NULL;
+
+static int read_full(int fd, char *buf, size_t len)
+{
+	ssize_t r;
+	size_t got=0;
+	while(got<len)
+	{
+		if((r=read(fd, buf+got, len-got))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		if(!r) return -1;
+		got+=r;
+	}
+	return 0;
+}
+
+static void scanahead_directory(const char *path, int atime)
+{
+	int i;
+	size_t len;
+	char *p=NULL;
+	struct stat statp;
+	struct dentries d;
+
+	if(dentries_read(path, &d, atime, 0 /*sort*/))
+		return;
+	len=strlen(path);
+	for(i=0; i<d.count; i++)
+	{
+		if((p=(char *)realloc_w(p,
+			len+strlen(d.name[i])+2, __func__)))
+		{
+			snprintf(p, len+strlen(d.name[i])+2, "%s/%s",
+				path, d.name[i]);
+			lstat(p, &statp);
+		}
+	}
+	free_w(&p);
+	dentries_free(&d);
+}
+
+static int scanahead_worker(int fd, int atime)
+{
+	uint8_t l[2];
+	size_t len;
+	char path[SCANAHEAD_MAX+1];
+
+	while(1)
+	{
+		// The parent closing the pipe is the signal to stop.
+		if(read_full(fd, (char *)l, sizeof(l)))
+			return 0;
+		len=(l[0]<<8)|l[1];
+		if(len>SCANAHEAD_MAX || read_full(fd, path, len))
+			return 1;
+		path[len]='\0';
+		scanahead_directory(path, atime);
+	}
+}
+
+int scanahead_start(int workers, int atime)
+{
+	int w;
+	int x;
+	int p[2];
+
+	if(workers<1) return 0;
+	if(!(scanahead_pids=(pid_t *)calloc_w(workers,
+		sizeof(pid_t), __func__))
+	  || !(scanahead_fds=(int *)calloc_w(workers, sizeof(int), __func__)))
+		goto error;
+	for(w=0; w<workers; w++)
+	{
+		scanahead_pids[w]=-1;
+		scanahead_fds[w]=-1;
+	}
+	scanahead_workers=workers;
+
+	// A worker that dies should not kill us.
+	signal(SIGPIPE, SIG_IGN);
+	for(w=0; w<workers; w++)
+	{
+		if(pipe(p))
+			goto error;
+		switch((scanahead_pids[w]=fork()))
+		{
+			case -1:
+				close(p[0]);
+				close(p[1]);
+				goto error;
+			case 0:
+				// Do not hold the pipes of the other
+				// workers open.
+				for(x=0; x<w; x++)
+					close(scanahead_fds[x]);
+				close(p[1]);
+				_exit(scanahead_worker(p[0], atime));
+			default:
+				break;
+		}
+		close(p[0]);
+		// The scan must never wait for a worker, so hints get
+		// dropped when a worker is behind.
+		set_non_blocking(p[1]);
+		scanahead_fds[w]=p[1];
+	}
+	logp("Using %d scan ahead workers\n", workers);
+	return 0;
+error:
+	logp("could not start worker in %s: %s\n", __func__, strerror(errno));
+	scanahead_stop();
+	return -1;
+}
+
+void scanahead_stop(void)
+{
+	int w;
+	for(w=0; w<scanahead_workers; w++)
+	{
+		// Whatever the worker is still doing is no longer useful.
+		close_fd(&scanahead_fds[w]);
+		if(scanahead_pids[w]>0)
+		{
+			kill(scanahead_pids[w], SIGTERM);
+			waitpid(scanahead_pids[w], NULL, 0);
+		}
+	}
+	free_v((void **)&scanahead_pids);
+	free_v((void **)&scanahead_fds);
+	scanahead_workers=0;
+	scanahead_next=0;
+}
+
+void scanahead_hint(const char *path)
+{
+	int w;
+	size_t len;
+	char buf[PIPE_BUF];
+
+	if(!scanahead_workers) return;
+	if((len=strlen(path))>SCANAHEAD_MAX) return;
+	buf[0]=(len>>8)&0xFF;
+	buf[1]=len&0xFF;
+	memcpy(buf+2, path, len);
+
+	w=scanahead_next;
+	scanahead_next=(scanahead_next+1)%scanahead_workers;
+	if(scanahead_fds[w]<0) return;
+	// Either the whole hint goes in, or none of it does.
+	if(write(scanahead_fds[w], buf, len+2)<0
+	  && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR)
+	{
+		// The worker has gone away.
+		close_fd(&scanahead_fds[w]);
+	}
+}
+
+#endif
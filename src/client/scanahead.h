@@ -0,0 +1,16 @@
+#ifndef _SCANAHEAD_H
+#define _SCANAHEAD_H
+
+// Child processes that read and lstat directories shortly before the
+// file system scan gets to them, so that the scan mostly finds the
+// information it needs already cached by the operating system. The scan
+// itself still happens in order, in the main process.
+
+extern int scanahead_start(int workers, int atime);
+extern void scanahead_stop(void);
+
+// Hint that a directory is going to be scanned soon. Never blocks, and
+// does nothing when there are no workers.
+extern void scanahead_hint(const char *path);
+
+#endif
@@ -91,6 +91,12 @@ static char *cmd_to_text(enum cmd cmd)
 			snprintf(buf, len, "Windows VSS footer"); break;
 		case CMD_ENC_VSS_T:
 			snprintf(buf, len, "Encrypted windows VSS footer"); break;
+		case CMD_DIR_DIGESTS:
+			snprintf(buf, len, "Directory digests"); break;
+		case CMD_DIR_UNCHANGED:
+			snprintf(buf, len, "Unchanged directory"); break;
+		case CMD_STREAM:
+			snprintf(buf, len, "Switch file stream"); break;
 
 		// No default so that we get compiler warnings when we forget
 		// to add new ones here.
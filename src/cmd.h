@@ -68,6 +68,9 @@ enum cmd
 	CMD_ENC_VSS	='V',	/* Encrypted Windows VSS metadata */
 	CMD_VSS_T	='u',	/* Windows VSS footer */
 	CMD_ENC_VSS_T	='U',	/* Encrypted Windows VSS footer */
+	CMD_DIR_DIGESTS	='h',	/* Digests of directories in the last backup */
+	CMD_DIR_UNCHANGED='o',	/* Entries of a directory are unchanged */
+	CMD_STREAM	='j',	/* What follows is for another file stream */
 };
 
 
@@ -851,6 +851,7 @@ const char *cntr_status_to_str(struct cntr *cntr)
 		case CNTR_STATUS_VERIFYING: return CNTR_STATUS_STR_VERIFYING;
 		case CNTR_STATUS_DELETING: return CNTR_STATUS_STR_DELETING;
 		case CNTR_STATUS_DIFFING: return CNTR_STATUS_STR_DIFFING;
+		case CNTR_STATUS_QUEUED: return CNTR_STATUS_STR_QUEUED;
 		default: return "unknown";
 	}
 }
@@ -875,5 +876,7 @@ enum cntr_status cntr_str_to_status(const char *str)
 		return CNTR_STATUS_DELETING;
 	else if(!strcmp(str, CNTR_STATUS_STR_DIFFING))
 		return CNTR_STATUS_DIFFING;
+	else if(!strcmp(str, CNTR_STATUS_STR_QUEUED))
+		return CNTR_STATUS_QUEUED;
 	return CNTR_STATUS_UNSET;
 }
@@ -19,6 +19,7 @@
 #define CNTR_STATUS_STR_VERIFYING	"verifying"
 #define CNTR_STATUS_STR_DELETING	"deleting"
 #define CNTR_STATUS_STR_DIFFING		"diffing"
+#define CNTR_STATUS_STR_QUEUED		"queued"
 
 enum cntr_status
 {
@@ -33,7 +34,8 @@ enum cntr_status
 	CNTR_STATUS_RESTORING,
 	CNTR_STATUS_VERIFYING,
 	CNTR_STATUS_DELETING,
-	CNTR_STATUS_DIFFING
+	CNTR_STATUS_DIFFING,
+	CNTR_STATUS_QUEUED
 };
 
 typedef struct cntr_ent cntr_ent_t;
@@ -229,7 +229,7 @@ int set_cntr(struct conf *conf, struct cntr *cntr)
 	return 0;
 }
 
-int add_to_strlist(struct conf *conf, const char *value, int include)
+int add_to_strlist(struct conf *conf, const char *value, long include)
 {
 	assert(conf->conf_type==CT_STRLIST);
 	if(conf->flags & CONF_FLAG_STRLIST_SORTED)
@@ -441,10 +441,39 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_str(c[o], 0, 0, "status_port");
 	case OPT_SSL_DHFILE:
 	  return sc_str(c[o], 0, 0, "ssl_dhfile");
+	case OPT_SSL_SESSION_TIMEOUT:
+	  return sc_int(c[o], 60*60*2, 0, "ssl_session_timeout");
 	case OPT_MAX_CHILDREN:
 	  return sc_int(c[o], 5, 0, "max_children");
 	case OPT_MAX_STATUS_CHILDREN:
 	  return sc_int(c[o], 5, 0, "max_status_children");
+	case OPT_PREFORK_CHILDREN:
+	  return sc_int(c[o], 0, 0, "prefork_children");
+	case OPT_MAX_BACKUPS:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "max_backups");
+	case OPT_MAX_BACKUP_PHASE4:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "max_backup_phase4");
+	case OPT_BACKUP_QUEUE_TIMEOUT:
+	  return sc_int(c[o], 60*10,
+		CONF_FLAG_CC_OVERRIDE, "backup_queue_timeout");
+	case OPT_NETWORK_BUDGET:
+	  return sc_flt(c[o], 0, 0, "network_budget");
+	case OPT_STORAGE_BUDGET:
+	  return sc_flt(c[o], 0, 0, "storage_budget");
+	case OPT_BUDGET_WEIGHT:
+	  return sc_flt(c[o], 1,
+		CONF_FLAG_CC_OVERRIDE, "budget_weight");
+	case OPT_RESTORE_BUDGET_WEIGHT:
+	  return sc_flt(c[o], 2,
+		CONF_FLAG_CC_OVERRIDE, "restore_budget_weight");
+	case OPT_MAX_RESTORE_STREAMS:
+	  return sc_int(c[o], 1,
+		CONF_FLAG_CC_OVERRIDE, "max_restore_streams");
+	case OPT_MAX_BACKUP_STREAMS:
+	  return sc_int(c[o], 1,
+		CONF_FLAG_CC_OVERRIDE, "max_backup_streams");
 	case OPT_CLIENT_LOCKDIR:
 	  return sc_str(c[o], 0, 0, "client_lockdir");
 	case OPT_UMASK:
@@ -475,6 +504,8 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_str(c[o], 0, 0, "passwd");
 	case OPT_SERVER:
 	  return sc_str(c[o], 0, 0, "server");
+	case OPT_SSL_SESSION_CACHE:
+	  return sc_str(c[o], 0, 0, "ssl_session_cache");
 	case OPT_ENCRYPTION_PASSWORD:
 	  return sc_str(c[o], 0, 0, "encryption_password");
 	case OPT_AUTOUPGRADE_OS:
@@ -493,6 +524,12 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_str(c[o], 0, CONF_FLAG_INCEXC_RESTORE, "restoreprefix");
 	case OPT_RESTORE_SPOOL:
 	  return sc_str(c[o], 0, 0, "restore_spool");
+	case OPT_RESTORE_WRITE_BUFFER:
+	  return sc_u64(c[o], 0, 0, "restore_write_buffer");
+	case OPT_RESTORE_PREALLOCATE:
+	  return sc_int(c[o], 0, 0, "restore_preallocate");
+	case OPT_RESTORE_STREAMS:
+	  return sc_int(c[o], 1, 0, "restore_streams");
 	case OPT_BROWSEFILE:
 	  return sc_str(c[o], 0, 0, "browsefile");
 	case OPT_BROWSEDIR:
@@ -537,6 +574,8 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_str(c[o], 0, 0, "restore_path");
 	case OPT_ORIG_CLIENT:
 	  return sc_str(c[o], 0, CONF_FLAG_INCEXC_RESTORE, "orig_client");
+	case OPT_CONF_FILES:
+	  return sc_lst(c[o], 0, 0, "");
 	case OPT_CNTR:
 	  return sc_cntr(c[o], 0, 0, "");
 	case OPT_BREAKPOINT:
@@ -628,6 +667,46 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	case OPT_COMPRESSION:
 	  return sc_int(c[o], 9,
 		CONF_FLAG_CC_OVERRIDE, "compression");
+	case OPT_MANIFEST_READAHEAD:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "manifest_readahead");
+	case OPT_MANIFEST_GZBUFFER:
+	  return sc_u64(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "manifest_gzbuffer");
+	case OPT_MANIFEST_ZSTD:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "manifest_zstd");
+	case OPT_MANIFEST_ZSTD_FRAME:
+	  return sc_int(c[o], 1000,
+		CONF_FLAG_CC_OVERRIDE, "manifest_zstd_frame");
+	case OPT_COMPRESSION_WORKERS:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "compression_workers");
+	case OPT_COMPRESSION_WORKERS_MIN_SIZE:
+	  return sc_u64(c[o], 16*1024*1024,
+		CONF_FLAG_CC_OVERRIDE, "compression_workers_min_size");
+	case OPT_DATA_ZSTD:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "data_zstd");
+	case OPT_PHASE4_WORKERS:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "phase4_workers");
+	case OPT_DIR_DIGESTS:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "dir_digests");
+	case OPT_DIFF_COMPARE:
+	  return sc_str(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "diff_compare");
+	case OPT_PATH_INDEX:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "path_index");
+	case OPT_BINARY_ATTRIBS:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "binary_attribs");
+	case OPT_GC_RATE:
+	  return sc_int(c[o], 0, 0, "gc_rate");
+	case OPT_GC_TIME_LIMIT:
+	  return sc_int(c[o], 0, 0, "gc_time_limit");
 	case OPT_VERSION_WARN:
 	  return sc_int(c[o], 1,
 		CONF_FLAG_CC_OVERRIDE, "version_warn");
@@ -773,6 +852,18 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_int(c[o], 0, CONF_FLAG_INCEXC, "atime");
 	case OPT_SCAN_PROBLEM_RAISES_ERROR:
 	  return sc_int(c[o], 0, CONF_FLAG_INCEXC, "scan_problem_raises_error");
+	case OPT_SCAN_WORKERS:
+	  return sc_int(c[o], 0, CONF_FLAG_INCEXC, "scan_workers");
+	case OPT_JOURNAL:
+	  return sc_str(c[o], 0, 0, "journal");
+	case OPT_BLK_WINDOW_MEMORY:
+	  return sc_u64(c[o], 256*1024*1024, 0, "blk_window_memory");
+	case OPT_READ_AHEAD_FILES:
+	  return sc_int(c[o], 0, 0, "read_ahead_files");
+	case OPT_READ_AHEAD_SIZE:
+	  return sc_u64(c[o], 8*1024*1024, 0, "read_ahead_size");
+	case OPT_BACKUP_STREAMS:
+	  return sc_int(c[o], 1, 0, "backup_streams");
 	case OPT_OVERWRITE:
 	  return sc_int(c[o], 0,
 		CONF_FLAG_INCEXC|CONF_FLAG_INCEXC_RESTORE, "overwrite");
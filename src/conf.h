@@ -108,8 +108,19 @@ enum conf_opt
 	OPT_TIMESTAMP_FORMAT,
 	OPT_CLIENTCONFDIR,
 	OPT_SSL_DHFILE,
+	OPT_SSL_SESSION_TIMEOUT,
 	OPT_MAX_CHILDREN,
 	OPT_MAX_STATUS_CHILDREN,
+	OPT_PREFORK_CHILDREN,
+	OPT_MAX_BACKUPS,
+	OPT_MAX_BACKUP_PHASE4,
+	OPT_BACKUP_QUEUE_TIMEOUT,
+	OPT_NETWORK_BUDGET,
+	OPT_STORAGE_BUDGET,
+	OPT_BUDGET_WEIGHT,
+	OPT_RESTORE_BUDGET_WEIGHT,
+	OPT_MAX_RESTORE_STREAMS,
+	OPT_MAX_BACKUP_STREAMS,
 	OPT_CLIENT_LOCKDIR,
 	OPT_UMASK,
 	OPT_MAX_HARDLINKS,
@@ -132,6 +143,7 @@ enum conf_opt
 	OPT_PASSWORD, // also a clientconfdir option
 	OPT_PASSWD, // also a clientconfdir option
 	OPT_SERVER,
+	OPT_SSL_SESSION_CACHE,
 	OPT_ENCRYPTION_PASSWORD,
 	OPT_AUTOUPGRADE_OS,
 	OPT_AUTOUPGRADE_DIR, // also a server option
@@ -166,6 +178,12 @@ enum conf_opt
 	OPT_XATTR,
 	OPT_ATIME,
 	OPT_SCAN_PROBLEM_RAISES_ERROR,
+	OPT_SCAN_WORKERS,
+	OPT_JOURNAL,
+	OPT_BLK_WINDOW_MEMORY,
+	OPT_READ_AHEAD_FILES,
+	OPT_READ_AHEAD_SIZE,
+	OPT_BACKUP_STREAMS,
 	// These are to do with restore.
 	OPT_OVERWRITE,
 	OPT_STRIP,
@@ -174,6 +192,9 @@ enum conf_opt
 	OPT_RESTOREPREFIX,
 	OPT_REGEX,
 	OPT_RESTORE_SPOOL,
+	OPT_RESTORE_WRITE_BUFFER,
+	OPT_RESTORE_PREALLOCATE,
+	OPT_RESTORE_STREAMS,
 	// To do with listing.
 	OPT_BROWSEFILE,
 	OPT_BROWSEDIR,
@@ -223,6 +244,20 @@ enum conf_opt
 	OPT_LIBRSYNC,
 
 	OPT_COMPRESSION,
+	OPT_MANIFEST_READAHEAD,
+	OPT_MANIFEST_GZBUFFER,
+	OPT_MANIFEST_ZSTD,
+	OPT_MANIFEST_ZSTD_FRAME,
+	OPT_COMPRESSION_WORKERS,
+	OPT_COMPRESSION_WORKERS_MIN_SIZE,
+	OPT_DATA_ZSTD,
+	OPT_PHASE4_WORKERS,
+	OPT_DIR_DIGESTS,
+	OPT_DIFF_COMPARE,
+	OPT_PATH_INDEX,
+	OPT_BINARY_ATTRIBS,
+	OPT_GC_RATE,
+	OPT_GC_TIME_LIMIT,
 	OPT_VERSION_WARN,
 	OPT_PATH_LENGTH_WARN,
 	OPT_HARD_QUOTA,
@@ -267,6 +302,11 @@ enum conf_opt
 	// restore to an alternative client,
 	OPT_ORIG_CLIENT,
 
+	// The global config files that were read, with their modification
+	// times, so that a forked child can tell whether it needs to read them
+	// again.
+	OPT_CONF_FILES,
+
 	OPT_CNTR,
 
 	// For testing.
@@ -312,7 +352,8 @@ extern int set_e_rshash(struct conf *conf, enum rshash r);
 extern int set_mode_t(struct conf *conf, mode_t m);
 extern int set_float(struct conf *conf, float f);
 extern int set_uint64_t(struct conf *conf, uint64_t s);
-extern int add_to_strlist(struct conf *conf, const char *value, int include);
+extern int add_to_strlist(struct conf *conf,
+	const char *value, long include);
 extern int add_to_strlist_include(struct conf *conf, const char *value);
 extern int add_to_strlist_exclude(struct conf *conf, const char *value);
 
@@ -286,6 +286,28 @@ static int load_conf_field_and_value(struct conf **c,
 		}
 		set_float(c[OPT_RATELIMIT], f);
 	}
+	else if(!strcmp(f, "network_budget"))
+	{
+		// Mega bits per second, like ratelimit, but 0 means off.
+		float f=atof(v);
+		if(f<0)
+		{
+			logp("network_budget should not be negative\n");
+			return -1;
+		}
+		set_float(c[OPT_NETWORK_BUDGET], (f*1024*1024)/8);
+	}
+	else if(!strcmp(f, "storage_budget"))
+	{
+		// Disks are measured in Mega bytes per second.
+		float f=atof(v);
+		if(f<0)
+		{
+			logp("storage_budget should not be negative\n");
+			return -1;
+		}
+		set_float(c[OPT_STORAGE_BUDGET], f*1024*1024);
+	}
 	else
 	{
 		int i=0;
@@ -1003,6 +1025,35 @@ static int conf_finalise_global_only(const char *conf_path, struct conf **confs)
 	return r;
 }
 
+// Remember when each file was last changed, for conf_files_changed().
+static int conf_note_file(struct conf **confs, const char *conf_path, FILE *fp)
+{
+	struct stat statp;
+	if(fstat(fileno(fp), &statp))
+	{
+		logp("could not stat '%s': %s\n", conf_path, strerror(errno));
+		return -1;
+	}
+	return add_to_strlist(confs[OPT_CONF_FILES],
+		conf_path, (long)statp.st_mtime);
+}
+
+// Returns 1 if any of the files that confs were loaded from have changed
+// since, or if it is not known what they were loaded from.
+int conf_files_changed(struct conf **confs)
+{
+	struct stat statp;
+	struct strlist *s=get_strlist(confs[OPT_CONF_FILES]);
+	if(!s) return 1;
+	for(; s; s=s->next)
+	{
+		if(stat(s->path, &statp)
+		  || (long)statp.st_mtime!=s->flag)
+			return 1;
+	}
+	return 0;
+}
+
 static int conf_load_lines_from_file(const char *conf_path, struct conf **confs)
 {
 	int ret=0;
@@ -1015,6 +1066,11 @@ static int conf_load_lines_from_file(const char *conf_path, struct conf **confs)
 		logp("could not open '%s' for reading.\n", conf_path);
 		return -1;
 	}
+	if(conf_note_file(confs, conf_path, fp))
+	{
+		fclose(fp);
+		return -1;
+	}
 	while(fgets(buf, sizeof(buf), fp))
 	{
 		line++;
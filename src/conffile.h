@@ -11,6 +11,7 @@ extern int conf_parse_incexcs_path(struct conf **confs, const char *path);
 extern int conf_load_clientconfdir(struct conf **globalcs,
 	struct conf **ccconfs);
 extern int conf_load_global_only(const char *path, struct conf **globalcs);
+extern int conf_files_changed(struct conf **confs);
 
 extern const char *confs_get_lockfile(struct conf **confs);
 
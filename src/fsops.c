@@ -8,6 +8,9 @@
 #ifndef HAVE_WIN32
 #include <sys/un.h>
 #endif
+#if defined(HAVE_SYS_SYSCALL_H) && defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
 uint32_t fs_name_max=0;
 uint32_t fs_full_path_max=0;
@@ -96,7 +99,8 @@ int mkpath(char **rpath, const char *limit)
 				logp("will not mkdir %s\n", *rpath);
 				goto end;
 			}
-			if(mkdir(*rpath, 0777))
+			// Another process may have just created it.
+			if(mkdir(*rpath, 0777) && errno!=EEXIST)
 			{
 				logp("could not mkdir %s: %s\n", *rpath, strerror(errno));
 				goto end;
@@ -466,6 +470,230 @@ int entries_in_directory_no_sort(const char *path, struct dirent ***nl,
 	return entries_in_directory(path, nl, count, atime, NULL);
 }
 
+// The entries of a directory are packed into a single arena as a type
+// byte followed by the name, and an index of pointers to the names goes on
+// the end. On Linux, getdents64() reads straight into the arena and each
+// record is packed down in place, since a record is always bigger than
+// what is left of it. The records are read in at the next 8 byte boundary
+// after what has been packed so far, so that they can be got at directly.
+#define DENTRIES_ALLOC	32768
+#define DENTRIES_MIN	8192
+
+static uint64_t dentries_dirs=0;
+static uint64_t dentries_entries=0;
+static uint64_t dentries_usecs=0;
+
+static int dentries_grow(struct dentries *d, size_t *alloc, size_t need)
+{
+	char *tmp;
+	size_t a=*alloc?*alloc:DENTRIES_ALLOC;
+	while(a<need) a*=2;
+	if(a==*alloc) return 0;
+	if(!(tmp=(char *)realloc_w(d->buf, a, __func__)))
+		return -1;
+	d->buf=tmp;
+	*alloc=a;
+	return 0;
+}
+
+static int is_dot_or_dotdot(const char *p)
+{
+	return p[0]=='.' && (!p[1] || (p[1]=='.' && !p[2]));
+}
+
+static void dentries_pack(struct dentries *d, size_t *used,
+	const char *name, size_t len, unsigned char type)
+{
+	char *p=d->buf+*used;
+	*p=(char)type;
+	memmove(p+1, name, len+1);
+	*used+=len+2;
+	d->count++;
+}
+
+#ifdef SYS_getdents64
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+static int dentries_getdents(int fd, struct dentries *d,
+	size_t *used, size_t *alloc)
+{
+	long n;
+	size_t off;
+	size_t start;
+	size_t reclen;
+	unsigned char type;
+	char *raw;
+	struct linux_dirent64 *e;
+
+	while(1)
+	{
+		if(*alloc-*used<DENTRIES_MIN
+		  && dentries_grow(d, alloc, *used+DENTRIES_MIN))
+			return -1;
+		start=(*used+sizeof(uint64_t)-1)&~(sizeof(uint64_t)-1);
+		raw=d->buf+start;
+		if((n=syscall(SYS_getdents64, fd, raw, *alloc-start))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		if(!n) return 0;
+		for(off=0; off<(size_t)n; off+=reclen)
+		{
+			e=(struct linux_dirent64 *)(raw+off);
+			// Packing may write over the record.
+			reclen=e->d_reclen;
+			type=e->d_type;
+			if(is_dot_or_dotdot(e->d_name)) continue;
+			dentries_pack(d, used, e->d_name,
+				strlen(e->d_name), type);
+		}
+	}
+}
+#else
+static int dentries_readdir(DIR *directory, struct dentries *d,
+	size_t *used, size_t *alloc)
+{
+	int ret=-1;
+	size_t len;
+	unsigned char type=0;
+	struct dirent *entry=NULL;
+	struct dirent *result=NULL;
+
+	if(!(entry=(struct dirent *)malloc_w(
+	  sizeof(struct dirent)+fs_name_max+100, __func__)))
+		return -1;
+	while(1)
+	{
+		if(readdir_r(directory, entry, &result))
+			goto end;
+		if(!result)
+			break;
+		if(is_dot_or_dotdot(entry->d_name))
+			continue;
+		len=strlen(entry->d_name);
+		if(dentries_grow(d, alloc, *used+len+2))
+			goto end;
+#ifdef _DIRENT_HAVE_D_TYPE
+		type=entry->d_type;
+#endif
+		dentries_pack(d, used, entry->d_name, len, type);
+	}
+	ret=0;
+end:
+	free_v((void **)&entry);
+	return ret;
+}
+#endif
+
+static int dentries_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int dentries_index(struct dentries *d, size_t used, size_t alloc,
+	int sort)
+{
+	int i;
+	int sorted=1;
+	size_t off=0;
+	size_t start;
+
+	start=(used+sizeof(char *)-1)&~(sizeof(char *)-1);
+	if(dentries_grow(d, &alloc, start+(d->count+1)*sizeof(char *)))
+		return -1;
+	d->name=(char **)(d->buf+start);
+	for(i=0; i<d->count; i++)
+	{
+		d->name[i]=d->buf+off+1;
+		off+=strlen(d->name[i])+2;
+		if(sorted && i && strcmp(d->name[i-1], d->name[i])>0)
+			sorted=0;
+	}
+	// Some file systems hand them back in order already.
+	if(sort && !sorted)
+		qsort(d->name, d->count, sizeof(char *), dentries_cmp);
+	return 0;
+}
+
+// Returns 1 if the directory could not be opened.
+int dentries_read(const char *path, struct dentries *d, int atime, int sort)
+{
+	int ret=-1;
+	size_t used=0;
+	size_t alloc=0;
+	struct timeval start;
+	struct timeval end;
+#ifdef SYS_getdents64
+	int dfd;
+#else
+	DIR *directory=NULL;
+#endif
+
+	memset(d, 0, sizeof(*d));
+	if(!fs_name_max && init_fs_max(path))
+		return -1;
+	gettimeofday(&start, NULL);
+#ifdef SYS_getdents64
+	if((dfd=open(path, O_RDONLY|O_DIRECTORY|(atime?0:O_NOATIME)))<0
+	  && !atime && errno==EPERM)
+		// O_NOATIME is only allowed for the owner of the directory.
+		dfd=open(path, O_RDONLY|O_DIRECTORY);
+	if(dfd<0)
+		return 1;
+	if(dentries_getdents(dfd, d, &used, &alloc))
+		goto end;
+#else
+	if(!(directory=opendir(path)))
+		return 1;
+	if(dentries_readdir(directory, d, &used, &alloc))
+		goto end;
+#endif
+	if(dentries_index(d, used, alloc, sort))
+		goto end;
+	ret=0;
+end:
+#ifdef SYS_getdents64
+	close_fd(&dfd);
+#else
+	closedir(directory);
+#endif
+	if(ret)
+		dentries_free(d);
+	else
+	{
+		gettimeofday(&end, NULL);
+		dentries_dirs++;
+		dentries_entries+=d->count;
+		dentries_usecs+=(end.tv_sec-start.tv_sec)*1000000
+			+end.tv_usec-start.tv_usec;
+	}
+	return ret;
+}
+
+void dentries_free(struct dentries *d)
+{
+	free_w(&d->buf);
+	d->name=NULL;
+	d->count=0;
+}
+
+void dentries_log_stats(void)
+{
+	double secs=dentries_usecs/1000000.0;
+	if(!dentries_dirs) return;
+	logp("Read %" PRIu64 " entries from %" PRIu64 " directories in %.2fs (%.0f entries/sec)\n",
+		dentries_entries, dentries_dirs, secs,
+		secs>0?dentries_entries/secs:0);
+}
+
 #ifndef HAVE_WIN32
 int mksock(const char *path)
 {
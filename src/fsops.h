@@ -31,6 +31,22 @@ extern int entries_in_directory_alphasort_rev(const char *path,
 extern int entries_in_directory_no_sort(const char *path,
 	struct dirent ***nl, int *count, int atime);
 
+// The entries of one directory, held in a single allocation.
+struct dentries
+{
+	char *buf;
+	char **name;
+	int count;
+};
+
+// The byte before each name is its DT_* type, or 0 if not known.
+#define dentries_type(d, i)	((unsigned char)(d)->name[i][-1])
+
+extern int dentries_read(const char *path, struct dentries *d,
+	int atime, int sort);
+extern void dentries_free(struct dentries *d);
+extern void dentries_log_stats(void);
+
 #ifndef HAVE_WIN32
 extern int mksock(const char *path);
 #endif
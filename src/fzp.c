@@ -1,5 +1,7 @@
 #include "burp.h"
 #include "alloc.h"
+#include "async.h"
+#include "budget.h"
 #include "cmd.h"
 #include "fsops.h"
 #include "fzp.h"
@@ -9,6 +11,9 @@
 #include "server/compress.h"
 #include "server/protocol1/zlibio.h"
 #endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 static struct fzp *fzp_alloc(void)
 {
@@ -70,6 +75,569 @@ static int close_zp(gzFile *zp)
 	return ret;
 }
 
+#ifndef HAVE_WIN32
+static int close_readahead(struct fzp *fzp)
+{
+	int ret=0;
+	int status=0;
+	int finished=0;
+	if(!fzp->fp) return ret;
+	// If we did not get to the end, the child will get EPIPE when we
+	// close our end, and we do not care how it exits.
+	finished=feof(fzp->fp);
+	if(close_fp(&fzp->fp)) ret=-1;
+	if(fzp->pid<=0) return ret;
+	if(waitpid(fzp->pid, &status, 0)<0)
+	{
+		logp("waitpid %d failed: %s\n", fzp->pid, strerror(errno));
+		ret=-1;
+	}
+	else if(finished
+	  && (!WIFEXITED(status) || WEXITSTATUS(status)))
+	{
+		logp("readahead child %d did not inflate successfully\n",
+			fzp->pid);
+		ret=-1;
+	}
+	fzp->pid=0;
+	return ret;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+// Manifests compressed with zstd are written as a series of independent
+// frames, followed by a skippable frame containing an index of where each
+// frame starts, both in the uncompressed and the compressed data. This
+// allows seeking without decompressing everything from the start.
+// Normal zstd tools ignore the index.
+#define ZSTD_INDEX_SKIPPABLE	(ZSTD_MAGIC_SKIPPABLE_START+0x0B)
+#define ZSTD_INDEX_MAGIC	0x42555250 // "BURP"
+#define ZSTD_INDEX_ENTRY_LEN	16
+#define ZSTD_INDEX_FOOTER_LEN	8
+
+struct zframe
+{
+	uint64_t uoff;
+	uint64_t coff;
+};
+
+struct zstdf
+{
+	FILE *fp;
+	int writing;
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+
+	// Compressed data going to or coming from fp.
+	char *cbuf;
+	size_t csize;
+	ZSTD_inBuffer in;
+
+	// Decompressed data waiting to be consumed.
+	char *obuf;
+	size_t osize;
+	size_t olen;
+	size_t opos;
+	size_t last; // Last return from ZSTD_decompressStream().
+
+	uint64_t upos; // Position in the uncompressed data.
+	uint64_t skip; // Pending forward seek.
+	uint64_t coff; // Compressed bytes written.
+	int in_frame;
+	int eof;
+
+	struct zframe *index;
+	size_t icount;
+	size_t ialloc;
+};
+
+static void zstd_error(const char *func, size_t r)
+{
+	logp("zstd error in %s: %s\n", func, ZSTD_getErrorName(r));
+}
+
+static void zstdf_free(struct zstdf **zs)
+{
+	if(!zs || !*zs) return;
+	if((*zs)->cctx) ZSTD_freeCCtx((*zs)->cctx);
+	if((*zs)->dctx) ZSTD_freeDCtx((*zs)->dctx);
+	free_v((void **)&(*zs)->cbuf);
+	free_v((void **)&(*zs)->obuf);
+	free_v((void **)&(*zs)->index);
+	free_v((void **)zs);
+}
+
+static void put_le(uint8_t *p, uint64_t v, int bytes)
+{
+	int i;
+	for(i=0; i<bytes; i++) p[i]=(uint8_t)(v>>(8*i));
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+	int i;
+	uint64_t v=0;
+	for(i=bytes-1; i>=0; i--) v=(v<<8)|p[i];
+	return v;
+}
+
+static int zstdf_index_add(struct zstdf *zs, uint64_t uoff, uint64_t coff)
+{
+	if(zs->icount==zs->ialloc)
+	{
+		struct zframe *tmp;
+		size_t ialloc=zs->ialloc?zs->ialloc*2:64;
+		if(!(tmp=(struct zframe *)realloc_w(zs->index,
+			ialloc*sizeof(struct zframe), __func__)))
+				return -1;
+		zs->index=tmp;
+		zs->ialloc=ialloc;
+	}
+	zs->index[zs->icount].uoff=uoff;
+	zs->index[zs->icount].coff=coff;
+	zs->icount++;
+	return 0;
+}
+
+// Look for the index at the end of the file. It is not an error for it to
+// be missing, for example if the writer was killed. Seeks will just need
+// to decompress from the start.
+static void zstdf_index_load(struct zstdf *zs)
+{
+	size_t i;
+	uint32_t n;
+	uint8_t foot[ZSTD_INDEX_FOOTER_LEN];
+	uint8_t head[8];
+	uint8_t entry[ZSTD_INDEX_ENTRY_LEN];
+	off_t len;
+
+	if(fseeko(zs->fp, -ZSTD_INDEX_FOOTER_LEN, SEEK_END)
+	  || fread(foot, 1, sizeof(foot), zs->fp)!=sizeof(foot)
+	  || get_le(foot+4, 4)!=ZSTD_INDEX_MAGIC)
+		goto end;
+	n=(uint32_t)get_le(foot, 4);
+	len=(off_t)n*ZSTD_INDEX_ENTRY_LEN+ZSTD_INDEX_FOOTER_LEN;
+	if(fseeko(zs->fp, -(len+(off_t)sizeof(head)), SEEK_END)
+	  || fread(head, 1, sizeof(head), zs->fp)!=sizeof(head)
+	  || get_le(head, 4)!=ZSTD_INDEX_SKIPPABLE
+	  || (off_t)get_le(head+4, 4)!=len)
+		goto end;
+	for(i=0; i<n; i++)
+	{
+		if(fread(entry, 1, sizeof(entry), zs->fp)!=sizeof(entry)
+		  || zstdf_index_add(zs, get_le(entry, 8), get_le(entry+8, 8)))
+		{
+			zs->icount=0;
+			goto end;
+		}
+	}
+end:
+	fseeko(zs->fp, 0, SEEK_SET);
+}
+
+static int zstdf_write_out(struct zstdf *zs, ZSTD_outBuffer *out)
+{
+	if(!out->pos) return 0;
+	if(fwrite(out->dst, 1, out->pos, zs->fp)!=out->pos)
+	{
+		logp("short write in %s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	zs->coff+=out->pos;
+	return 0;
+}
+
+static int zstdf_compress(struct zstdf *zs, const void *ptr, size_t nmemb,
+	ZSTD_EndDirective mode)
+{
+	size_t r;
+	ZSTD_inBuffer in={ptr, nmemb, 0};
+	do
+	{
+		ZSTD_outBuffer out={zs->cbuf, zs->csize, 0};
+		r=ZSTD_compressStream2(zs->cctx, &out, &in, mode);
+		if(ZSTD_isError(r))
+		{
+			zstd_error(__func__, r);
+			return -1;
+		}
+		if(zstdf_write_out(zs, &out)) return -1;
+	} while(in.pos<in.size || (mode==ZSTD_e_end && r));
+	return 0;
+}
+
+static size_t zstdf_write(struct zstdf *zs, const void *ptr, size_t nmemb)
+{
+	if(!nmemb) return 0;
+	if(!zs->in_frame)
+	{
+		if(zstdf_index_add(zs, zs->upos, zs->coff)) return 0;
+		zs->in_frame=1;
+	}
+	if(zstdf_compress(zs, ptr, nmemb, ZSTD_e_continue)) return 0;
+	zs->upos+=nmemb;
+	return nmemb;
+}
+
+static int zstdf_end_frame(struct zstdf *zs)
+{
+	if(!zs->writing || !zs->in_frame) return 0;
+	if(zstdf_compress(zs, NULL, 0, ZSTD_e_end)) return -1;
+	zs->in_frame=0;
+	return 0;
+}
+
+static int zstdf_write_index(struct zstdf *zs)
+{
+	size_t i;
+	uint8_t head[8];
+	uint8_t entry[ZSTD_INDEX_ENTRY_LEN];
+	uint8_t foot[ZSTD_INDEX_FOOTER_LEN];
+	put_le(head, ZSTD_INDEX_SKIPPABLE, 4);
+	put_le(head+4, zs->icount*ZSTD_INDEX_ENTRY_LEN
+		+ZSTD_INDEX_FOOTER_LEN, 4);
+	if(fwrite(head, 1, sizeof(head), zs->fp)!=sizeof(head))
+		goto error;
+	for(i=0; i<zs->icount; i++)
+	{
+		put_le(entry, zs->index[i].uoff, 8);
+		put_le(entry+8, zs->index[i].coff, 8);
+		if(fwrite(entry, 1, sizeof(entry), zs->fp)!=sizeof(entry))
+			goto error;
+	}
+	put_le(foot, zs->icount, 4);
+	put_le(foot+4, ZSTD_INDEX_MAGIC, 4);
+	if(fwrite(foot, 1, sizeof(foot), zs->fp)!=sizeof(foot))
+		goto error;
+	return 0;
+error:
+	logp("short write in %s: %s\n", __func__, strerror(errno));
+	return -1;
+}
+
+static int close_zs(struct zstdf **zs)
+{
+	int ret=0;
+	if(!*zs) return ret;
+	if((*zs)->writing && (*zs)->fp
+	  && (zstdf_end_frame(*zs) || zstdf_write_index(*zs)))
+		ret=-1;
+	if(close_fp(&(*zs)->fp)) ret=-1;
+	zstdf_free(zs);
+	return ret;
+}
+
+static struct zstdf *zstdf_alloc(FILE *fp, int writing, int level)
+{
+	struct zstdf *zs=NULL;
+	if(!(zs=(struct zstdf *)calloc_w(1, sizeof(struct zstdf), __func__)))
+		return NULL;
+	zs->fp=fp;
+	zs->writing=writing;
+	if(writing)
+	{
+		size_t r;
+		zs->csize=ZSTD_CStreamOutSize();
+		if(!(zs->cctx=ZSTD_createCCtx())
+		  || !(zs->cbuf=(char *)malloc_w(zs->csize, __func__)))
+			goto error;
+		if(level && ZSTD_isError(r=ZSTD_CCtx_setParameter(zs->cctx,
+			ZSTD_c_compressionLevel, level)))
+		{
+			zstd_error(__func__, r);
+			goto error;
+		}
+	}
+	else
+	{
+		zs->csize=ZSTD_DStreamInSize();
+		zs->osize=ZSTD_DStreamOutSize();
+		if(!(zs->dctx=ZSTD_createDCtx())
+		  || !(zs->cbuf=(char *)malloc_w(zs->csize, __func__))
+		  || !(zs->obuf=(char *)malloc_w(zs->osize, __func__)))
+			goto error;
+		zs->in.src=zs->cbuf;
+		zstdf_index_load(zs);
+	}
+	return zs;
+error:
+	zs->fp=NULL;
+	zstdf_free(&zs);
+	return NULL;
+}
+
+// Get the level out of modes like "wb9".
+static int zstd_level_from_mode(const char *mode)
+{
+	for(; *mode; mode++)
+		if(isdigit(*mode)) return atoi(mode);
+	return 0;
+}
+
+static struct zstdf *open_zs(const char *fname, const char *mode)
+{
+	FILE *fp=NULL;
+	struct zstdf *zs=NULL;
+	int writing=(*mode=='w');
+	if(!writing && *mode!='r')
+	{
+		logp("zstd files cannot be opened with mode '%s'\n", mode);
+		return NULL;
+	}
+	if(!(fp=open_fp(fname, writing?"wb":"rb")))
+		return NULL;
+	if(!(zs=zstdf_alloc(fp, writing, zstd_level_from_mode(mode))))
+		close_fp(&fp);
+	return zs;
+}
+
+// Returns 0 for data available, 1 for end of file, -1 for error.
+static int zstdf_fill(struct zstdf *zs)
+{
+	while(zs->opos>=zs->olen)
+	{
+		ZSTD_outBuffer out={zs->obuf, zs->osize, 0};
+		if(zs->eof) return 1;
+		// If the last call filled the output buffer, the decoder may
+		// be holding more without needing any further input.
+		if(zs->in.pos>=zs->in.size && zs->olen<zs->osize)
+		{
+			zs->in.size=fread(zs->cbuf, 1, zs->csize, zs->fp);
+			zs->in.pos=0;
+			if(!zs->in.size)
+			{
+				if(ferror(zs->fp))
+				{
+					logp("read error in %s: %s\n",
+						__func__, strerror(errno));
+					return -1;
+				}
+				if(zs->last)
+				{
+					logp("truncated zstd frame\n");
+					return -1;
+				}
+				zs->eof=1;
+				return 1;
+			}
+		}
+		zs->last=ZSTD_decompressStream(zs->dctx, &out, &zs->in);
+		if(ZSTD_isError(zs->last))
+		{
+			zstd_error(__func__, zs->last);
+			return -1;
+		}
+		zs->olen=out.pos;
+		zs->opos=0;
+	}
+	return 0;
+}
+
+// Do the skip left by a seek. Returns 0 for OK, 1 for end of file, -1 for
+// error.
+static int zstdf_skip(struct zstdf *zs)
+{
+	while(zs->skip)
+	{
+		size_t len;
+		if(zstdf_fill(zs)) return zs->eof?1:-1;
+		len=zs->olen-zs->opos;
+		if(len>zs->skip) len=zs->skip;
+		zs->opos+=len;
+		zs->skip-=len;
+	}
+	return 0;
+}
+
+static int zstdf_read(struct zstdf *zs, void *ptr, size_t nmemb)
+{
+	size_t got=0;
+	switch(zstdf_skip(zs))
+	{
+		case 0: break;
+		case 1: return 0;
+		default: return -1;
+	}
+	while(got<nmemb)
+	{
+		size_t len;
+		switch(zstdf_fill(zs))
+		{
+			case 0: break;
+			case 1: goto end;
+			default: return -1;
+		}
+		len=zs->olen-zs->opos;
+		if(len>nmemb-got) len=nmemb-got;
+		memcpy((char *)ptr+got, zs->obuf+zs->opos, len);
+		zs->opos+=len;
+		got+=len;
+	}
+end:
+	zs->upos+=got;
+	return (int)got;
+}
+
+// Copy straight out of the decompressed buffer, up to and including the
+// next newline.
+static char *zstdf_gets(struct zstdf *zs, char *s, int size)
+{
+	size_t i=0;
+	size_t len;
+	char *nl=NULL;
+	if(size<=0 || zstdf_skip(zs)) return NULL;
+	while(!nl && i<(size_t)size-1)
+	{
+		if(zstdf_fill(zs)) break;
+		len=zs->olen-zs->opos;
+		if(len>(size_t)size-1-i) len=(size_t)size-1-i;
+		if((nl=(char *)memchr(zs->obuf+zs->opos, '\n', len)))
+			len=nl-(zs->obuf+zs->opos)+1;
+		memcpy(s+i, zs->obuf+zs->opos, len);
+		zs->opos+=len;
+		zs->upos+=len;
+		i+=len;
+	}
+	if(!i) return NULL;
+	s[i]='\0';
+	return s;
+}
+
+static int zstdf_eof(struct zstdf *zs)
+{
+	return zs->eof && zs->opos>=zs->olen;
+}
+
+static int zstdf_seek(struct zstdf *zs, off_t offset, int whence)
+{
+	size_t i;
+	uint64_t target;
+	struct zframe start={0, 0};
+	if(zs->writing)
+	{
+		logp("cannot seek when writing zstd files\n");
+		return -1;
+	}
+	switch(whence)
+	{
+		case SEEK_SET: target=(uint64_t)offset; break;
+		case SEEK_CUR: target=zs->upos+offset; break;
+		default:
+			logp("unsupported whence in %s: %d\n",
+				__func__, whence);
+			return -1;
+	}
+	if(target>=zs->upos && target-zs->upos<zs->osize && !zs->skip)
+	{
+		// Close enough to just skip forward.
+		zs->skip=target-zs->upos;
+		zs->upos=target;
+		return 0;
+	}
+	// Find the frame that the target is in. Without an index, that is
+	// the start of the file.
+	for(i=0; i<zs->icount && zs->index[i].uoff<=target; i++)
+		start=zs->index[i];
+	if(fseeko(zs->fp, (off_t)start.coff, SEEK_SET))
+	{
+		logp("fseeko failed in %s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	ZSTD_DCtx_reset(zs->dctx, ZSTD_reset_session_only);
+	zs->in.pos=zs->in.size=0;
+	zs->opos=zs->olen=0;
+	zs->last=0;
+	zs->eof=0;
+	// Like gzseek(), the skip happens on the next read.
+	zs->skip=target-start.uoff;
+	zs->upos=target;
+	return 0;
+}
+
+// Truncate in place by cutting the file at the start of the frame that
+// contains the new length, then writing a replacement for the part of
+// that frame that is to be kept. Without an index, that frame is the
+// whole file.
+static int zstdtruncate(const char *path, off_t length, int compression)
+{
+	int ret=-1;
+	char *keep=NULL;
+	size_t keeplen=0;
+	struct zstdf *zs=NULL;
+	struct zframe start={0, 0};
+	size_t i;
+	size_t nframes=0;
+	struct zframe *index=NULL;
+
+	if(!(zs=open_zs(path, "rb")))
+		goto end;
+	for(i=0; i<zs->icount && zs->index[i].uoff<=(uint64_t)length; i++)
+	{
+		start=zs->index[i];
+		nframes=i;
+	}
+	if(zstdf_seek(zs, (off_t)start.uoff, SEEK_SET))
+		goto end;
+	while(keeplen<(uint64_t)length-start.uoff)
+	{
+		int r;
+		char *tmp;
+		size_t want=(uint64_t)length-start.uoff-keeplen;
+		if(want>ZCHUNK) want=ZCHUNK;
+		if(!(tmp=(char *)realloc_w(keep, keeplen+want, __func__)))
+			goto end;
+		keep=tmp;
+		if((r=zstdf_read(zs, keep+keeplen, want))<0)
+			goto end;
+		if(!r) break;
+		keeplen+=r;
+	}
+	// Take the index entries before the cut point.
+	index=zs->index;
+	zs->index=NULL;
+	if(close_zs(&zs))
+		goto end;
+
+	if(!(zs=zstdf_alloc(NULL, 1, compression)))
+		goto end;
+	zs->index=index;
+	zs->ialloc=zs->icount=nframes;
+	index=NULL;
+	zs->upos=start.uoff;
+	zs->coff=start.coff;
+	if(!(zs->fp=open_fp(path, "r+b")))
+		goto end;
+	if(ftruncate(fileno(zs->fp), (off_t)start.coff)
+	  || fseeko(zs->fp, (off_t)start.coff, SEEK_SET))
+	{
+		logp("could not truncate %s: %s\n", path, strerror(errno));
+		goto end;
+	}
+	if(keeplen && zstdf_write(zs, keep, keeplen)!=keeplen)
+		goto end;
+	ret=close_zs(&zs);
+end:
+	close_zs(&zs);
+	free_v((void **)&index);
+	free_v((void **)&keep);
+	return ret;
+}
+
+static int is_zstd_file(const char *path)
+{
+	FILE *fp;
+	uint8_t magic[4];
+	int ret=0;
+	if(!(fp=fopen(path, "rb"))) return 0;
+	if(fread(magic, 1, sizeof(magic), fp)==sizeof(magic)
+	  && (get_le(magic, 4)==ZSTD_MAGICNUMBER
+		|| get_le(magic, 4)==ZSTD_INDEX_SKIPPABLE))
+			ret=1;
+	fclose(fp);
+	return ret;
+}
+#endif
+
 static void unknown_type(enum fzp_type type, const char *func)
 {
 	logp("unknown type in %s: %d\n", func, type);
@@ -80,6 +648,11 @@ static void not_open(const char *func)
 	logp("File pointer not open in %s\n", func);
 }
 
+static void not_supported(enum fzp_type type, const char *func)
+{
+	logp("%s not supported for type %d\n", func, type);
+}
+
 static struct fzp *fzp_do_open(const char *path, const char *mode,
 	enum fzp_type type)
 {
@@ -97,6 +670,12 @@ static struct fzp *fzp_do_open(const char *path, const char *mode,
 			if(!(fzp->zp=open_zp(path, mode)))
 				goto error;
 			return fzp;
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			if(!(fzp->zs=open_zs(path, mode)))
+				goto error;
+			return fzp;
+#endif
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -113,9 +692,35 @@ struct fzp *fzp_open(const char *path, const char *mode)
 
 struct fzp *fzp_gzopen(const char *path, const char *mode)
 {
+#ifdef HAVE_ZSTD
+	// Readers do not need to know which compression was used.
+	if(*mode=='r' && is_zstd_file(path))
+		return fzp_do_open(path, mode, FZP_ZSTD);
+#endif
 	return fzp_do_open(path, mode, FZP_COMPRESSED);
 }
 
+// Open a zstd compressed file. The mode is "rb", or "wb" with an optional
+// compression level, for example "wb3".
+struct fzp *fzp_zstdopen(const char *path, const char *mode)
+{
+#ifdef HAVE_ZSTD
+	return fzp_do_open(path, mode, FZP_ZSTD);
+#else
+	logp("%s: burp was not built with zstd support\n", __func__);
+	return NULL;
+#endif
+}
+
+int fzp_is_zstd(const char *path)
+{
+#ifdef HAVE_ZSTD
+	return is_zstd_file(path);
+#else
+	return 0;
+#endif
+}
+
 int fzp_close(struct fzp **fzp)
 {
 	int ret=-1;
@@ -128,6 +733,16 @@ int fzp_close(struct fzp **fzp)
 		case FZP_COMPRESSED:
 			ret=close_zp(&((*fzp)->zp));
 			break;
+#ifndef HAVE_WIN32
+		case FZP_READAHEAD:
+			ret=close_readahead(*fzp);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			ret=close_zs(&((*fzp)->zs));
+			break;
+#endif
 		default:
 			unknown_type((*fzp)->type, __func__);
 			break;
@@ -136,7 +751,7 @@ int fzp_close(struct fzp **fzp)
 	return ret;
 }
 
-int fzp_read(struct fzp *fzp, void *ptr, size_t nmemb)
+static int do_fzp_read(struct fzp *fzp, void *ptr, size_t nmemb)
 {
 	if(fzp) switch(fzp->type)
 	{
@@ -144,6 +759,16 @@ int fzp_read(struct fzp *fzp, void *ptr, size_t nmemb)
 			return (int)fread(ptr, 1, nmemb, fzp->fp);
 		case FZP_COMPRESSED:
 			return gzread(fzp->zp, ptr, (unsigned)nmemb);
+		case FZP_READAHEAD:
+		{
+			size_t got=fread(ptr, 1, nmemb, fzp->fp);
+			fzp->pos+=got;
+			return (int)got;
+		}
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			return zstdf_read(fzp->zs, ptr, nmemb);
+#endif
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -153,7 +778,17 @@ error:
 	return 0;
 }
 
-size_t fzp_write(struct fzp *fzp, const void *ptr, size_t nmemb)
+// Server children share a storage budget with each other.
+int fzp_read(struct fzp *fzp, void *ptr, size_t nmemb)
+{
+	int r;
+	budget_block(BUDGET_STORAGE);
+	r=do_fzp_read(fzp, ptr, nmemb);
+	if(r>0) budget_charge(BUDGET_STORAGE, (size_t)r);
+	return r;
+}
+
+static size_t do_fzp_write(struct fzp *fzp, const void *ptr, size_t nmemb)
 {
 	if(fzp) switch(fzp->type)
 	{
@@ -161,6 +796,13 @@ size_t fzp_write(struct fzp *fzp, const void *ptr, size_t nmemb)
 			return fwrite(ptr, 1, nmemb, fzp->fp);
 		case FZP_COMPRESSED:
 			return gzwrite(fzp->zp, ptr, (unsigned)nmemb);
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			return zstdf_write(fzp->zs, ptr, nmemb);
+#endif
+		case FZP_READAHEAD:
+			not_supported(fzp->type, __func__);
+			goto error;
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -170,14 +812,28 @@ error:
 	return 0;
 }
 
+size_t fzp_write(struct fzp *fzp, const void *ptr, size_t nmemb)
+{
+	size_t w;
+	budget_block(BUDGET_STORAGE);
+	w=do_fzp_write(fzp, ptr, nmemb);
+	budget_charge(BUDGET_STORAGE, w);
+	return w;
+}
+
 int fzp_eof(struct fzp *fzp)
 {
 	if(fzp) switch(fzp->type)
 	{
 		case FZP_FILE:
+		case FZP_READAHEAD:
 			return feof(fzp->fp);
 		case FZP_COMPRESSED:
 			return gzeof(fzp->zp);
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			return zstdf_eof(fzp->zs);
+#endif
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -193,9 +849,15 @@ int fzp_flush(struct fzp *fzp)
 	if(fzp) switch(fzp->type)
 	{
 		case FZP_FILE:
+		case FZP_READAHEAD:
 			return fflush(fzp->fp);
 		case FZP_COMPRESSED:
 			return gzflush(fzp->zp, Z_FINISH);
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			if(zstdf_end_frame(fzp->zs)) return EOF;
+			return fflush(fzp->zs->fp);
+#endif
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -216,6 +878,13 @@ int fzp_seek(struct fzp *fzp, off_t offset, int whence)
 			if(gzseek(fzp->zp, offset, whence)==offset)
 				return 0;
 			goto error;
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			return zstdf_seek(fzp->zs, offset, whence);
+#endif
+		case FZP_READAHEAD:
+			not_supported(fzp->type, __func__);
+			goto error;
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -233,6 +902,14 @@ off_t fzp_tell(struct fzp *fzp)
 			return ftello(fzp->fp);
 		case FZP_COMPRESSED:
 			return gztell(fzp->zp);
+		case FZP_READAHEAD:
+			// Same as gztell() would give, so it can be given
+			// to fzp_seek() on a normal FZP_COMPRESSED later.
+			return fzp->pos;
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			return (off_t)fzp->zs->upos;
+#endif
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -281,6 +958,10 @@ int fzp_truncate(const char *path, enum fzp_type type, off_t length,
 			return truncate(path, length);
 		case FZP_COMPRESSED:
 			return gztruncate(path, length, compression);
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			return zstdtruncate(path, length, compression);
+#endif
 		default:
 			unknown_type(type, __func__);
 			goto error;
@@ -306,6 +987,14 @@ int fzp_printf(struct fzp *fzp, const char *format, ...)
 		case FZP_COMPRESSED:
 			ret=gzprintf(fzp->zp, "%s", buf);
 			break;
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			ret=(int)zstdf_write(fzp->zs, buf, strlen(buf));
+			break;
+#endif
+		case FZP_READAHEAD:
+			not_supported(fzp->type, __func__);
+			break;
 		default:
 			unknown_type(fzp->type, __func__);
 			break;
@@ -316,6 +1005,53 @@ int fzp_printf(struct fzp *fzp, const char *format, ...)
 	return ret;
 }
 
+// Set the size of the zlib internal buffer. Needs to be called before the
+// first read or write. A size of zero leaves the zlib default alone.
+int fzp_gzbuffer(struct fzp *fzp, unsigned int size)
+{
+	if(fzp) switch(fzp->type)
+	{
+		case FZP_FILE:
+		case FZP_READAHEAD:
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+#endif
+			return 0;
+		case FZP_COMPRESSED:
+#if ZLIB_VERNUM >= 0x1240
+			if(size && gzbuffer(fzp->zp, size))
+			{
+				logp("gzbuffer(%u) failed in %s\n",
+					size, __func__);
+				return -1;
+			}
+#endif
+			return 0;
+		default:
+			unknown_type(fzp->type, __func__);
+			goto error;
+	}
+	not_open(__func__);
+error:
+	return -1;
+}
+
+// For zstd, finish the current frame so that the next write starts a new
+// one that can be seeked to. Does nothing for other types.
+int fzp_end_frame(struct fzp *fzp)
+{
+	if(!fzp)
+	{
+		not_open(__func__);
+		return -1;
+	}
+#ifdef HAVE_ZSTD
+	if(fzp->type==FZP_ZSTD)
+		return zstdf_end_frame(fzp->zs);
+#endif
+	return 0;
+}
+
 void fzp_setlinebuf(struct fzp *fzp)
 {
 #ifndef HAVE_WIN32
@@ -327,6 +1063,12 @@ void fzp_setlinebuf(struct fzp *fzp)
 		case FZP_COMPRESSED:
 			logp("gzsetlinebuf() does not exist in %s\n", __func__);
 			return;
+		case FZP_READAHEAD:
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+#endif
+			not_supported(fzp->type, __func__);
+			return;
 		default:
 			unknown_type(fzp->type, __func__);
 			return;
@@ -343,6 +1085,16 @@ char *fzp_gets(struct fzp *fzp, char *s, int size)
 			return fgets(s, size, fzp->fp);
 		case FZP_COMPRESSED:
 			return gzgets(fzp->zp, s, size);
+		case FZP_READAHEAD:
+		{
+			char *ret=fgets(s, size, fzp->fp);
+			if(ret) fzp->pos+=strlen(ret);
+			return ret;
+		}
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			return zstdf_gets(fzp->zs, s, size);
+#endif
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -357,10 +1109,16 @@ extern int fzp_fileno(struct fzp *fzp)
 	if(fzp) switch(fzp->type)
 	{
 		case FZP_FILE:
+		case FZP_READAHEAD:
 			return fileno(fzp->fp);
 		case FZP_COMPRESSED:
 			logp("gzfileno() does not exist in %s\n", __func__);
 			goto error;
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+			not_supported(fzp->type, __func__);
+			goto error;
+#endif
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -406,6 +1164,125 @@ struct fzp *fzp_gzdopen(int fd, const char *mode)
 	return fzp_do_dopen(fd, mode, FZP_COMPRESSED);
 }
 
+#ifndef HAVE_WIN32
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t w;
+	while(len)
+	{
+		if((w=write(fd, buf, len))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		buf+=w;
+		len-=w;
+	}
+	return 0;
+}
+
+// Runs in the child. Inflate path and write the result down the pipe.
+static int readahead_inflate(const char *path, int fd, unsigned int bufsize)
+{
+	int ret=1;
+	int len;
+	gzFile zp=NULL;
+	char buf[ZCHUNK];
+
+	if(!(zp=open_zp(path, "rb")))
+		return ret;
+#if ZLIB_VERNUM >= 0x1240
+	if(bufsize) gzbuffer(zp, bufsize);
+#endif
+	while((len=gzread(zp, buf, sizeof(buf)))>0)
+	{
+		if(write_all(fd, buf, (size_t)len))
+		{
+			// The reader went away early. Not our problem.
+			if(errno!=EPIPE)
+				logp("write to readahead pipe failed: %s\n",
+					strerror(errno));
+			goto end;
+		}
+	}
+	if(len<0)
+	{
+		int e;
+		logp("gzread of %s failed: %s\n", path, gzerror(zp, &e));
+		goto end;
+	}
+	ret=0;
+end:
+	if(close_zp(&zp)) ret=1;
+	close(fd);
+	return ret;
+}
+
+// Open a compressed file for reading, with the inflating done by a child
+// process that hands the plain data over via a pipe. This lets zlib work
+// ahead on another CPU while the caller parses what it has already got.
+// The result can only be read from and told. It cannot be seeked.
+// bufsize sets both the zlib buffer and the pipe size. Zero means defaults.
+struct fzp *fzp_gzopen_readahead(const char *path, unsigned int bufsize)
+{
+	int fds[2];
+	pid_t pid;
+	struct fzp *fzp=NULL;
+
+#ifdef HAVE_ZSTD
+	// zstd decompresses fast enough that a child is not worth it.
+	if(is_zstd_file(path))
+		return fzp_do_open(path, "rb", FZP_ZSTD);
+#endif
+	if(pipe(fds))
+	{
+		logp("pipe failed in %s: %s\n", __func__, strerror(errno));
+		return NULL;
+	}
+#ifdef F_SETPIPE_SZ
+	// Best effort - a bigger pipe lets the child get further ahead.
+	if(bufsize)
+		fcntl(fds[1], F_SETPIPE_SZ, (int)bufsize);
+#endif
+	switch((pid=fork()))
+	{
+		case -1:
+			logp("fork failed in %s: %s\n",
+				__func__, strerror(errno));
+			close(fds[0]);
+			close(fds[1]);
+			return NULL;
+		case 0:
+			close(fds[0]);
+			_exit(readahead_inflate(path, fds[1], bufsize));
+		default:
+			break;
+	}
+	close(fds[1]);
+	if(!(fzp=fzp_alloc()))
+		goto error;
+	fzp->type=FZP_READAHEAD;
+	fzp->pid=pid;
+	if(!(fzp->fp=fdopen(fds[0], "rb")))
+	{
+		logp("fdopen failed in %s: %s\n", __func__, strerror(errno));
+		goto error;
+	}
+	if(bufsize)
+		setvbuf(fzp->fp, NULL, _IOFBF, bufsize);
+	return fzp;
+error:
+	if(fzp && fzp->fp) fzp_close(&fzp);
+	else
+	{
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		fzp_free(&fzp);
+	}
+	return NULL;
+}
+#endif
+
 void fzp_ERR_print_errors_fp(struct fzp *fzp)
 {
 	if(fzp) switch(fzp->type)
@@ -417,6 +1294,12 @@ void fzp_ERR_print_errors_fp(struct fzp *fzp)
 			logp("ERR_print_errors_zp() does not exist in %s\n",
 				__func__);
 			break;
+		case FZP_READAHEAD:
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+#endif
+			not_supported(fzp->type, __func__);
+			break;
 		default:
 			unknown_type(fzp->type, __func__);
 			break;
@@ -433,6 +1316,12 @@ X509 *fzp_PEM_read_X509(struct fzp *fzp)
 			logp("PEM_read_X509() does not exist in %s\n",
 				__func__);
 			goto error;
+		case FZP_READAHEAD:
+#ifdef HAVE_ZSTD
+		case FZP_ZSTD:
+#endif
+			not_supported(fzp->type, __func__);
+			goto error;
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
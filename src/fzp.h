@@ -6,9 +6,13 @@
 enum fzp_type
 {
 	FZP_FILE=0,
-	FZP_COMPRESSED
+	FZP_COMPRESSED,
+	FZP_READAHEAD,
+	FZP_ZSTD
 };
 
+struct zstdf;
+
 struct fzp
 {
 	enum fzp_type type;
@@ -16,12 +20,23 @@ struct fzp
 	{
 		FILE *fp;
 		gzFile zp;
+		struct zstdf *zs;
 	};
+	// For FZP_READAHEAD, the child doing the inflating, and the number
+	// of inflated bytes read so far.
+	pid_t pid;
+	off_t pos;
 };
 
 extern struct fzp *fzp_open(const char *path, const char *mode);
 extern struct fzp *fzp_gzopen(const char *path, const char *mode);
+extern struct fzp *fzp_zstdopen(const char *path, const char *mode);
+extern int fzp_is_zstd(const char *path);
 extern int fzp_close(struct fzp **fzp);
+#ifndef HAVE_WIN32
+extern struct fzp *fzp_gzopen_readahead(const char *path,
+	unsigned int bufsize);
+#endif
 
 extern int fzp_read(struct fzp *fzp, void *ptr, size_t nmemb);
 extern size_t fzp_write(struct fzp *fzp, const void *ptr, size_t nmemb);
@@ -38,6 +53,8 @@ extern int fzp_truncate(const char *path, enum fzp_type type, off_t length,
 
 extern int fzp_printf(struct fzp *fzp, const char *format, ...);
 
+extern int fzp_gzbuffer(struct fzp *fzp, unsigned int size);
+extern int fzp_end_frame(struct fzp *fzp);
 extern void fzp_setlinebuf(struct fzp *fzp);
 
 extern char *fzp_gets(struct fzp *fzp, char *s, int size);
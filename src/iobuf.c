@@ -1,5 +1,6 @@
 #include "burp.h"
 #include "alloc.h"
+#include "arena.h"
 #include "cmd.h"
 #include "iobuf.h"
 #include "log.h"
@@ -122,7 +123,7 @@ int iobuf_is_metadata(struct iobuf *iobuf)
 }
 
 static int do_iobuf_fill_from_fzp(struct iobuf *iobuf, struct fzp *fzp,
-	int extra_bytes)
+	int extra_bytes, struct arena *arena)
 {
 	static unsigned int s;
 	static char lead[5]="";
@@ -143,9 +144,14 @@ static int do_iobuf_fill_from_fzp(struct iobuf *iobuf, struct fzp *fzp,
 		return -1;
 	}
 	iobuf->len=(size_t)s;
-	if(!(iobuf->buf=(char *)malloc_w(
-		iobuf->len+extra_bytes+1, __func__)))
-			return -1;
+	if(arena)
+		iobuf->buf=(char *)arena_malloc(arena,
+			iobuf->len+extra_bytes+1);
+	else
+		iobuf->buf=(char *)malloc_w(
+			iobuf->len+extra_bytes+1, __func__);
+	if(!iobuf->buf)
+		return -1;
 	switch(fzp_read_ensure(fzp,
 		iobuf->buf, iobuf->len+extra_bytes, __func__))
 	{
@@ -161,10 +167,16 @@ static int do_iobuf_fill_from_fzp(struct iobuf *iobuf, struct fzp *fzp,
 
 int iobuf_fill_from_fzp(struct iobuf *iobuf, struct fzp *fzp)
 {
-	return do_iobuf_fill_from_fzp(iobuf, fzp, 1 /*newline*/);
+	return do_iobuf_fill_from_fzp(iobuf, fzp, 1 /*newline*/, NULL);
+}
+
+int iobuf_fill_from_fzp_arena(struct iobuf *iobuf, struct fzp *fzp,
+	struct arena *arena)
+{
+	return do_iobuf_fill_from_fzp(iobuf, fzp, 1 /*newline*/, arena);
 }
 
 int iobuf_fill_from_fzp_data(struct iobuf *iobuf, struct fzp *fzp)
 {
-	return do_iobuf_fill_from_fzp(iobuf, fzp, 0 /*no newline*/);
+	return do_iobuf_fill_from_fzp(iobuf, fzp, 0 /*no newline*/, NULL);
 }
@@ -4,6 +4,8 @@
 #include "cmd.h"
 #include "fzp.h"
 
+struct arena;
+
 struct iobuf
 {
 	enum cmd cmd;
@@ -34,6 +36,8 @@ extern int iobuf_is_encrypted(struct iobuf *iobuf);
 extern int iobuf_is_metadata(struct iobuf *iobuf);
 
 extern int iobuf_fill_from_fzp(struct iobuf *iobuf, struct fzp *fzp);
+extern int iobuf_fill_from_fzp_arena(struct iobuf *iobuf, struct fzp *fzp,
+	struct arena *arena);
 extern int iobuf_fill_from_fzp_data(struct iobuf *iobuf, struct fzp *fzp);
 
 #endif
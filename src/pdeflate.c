@@ -0,0 +1,433 @@
+#include "burp.h"
+#include "alloc.h"
+#include "async.h"
+#include "log.h"
+#include "pdeflate.h"
+
+#include <zlib.h>
+
+// Input block size given to each worker. Big enough that the per-block
+// flush costs nothing noticeable, small enough to keep the workers busy.
+#define PDEFLATE_BLOCK	(128*1024)
+// Each block is compressed with the end of the previous one as a preset
+// dictionary, so that the ratio is almost the same as a single stream.
+#define PDEFLATE_DICT	32768
+
+// Number of child processes to compress with, and the input size at which
+// it is worth starting them. Fewer than two workers means off.
+static int pdeflate_workers=0;
+static uint64_t pdeflate_min_size=0;
+
+void pdeflate_set_workers(int workers, uint64_t min_size)
+{
+	pdeflate_workers=workers;
+	pdeflate_min_size=min_size;
+}
+
+#ifdef UTEST
+int pdeflate_get_workers(void)
+{
+	return pdeflate_workers;
+}
+#endif
+
+#ifdef HAVE_WIN32
+int pdeflate_wanted(uint64_t size)
+{
+	// Needs fork().
+	return 0;
+}
+
+struct pdeflate *pdeflate_alloc(int compression)
+{
+	logp("%s not implemented on Windows\n", __func__);
+	return NULL;
+}
+
+void pdeflate_free(struct pdeflate **pd)
+{
+}
+
+int pdeflate_write(struct pdeflate *pd, const uint8_t *buf, size_t len,
+	pdeflate_out_func *out, void *ctx)
+{
+	return -1;
+}
+
+int pdeflate_finish(struct pdeflate *pd, pdeflate_out_func *out, void *ctx)
+{
+	return -1;
+}
+#else
+
+int pdeflate_wanted(uint64_t size)
+{
+	return pdeflate_workers>1 && size>=pdeflate_min_size;
+}
+
+struct pdeflate
+{
+	int compression;
+	int workers;
+	pid_t *pids;
+	int *to;		// Pipes for sending blocks to each worker.
+	int *from;		// Pipes for getting results from each worker.
+	size_t *lens;		// Input length of the block each worker has.
+
+	uint8_t *block;		// Input block being filled.
+	size_t blen;
+	uint8_t dict[PDEFLATE_DICT];
+	size_t dlen;
+
+	int next;		// Worker to give the next block to.
+	int oldest;		// Worker with the oldest unfinished block.
+	int inflight;
+
+	uint8_t *obuf;		// Compressed result of a block.
+	size_t osize;
+
+	uLong crc;
+	uint64_t total;
+	int started;		// Whether the gzip header has gone out.
+};
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	ssize_t r;
+	uint8_t *b=(uint8_t *)buf;
+	while(len)
+	{
+		if((r=read(fd, b, len))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		// A clean end of file before anything was read is returned
+		// as 1, so that workers know that there is no more to do.
+		if(!r) return b==buf?1:-1;
+		b+=r;
+		len-=r;
+	}
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t w;
+	const uint8_t *b=(const uint8_t *)buf;
+	while(len)
+	{
+		if((w=write(fd, b, len))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		b+=w;
+		len-=w;
+	}
+	return 0;
+}
+
+// Runs in the child. Deflate each block that arrives, ending each one with
+// a sync flush so that the results can just be concatenated.
+static int pdeflate_worker(int compression, int rfd, int wfd)
+{
+	int ret=1;
+	z_stream strm;
+	uint32_t head[2];
+	uint8_t *in=NULL;
+	uint8_t *out=NULL;
+	uint8_t dict[PDEFLATE_DICT];
+	size_t osize;
+
+	memset(&strm, 0, sizeof(strm));
+	if(deflateInit2(&strm, compression, Z_DEFLATED, -15,
+		8, Z_DEFAULT_STRATEGY)!=Z_OK)
+			return ret;
+	osize=deflateBound(&strm, PDEFLATE_BLOCK)+64;
+	if(!(in=(uint8_t *)malloc_w(PDEFLATE_BLOCK, __func__))
+	  || !(out=(uint8_t *)malloc_w(osize, __func__)))
+		goto end;
+
+	while(1)
+	{
+		switch(read_all(rfd, head, sizeof(head)))
+		{
+			case 0: break;
+			case 1: ret=0; goto end; // Finished.
+			default: goto end;
+		}
+		if(head[0]>PDEFLATE_BLOCK || head[1]>PDEFLATE_DICT
+		  || (head[1] && read_all(rfd, dict, head[1]))
+		  || read_all(rfd, in, head[0]))
+			goto end;
+		if(deflateReset(&strm)!=Z_OK
+		  || (head[1] && deflateSetDictionary(&strm,
+			dict, head[1])!=Z_OK))
+				goto end;
+		strm.next_in=in;
+		strm.avail_in=head[0];
+		strm.next_out=out;
+		strm.avail_out=osize;
+		if(deflate(&strm, Z_SYNC_FLUSH)!=Z_OK
+		  || strm.avail_in || !strm.avail_out)
+		{
+			logp("deflate of block did not complete in %s\n",
+				__func__);
+			goto end;
+		}
+		head[0]=osize-strm.avail_out;
+		head[1]=crc32(0, in, (uInt)(strm.next_in-in));
+		if(write_all(wfd, head, sizeof(head))
+		  || write_all(wfd, out, head[0]))
+			goto end;
+	}
+end:
+	deflateEnd(&strm);
+	free_v((void **)&in);
+	free_v((void **)&out);
+	return ret;
+}
+
+static void close_fd(int *fd)
+{
+	if(*fd<0) return;
+	close(*fd);
+	*fd=-1;
+}
+
+void pdeflate_free(struct pdeflate **pd)
+{
+	int i;
+	if(!pd || !*pd) return;
+	for(i=0; i<(*pd)->workers; i++)
+	{
+		// Closing the pipes tells the worker to exit, whether it
+		// was waiting to read or to write.
+		close_fd(&(*pd)->to[i]);
+		close_fd(&(*pd)->from[i]);
+		if((*pd)->pids[i]>0)
+			waitpid((*pd)->pids[i], NULL, 0);
+	}
+	free_v((void **)&(*pd)->pids);
+	free_v((void **)&(*pd)->to);
+	free_v((void **)&(*pd)->from);
+	free_v((void **)&(*pd)->lens);
+	free_v((void **)&(*pd)->block);
+	free_v((void **)&(*pd)->obuf);
+	free_v((void **)pd);
+}
+
+static int start_worker(struct pdeflate *pd, int w)
+{
+	int i;
+	int tofds[2];
+	int fromfds[2];
+
+	if(pipe(tofds))
+		goto error;
+	if(pipe(fromfds))
+	{
+		close(tofds[0]);
+		close(tofds[1]);
+		goto error;
+	}
+	switch((pd->pids[w]=fork()))
+	{
+		case -1:
+			close(tofds[0]);
+			close(tofds[1]);
+			close(fromfds[0]);
+			close(fromfds[1]);
+			goto error;
+		case 0:
+			// Do not hold the pipes of the other workers open.
+			for(i=0; i<w; i++)
+			{
+				close(pd->to[i]);
+				close(pd->from[i]);
+			}
+			close(tofds[1]);
+			close(fromfds[0]);
+			_exit(pdeflate_worker(pd->compression,
+				tofds[0], fromfds[1]));
+		default:
+			break;
+	}
+	close(tofds[0]);
+	close(fromfds[1]);
+	pd->to[w]=tofds[1];
+	pd->from[w]=fromfds[0];
+	return 0;
+error:
+	logp("could not start worker in %s: %s\n", __func__, strerror(errno));
+	return -1;
+}
+
+struct pdeflate *pdeflate_alloc(int compression)
+{
+	int i;
+	struct pdeflate *pd=NULL;
+	int workers=pdeflate_workers>1?pdeflate_workers:2;
+
+	if(!(pd=(struct pdeflate *)calloc_w(1,
+		sizeof(struct pdeflate), __func__))
+	  || !(pd->pids=(pid_t *)calloc_w(workers, sizeof(pid_t), __func__))
+	  || !(pd->to=(int *)calloc_w(workers, sizeof(int), __func__))
+	  || !(pd->from=(int *)calloc_w(workers, sizeof(int), __func__))
+	  || !(pd->lens=(size_t *)calloc_w(workers, sizeof(size_t), __func__))
+	  || !(pd->block=(uint8_t *)malloc_w(PDEFLATE_BLOCK, __func__)))
+		goto error;
+	pd->compression=compression;
+	pd->workers=workers;
+	pd->crc=crc32(0, NULL, 0);
+	for(i=0; i<workers; i++)
+		pd->to[i]=pd->from[i]=-1;
+
+	// The process ignores SIGPIPE from startup, so a worker that dies
+	// gives us an EPIPE error rather than killing us.
+	for(i=0; i<workers; i++)
+		if(start_worker(pd, i))
+			goto error;
+	return pd;
+error:
+	pdeflate_free(&pd);
+	return NULL;
+}
+
+static int emit(pdeflate_out_func *out, void *ctx, uint8_t *buf, size_t len)
+{
+	int r;
+	size_t l;
+	while(len)
+	{
+		l=len>ZCHUNK?ZCHUNK:len;
+		if((r=out(ctx, buf, l))) return r;
+		buf+=l;
+		len-=l;
+	}
+	return 0;
+}
+
+static int collect(struct pdeflate *pd, pdeflate_out_func *out, void *ctx)
+{
+	uint32_t head[2];
+	int w=pd->oldest;
+
+	if(read_all(pd->from[w], head, sizeof(head)))
+		goto error;
+	if(head[0]>pd->osize)
+	{
+		uint8_t *tmp;
+		if(!(tmp=(uint8_t *)realloc_w(pd->obuf, head[0], __func__)))
+			return -1;
+		pd->obuf=tmp;
+		pd->osize=head[0];
+	}
+	if(read_all(pd->from[w], pd->obuf, head[0]))
+		goto error;
+	pd->crc=crc32_combine(pd->crc, head[1], (z_off_t)pd->lens[w]);
+	pd->oldest=(w+1)%pd->workers;
+	pd->inflight--;
+	return emit(out, ctx, pd->obuf, head[0]);
+error:
+	logp("could not read from worker %d in %s\n", pd->pids[w], __func__);
+	return -1;
+}
+
+static int dispatch(struct pdeflate *pd, pdeflate_out_func *out, void *ctx)
+{
+	int r;
+	int w;
+	uint32_t head[2];
+
+	if(pd->inflight==pd->workers && (r=collect(pd, out, ctx)))
+		return r;
+	w=pd->next;
+	head[0]=(uint32_t)pd->blen;
+	head[1]=(uint32_t)pd->dlen;
+	if(write_all(pd->to[w], head, sizeof(head))
+	  || write_all(pd->to[w], pd->dict, pd->dlen)
+	  || write_all(pd->to[w], pd->block, pd->blen))
+	{
+		logp("could not write to worker %d in %s: %s\n",
+			pd->pids[w], __func__, strerror(errno));
+		return -1;
+	}
+	pd->lens[w]=pd->blen;
+	pd->next=(w+1)%pd->workers;
+	pd->inflight++;
+
+	// The end of this block is the dictionary for the next one.
+	if(pd->blen>=PDEFLATE_DICT)
+	{
+		memcpy(pd->dict, pd->block+pd->blen-PDEFLATE_DICT,
+			PDEFLATE_DICT);
+		pd->dlen=PDEFLATE_DICT;
+	}
+	else
+	{
+		size_t keep=PDEFLATE_DICT-pd->blen;
+		if(keep>pd->dlen) keep=pd->dlen;
+		memmove(pd->dict, pd->dict+pd->dlen-keep, keep);
+		memcpy(pd->dict+keep, pd->block, pd->blen);
+		pd->dlen=keep+pd->blen;
+	}
+	pd->blen=0;
+	return 0;
+}
+
+static int start(struct pdeflate *pd, pdeflate_out_func *out, void *ctx)
+{
+	// Minimal gzip header: no name, no time, unix.
+	uint8_t head[10]={0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+	if(pd->started) return 0;
+	pd->started=1;
+	return emit(out, ctx, head, sizeof(head));
+}
+
+int pdeflate_write(struct pdeflate *pd, const uint8_t *buf, size_t len,
+	pdeflate_out_func *out, void *ctx)
+{
+	int r;
+	size_t l;
+	if((r=start(pd, out, ctx))) return r;
+	pd->total+=len;
+	while(len)
+	{
+		l=PDEFLATE_BLOCK-pd->blen;
+		if(l>len) l=len;
+		memcpy(pd->block+pd->blen, buf, l);
+		pd->blen+=l;
+		buf+=l;
+		len-=l;
+		if(pd->blen==PDEFLATE_BLOCK && (r=dispatch(pd, out, ctx)))
+			return r;
+	}
+	return 0;
+}
+
+int pdeflate_finish(struct pdeflate *pd, pdeflate_out_func *out, void *ctx)
+{
+	int r;
+	int i;
+	// An empty final block ends the deflate stream, then comes the
+	// gzip trailer.
+	uint8_t tail[10]={0x03, 0x00};
+
+	if((r=start(pd, out, ctx)))
+		return r;
+	if(pd->blen && (r=dispatch(pd, out, ctx)))
+		return r;
+	while(pd->inflight)
+		if((r=collect(pd, out, ctx)))
+			return r;
+	for(i=0; i<4; i++)
+	{
+		tail[2+i]=(uint8_t)(pd->crc>>(8*i));
+		tail[6+i]=(uint8_t)(pd->total>>(8*i));
+	}
+	return emit(out, ctx, tail, sizeof(tail));
+}
+
+#endif
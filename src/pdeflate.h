@@ -0,0 +1,31 @@
+#ifndef _PDEFLATE_H
+#define _PDEFLATE_H
+
+#include "burp.h"
+
+// Parallel gzip compression. The input is cut into blocks that are
+// deflated by a set of child processes, and the results are stitched back
+// together into a single standard gzip stream, like pigz does.
+
+// Called with compressed data, in order, in pieces of at most ZCHUNK bytes.
+// Return -1 for error, 0 to continue, 1 to stop early.
+typedef int pdeflate_out_func(void *ctx, uint8_t *buf, size_t len);
+
+struct pdeflate;
+
+extern void pdeflate_set_workers(int workers, uint64_t min_size);
+extern int pdeflate_wanted(uint64_t size);
+
+extern struct pdeflate *pdeflate_alloc(int compression);
+extern void pdeflate_free(struct pdeflate **pd);
+
+extern int pdeflate_write(struct pdeflate *pd, const uint8_t *buf, size_t len,
+	pdeflate_out_func *out, void *ctx);
+extern int pdeflate_finish(struct pdeflate *pd,
+	pdeflate_out_func *out, void *ctx);
+
+#ifdef UTEST
+extern int pdeflate_get_workers(void);
+#endif
+
+#endif
@@ -10,6 +10,7 @@
 #include "log.h"
 #include "server/main.h"
 #include "server/protocol1/bedup.h"
+#include "server/protocol2/bcompact.h"
 #include "server/protocol2/bsigs.h"
 #include "server/protocol2/champ_chooser/champ_server.h"
 
@@ -71,6 +72,9 @@ static void usage_client(void)
 	printf("                  delete: delete\n");
 	printf("                  d: diff\n");
 	printf("                  e: estimate\n");
+#ifndef HAVE_WIN32
+	printf("                  j: record file system changes in the journal\n");
+#endif
 	printf("                  l: list (this is the default when an action is not given)\n");
 	printf("                  L: long list\n");
 	printf("                  m: monitor interface\n");
@@ -187,6 +191,8 @@ static int parse_action(enum action *act, const char *optarg)
 		*act=ACTION_DIFF_LONG;
 	else if(!strncmp(optarg, "monitor", 1))
 		*act=ACTION_MONITOR;
+	else if(!strncmp(optarg, "journal", 1))
+		*act=ACTION_JOURNAL;
 	else
 	{
 		usage();
@@ -297,6 +303,8 @@ int real_main(int argc, char *argv[])
 		return run_bedup(argc, argv);
 	if(!strcmp(prog, "bsigs"))
 		return run_bsigs(argc, argv);
+	if(!strcmp(prog, "bcompact"))
+		return run_bcompact(argc, argv);
 #endif
 
 	while((option=getopt(argc, argv, "a:b:c:C:d:fFghil:nq:r:s:tvxjz:?"))!=-1)
@@ -460,7 +468,8 @@ int real_main(int argc, char *argv[])
 		|| act==ACTION_DIFF_LONG
 		|| act==ACTION_STATUS
 		|| act==ACTION_STATUS_SNAPSHOT
-		|| act==ACTION_MONITOR))
+		|| act==ACTION_MONITOR
+		|| act==ACTION_JOURNAL))
 	{
 		// These client modes need to run without getting the lock.
 	}
@@ -0,0 +1,114 @@
+#include "../burp.h"
+#include "../log.h"
+#include "dirdigest.h"
+
+static uint64_t get_u64(const uint8_t *buf)
+{
+	int i;
+	uint64_t ret=0;
+	for(i=0; i<8; i++)
+		ret=(ret<<8)|buf[i];
+	return ret;
+}
+
+static void put_u64(uint8_t *buf, uint64_t val)
+{
+	int i;
+	for(i=7; i>=0; i--)
+	{
+		buf[i]=val&0xFF;
+		val>>=8;
+	}
+}
+
+uint64_t dirdigest_path(const char *path, size_t len)
+{
+	uint8_t checksum[MD5_DIGEST_LENGTH];
+	MD5((const unsigned char *)path, len, checksum);
+	return get_u64(checksum);
+}
+
+size_t dirdigest_parent_len(const char *path)
+{
+	const char *cp;
+	if(!(cp=strrchr(path, '/')) || !cp[1])
+		return 0;
+	// The parent of '/home' is '/'.
+	if(cp==path)
+		return 1;
+	return cp-path;
+}
+
+int dirdigest_init(MD5_CTX *md5)
+{
+	if(!MD5_Init(md5))
+	{
+		logp("MD5_Init() failed in %s\n", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+// Only the things that phase2 would look at to decide whether an entry has
+// changed, and nothing that depends on how it was stored.
+void dirdigest_add(MD5_CTX *md5, const char *name,
+	struct stat *statp, const char *link)
+{
+	uint8_t buf[9*8];
+	MD5_Update(md5, name, strlen(name)+1);
+	put_u64(buf,    (uint64_t)statp->st_mode);
+	put_u64(buf+8,  (uint64_t)statp->st_uid);
+	put_u64(buf+16, (uint64_t)statp->st_gid);
+	put_u64(buf+24, (uint64_t)statp->st_size);
+	put_u64(buf+32, (uint64_t)statp->st_mtime);
+	put_u64(buf+40, (uint64_t)statp->st_ctime);
+	put_u64(buf+48, (uint64_t)statp->st_ino);
+	put_u64(buf+56, (uint64_t)statp->st_nlink);
+	put_u64(buf+64, (uint64_t)statp->st_rdev);
+	MD5_Update(md5, buf, sizeof(buf));
+	if(!link) link="";
+	MD5_Update(md5, link, strlen(link)+1);
+}
+
+uint64_t dirdigest_final(MD5_CTX *md5)
+{
+	uint8_t checksum[MD5_DIGEST_LENGTH];
+	MD5_Final(checksum, md5);
+	return get_u64(checksum);
+}
+
+static int dirdigest_cmp(const void *a, const void *b)
+{
+	const struct dirdigest *x=(const struct dirdigest *)a;
+	const struct dirdigest *y=(const struct dirdigest *)b;
+	if(x->path<y->path) return -1;
+	if(x->path>y->path) return 1;
+	return 0;
+}
+
+void dirdigest_sort(struct dirdigest *list, size_t count)
+{
+	if(count) qsort(list, count, sizeof(struct dirdigest), dirdigest_cmp);
+}
+
+struct dirdigest *dirdigest_find(struct dirdigest *list, size_t count,
+	uint64_t path)
+{
+	struct dirdigest key;
+	if(!count) return NULL;
+	key.path=path;
+	return (struct dirdigest *)bsearch(&key, list, count,
+		sizeof(struct dirdigest), dirdigest_cmp);
+}
+
+void dirdigest_to_wire(struct dirdigest *d, uint8_t *buf)
+{
+	put_u64(buf, d->path);
+	put_u64(buf+8, d->digest);
+}
+
+void dirdigest_from_wire(struct dirdigest *d, const uint8_t *buf)
+{
+	d->path=get_u64(buf);
+	d->digest=get_u64(buf+8);
+}
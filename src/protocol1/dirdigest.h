@@ -0,0 +1,41 @@
+#ifndef _DIRDIGEST_H
+#define _DIRDIGEST_H
+
+#include <openssl/md5.h>
+
+// A digest of the entries directly inside a directory. At the start of
+// phase1, the server sends these for the directories in the previous
+// backup. When the client works out the same digest for a directory, it
+// tells the server that it is unchanged instead of sending its entries,
+// and the server takes them from the previous manifest.
+
+// Directory digests are sent in batches of this many, which fits in
+// ASYNC_BUF_LEN.
+#define DIRDIGEST_BATCH		1000
+// Size of one digest on the network.
+#define DIRDIGEST_WIRE_LEN	16
+
+struct dirdigest
+{
+	uint64_t path;		// Hash of the path of the directory.
+	uint64_t digest;	// Hash of the entries in it.
+};
+
+extern uint64_t dirdigest_path(const char *path, size_t len);
+// Returns the length of the part of path that is the directory containing
+// it, or 0 if there is none.
+extern size_t dirdigest_parent_len(const char *path);
+
+extern int dirdigest_init(MD5_CTX *md5);
+extern void dirdigest_add(MD5_CTX *md5, const char *name,
+	struct stat *statp, const char *link);
+extern uint64_t dirdigest_final(MD5_CTX *md5);
+
+extern void dirdigest_sort(struct dirdigest *list, size_t count);
+extern struct dirdigest *dirdigest_find(struct dirdigest *list, size_t count,
+	uint64_t path);
+
+extern void dirdigest_to_wire(struct dirdigest *d, uint8_t *buf);
+extern void dirdigest_from_wire(struct dirdigest *d, const uint8_t *buf);
+
+#endif
@@ -8,6 +8,7 @@
 #include "../hexmap.h"
 #include "../iobuf.h"
 #include "../log.h"
+#include "../pdeflate.h"
 #include "handy.h"
 
 static int do_encryption(struct asfd *asfd, EVP_CIPHER_CTX *ctx,
@@ -100,6 +101,42 @@ int write_endfile(struct asfd *asfd, uint64_t bytes, uint8_t *checksum)
 		CMD_END_FILE, get_endfile_str(bytes, checksum));
 }
 
+struct send_gz
+{
+	struct asfd *asfd;
+	EVP_CIPHER_CTX *enc_ctx;
+	uint8_t *eoutbuf;
+	MD5_CTX *md5;
+	int quick_read;
+	const char *datapth;
+	struct cntr *cntr;
+};
+
+// Send a piece of (maybe) compressed data on, encrypting it if needed.
+// Return -1 for error, 0 for OK, 1 if the client wants to interrupt.
+static int send_gz_out(void *ctx, uint8_t *out, size_t have)
+{
+	int eoutlen;
+	struct iobuf wbuf;
+	struct send_gz *sgz=(struct send_gz *)ctx;
+
+	if(sgz->enc_ctx)
+	{
+		if(do_encryption(sgz->asfd, sgz->enc_ctx, out, (int)have,
+			sgz->eoutbuf, &eoutlen, sgz->md5))
+				return -1;
+	}
+	else
+	{
+		iobuf_set(&wbuf, CMD_APPEND, (char *)out, have);
+		if(sgz->asfd->write(sgz->asfd, &wbuf))
+			return -1;
+	}
+	if(sgz->quick_read && sgz->datapth)
+		return do_quick_read(sgz->asfd, sgz->datapth, sgz->cntr);
+	return 0;
+}
+
 /* OK, this function is getting a bit out of control.
    One problem is that, if you give deflateInit2 compression=0, it still
    writes gzip headers and footers, so I had to add extra
@@ -123,6 +160,7 @@ int send_whole_file_gzl(struct asfd *asfd,
 	struct iobuf wbuf;
 
 	int have;
+	int qr;
 	z_stream strm;
 	int flush=Z_NO_FLUSH;
 	uint8_t in[ZCHUNK];
@@ -132,6 +170,8 @@ int send_whole_file_gzl(struct asfd *asfd,
 	uint8_t eoutbuf[ZCHUNK+EVP_MAX_BLOCK_LENGTH];
 
 	EVP_CIPHER_CTX *enc_ctx=NULL;
+	struct send_gz sgz;
+	struct pdeflate *pd=NULL;
 #ifdef HAVE_WIN32
 	int do_known_byte_count=0;
 	size_t datalen=bfd->datalen;
@@ -141,6 +181,14 @@ int send_whole_file_gzl(struct asfd *asfd,
 	if(encpassword && !(enc_ctx=enc_setup(1, encpassword)))
 		return -1;
 
+	sgz.asfd=asfd;
+	sgz.enc_ctx=enc_ctx;
+	sgz.eoutbuf=eoutbuf;
+	sgz.md5=&md5;
+	sgz.quick_read=quick_read;
+	sgz.datapth=datapth;
+	sgz.cntr=cntr;
+
 	if(!MD5_Init(&md5))
 	{
 		logp("MD5_Init() failed\n");
@@ -165,6 +213,18 @@ int send_whole_file_gzl(struct asfd *asfd,
 		return -1;
 	}
 
+#ifndef HAVE_WIN32
+	// Big files get compressed by several processes at once.
+	if(compression && !metadata)
+	{
+		struct stat statp;
+		if(!fstat(bfd->fd, &statp)
+		  && pdeflate_wanted((uint64_t)statp.st_size)
+		  && !(pd=pdeflate_alloc(compression)))
+			logp("Falling back to single process compression\n");
+	}
+#endif
+
 	do
 	{
 		if(metadata)
@@ -219,6 +279,26 @@ int send_whole_file_gzl(struct asfd *asfd,
 
 		strm.next_in=in;
 
+		if(pd)
+		{
+			if(flush==Z_FINISH)
+			{
+				qr=pdeflate_finish(pd, send_gz_out, &sgz);
+				zret=Z_STREAM_END;
+			}
+			else
+				qr=pdeflate_write(pd, in, strm.avail_in,
+					send_gz_out, &sgz);
+			if(qr<0)
+			{
+				ret=-1;
+				break;
+			}
+			if(qr) // client wants to interrupt
+				goto cleanup;
+			continue;
+		}
+
 		/* run deflate() on input until output buffer not full, finish
 			compression if all of source has been read in */
 		do
@@ -242,37 +322,13 @@ int send_whole_file_gzl(struct asfd *asfd,
 				memcpy(out, in, have);
 			}
 
-			if(enc_ctx)
+			if((qr=send_gz_out(&sgz, out, (size_t)have))<0)
 			{
-				if(do_encryption(asfd, enc_ctx, out, have,
-					eoutbuf, &eoutlen, &md5))
-				{
-					ret=-1;
-					break;
-				}
-			}
-			else
-			{
-				iobuf_set(&wbuf, CMD_APPEND, (char *)out, have);
-				if(asfd->write(asfd, &wbuf))
-				{
-					ret=-1;
-					break;
-				}
-			}
-			if(quick_read && datapth)
-			{
-				int qr;
-				if((qr=do_quick_read(asfd, datapth, cntr))<0)
-				{
-					ret=-1;
-					break;
-				}
-				if(qr) // client wants to interrupt
-				{
-					goto cleanup;
-				}
+				ret=-1;
+				break;
 			}
+			if(qr) // client wants to interrupt
+				goto cleanup;
 			if(!compression) break;
 		} while (!strm.avail_out);
 
@@ -319,6 +375,7 @@ int send_whole_file_gzl(struct asfd *asfd,
 
 cleanup:
 	deflateEnd(&strm);
+	pdeflate_free(&pd);
 
 	if(enc_ctx)
 	{
@@ -7,8 +7,106 @@
 #include "../protocol2/rabin/rabin.h"
 #include "rabin/rconf.h"
 
+// When pooling is turned on, blks are handed out from slabs and go onto a
+// free list when they are freed, and data buffers of up to
+// BLK_POOL_DATA_SIZE are kept for reuse instead of being freed. Reused data
+// buffers are not cleared, only blk->length bytes of them mean anything.
+// The slabs are only given back by blk_pool_free(), once every blk has been
+// freed.
+
+#define BLK_SLAB_SIZE		1024
+#define BLK_POOL_DATA_MAX	1024
+
+struct blk_slab
+{
+	struct blk_slab *next;
+	struct blk blks[BLK_SLAB_SIZE];
+};
+
+static int pooling=0;
+static struct blk_slab *slabs=NULL;
+static struct blk *free_blks=NULL;
+static char *free_data=NULL;
+static uint64_t free_data_count=0;
+static uint64_t live=0;
+static time_t pool_start=0;
+
+static uint64_t blks_alloced=0;
+static uint64_t blks_reused=0;
+static uint64_t slabs_alloced=0;
+static uint64_t data_alloced=0;
+static uint64_t data_reused=0;
+
+void blk_pool_set(int value)
+{
+	pooling=value;
+	if(pooling && !pool_start) pool_start=time(NULL);
+}
+
+static struct blk *blk_from_pool(void)
+{
+	int i;
+	struct blk *blk;
+	struct blk_slab *slab;
+	if(!free_blks)
+	{
+		if(!(slab=(struct blk_slab *)
+			malloc_w(sizeof(struct blk_slab), __func__)))
+				return NULL;
+		slab->next=slabs;
+		slabs=slab;
+		for(i=BLK_SLAB_SIZE-1; i>=0; i--)
+		{
+			slab->blks[i].next=free_blks;
+			free_blks=&slab->blks[i];
+		}
+		slabs_alloced++;
+	}
+	else
+		blks_reused++;
+	blk=free_blks;
+	free_blks=blk->next;
+	memset(blk, 0, sizeof(struct blk));
+	blk->pooled=BLK_POOLED;
+	live++;
+	return blk;
+}
+
+static char *data_from_pool(void)
+{
+	char *data;
+	if(!free_data)
+	{
+		if(!(data=(char *)malloc_w(BLK_POOL_DATA_SIZE, __func__)))
+			return NULL;
+		data_alloced++;
+		return data;
+	}
+	data=free_data;
+	free_data=*(char **)data;
+	free_data_count--;
+	data_reused++;
+	return data;
+}
+
+static void data_to_pool(char **data)
+{
+	if(free_data_count>=BLK_POOL_DATA_MAX)
+	{
+		free_w(data);
+		return;
+	}
+	*(char **)*data=free_data;
+	free_data=*data;
+	free_data_count++;
+	*data=NULL;
+}
+
 struct blk *blk_alloc(void)
 {
+	blks_alloced++;
+	if(pooling)
+		return blk_from_pool();
 	return (struct blk *)calloc_w(1, sizeof(struct blk), __func__);
 }
 
@@ -16,9 +114,18 @@ struct blk *blk_alloc_with_data(uint32_t max_data_length)
 {
 	struct blk *blk=NULL;
 	if(!(blk=blk_alloc())) return NULL;
+	if(pooling && max_data_length<=BLK_POOL_DATA_SIZE)
+	{
+		if(!(blk->data=data_from_pool()))
+			goto error;
+		blk->pooled|=BLK_POOLED_DATA;
+		return blk;
+	}
+	data_alloced++;
 	if((blk->data=(char *)
 	  calloc_w(1, sizeof(char)*max_data_length, __func__)))
 		return blk;
+error:
 	blk_free(&blk);
 	return NULL;
 }
@@ -26,16 +133,61 @@ struct blk *blk_alloc_with_data(uint32_t max_data_length)
 void blk_free_content(struct blk *blk)
 {
 	if(!blk) return;
-	free_w(&blk->data);
+	if((blk->pooled&BLK_POOLED_DATA) && blk->data)
+		data_to_pool(&blk->data);
+	else
+		free_w(&blk->data);
+	blk->pooled&=~BLK_POOLED_DATA;
 }
 
 void blk_free(struct blk **blk)
 {
 	if(!blk || !*blk) return;
 	blk_free_content(*blk);
+	if((*blk)->pooled&BLK_POOLED)
+	{
+		(*blk)->next=free_blks;
+		free_blks=*blk;
+		*blk=NULL;
+		live--;
+		return;
+	}
 	free_v((void **)blk);
 }
 
+void blk_pool_free(void)
+{
+	struct blk_slab *slab;
+	while(free_data)
+	{
+		char *data=free_data;
+		free_data=*(char **)data;
+		free_w(&data);
+	}
+	free_data_count=0;
+	// Blks that are still in use would be left pointing at nothing.
+	if(live) return;
+	while(slabs)
+	{
+		slab=slabs;
+		slabs=slab->next;
+		free_v((void **)&slab);
+	}
+	free_blks=NULL;
+}
+
+void blk_print_alloc_stats(void)
+{
+	time_t secs=time(NULL)-pool_start;
+	if(!pool_start || secs<1) secs=1;
+	logp("Blks alloced: %" PRIu64 " (%" PRIu64 "/s), from free list: %"
+		PRIu64 ", slabs: %" PRIu64 "\n",
+		blks_alloced, blks_alloced/secs, blks_reused, slabs_alloced);
+	logp("Blk data buffers alloced: %" PRIu64 " (%" PRIu64 "/s), reused: %"
+		PRIu64 "\n",
+		data_alloced, data_alloced/secs, data_reused);
+}
+
 static int md5_generation(uint8_t md5sum[], const char *data, uint32_t length)
 {
 	MD5_CTX md5;
@@ -8,6 +8,13 @@
 // The highest number of blocks that the client will hold in memory.
 #define BLKS_MAX_IN_MEM		20000
 
+// Data buffers of up to this size are reused when blk pooling is on.
+#define BLK_POOL_DATA_SIZE	8192
+
+// Bits of blk->pooled.
+#define BLK_POOLED		0x01	// The blk came from a slab.
+#define BLK_POOLED_DATA		0x02	// The data buffer goes back to the pool.
+
 // 4096 signatures per data file.
 #define DATA_FILE_SIG_MAX	0x1000
 
@@ -33,7 +40,7 @@ struct blk
 	uint8_t got;				// 1
 	uint8_t requested;			// 1
 	uint8_t got_save_path;			// 1
-	uint8_t pad;				// 1
+	uint8_t pooled;				// 1
 	uint32_t length;			// 4
 	uint64_t fingerprint;			// 8
 	uint8_t md5sum[MD5_DIGEST_LENGTH];	// 16
@@ -46,6 +53,9 @@ extern struct blk *blk_alloc(void);
 extern struct blk *blk_alloc_with_data(uint32_t max_data_length);
 extern void blk_free_content(struct blk *blk);
 extern void blk_free(struct blk **blk);
+extern void blk_pool_set(int value);
+extern void blk_pool_free(void);
+extern void blk_print_alloc_stats(void);
 extern int blk_md5_update(struct blk *blk);
 extern int blk_is_zero_length(struct blk *blk);
 extern int blk_verify(struct blk *blk);
@@ -0,0 +1,124 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../log.h"
+#include "flow.h"
+
+static uint64_t now_usec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000000+tv.tv_usec;
+}
+
+static void set_window(struct flow *flow, uint64_t window)
+{
+	if(window<FLOW_WINDOW_MIN) window=FLOW_WINDOW_MIN;
+	if(window>flow->max) window=flow->max;
+	flow->window=window;
+	if(window<flow->window_low) flow->window_low=window;
+	if(window>flow->window_high) flow->window_high=window;
+}
+
+// With no memory budget, the flow is only measured and there is no window.
+struct flow *flow_alloc(uint64_t memory, uint32_t blk_max)
+{
+	struct flow *flow;
+	if(!(flow=(struct flow *)calloc_w(1, sizeof(struct flow), __func__)))
+		return NULL;
+	if(memory && blk_max)
+	{
+		flow->max=memory/blk_max;
+		if(flow->max<FLOW_WINDOW_MIN) flow->max=FLOW_WINDOW_MIN;
+		flow->window_low=flow->max;
+		set_window(flow, FLOW_WINDOW_MIN);
+	}
+	flow->now=now_usec;
+	flow->start=flow->now();
+	flow->last_update=flow->start;
+	return flow;
+}
+
+#ifdef UTEST
+void flow_set_clock(struct flow *flow, uint64_t (*now)(void))
+{
+	flow->now=now;
+	flow->start=flow->now();
+	flow->last_update=flow->start;
+}
+#endif
+
+void flow_free(struct flow **flow)
+{
+	free_v((void **)flow);
+}
+
+// Only one sig is timed at once.
+void flow_sig_sent(struct flow *flow, uint64_t index)
+{
+	flow->sigs++;
+	if(flow->probe_index) return;
+	flow->probe_index=index;
+	flow->probe_sent=flow->now();
+}
+
+// Anything that comes back about a block at or after the one being timed
+// ends the timing.
+void flow_ack(struct flow *flow, uint64_t index)
+{
+	uint64_t rtt;
+	if(!flow->probe_index || index<flow->probe_index) return;
+	rtt=flow->now()-flow->probe_sent;
+	if(flow->srtt) flow->srtt=(flow->srtt*7+rtt)/8;
+	else flow->srtt=rtt;
+	flow->probe_index=0;
+	flow->rtt_samples++;
+}
+
+void flow_data(struct flow *flow, size_t bytes)
+{
+	flow->blks++;
+	flow->bytes+=bytes;
+}
+
+// Given the total number of blocks acknowledged so far. When the window is
+// what is holding things up, the measured rate goes up with it, so the
+// window keeps doubling until the link or the other end is the limit.
+void flow_update(struct flow *flow, uint64_t acked)
+{
+	uint64_t rate;
+	uint64_t now=flow->now();
+	uint64_t elapsed=now-flow->last_update;
+	if(elapsed<FLOW_INTERVAL) return;
+	if(acked<flow->last_acked) acked=flow->last_acked;
+
+	rate=(acked-flow->last_acked)*1000000/elapsed;
+	if(flow->rate) flow->rate=(flow->rate*3+rate)/4;
+	else flow->rate=rate;
+	flow->last_acked=acked;
+	flow->last_update=now;
+
+	if(!flow->max || !flow->srtt) return;
+	set_window(flow, flow->rate*flow->srtt/1000000*2);
+}
+
+int flow_is_open(struct flow *flow, uint64_t in_flight)
+{
+	return in_flight<flow->window;
+}
+
+void flow_print_stats(struct flow *flow, const char *who)
+{
+	uint64_t secs=(flow->now()-flow->start)/1000000;
+	if(!secs) secs=1;
+	logp("%s: %" PRIu64 " sigs, %" PRIu64 " blocks, %" PRIu64
+		" bytes in %" PRIu64 "s (%" PRIu64 " bytes/s)\n",
+		who, flow->sigs, flow->blks, flow->bytes,
+		secs, flow->bytes/secs);
+	logp("%s: rtt %" PRIu64 "ms over %" PRIu64 " samples, %" PRIu64
+		" acks/s\n", who, flow->srtt/1000, flow->rtt_samples,
+		flow->rate);
+	if(!flow->max) return;
+	logp("%s: window %" PRIu64 " blocks (%" PRIu64 "-%" PRIu64
+		", max %" PRIu64 ")\n", who, flow->window,
+		flow->window_low, flow->window_high, flow->max);
+}
@@ -0,0 +1,56 @@
+#ifndef __PROTOCOL2_FLOW_H
+#define __PROTOCOL2_FLOW_H
+
+#include "../burp.h"
+#include "blk.h"
+
+// The champ chooser only deduplicates once it has MANIFEST_SIG_MAX sigs,
+// so never let fewer than this many blocks be outstanding.
+#define FLOW_WINDOW_MIN		(MANIFEST_SIG_MAX*2)
+// How often to recalculate the acknowledgement rate, in microseconds.
+#define FLOW_INTERVAL		1000000
+
+// Tracks the blocks in flight between a sender and whatever acknowledges
+// them, and sizes a window to twice the measured bandwidth-delay product.
+struct flow
+{
+	uint64_t window;	// Blocks allowed in flight.
+	uint64_t max;		// From the memory budget.
+
+	uint64_t probe_index;	// A sig being timed, 0 if none.
+	uint64_t probe_sent;
+	uint64_t srtt;		// Smoothed round trip time, microseconds.
+	uint64_t rate;		// Smoothed acknowledgements per second.
+
+	uint64_t start;
+	uint64_t last_update;
+	uint64_t last_acked;
+
+	// Stats.
+	uint64_t sigs;
+	uint64_t blks;
+	uint64_t bytes;
+	uint64_t rtt_samples;
+	uint64_t window_low;
+	uint64_t window_high;
+
+	// Microseconds, from gettimeofday() unless a test says otherwise.
+	uint64_t (*now)(void);
+};
+
+extern struct flow *flow_alloc(uint64_t memory, uint32_t blk_max);
+extern void flow_free(struct flow **flow);
+
+extern void flow_sig_sent(struct flow *flow, uint64_t index);
+extern void flow_ack(struct flow *flow, uint64_t index);
+extern void flow_data(struct flow *flow, size_t bytes);
+extern void flow_update(struct flow *flow, uint64_t acked);
+extern int flow_is_open(struct flow *flow, uint64_t in_flight);
+
+extern void flow_print_stats(struct flow *flow, const char *who);
+
+#ifdef UTEST
+extern void flow_set_clock(struct flow *flow, uint64_t (*now)(void));
+#endif
+
+#endif
@@ -30,6 +30,7 @@ void blks_generate_free(void)
 {
 	free_w(&gbuf);
 	win_free(&win);
+	blk_free(&blk);
 }
 
 // This is where the magic happens.
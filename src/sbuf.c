@@ -1,6 +1,7 @@
 #include "burp.h"
 #include "sbuf.h"
 #include "alloc.h"
+#include "arena.h"
 #include "asfd.h"
 #include "attribs.h"
 #include "cmd.h"
@@ -11,11 +12,17 @@
 #include "protocol2/blk.h"
 #include "server/protocol2/rblk.h"
 
+static uint64_t sbufs_alloced=0;
+static uint64_t sbufs_freed=0;
+static uint64_t heap_reads=0;
+static uint64_t arena_reads=0;
+
 struct sbuf *sbuf_alloc(enum protocol protocol)
 {
 	struct sbuf *sb;
 	if(!(sb=(struct sbuf *)calloc_w(1, sizeof(struct sbuf), __func__)))
 		return NULL;
+	sbufs_alloced++;
 	iobuf_init(&sb->path);
 	iobuf_init(&sb->attr);
 	sb->attr.cmd=CMD_ATTRIBS;
@@ -33,12 +40,24 @@ struct sbuf *sbuf_alloc(enum protocol protocol)
 	return sb;
 }
 
+// Buffers from the arena of the sbuf are just dropped, they go when the
+// arena is reset.
+static void sbuf_iobuf_free(struct sbuf *sb, struct iobuf *iobuf)
+{
+	if(sb->arena && iobuf->buf && arena_owns(sb->arena, iobuf->buf))
+		iobuf_init(iobuf);
+	else
+		iobuf_free_content(iobuf);
+}
+
 void sbuf_free_content(struct sbuf *sb)
 {
-	iobuf_free_content(&sb->path);
-	iobuf_free_content(&sb->attr);
-	iobuf_free_content(&sb->link);
-	iobuf_free_content(&sb->endfile);
+	sbuf_iobuf_free(sb, &sb->path);
+	sbuf_iobuf_free(sb, &sb->attr);
+	sbuf_iobuf_free(sb, &sb->link);
+	sbuf_iobuf_free(sb, &sb->endfile);
+	if(sb->protocol1)
+		sbuf_iobuf_free(sb, &sb->protocol1->datapth);
 	memset(&(sb->statp), 0, sizeof(sb->statp));
 	sb->compression=-1;
 	sb->winattr=0;
@@ -51,9 +70,31 @@ void sbuf_free(struct sbuf **sb)
 {
 	if(!sb || !*sb) return;
 	sbuf_free_content(*sb);
+	arena_free(&(*sb)->arena);
 	free_v((void **)&((*sb)->protocol1));
 	free_v((void **)&((*sb)->protocol2));
 	free_v((void **)sb);
+	sbufs_freed++;
+}
+
+// For passes that read entries from a manifest one at a time and are done
+// with each one before reading the next. The buffers read into the sbuf
+// then come from an arena that is reset on each read, instead of being
+// allocated and freed one by one. They must not be freed or kept by
+// anything else.
+int sbuf_use_arena(struct sbuf *sb)
+{
+	if(sb->arena) return 0;
+	return (sb->arena=arena_alloc())?0:-1;
+}
+
+void sbuf_print_alloc_stats(void)
+{
+	logp("Sbufs alloced: %" PRIu64 ", freed: %" PRIu64
+		", entries read to heap: %" PRIu64
+		", to arenas: %" PRIu64 "\n",
+		sbufs_alloced, sbufs_freed, heap_reads, arena_reads);
+	arena_print_stats();
 }
 
 int sbuf_is_link(struct sbuf *sb)
@@ -81,6 +122,29 @@ int sbuf_is_metadata(struct sbuf *sb)
 	return iobuf_is_metadata(&sb->path);
 }
 
+// The binary version has no separators, so the index is written as zero
+// instead.
+static int send_binary_attribs_without_index(struct sbuf *sb, struct fzp *fzp)
+{
+	char buf[256];
+	const char *cp=sb->attr.buf+2;
+	const char *end=sb->attr.buf+sb->attr.len;
+
+	while(cp<end && (*cp&0x80))
+		cp++;
+	if(cp>=end || (size_t)(end-cp)+2>sizeof(buf))
+	{
+		logp("Strange binary attributes\n");
+		return -1;
+	}
+	cp++;
+	buf[0]=sb->attr.buf[0];
+	buf[1]=sb->attr.buf[1];
+	buf[2]=0;
+	memcpy(buf+3, cp, end-cp);
+	return send_msg_fzp(fzp, CMD_ATTRIBS, buf, end-cp+3);
+}
+
 int sbuf_to_manifest(struct sbuf *sb, struct fzp *fzp)
 {
 	if(!sb->path.buf) return 0;
@@ -101,12 +165,17 @@ int sbuf_to_manifest(struct sbuf *sb, struct fzp *fzp)
 		// identical to each other. Better would be to preserve the
 		// index.
 		char *cp;
-		if(!(cp=strchr(sb->attr.buf, ' ')))
+		if(attribs_is_binary(&sb->attr))
+		{
+			if(send_binary_attribs_without_index(sb, fzp))
+				return -1;
+		}
+		else if(!(cp=strchr(sb->attr.buf, ' ')))
 		{
 			logp("Strange attributes: %s\n", sb->attr.buf);
 			return -1;
 		}
-		if(send_msg_fzp(fzp, CMD_ATTRIBS,
+		else if(send_msg_fzp(fzp, CMD_ATTRIBS,
 			cp, sb->attr.len-(cp-sb->attr.buf)))
 				return -1;
 	}
@@ -194,7 +263,7 @@ static parse_ret parse_cmd(struct sbuf *sb, struct asfd *asfd,
 				if(sb->protocol1->datapth.buf)
 					// protocol 1 phase 2+ file data
 					// starts with datapth.
-					iobuf_free_content(&sb->attr);
+					sbuf_iobuf_free(sb, &sb->attr);
 				else
 					// protocol 1 phase 1 or non file data
 					// starts with attribs
@@ -228,7 +297,7 @@ static parse_ret parse_cmd(struct sbuf *sb, struct asfd *asfd,
 			{
 				if(cmd_is_link(rbuf->cmd))
 				{
-					iobuf_free_content(&sb->link);
+					sbuf_iobuf_free(sb, &sb->link);
 					iobuf_move(&sb->link, rbuf);
 					sb->flags &= ~SBUF_NEED_LINK;
 					return PARSE_RET_COMPLETE;
@@ -241,7 +310,7 @@ static parse_ret parse_cmd(struct sbuf *sb, struct asfd *asfd,
 			}
 			else
 			{
-				iobuf_free_content(&sb->path);
+				sbuf_iobuf_free(sb, &sb->path);
 				iobuf_move(&sb->path, rbuf);
 				if(cmd_is_link(rbuf->cmd))
 				{
@@ -271,7 +340,7 @@ static parse_ret parse_cmd(struct sbuf *sb, struct asfd *asfd,
 			if(blk_set_from_iobuf_sig_and_savepath(blk, rbuf))
 				return PARSE_RET_ERROR;
 			blk->got_save_path=1;
-			iobuf_free_content(rbuf);
+			sbuf_iobuf_free(sb, rbuf);
 			if(datpath && rblk_retrieve_data(datpath, blk))
 			{
 				logp("Could not retrieve blk data.\n");
@@ -299,6 +368,13 @@ static parse_ret parse_cmd(struct sbuf *sb, struct asfd *asfd,
                 	  || !strcmp(rbuf->buf, "backupend")
 			  || !strcmp(rbuf->buf, "estimateend"))
 				return PARSE_RET_FINISHED;
+			// Client restore with several streams.
+			if(!strcmp(rbuf->buf, "restore_streams_wait"))
+			{
+				sbuf_iobuf_free(sb, &sb->path);
+				iobuf_move(&sb->path, rbuf);
+				return PARSE_RET_COMPLETE;
+			}
 			iobuf_log_unexpected(rbuf, __func__);
 			return PARSE_RET_ERROR;
 		case CMD_FINGERPRINT:
@@ -306,7 +382,8 @@ static parse_ret parse_cmd(struct sbuf *sb, struct asfd *asfd,
 				return PARSE_RET_ERROR;
 			// Fall through.
 		case CMD_MANIFEST:
-			iobuf_free_content(&sb->path);
+		case CMD_DIR_UNCHANGED:
+			sbuf_iobuf_free(sb, &sb->path);
 			iobuf_move(&sb->path, rbuf);
 			return PARSE_RET_COMPLETE;
 		case CMD_ERROR:
@@ -329,7 +406,7 @@ static parse_ret parse_cmd(struct sbuf *sb, struct asfd *asfd,
 			iobuf_move(&sb->protocol1->datapth, rbuf);
 			return PARSE_RET_NEED_MORE;
 		case CMD_END_FILE:
-			iobuf_free_content(&sb->endfile);
+			sbuf_iobuf_free(sb, &sb->endfile);
 			iobuf_move(&sb->endfile, rbuf);
 			if(sb->protocol1)
 			{
@@ -356,6 +433,7 @@ static int sbuf_fill(struct sbuf *sb, struct asfd *asfd, struct fzp *fzp,
 {
 	static struct iobuf *rbuf;
 	static struct iobuf localrbuf;
+	struct arena *arena=NULL;
 	int ret=-1;
 
 	if(asfd) rbuf=asfd->rbuf;
@@ -364,13 +442,23 @@ static int sbuf_fill(struct sbuf *sb, struct asfd *asfd, struct fzp *fzp,
 		// If not given asfd, use our own iobuf.
 		memset(&localrbuf, 0, sizeof(struct iobuf));
 		rbuf=&localrbuf;
+		// Block data is handed on to the blk, so cannot come from
+		// the arena.
+		if(sb->arena && !blk)
+		{
+			arena=sb->arena;
+			sbuf_free_content(sb);
+			arena_reset(arena);
+		}
 	}
+	if(arena) arena_reads++;
+	else heap_reads++;
 	while(1)
 	{
-		iobuf_free_content(rbuf);
+		sbuf_iobuf_free(sb, rbuf);
 		if(fzp)
 		{
-			if((ret=iobuf_fill_from_fzp(rbuf, fzp)))
+			if((ret=iobuf_fill_from_fzp_arena(rbuf, fzp, arena)))
 				goto end;
 		}
 		else
@@ -397,7 +485,7 @@ static int sbuf_fill(struct sbuf *sb, struct asfd *asfd, struct fzp *fzp,
 		}
 	}
 end:
-	iobuf_free_content(rbuf);
+	sbuf_iobuf_free(sb, rbuf);
 	return ret;
 }
 
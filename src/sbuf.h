@@ -30,6 +30,8 @@
 // Keep track of what is being received.
 #define SBUF_RECV_DELTA			0x1000
 #define SBUF_CLIENT_RESTORE_HACK	0x2000
+// The client has asked the OS to start reading the file data.
+#define SBUF_READ_AHEAD			0x4000
 
 
 typedef struct sbuf sbuf_t;
@@ -50,12 +52,15 @@ struct sbuf
 	struct protocol1 *protocol1;
 	struct protocol2 *protocol2;
 
+	struct arena *arena;	// See sbuf_use_arena().
+
 	struct sbuf *next;
 };
 
 extern struct sbuf *sbuf_alloc(enum protocol protocol);
 extern void sbuf_free_content(struct sbuf *sb);
 extern void sbuf_free(struct sbuf **sb);
+extern int sbuf_use_arena(struct sbuf *sb);
 
 extern int sbuf_open_file(struct sbuf *sb,
 	struct asfd *asfd, struct cntr *cntr, struct conf **confs);
@@ -16,6 +16,9 @@
 #include "backup_phase3.h"
 #include "compress.h"
 #include "delete.h"
+#include "pindex.h"
+#include "sched.h"
+#include "timer.h"
 #include "protocol1/backup_phase2.h"
 #include "protocol1/backup_phase4.h"
 #include "protocol2/backup_phase2.h"
@@ -75,12 +78,12 @@ end:
 }
 
 static int backup_phase1_server(struct async *as,
-	struct sdirs *sdirs, struct conf **cconfs)
+	struct sdirs *sdirs, const char *incexc, struct conf **cconfs)
 {
 	int breaking=get_int(cconfs[OPT_BREAKPOINT]);
 	if(breaking==1)
 		return breakpoint(breaking, __func__);
-	return backup_phase1_server_all(as, sdirs, cconfs);
+	return backup_phase1_server_all(as, sdirs, incexc, cconfs);
 }
 
 static int backup_phase2_server(struct async *as, struct sdirs *sdirs,
@@ -127,6 +130,25 @@ static int backup_phase4_server(struct sdirs *sdirs, struct conf **cconfs)
 	}
 }
 
+// The index only makes listing faster, so failing to make one is not an
+// error.
+static void backup_path_index(struct sdirs *sdirs, struct conf **cconfs)
+{
+	char *manifest=NULL;
+	char *pindex=NULL;
+	enum protocol protocol=get_protocol(cconfs);
+
+	if(!get_int(cconfs[OPT_PATH_INDEX]))
+		return;
+	if(!(manifest=prepend_s(sdirs->finishing,
+		protocol==PROTO_1?"manifest.gz":"manifest"))
+	  || !(pindex=prepend_s(sdirs->finishing, "pindex"))
+	  || pindex_build(manifest, pindex, protocol))
+		logw(NULL, get_cntr(cconfs), "Could not write path index\n");
+	free_w(&manifest);
+	free_w(&pindex);
+}
+
 static void log_rshash(struct conf **confs)
 {
 	if(get_protocol(confs)!=PROTO_1) return;
@@ -135,7 +157,8 @@ static void log_rshash(struct conf **confs)
 }
 
 static int do_backup_server(struct async *as, struct sdirs *sdirs,
-	struct conf **cconfs, const char *incexc, int resume)
+	struct conf **cconfs, const char *incexc, int resume,
+	struct lock **slot)
 {
 	int ret=0;
 	int do_phase2=1;
@@ -169,7 +192,7 @@ static int do_backup_server(struct async *as, struct sdirs *sdirs,
 			goto error;
 		}
 
-		if(backup_phase1_server(as, sdirs, cconfs))
+		if(backup_phase1_server(as, sdirs, incexc, cconfs))
 		{
 			logp("error in phase 1\n");
 			goto error;
@@ -214,6 +237,9 @@ static int do_backup_server(struct async *as, struct sdirs *sdirs,
 	as->asfd_remove(as, asfd);
 	asfd_close(asfd);
 
+	// Let the next client start sending while we finish off.
+	sched_release(slot);
+
 	if(backup_phase3_server(sdirs, cconfs))
 	{
 		logp("error in backup phase 3\n");
@@ -223,11 +249,15 @@ static int do_backup_server(struct async *as, struct sdirs *sdirs,
 	if(do_rename(sdirs->working, sdirs->finishing))
 		goto error;
 
+	if(sched_phase4_start(sdirs, cconfs, slot))
+		goto error;
 	if(backup_phase4_server(sdirs, cconfs))
 	{
 		logp("error in backup phase 4\n");
 		goto error;
 	}
+	sched_release(slot);
+	backup_path_index(sdirs, cconfs);
 
 	cntr_print(get_cntr(cconfs), ACTION_BACKUP);
 	cntr_stats_to_file(get_cntr(cconfs),
@@ -258,6 +288,7 @@ int run_backup(struct async *as, struct sdirs *sdirs, struct conf **cconfs,
 {
 	int ret;
 	char okstr[32]="";
+	struct lock *slot=NULL;
 	struct asfd *asfd=as->asfd;
 	struct iobuf *rbuf=asfd->rbuf;
 	const char *cname=get_string(cconfs[OPT_CNAME]);
@@ -287,13 +318,19 @@ int run_backup(struct async *as, struct sdirs *sdirs, struct conf **cconfs,
 		args[a++]="reserved1";
 		args[a++]="reserved2";
 		args[a++]=NULL;
-		if((*timer_ret=run_script(asfd, args,
-		  get_strlist(cconfs[OPT_TIMER_ARG]),
-		  cconfs,
-		  1 /* wait */,
-		  1 /* use logp */,
-		  0 /* no log_remote */
-		))<0)
+		// With timer_arg but no timer_script, work it out here rather
+		// than forking a script.
+		if(!args[0] && get_strlist(cconfs[OPT_TIMER_ARG]))
+			*timer_ret=timer_run_builtin(sdirs, cconfs);
+		else
+			*timer_ret=run_script(asfd, args,
+			  get_strlist(cconfs[OPT_TIMER_ARG]),
+			  cconfs,
+			  1 /* wait */,
+			  1 /* use logp */,
+			  0 /* no log_remote */
+			);
+		if(*timer_ret<0)
 		{
 			logp("Error running timer script for %s\n",
 				cname);
@@ -314,7 +351,6 @@ int run_backup(struct async *as, struct sdirs *sdirs, struct conf **cconfs,
 			return asfd->write_str(asfd,
 				CMD_GEN, "timer conditions met");
 		}
-		logp("Running backup of %s\n", cname);
 	}
 	else if(!get_int(cconfs[OPT_CLIENT_CAN_FORCE_BACKUP]))
 	{
@@ -323,11 +359,32 @@ int run_backup(struct async *as, struct sdirs *sdirs, struct conf **cconfs,
 			CMD_GEN, "Forced backup is not allowed");
 	}
 
+	switch(sched_backup_start(asfd, sdirs, cconfs, &slot))
+	{
+		case 0:
+			break;
+		case 1:
+			logp("Server too busy for a backup of %s\n", cname);
+			if(!strncmp_w(rbuf->buf, "backupphase1timed"))
+			{
+				// Looks like the timer said no, so the client
+				// will just try again next time.
+				*timer_ret=1;
+				return asfd->write_str(asfd,
+					CMD_GEN, "timer conditions not met");
+			}
+			return asfd->write_str(asfd,
+				CMD_GEN, "Server is busy, try again later");
+		default:
+			return -1;
+	}
+	logp("Running backup of %s\n", cname);
+
 	snprintf(okstr, sizeof(okstr), "%s:%d",
 		resume?"resume":"ok", get_int(cconfs[OPT_COMPRESSION]));
 	if(asfd->write_str(asfd, CMD_GEN, okstr)) return -1;
 
-	if((ret=do_backup_server(as, sdirs, cconfs, incexc, resume)))
+	if((ret=do_backup_server(as, sdirs, cconfs, incexc, resume, &slot)))
 		goto end;
 	if((ret=delete_backups(sdirs, cname,
 		get_strlist(cconfs[OPT_KEEP]),
@@ -336,5 +393,6 @@ int run_backup(struct async *as, struct sdirs *sdirs, struct conf **cconfs,
 	if(get_protocol(cconfs)==PROTO_2)
 		ret=regenerate_client_dindex(sdirs);
 end:
+	sched_release(&slot);
 	return ret;
 }
@@ -2,27 +2,355 @@
 #include "../alloc.h"
 #include "../asfd.h"
 #include "../async.h"
+#include "../attribs.h"
 #include "../cmd.h"
 #include "../cntr.h"
 #include "../fsops.h"
+#include "../fzp.h"
 #include "../handy.h"
+#include "../iobuf.h"
 #include "../log.h"
 #include "../msg.h"
+#include "../pathcmp.h"
 #include "../sbuf.h"
+#include "../protocol1/dirdigest.h"
 #include "child.h"
 #include "compress.h"
 #include "manio.h"
 #include "quota.h"
 #include "sdirs.h"
 
+// A directory, and the directories that it is inside, are kept in a stack
+// while going through a manifest in order.
+struct pdir
+{
+	char *path;
+	size_t len;
+	MD5_CTX md5;
+};
+
+// For clients that can skip directories that have not changed since the
+// previous backup.
+struct unchanged
+{
+	struct dirdigest *digests;
+	size_t dcount;
+	size_t dalloc;
+	// Cursor in the previous manifest, for copying the entries of
+	// unchanged directories.
+	struct manio *cmanio;
+	struct sbuf *csb;
+	int finished;
+	// The unchanged directories that the cursor is in.
+	struct pdir *dirs;
+	size_t depth;
+	size_t alloc;
+	uint64_t count;
+};
+
+static int pdir_push(struct pdir **dirs, size_t *depth, size_t *alloc,
+	const char *path, size_t len)
+{
+	struct pdir *d;
+	if(*depth>=*alloc)
+	{
+		struct pdir *tmp;
+		if(!(tmp=(struct pdir *)realloc_w(*dirs,
+			(*alloc+16)*sizeof(struct pdir), __func__)))
+				return -1;
+		*dirs=tmp;
+		*alloc+=16;
+	}
+	d=&(*dirs)[*depth];
+	if(!(d->path=(char *)malloc_w(len+1, __func__)))
+		return -1;
+	memcpy(d->path, path, len);
+	d->path[len]='\0';
+	d->len=len;
+	(*depth)++;
+	return 0;
+}
+
+static void pdirs_free(struct pdir **dirs, size_t *depth, size_t *alloc)
+{
+	while(*depth)
+		free_w(&(*dirs)[--(*depth)].path);
+	free_v((void **)dirs);
+	*alloc=0;
+}
+
+// Whether the first len characters of path are the directory, or inside it.
+static int pdir_contains(struct pdir *d, const char *path, size_t len)
+{
+	if(len<d->len || strncmp(d->path, path, d->len))
+		return 0;
+	return len==d->len || path[d->len]=='/' || d->path[d->len-1]=='/';
+}
+
+static int add_digest(struct unchanged *u, struct pdir *d)
+{
+	if(u->dcount>=u->dalloc)
+	{
+		struct dirdigest *tmp;
+		if(!(tmp=(struct dirdigest *)realloc_w(u->digests,
+			(u->dalloc+1024)*sizeof(struct dirdigest), __func__)))
+				return -1;
+		u->digests=tmp;
+		u->dalloc+=1024;
+	}
+	u->digests[u->dcount].path=dirdigest_path(d->path, d->len);
+	u->digests[u->dcount++].digest=dirdigest_final(&d->md5);
+	free_w(&d->path);
+	return 0;
+}
+
+// Work out the digest of the entries in each directory of the previous
+// backup. Also notes whether it had encrypted or unencrypted file data,
+// because the digests do not cover that.
+static int load_digests(struct unchanged *u, const char *cmanifest,
+	int *enc, int *plain)
+{
+	int ars;
+	int ret=-1;
+	size_t plen;
+	size_t depth=0;
+	size_t alloc=0;
+	const char *name;
+	struct pdir *dirs=NULL;
+	struct sbuf *sb=NULL;
+	struct manio *cmanio=NULL;
+
+	if(!(cmanio=manio_open(cmanifest, "rb", PROTO_1))
+	  || !(sb=sbuf_alloc(PROTO_1)))
+		goto end;
+	while(1)
+	{
+		sbuf_free_content(sb);
+		if((ars=manio_read(cmanio, sb))<0)
+			goto end;
+		else if(ars>0)
+			break;
+
+		if(cmd_is_encrypted(sb->path.cmd))
+			*enc=1;
+		else if(cmd_is_filedata(sb->path.cmd))
+			*plain=1;
+
+		// Extra meta data goes along with the entry before it.
+		if(cmd_is_metadata(sb->path.cmd)
+		  || !(plen=dirdigest_parent_len(sb->path.buf)))
+			continue;
+
+		while(depth && !pdir_contains(&dirs[depth-1],
+			sb->path.buf, plen))
+				if(add_digest(u, &dirs[--depth]))
+					goto end;
+		if(!depth || dirs[depth-1].len!=plen)
+		{
+			if(pdir_push(&dirs, &depth, &alloc, sb->path.buf, plen)
+			  || dirdigest_init(&dirs[depth-1].md5))
+				goto end;
+		}
+
+		name=sb->path.buf+plen;
+		if(*name=='/') name++;
+		attribs_decode(sb);
+		dirdigest_add(&dirs[depth-1].md5, name, &sb->statp,
+			sb->path.cmd==CMD_SOFT_LINK?sb->link.buf:NULL);
+	}
+	while(depth)
+		if(add_digest(u, &dirs[--depth]))
+			goto end;
+	dirdigest_sort(u->digests, u->dcount);
+	ret=0;
+end:
+	pdirs_free(&dirs, &depth, &alloc);
+	sbuf_free(&sb);
+	manio_close(&cmanio);
+	return ret;
+}
+
+// The entries of an unchanged directory come from the previous backup, so
+// the include/exclude settings that chose them must not have changed.
+static int incexc_unchanged(const char *path, const char *incexc)
+{
+	int ret=0;
+	size_t len;
+	char *buf=NULL;
+	struct stat statp;
+	struct fzp *fzp=NULL;
+
+	len=incexc?strlen(incexc):0;
+	if(lstat(path, &statp))
+		return !len;
+	if((size_t)statp.st_size!=len)
+		return 0;
+	if(!len)
+		return 1;
+	if(!(buf=(char *)malloc_w(len, __func__))
+	  || !(fzp=fzp_open(path, "rb"))
+	  || fzp_read(fzp, buf, len)!=(int)len)
+		goto end;
+	ret=!memcmp(buf, incexc, len);
+end:
+	fzp_close(&fzp);
+	free_w(&buf);
+	return ret;
+}
+
+static int send_digests(struct asfd *asfd, struct unchanged *u,
+	int enc, int plain)
+{
+	size_t i;
+	size_t j;
+	size_t n;
+	char msg[64]="";
+	struct iobuf wbuf;
+	static uint8_t buf[DIRDIGEST_BATCH*DIRDIGEST_WIRE_LEN];
+
+	snprintf(msg, sizeof(msg), "dirdigests %d %d", enc, plain);
+	if(asfd->write_str(asfd, CMD_GEN, msg))
+		return -1;
+	for(i=0; i<u->dcount; i+=n)
+	{
+		n=u->dcount-i;
+		if(n>DIRDIGEST_BATCH) n=DIRDIGEST_BATCH;
+		for(j=0; j<n; j++)
+			dirdigest_to_wire(&u->digests[i+j],
+				buf+j*DIRDIGEST_WIRE_LEN);
+		iobuf_set(&wbuf, CMD_DIR_DIGESTS,
+			(char *)buf, n*DIRDIGEST_WIRE_LEN);
+		if(asfd->write(asfd, &wbuf))
+			return -1;
+	}
+	return asfd->write_str(asfd, CMD_GEN, "dirdigests end");
+}
+
+static void unchanged_free(struct unchanged **u)
+{
+	if(!u || !*u) return;
+	free_v((void **)&(*u)->digests);
+	manio_close(&(*u)->cmanio);
+	sbuf_free(&(*u)->csb);
+	pdirs_free(&(*u)->dirs, &(*u)->depth, &(*u)->alloc);
+	free_v((void **)u);
+}
+
+static struct unchanged *unchanged_setup(struct asfd *asfd,
+	struct sdirs *sdirs, const char *incexc)
+{
+	int enc=0;
+	int plain=0;
+	struct stat statp;
+	struct unchanged *u=NULL;
+
+	if(!(u=(struct unchanged *)calloc_w(1,
+		sizeof(struct unchanged), __func__)))
+			goto error;
+	// Without a previous backup, nothing can be unchanged.
+	if(!lstat(sdirs->cmanifest, &statp))
+	{
+		if(!incexc_unchanged(sdirs->cincexc, incexc))
+			logp("Includes/excludes changed since the last backup, so not sending directory digests\n");
+		else if(load_digests(u, sdirs->cmanifest, &enc, &plain)
+		  || !(u->cmanio=manio_open(sdirs->cmanifest, "rb", PROTO_1))
+		  || !(u->csb=sbuf_alloc(PROTO_1)))
+			goto error;
+	}
+	if(!u->cmanio)
+		u->finished=1;
+	logp("Sending %lu directory digests\n", (unsigned long)u->dcount);
+	if(send_digests(asfd, u, enc, plain))
+		goto error;
+	return u;
+error:
+	unchanged_free(&u);
+	return NULL;
+}
+
+// Whether the entry is directly inside a directory that the client said
+// was unchanged. Since the entries come in order, directories that the
+// entry is not inside are finished with.
+static int in_unchanged_dir(struct unchanged *u, const char *path)
+{
+	size_t plen;
+	if(!(plen=dirdigest_parent_len(path)))
+		return 0;
+	while(u->depth && !pdir_contains(&u->dirs[u->depth-1], path, plen))
+		free_w(&u->dirs[--u->depth].path);
+	return u->depth && u->dirs[u->depth-1].len==plen;
+}
+
+// Copy the entries of unchanged directories from the previous manifest,
+// up to the given path, or to the end if there is none.
+static int unchanged_copy(struct unchanged *u, const char *upto,
+	int inclusive, struct manio *manio, struct cntr *cntr)
+{
+	int c;
+	struct sbuf *csb=u->csb;
+	while(!u->finished)
+	{
+		if(!csb->path.buf)
+		{
+			switch(manio_read(u->cmanio, csb))
+			{
+				case 0: break;
+				case 1: u->finished=1; return 0;
+				default: return -1;
+			}
+		}
+		if(upto && ((c=pathcmp(csb->path.buf, upto))>0
+			|| (!c && !inclusive)))
+				return 0;
+		if(in_unchanged_dir(u, csb->path.buf))
+		{
+			// Make it look like it came from the client, so that
+			// phase2 finds it unchanged.
+			iobuf_free_content(&csb->protocol1->datapth);
+			iobuf_free_content(&csb->endfile);
+			if(manio_write_sbuf(manio, csb))
+				return -1;
+			cntr_add_phase1(cntr, csb->path.cmd, 0);
+			if(sbuf_is_filedata(csb))
+			{
+				attribs_decode(csb);
+				cntr_add_val(cntr, CMD_BYTES_ESTIMATED,
+					(uint64_t)csb->statp.st_size, 0);
+			}
+		}
+		sbuf_free_content(csb);
+	}
+	return 0;
+}
+
+static int unchanged_dir(struct unchanged *u, const char *path,
+	struct manio *manio, struct cntr *cntr)
+{
+	size_t len=strlen(path);
+	if(!dirdigest_find(u->digests, u->dcount, dirdigest_path(path, len)))
+	{
+		logp("Client says that %s is unchanged, but it has no digest\n",
+			path);
+		return -1;
+	}
+	if(unchanged_copy(u, path, 1 /* inclusive */, manio, cntr))
+		return -1;
+	// Get rid of the finished ones.
+	while(u->depth && !pdir_contains(&u->dirs[u->depth-1], path, len))
+		free_w(&u->dirs[--u->depth].path);
+	u->count++;
+	return pdir_push(&u->dirs, &u->depth, &u->alloc, path, len);
+}
+
 int backup_phase1_server_all(struct async *as,
-	struct sdirs *sdirs, struct conf **confs)
+	struct sdirs *sdirs, const char *incexc, struct conf **confs)
 {
 	int ret=-1;
 	struct sbuf *sb=NULL;
 	char *phase1tmp=NULL;
 	struct asfd *asfd=as->asfd;
 	struct manio *manio=NULL;
+	struct unchanged *unchanged=NULL;
 	enum protocol protocol=get_protocol(confs);
 	struct cntr *cntr=get_cntr(confs);
 
@@ -34,6 +362,11 @@ int backup_phase1_server_all(struct async *as,
 	  || !(sb=sbuf_alloc(protocol)))
 		goto error;
 
+	if(protocol==PROTO_1
+	  && get_int(confs[OPT_DIR_DIGESTS])
+	  && !(unchanged=unchanged_setup(asfd, sdirs, incexc)))
+		goto error;
+
 	while(1)
 	{
 		sbuf_free_content(sb);
@@ -42,7 +375,9 @@ int backup_phase1_server_all(struct async *as,
 			case 0: break;
 			case 1: // Last thing the client sends is
 				// 'backupphase2', and it wants an 'ok' reply.
-				if(asfd->write_str(asfd, CMD_GEN, "ok")
+				if((unchanged && unchanged_copy(unchanged,
+					NULL, 0, manio, cntr))
+				  || asfd->write_str(asfd, CMD_GEN, "ok")
 				  || send_msg_fzp(manio->fzp, CMD_GEN,
 					"phase1end", strlen("phase1end")))
 						goto error;
@@ -50,6 +385,20 @@ int backup_phase1_server_all(struct async *as,
 			case -1:
 			default: goto error;
 		}
+		if(sb->path.cmd==CMD_DIR_UNCHANGED)
+		{
+			if(!unchanged)
+			{
+				iobuf_log_unexpected(&sb->path, __func__);
+				goto error;
+			}
+			if(unchanged_dir(unchanged, sb->path.buf, manio, cntr))
+				goto error;
+			continue;
+		}
+		if(unchanged && unchanged_copy(unchanged,
+			sb->path.buf, 0, manio, cntr))
+				goto error;
 		if(write_status(CNTR_STATUS_SCANNING, sb->path.buf, cntr)
 		  || manio_write_sbuf(manio, sb))
 			goto error;
@@ -63,6 +412,9 @@ int backup_phase1_server_all(struct async *as,
 	}
 
 end:
+	if(unchanged)
+		logp("%lu directories unchanged\n",
+			(unsigned long)unchanged->count);
 	if(manio_close(&manio))
 	{
 		logp("error closing %s in backup_phase1_server\n", phase1tmp);
@@ -88,5 +440,6 @@ error:
 	free_w(&phase1tmp);
 	manio_close(&manio);
 	sbuf_free(&sb);
+	unchanged_free(&unchanged);
 	return ret;
 }
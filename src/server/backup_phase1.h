@@ -2,6 +2,6 @@
 #define _BACKUP_PHASE1_SERVER_H
 
 extern int backup_phase1_server_all(struct async *as,
-	struct sdirs *sdirs, struct conf **confs);
+	struct sdirs *sdirs, const char *incexc, struct conf **confs);
 
 #endif
@@ -97,6 +97,7 @@ static int maybe_add_ent(const char *dir, const char *d_name,
 				case CNTR_STATUS_BACKUP:
 				case CNTR_STATUS_MERGING:
 				case CNTR_STATUS_SHUFFLING:
+				case CNTR_STATUS_QUEUED:
 					bu->flags|=BU_STATS_BACKUP;
 					break;
 				case CNTR_STATUS_VERIFYING:
@@ -5,6 +5,7 @@
 #include "../fsops.h"
 #include "../fzp.h"
 #include "../log.h"
+#include "../pdeflate.h"
 #include "../prepend.h"
 
 char *comp_level(int compression)
@@ -14,6 +15,67 @@ char *comp_level(int compression)
 	return comp;
 }
 
+// Whether protocol1 data that the server compresses itself is written
+// with zstd instead of zlib. The file names keep their '.gz' suffix, and
+// readers tell the difference from the file contents.
+static int data_zstd=0;
+
+void compress_set_zstd(int value)
+{
+#ifdef HAVE_ZSTD
+	data_zstd=value;
+#else
+	if(value)
+		logp("data_zstd is set, but burp was built without zstd\n");
+#endif
+}
+
+struct fzp *compress_open_data(const char *path, int compression)
+{
+	if(data_zstd)
+		return fzp_zstdopen(path, comp_level(compression));
+	return fzp_gzopen(path, comp_level(compression));
+}
+
+static int write_fzp(void *ctx, uint8_t *buf, size_t len)
+{
+	if(fzp_write((struct fzp *)ctx, buf, len)!=len)
+	{
+		logp("short write in %s\n", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+// Like compress(), but with several processes doing the deflating.
+// The result is a normal gzip file.
+static int compress_parallel(const char *src, const char *dst,
+	int compression)
+{
+	int ret=-1;
+	int got;
+	struct fzp *sfzp=NULL;
+	struct fzp *dfzp=NULL;
+	struct pdeflate *pd=NULL;
+	uint8_t buf[ZCHUNK];
+
+	if(!(sfzp=fzp_open(src, "rb"))
+	  || !(dfzp=fzp_open(dst, "wb"))
+	  || !(pd=pdeflate_alloc(compression)))
+		goto end;
+	while((got=fzp_read(sfzp, buf, sizeof(buf)))>0)
+		if(pdeflate_write(pd, buf, got, write_fzp, dfzp))
+			goto end;
+	if(pdeflate_finish(pd, write_fzp, dfzp))
+		goto end;
+	ret=0;
+end:
+	pdeflate_free(&pd);
+	fzp_close(&sfzp);
+	if(fzp_close(&dfzp)) ret=-1;
+	return ret;
+}
+
 static int compress(const char *src, const char *dst, int compression)
 {
 	int res;
@@ -21,6 +83,11 @@ static int compress(const char *src, const char *dst, int compression)
 	struct fzp *sfzp=NULL;
 	struct fzp *dfzp=NULL;
 	char buf[ZCHUNK];
+	struct stat statp;
+
+	if(compression && !lstat(src, &statp)
+	  && pdeflate_wanted((uint64_t)statp.st_size))
+		return compress_parallel(src, dst, compression);
 
 	if(!(sfzp=fzp_open(src, "rb"))
 	  || !(dfzp=fzp_gzopen(dst, comp_level(compression))))
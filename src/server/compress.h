@@ -2,6 +2,8 @@
 #define _COMPRESS_H
 
 extern char *comp_level(int compression);
+extern void compress_set_zstd(int value);
+extern struct fzp *compress_open_data(const char *path, int compression);
 extern int compress_file(const char *current, const char *file,
 	int compression);
 extern int compress_filename(const char *d, const char *file,
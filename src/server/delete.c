@@ -12,6 +12,7 @@
 #include "child.h"
 #include "sdirs.h"
 #include "protocol2/backup_phase4.h"
+#include "protocol2/champ_chooser/dindex.h"
 
 static int do_rename_w(const char *a, const char *b,
 	const char *cname, struct bu *bu)
@@ -58,6 +59,8 @@ static int delete_backup(struct sdirs *sdirs, const char *cname, struct bu *bu,
 		if(remove_from_global_sparse(
 			sdirs->global_sparse, candidate_str))
 				return -1;
+		if(dindex_note_deleted_backup(sdirs->data))
+			return -1;
 	}
 
 	if(!bu->next && !bu->prev)
@@ -2,6 +2,7 @@
 #include "../alloc.h"
 #include "../asfd.h"
 #include "../async.h"
+#include "../attribs.h"
 #include "../bu.h"
 #include "../conf.h"
 #include "../cmd.h"
@@ -12,6 +13,7 @@
 #include "bu_get.h"
 #include "child.h"
 #include "manio.h"
+#include "mjoin.h"
 
 static char *get_manifest_path(const char *fullpath, enum protocol protocol)
 {
@@ -23,6 +25,7 @@ static int send_diff(struct asfd *asfd, const char *symbol, struct sbuf *sb)
 	int ret=-1;
 	char *dpath=NULL;
 	if(!(dpath=prepend_s(symbol, sb->path.buf))
+	  || attribs_for_peer(sb)
 	  || asfd->write(asfd, &sb->attr)
 	  || asfd->write_str(asfd, sb->path.cmd, dpath))
 		goto end;
@@ -45,101 +48,39 @@ static int send_addition(struct asfd *asfd, struct sbuf *sb)
 	return send_diff(asfd, "+ ", sb);
 }
 
+static int diff_entry(void *data,
+	struct sbuf *sb1, struct sbuf *sb2, int changed)
+{
+	struct asfd *asfd=(struct asfd *)data;
+	if(sb1 && (!sb2 || changed)
+	  && send_deletion(asfd, sb1))
+		return -1;
+	if(sb2 && (!sb1 || changed)
+	  && send_addition(asfd, sb2))
+		return -1;
+	return 0;
+}
+
 static int diff_manifests(struct asfd *asfd,
 	const char *fullpath1, const char *fullpath2,
-	struct cntr *cntr, enum protocol protocol)
+	struct cntr *cntr, enum protocol protocol, int compare)
 {
 	int ret=-1;
-	int pcmp;
-	struct sbuf *sb1=NULL;
-	struct sbuf *sb2=NULL;
-	struct manio *manio1=NULL;
-	struct manio *manio2=NULL;
 	char *manifest_dir1=NULL;
 	char *manifest_dir2=NULL;
 
 	if(!(manifest_dir1=get_manifest_path(fullpath1, protocol))
-	  || !(manifest_dir2=get_manifest_path(fullpath2, protocol))
-	  || !(manio1=manio_open(manifest_dir1, "rb", protocol))
-	  || !(manio2=manio_open(manifest_dir2, "rb", protocol))
-	  || !(sb1=sbuf_alloc(protocol))
-	  || !(sb2=sbuf_alloc(protocol)))
+	  || !(manifest_dir2=get_manifest_path(fullpath2, protocol)))
 	{
 		log_and_send_oom(asfd, __func__);
 		goto end;
 	}
 
-	while(manio1 || manio2)
-	{
-		if(manio1
-		  && !sb1->path.buf)
-		{
-			switch(manio_read(manio1, sb1))
-			{
-				case -1: goto end;
-				case 1: manio_close(&manio1);
-			}
-		}
-
-		if(manio2
-		  && !sb2->path.buf)
-		{
-			switch(manio_read(manio2, sb2))
-			{
-				case -1: goto end;
-				case 1: manio_close(&manio2);
-			}
-		}
-
-		if(sb1->path.buf && !sb2->path.buf)
-		{
-			if(send_deletion(asfd, sb1))
-				goto end;
-			sbuf_free_content(sb1);
-		}
-		else if(!sb1->path.buf && sb2->path.buf)
-		{
-			if(send_addition(asfd, sb2))
-				goto end;
-			sbuf_free_content(sb2);
-		}
-		else if(!sb1->path.buf && !sb2->path.buf)
-		{
-			continue;
-		}
-		else if(!(pcmp=sbuf_pathcmp(sb1, sb2)))
-		{
-			if(sb1->statp.st_mtime!=sb2->statp.st_mtime)
-			{
-				if(send_deletion(asfd, sb1)
-				  || send_addition(asfd, sb2))
-					goto end;
-			}
-			sbuf_free_content(sb1);
-			sbuf_free_content(sb2);
-		}
-		else if(pcmp<0)
-		{
-			if(send_deletion(asfd, sb1))
-				goto end;
-			sbuf_free_content(sb1);
-		}
-		else
-		{
-			if(send_addition(asfd, sb2))
-				goto end;
-			sbuf_free_content(sb2);
-		}
-	}
-
-	ret=0;
+	ret=mjoin(manifest_dir1, manifest_dir2,
+		protocol, compare, diff_entry, asfd);
 end:
-	sbuf_free(&sb1);
-	sbuf_free(&sb2);
 	free_w(&manifest_dir1);
 	free_w(&manifest_dir2);
-	manio_close(&manio1);
-	manio_close(&manio2);
 	return ret;
 }
 
@@ -151,9 +92,11 @@ static int send_backup_name_to_client(struct asfd *asfd, struct bu *bu)
 }
 
 int do_diff_server(struct asfd *asfd, struct sdirs *sdirs, struct cntr *cntr,
-	enum protocol protocol, const char *backup1, const char *backup2)
+	enum protocol protocol, const char *backup1, const char *backup2,
+	const char *compare_str)
 {
 	int ret=-1;
+	int compare;
 	unsigned long bno1=0;
 	unsigned long bno2=0;
 	struct bu *bu1=NULL;
@@ -162,6 +105,13 @@ int do_diff_server(struct asfd *asfd, struct sdirs *sdirs, struct cntr *cntr,
 
 	//printf("in do_diff_server\n");
 
+	if((compare=mjoin_parse_compare(compare_str))<0)
+	{
+		asfd->write_str(asfd, CMD_ERROR,
+			"bad diff_compare setting on the server");
+		goto end;
+	}
+
 	if(bu_get_list(sdirs, &bu_list)
 	  || write_status(CNTR_STATUS_DIFFING, NULL, cntr))
 		goto end;
@@ -191,7 +141,7 @@ int do_diff_server(struct asfd *asfd, struct sdirs *sdirs, struct cntr *cntr,
 	  || send_backup_name_to_client(asfd, bu2))
 		goto end;
 
-	if(diff_manifests(asfd, bu1->path, bu2->path, cntr, protocol))
+	if(diff_manifests(asfd, bu1->path, bu2->path, cntr, protocol, compare))
 		goto end;
 
 	ret=0;
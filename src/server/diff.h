@@ -3,6 +3,6 @@
 
 extern int do_diff_server(struct asfd *asfd,
 	struct sdirs *sdirs, struct cntr *cntr, enum protocol protocol,
-	const char *backup1, const char *backup2);
+	const char *backup1, const char *backup2, const char *compare);
 
 #endif
@@ -2,6 +2,7 @@
 #include "../alloc.h"
 #include "../asfd.h"
 #include "../async.h"
+#include "../attribs.h"
 #include "../cmd.h"
 #include "../conf.h"
 #include "../conffile.h"
@@ -11,7 +12,9 @@
 #include "../iobuf.h"
 #include "../log.h"
 #include "../prepend.h"
+#include "../regexp.h"
 #include "autoupgrade.h"
+#include "restore.h"
 
 static int append_to_feat(char **feat, const char *str)
 {
@@ -40,7 +43,8 @@ static char *get_restorepath(struct conf **cconfs)
 	return restorepath;
 }
 
-static int send_features(struct asfd *asfd, struct conf **cconfs)
+static int send_features(struct asfd *asfd, struct conf **cconfs,
+	int dir_digests, int binary_attribs)
 {
 	int ret=-1;
 	char *feat=NULL;
@@ -87,6 +91,33 @@ static int send_features(struct asfd *asfd, struct conf **cconfs)
 	if(append_to_feat(&feat, "msg:"))
 		goto end;
 
+	// Protocol1 clients can skip directories that have not changed.
+	if(dir_digests
+	  && protocol!=PROTO_2
+	  && append_to_feat(&feat, "dirdigests:"))
+		goto end;
+
+	// Clients can send attributes in binary.
+	if(binary_attribs
+	  && append_to_feat(&feat, "binattribs:"))
+		goto end;
+
+	// Clients can spread a restore over several connections.
+	if(get_int(cconfs[OPT_MAX_RESTORE_STREAMS])>1
+	  && append_to_feat(&feat, "restore_streams:"))
+		goto end;
+
+	// Protocol1 clients can send several files at once, up to a limit.
+	if(get_int(cconfs[OPT_MAX_BACKUP_STREAMS])>1
+	  && protocol!=PROTO_2)
+	{
+		char b[32]="";
+		snprintf(b, sizeof(b), "backup_streams=%d:",
+			get_int(cconfs[OPT_MAX_BACKUP_STREAMS]));
+		if(append_to_feat(&feat, b))
+			goto end;
+	}
+
 	if(protocol==PROTO_AUTO)
 	{
 		/* If the server is configured to use either protocol, let the
@@ -261,6 +292,27 @@ static int extra_comms_read(struct async *as,
 			if(asfd->write_str(asfd, CMD_GEN, "orig_client ok"))
 				goto end;
 		}
+		else if(!strncmp_w(rbuf->buf, "restore_streams="))
+		{
+			if(restore_parse_streams(
+				rbuf->buf+strlen("restore_streams="),
+				get_int(cconfs[OPT_MAX_RESTORE_STREAMS])))
+			{
+				iobuf_log_unexpected(rbuf, __func__);
+				goto end;
+			}
+		}
+		else if(!strncmp_w(rbuf->buf, "backup_streams="))
+		{
+			int streams=atoi(rbuf->buf+strlen("backup_streams="));
+			if(streams<2
+			  || streams>get_int(cconfs[OPT_MAX_BACKUP_STREAMS]))
+			{
+				iobuf_log_unexpected(rbuf, __func__);
+				goto end;
+			}
+			set_int(cconfs[OPT_BACKUP_STREAMS], streams);
+		}
 		else if(!strncmp_w(rbuf->buf, "restore_spool="))
 		{
 			// Client supports temporary spool directory
@@ -314,6 +366,15 @@ static int extra_comms_read(struct async *as,
 			set_int(cconfs[OPT_MESSAGE], 1);
 			set_int(globalcs[OPT_MESSAGE], 1);
 		}
+		else if(!strcmp(rbuf->buf, "dirdigests"))
+		{
+			set_int(cconfs[OPT_DIR_DIGESTS], 1);
+		}
+		else if(!strcmp(rbuf->buf, "binattribs"))
+		{
+			set_int(cconfs[OPT_BINARY_ATTRIBS], 1);
+			attribs_set_binary(1);
+		}
 		else
 		{
 			iobuf_log_unexpected(rbuf, __func__);
@@ -346,9 +407,19 @@ int extra_comms(struct async *as,
 	asfd=as->asfd;
 	//char *restorepath=NULL;
 	const char *peer_version=NULL;
+	int dir_digests=0;
+	int binary_attribs=0;
 
 	if(vers_init(&vers, cconfs)) goto error;
 
+	// Only turned back on if the client takes up the offer.
+	dir_digests=get_int(cconfs[OPT_DIR_DIGESTS]);
+	set_int(cconfs[OPT_DIR_DIGESTS], 0);
+	binary_attribs=get_int(cconfs[OPT_BINARY_ATTRIBS]);
+	set_int(cconfs[OPT_BINARY_ATTRIBS], 0);
+	// Only more than one if the client asks.
+	set_int(cconfs[OPT_BACKUP_STREAMS], 1);
+
 	if(vers.cli<vers.directory_tree)
 	{
 		set_int(confs[OPT_DIRECTORY_TREE], 0);
@@ -378,7 +449,8 @@ int extra_comms(struct async *as,
 	}
 	else
 	{
-		if(send_features(asfd, cconfs)) goto error;
+		if(send_features(asfd, cconfs, dir_digests, binary_attribs))
+			goto error;
 	}
 
 	if(extra_comms_read(as, &vers, srestore, incexc, confs, cconfs))
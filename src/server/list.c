@@ -13,6 +13,7 @@
 #include "child.h"
 #include "list.h"
 #include "manio.h"
+#include "pindex.h"
 
 enum list_mode
 {
@@ -25,6 +26,7 @@ static struct asfd *asfd;
 static struct cntr *cntr;
 static enum protocol protocol;
 static const char *backup;
+static const char *regex_string=NULL;
 static regex_t *regex=NULL;
 static const char *browsedir;
 static struct bu *bu_list=NULL;
@@ -45,6 +47,7 @@ int list_server_init(
 	protocol=p;
 	backup=backup_str;
 	browsedir=browsedir_str;
+	regex_string=regex_str;
 	if(bu_get_list(s, &bu_list))
 		goto error;
 	if(regex_str
@@ -91,7 +94,7 @@ static void maybe_fake_directory(struct sbuf *mb)
 	// Make sure the directory bit is set.
 	mb->statp.st_mode &= ~(S_IFMT);
 	mb->statp.st_mode |= S_IFDIR;
-	attribs_encode(mb);
+	attribs_reencode(mb);
 }
 
 int check_browsedir(const char *browsedir,
@@ -142,11 +145,12 @@ int check_browsedir(const char *browsedir,
 		free_w(&copy);
 		return 0;
 	}
-	free_w(&mb->path.buf);
-	mb->path.buf=copy;
+	// The copy is never longer than the path, so it can go over it,
+	// which works whether or not the path came from an arena.
+	mb->path.len=strlen(copy);
+	memcpy(mb->path.buf, copy, mb->path.len+1);
 	free_w(last_bd_match);
-	if(!(*last_bd_match=strdup_w(copy, __func__)))
-		goto error;
+	*last_bd_match=copy;
 	return 1;
 error:
 	free_w(&copy);
@@ -159,26 +163,36 @@ static int list_manifest(const char *fullpath)
 	int ret=0;
 	struct sbuf *sb=NULL;
 	struct manio *manio=NULL;
+	struct pindex *pindex=NULL;
 	char *manifest_dir=NULL;
+	char *pindex_path=NULL;
 	char *last_bd_match=NULL;
 	size_t bdlen=0;
 
 	if(!(manifest_dir=prepend_s(fullpath,
 		protocol==PROTO_1?"manifest.gz":"manifest"))
+	  || !(pindex_path=prepend_s(fullpath, "pindex"))
 	  || !(manio=manio_open(manifest_dir, "rb", protocol))
-	  || !(sb=sbuf_alloc(protocol)))
+	  || !(sb=sbuf_alloc(protocol))
+	  || sbuf_use_arena(sb))
 	{
 		log_and_send_oom(asfd, __func__);
 		goto error;
 	}
 
+	// Without an index, read the whole manifest.
+	if(regex || (browsedir && *browsedir))
+		pindex=pindex_open(pindex_path,
+			regex?regex_string:NULL, browsedir);
+
 	if(browsedir) bdlen=strlen(browsedir);
 
 	while(1)
 	{
 		sbuf_free_content(sb);
 
-		switch(manio_read(manio, sb))
+		switch(pindex?pindex_read(pindex, manio, sb)
+			  :manio_read(manio, sb))
 		{
 			case 0: break;
 			case 1: if(browsedir && *browsedir && !last_bd_match)
@@ -209,7 +223,8 @@ static int list_manifest(const char *fullpath)
 		if(regex && !regex_check(regex, sb->path.buf))
 			continue;
 
-		if(asfd_write_wrapper(asfd, &sb->attr)
+		if(attribs_for_peer(sb)
+		  || asfd_write_wrapper(asfd, &sb->attr)
 		  || asfd_write_wrapper(asfd, &sb->path))
 			goto error;
 		if(sbuf_is_link(sb)
@@ -220,8 +235,14 @@ static int list_manifest(const char *fullpath)
 error:
 	ret=-1;
 end:
+	if(pindex && pindex->skipped)
+		logp("Path index skipped %" PRIu64 " of %" PRIu64
+			" regions\n", pindex->skipped,
+			(uint64_t)pindex->count);
+	pindex_free(&pindex);
 	sbuf_free(&sb);
 	free_w(&manifest_dir);
+	free_w(&pindex_path);
 	manio_close(&manio);
 	free_w(&last_bd_match);
 	return ret;
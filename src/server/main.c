@@ -1,6 +1,7 @@
 #include "../burp.h"
 #include "../asfd.h"
 #include "../async.h"
+#include "../budget.h"
 #include "../cntr.h"
 #include "../conf.h"
 #include "../conffile.h"
@@ -13,6 +14,7 @@
 #include "ca.h"
 #include "child.h"
 #include "main.h"
+#include "prefork.h"
 #include "monitor/status_server.h"
 
 // FIX THIS: Should be able to configure multiple addresses and ports.
@@ -65,6 +67,7 @@ static void chld_check_for_exiting(struct async *mainas)
 
 	while((p=waitpid(-1, &status, WNOHANG))>0)
 	{
+		if(prefork_forget(p)) continue;
 		// Logging a message here appeared to occasionally lock burp up
 		// on a Ubuntu server that I used to use.
 		for(asfd=mainas->asfd; asfd; asfd=asfd->next)
@@ -176,8 +179,11 @@ int setup_signals(int oldmax_children, int max_children,
 	return 0;
 }
 
+// If globalcs is given, it is the config that the parent had, and it is used
+// as long as none of the files that it came from have changed.
 static int run_child(int *cfd, SSL_CTX *ctx, struct sockaddr_storage *addr,
-	int status_wfd, int status_rfd, const char *conffile, int forking)
+	int status_wfd, int status_rfd, const char *conffile, int forking,
+	struct conf **globalcs)
 {
 	int ret=-1;
 	int ca_ret=0;
@@ -189,17 +195,24 @@ static int run_child(int *cfd, SSL_CTX *ctx, struct sockaddr_storage *addr,
 	struct async *as=NULL;
 	const char *cname=NULL;
 
-	if(!(confs=confs_alloc())
-	  || !(cconfs=confs_alloc()))
+	if(!(cconfs=confs_alloc()))
 		goto end;
 
 	set_peer_env_vars(addr);
 
-	// Reload global config, in case things have changed. This means that
-	// the server does not need to be restarted for most conf changes.
-	confs_init(confs);
+	// Reload global config if things have changed since the parent read
+	// it. This means that the server does not need to be restarted for
+	// most conf changes.
 	confs_init(cconfs);
-	if(conf_load_global_only(conffile, confs)) goto end;
+	if(globalcs && !conf_files_changed(globalcs))
+		confs=globalcs;
+	else
+	{
+		if(!(confs=confs_alloc()))
+			goto end;
+		confs_init(confs);
+		if(conf_load_global_only(conffile, confs)) goto end;
+	}
 
 	// Hack to keep forking turned off if it was specified as off on the
 	// command line.
@@ -287,7 +300,7 @@ end:
 	if(confs)
 	{
 		set_cntr(confs[OPT_CNTR], NULL);
-		confs_free(&confs);
+		if(confs!=globalcs) confs_free(&confs);
 	}
 	if(cconfs)
 	{
@@ -338,6 +351,133 @@ static int chld_check_counts(struct conf **confs, struct asfd *asfd)
 	return 0;
 }
 
+// Give a new connection to a child that was forked earlier. Returns 1 if
+// there was no child waiting.
+static int prefork_handoff(struct async *mainas, int *cfd,
+	struct sockaddr_storage *client_name, struct conf **confs)
+{
+	struct prefork *p;
+	while((p=prefork_take()))
+	{
+		if(prefork_send(p->ctl, *cfd, client_name))
+		{
+			// It probably exited. Closing ctl makes sure of it.
+			logp("Could not hand connection to child: %d\n",
+				p->pid);
+			prefork_close(&p);
+			continue;
+		}
+		close_fd(cfd);
+		logp("handed connection to preforked child: %d\n", p->pid);
+		if(!setup_asfd(mainas, "pipe from child",
+			&p->pipe_rfd, NULL,
+			ASFD_STREAM_STANDARD, ASFD_FD_SERVER_PIPE_READ,
+			p->pid, confs))
+		{
+			prefork_close(&p);
+			return -1;
+		}
+		prefork_close(&p);
+		return 0;
+	}
+	return 1;
+}
+
+static void prefork_child(struct async *mainas, int ctl, int pipe_wfd,
+	SSL_CTX *ctx, const char *conffile, struct conf **confs)
+{
+	int p;
+	int ret=-1;
+	int cfd=-1;
+	struct sigaction sa;
+	struct sockaddr_storage client_name;
+
+	async_asfd_free_all(&mainas);
+	prefork_free_all();
+	for(p=3; p<(int)FD_SETSIZE; p++)
+		if(p!=ctl && p!=pipe_wfd)
+			close(p);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler=SIG_DFL;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	// Wait here until the parent has a connection for us.
+	switch(prefork_recv(ctl, &cfd, &client_name))
+	{
+		case 0:
+			close(ctl);
+			ret=run_child(&cfd, ctx, &client_name, pipe_wfd, -1,
+				conffile, 1, confs);
+			break;
+		case 1:
+			// Not needed any more.
+			ret=0;
+			break;
+		default:
+			break;
+	}
+	close(pipe_wfd);
+	close_fd(&cfd);
+	exit(ret);
+}
+
+// Keep prefork_children children forked and waiting for connections, so that
+// a new connection does not have to wait for a fork.
+static int prefork_fill(struct async *mainas, SSL_CTX *ctx,
+	const char *conffile, struct conf **confs)
+{
+	pid_t childpid;
+	int ctl[2];
+	int pipe_rfd[2];
+	int want=get_int(confs[OPT_PREFORK_CHILDREN]);
+
+	if(!get_int(confs[OPT_FORK])) return 0;
+
+	while(prefork_count()<want)
+	{
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, ctl)<0)
+		{
+			logp("socketpair failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if(pipe(pipe_rfd)<0)
+		{
+			logp("pipe failed: %s\n", strerror(errno));
+			close(ctl[0]);
+			close(ctl[1]);
+			return -1;
+		}
+		switch((childpid=fork()))
+		{
+			case -1:
+				logp("fork failed: %s\n", strerror(errno));
+				close(ctl[0]);
+				close(ctl[1]);
+				close(pipe_rfd[0]);
+				close(pipe_rfd[1]);
+				return -1;
+			case 0:
+				close(ctl[0]);
+				close(pipe_rfd[0]);
+				prefork_child(mainas, ctl[1], pipe_rfd[1],
+					ctx, conffile, confs);
+				// Not reached.
+			default:
+				close(ctl[1]);
+				close(pipe_rfd[1]);
+				if(prefork_add(childpid, ctl[0], pipe_rfd[0]))
+				{
+					close(ctl[0]);
+					close(pipe_rfd[0]);
+					return -1;
+				}
+				break;
+		}
+	}
+	return 0;
+}
+
 static int process_incoming_client(struct asfd *asfd, SSL_CTX *ctx,
 	const char *conffile, struct conf **confs)
 {
@@ -366,7 +506,7 @@ static int process_incoming_client(struct asfd *asfd, SSL_CTX *ctx,
 
 	if(!forking)
 		return run_child(&cfd, ctx,
-			&client_name, -1, -1, conffile, forking);
+			&client_name, -1, -1, conffile, forking, NULL);
 
 	if(chld_check_counts(confs, asfd))
 	{
@@ -375,6 +515,16 @@ static int process_incoming_client(struct asfd *asfd, SSL_CTX *ctx,
 		return 0;
 	}
 
+	if(fdtype==ASFD_FD_SERVER_LISTEN_MAIN)
+	{
+		switch(prefork_handoff(asfd->as, &cfd, &client_name, confs))
+		{
+			case 0: return 0;
+			case 1: break; // No child waiting, so fork one now.
+			default: return -1;
+		}
+	}
+
 	if(pipe(pipe_rfd)<0 || pipe(pipe_wfd)<0)
 	{
 		logp("pipe failed: %s", strerror(errno));
@@ -395,6 +545,7 @@ static int process_incoming_client(struct asfd *asfd, SSL_CTX *ctx,
 			struct sigaction sa;
 			struct async *as=asfd->as;
 			async_asfd_free_all(&as);
+			prefork_free_all();
 
 			// Close unnecessary file descriptors.
 			// Go up to FD_SETSIZE and hope for the best.
@@ -417,12 +568,9 @@ static int process_incoming_client(struct asfd *asfd, SSL_CTX *ctx,
 			close(pipe_rfd[0]); // close read end
 			close(pipe_wfd[1]); // close write end
 
-			confs_free_content(confs);
-			confs_init(confs);
-
 			ret=run_child(&cfd, ctx, &client_name, pipe_rfd[1],
 			  fdtype==ASFD_FD_SERVER_LISTEN_STATUS?pipe_wfd[0]:-1,
-			  conffile, forking);
+			  conffile, forking, confs);
 
 			close(pipe_rfd[1]);
 			close(pipe_wfd[0]);
@@ -568,6 +716,9 @@ static int run_server(struct conf **confs, const char *conffile,
 		logp("error loading dh params\n");
 		goto end;
 	}
+	ssl_server_sessions(ctx, get_int(confs[OPT_SSL_SESSION_TIMEOUT]));
+	budget_set_rate(BUDGET_NETWORK, get_float(confs[OPT_NETWORK_BUDGET]));
+	budget_set_rate(BUDGET_STORAGE, get_float(confs[OPT_STORAGE_BUDGET]));
 
 	if(init_listen_socket(address, port, rfds)
 	  || init_listen_socket(status_address, status_port, sfds))
@@ -666,6 +817,10 @@ static int run_server(struct conf **confs, const char *conffile,
 
 		chld_check_for_exiting(mainas);
 
+		// If this fails, new connections just fork their own child.
+		if(!gentleshutdown)
+			prefork_fill(mainas, ctx, conffile, confs);
+
 		// Leave if we had a SIGUSR1 and there are no children running.
 		if(gentleshutdown)
 		{
@@ -689,6 +844,8 @@ static int run_server(struct conf **confs, const char *conffile,
 
 	ret=0;
 end:
+	// Any children still waiting for a connection will exit.
+	prefork_free_all();
 	async_asfd_free_all(&mainas);
 	if(ctx) ssl_destroy_ctx(ctx);
 	return ret;
@@ -720,6 +877,9 @@ int server(struct conf **confs, const char *conffile,
 
 	ssl_load_globals();
 
+	// Before any children are forked, so that they all share it.
+	if(budget_init()) goto error;
+
 	while(!gentleshutdown)
 	{
 		if(run_server(confs, conffile, rfds, sfds))
@@ -741,6 +901,7 @@ end:
 error:
 	close_fds(rfds);
 	close_fds(sfds);
+	budget_free();
 
 // FIX THIS: Have an enum for a return value, so that it is more obvious what
 // is happening, like client.c does.
@@ -17,6 +17,41 @@
 #define MANIO_MODE_WRITE	"wb"
 #define MANIO_MODE_APPEND	"ab"
 
+// Whether to inflate compressed manifests in a separate process while
+// reading them, and the zlib buffer size to use for compressed manifests.
+static int use_readahead=0;
+static unsigned int gzbuffer_size=0;
+
+void manio_set_readahead(int value, unsigned int bufsize)
+{
+	use_readahead=value;
+	gzbuffer_size=bufsize;
+}
+
+// Whether to write compressed manifests with zstd instead of gzip, and how
+// many entries to put in each independently seekable zstd frame.
+// Readers work out which one was used by themselves.
+static int use_zstd=0;
+static int zstd_frame_entries=0;
+
+void manio_set_zstd(int value, int frame_entries)
+{
+#ifdef HAVE_ZSTD
+	use_zstd=value;
+#else
+	if(value)
+		logp("manifest_zstd is set, but burp was built without zstd\n");
+#endif
+	zstd_frame_entries=frame_entries;
+}
+
+struct fzp *manio_fzp_open_write(const char *path, const char *mode)
+{
+	if(use_zstd)
+		return fzp_zstdopen(path, mode);
+	return fzp_gzopen(path, mode);
+}
+
 static void man_off_t_free_content(man_off_t *offset)
 {
 	if(!offset) return;
@@ -95,8 +130,20 @@ static int manio_open_next_fpath(struct manio *manio)
 		case 1:
 		case 3:
 		default:
-			if(!(manio->fzp=fzp_gzopen(offset->fpath,
-				manio->mode))) return -1;
+			manio->frame_entries=0;
+			if(use_readahead
+			  && !strcmp(manio->mode, MANIO_MODE_READ))
+				manio->fzp=fzp_gzopen_readahead(
+					offset->fpath, gzbuffer_size);
+			else if(!strcmp(manio->mode, MANIO_MODE_WRITE))
+				manio->fzp=manio_fzp_open_write(
+					offset->fpath, manio->mode);
+			else
+				manio->fzp=fzp_gzopen(offset->fpath,
+					manio->mode);
+			if(!manio->fzp
+			  || fzp_gzbuffer(manio->fzp, gzbuffer_size))
+				return -1;
 			return 0;
 	}
 }
@@ -548,9 +595,25 @@ int manio_write_sig_and_path(struct manio *manio, struct blk *blk)
 	return write_sig_msg(manio, blk);
 }
 
+// Call before writing each manifest entry. Starts a new frame at an entry
+// boundary, so that later seeks to the entries only have to decompress
+// from there. Anything that writes manifest entries without
+// manio_write_sbuf() uses this too, so that its frames come out the same.
+int manio_frame_entry(struct fzp *fzp, int *frame_entries)
+{
+	if(zstd_frame_entries
+	  && (*frame_entries)++>=zstd_frame_entries)
+	{
+		if(fzp_end_frame(fzp)) return -1;
+		*frame_entries=1;
+	}
+	return 0;
+}
+
 int manio_write_sbuf(struct manio *manio, struct sbuf *sb)
 {
 	if(!manio->fzp && manio_open_next_fpath(manio)) return -1;
+	if(manio_frame_entry(manio->fzp, &manio->frame_entries)) return -1;
 	return sbuf_to_manifest(sb, manio->fzp);
 }
 
@@ -650,6 +713,7 @@ int manio_seek(struct manio *manio, man_off_t *offset)
 {
 	fzp_close(&manio->fzp);
 	if(!(manio->fzp=fzp_gzopen(offset->fpath, manio->mode))
+	  || fzp_gzbuffer(manio->fzp, gzbuffer_size)
 	  || fzp_seek(manio->fzp, offset->offset, SEEK_SET))
 		return -1;
 	man_off_t_free_content(manio->offset);
@@ -660,6 +724,24 @@ int manio_seek(struct manio *manio, man_off_t *offset)
 	return 0;
 }
 
+// Like manio_seek(), but only needs the fcount and offset from a previous
+// manio_tell(), working out the file path from them.
+int manio_seek_fcount(struct manio *manio, man_off_t *offset)
+{
+	int ret=-1;
+	man_off_t *tmp=NULL;
+	if(!(tmp=man_off_t_alloc()))
+		goto end;
+	tmp->fcount=offset->fcount?offset->fcount-1:0;
+	if(!(tmp->fpath=get_next_fpath(manio, tmp)))
+		goto end;
+	tmp->offset=offset->offset;
+	ret=manio_seek(manio, tmp);
+end:
+	man_off_t_free(&tmp);
+	return ret;
+}
+
 static int remove_trailing_files(struct manio *manio, man_off_t *offset)
 {
 	int ret=-1;
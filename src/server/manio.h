@@ -38,10 +38,15 @@ struct manio
 	int dindex_count;
 	enum protocol protocol;	// Whether running in protocol1/2 mode.
 	int phase;
+	int frame_entries;	// Entries written in the current zstd frame.
 
 	man_off_t *offset;
 };
 
+extern void manio_set_readahead(int value, unsigned int bufsize);
+extern void manio_set_zstd(int value, int frame_entries);
+extern struct fzp *manio_fzp_open_write(const char *path, const char *mode);
+
 extern struct manio *manio_open(const char *manifest, const char *mode,
 	enum protocol protocol);
 extern struct manio *manio_open_phase1(const char *manifest, const char *mode,
@@ -59,6 +64,7 @@ extern int manio_read_with_blk(struct manio *manio,
 extern int manio_read(struct manio *manio, struct sbuf *sb);
 
 extern int manio_write_sig_and_path(struct manio *manio, struct blk *blk);
+extern int manio_frame_entry(struct fzp *fzp, int *frame_entries);
 extern int manio_write_sbuf(struct manio *manio, struct sbuf *sb);
 
 extern int manio_copy_entry(struct sbuf *csb, struct sbuf *sb,
@@ -70,6 +76,7 @@ extern int manio_forward_through_sigs(struct sbuf *csb,
 extern void man_off_t_free(man_off_t **offset);
 extern man_off_t *manio_tell(struct manio *manio);
 extern int manio_seek(struct manio *manio, man_off_t *offset);
+extern int manio_seek_fcount(struct manio *manio, man_off_t *offset);
 extern int manio_close_and_truncate(struct manio **manio,
 	man_off_t *offset, int compression);
 
@@ -0,0 +1,222 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../log.h"
+#include "../sbuf.h"
+#include "../protocol2/blk.h"
+#include "manio.h"
+#include "mjoin.h"
+
+// One of the manifests being joined. When comparing protocol2 block
+// fingerprints, the blocks of an entry come after it in the manifest, so
+// the reader has to go on to the start of the next entry to find them all.
+struct mside
+{
+	struct manio *manio;
+	struct sbuf *sb;	// The current entry.
+	struct sbuf *next;	// The entry after it, if already read.
+	struct blk *blk;
+	uint8_t data[MD5_DIGEST_LENGTH];
+	int eof;
+};
+
+int mjoin_parse_compare(const char *str)
+{
+	int ret=0;
+	size_t len;
+	const char *cp;
+
+	if(!str || !*str)
+		return MJOIN_CMP_MTIME;
+	for(cp=str; *cp; cp+=len)
+	{
+		cp+=strspn(cp, ", ");
+		if(!(len=strcspn(cp, ", ")))
+			break;
+		if(len==5 && !strncmp(cp, "mtime", len))
+			ret|=MJOIN_CMP_MTIME;
+		else if(len==5 && !strncmp(cp, "ctime", len))
+			ret|=MJOIN_CMP_CTIME;
+		else if(len==4 && !strncmp(cp, "size", len))
+			ret|=MJOIN_CMP_SIZE;
+		else if(len==4 && !strncmp(cp, "data", len))
+			ret|=MJOIN_CMP_DATA;
+		else
+		{
+			logp("Unknown comparison in '%s'\n", str);
+			return -1;
+		}
+	}
+	return ret;
+}
+
+static int mside_open(struct mside *s, const char *manifest,
+	enum protocol protocol, int compare)
+{
+	if(!(s->manio=manio_open(manifest, "rb", protocol))
+	  || !(s->sb=sbuf_alloc(protocol))
+	  || !(s->next=sbuf_alloc(protocol))
+	  || sbuf_use_arena(s->sb)
+	  || sbuf_use_arena(s->next))
+		return -1;
+	if(protocol==PROTO_2
+	  && (compare & MJOIN_CMP_DATA)
+	  && !(s->blk=blk_alloc()))
+		return -1;
+	return 0;
+}
+
+static void mside_close(struct mside *s)
+{
+	manio_close(&s->manio);
+	sbuf_free(&s->sb);
+	sbuf_free(&s->next);
+	blk_free(&s->blk);
+}
+
+// Protocol2 manifests have an end of file record after the blocks of a
+// file, which comes back without a path, so skip those.
+static int mside_read(struct mside *s, struct sbuf *sb, struct blk *blk)
+{
+	while(1)
+	{
+		sbuf_free_content(sb);
+		if(blk) blk->got_save_path=0;
+		switch(manio_read_with_blk(s->manio, sb, blk, NULL))
+		{
+			case 0: break;
+			case 1: s->eof=1; return 1;
+			default: return -1;
+		}
+		if(sb->path.buf || (blk && blk->got_save_path))
+			return 0;
+	}
+}
+
+// Returns 0 if there is a new current entry, 1 if there are no more, or -1
+// on error.
+static int mside_next(struct mside *s)
+{
+	struct sbuf *tmp;
+	MD5_CTX md5;
+
+	if(s->next->path.buf)
+	{
+		tmp=s->sb;
+		s->sb=s->next;
+		s->next=tmp;
+		sbuf_free_content(s->next);
+	}
+	else
+	{
+		if(s->eof)
+			return 1;
+		switch(mside_read(s, s->sb, NULL))
+		{
+			case 0: break;
+			case 1: return 1;
+			default: return -1;
+		}
+	}
+	if(!s->blk)
+		return 0;
+
+	if(!MD5_Init(&md5))
+	{
+		logp("MD5_Init() failed in %s\n", __func__);
+		return -1;
+	}
+	while(!s->eof)
+	{
+		switch(mside_read(s, s->next, s->blk))
+		{
+			case 0: break;
+			case 1: continue;
+			default: return -1;
+		}
+		if(s->next->path.buf)
+			break;
+		MD5_Update(&md5, &s->blk->fingerprint,
+			sizeof(s->blk->fingerprint));
+		MD5_Update(&md5, s->blk->md5sum, MD5_DIGEST_LENGTH);
+	}
+	MD5_Final(s->data, &md5);
+	return 0;
+}
+
+static int changed(struct mside *s1, struct mside *s2, int compare)
+{
+	struct sbuf *a=s1->sb;
+	struct sbuf *b=s2->sb;
+
+	if((compare & MJOIN_CMP_MTIME)
+	  && a->statp.st_mtime!=b->statp.st_mtime)
+		return 1;
+	if((compare & MJOIN_CMP_CTIME)
+	  && a->statp.st_ctime!=b->statp.st_ctime)
+		return 1;
+	if((compare & MJOIN_CMP_SIZE)
+	  && a->statp.st_size!=b->statp.st_size)
+		return 1;
+	if(compare & MJOIN_CMP_DATA)
+	{
+		if(s1->blk)
+			return memcmp(s1->data, s2->data, MD5_DIGEST_LENGTH)!=0;
+		// Protocol1 keeps the size and checksum of the file data in
+		// the end of file record.
+		if(!a->endfile.buf != !b->endfile.buf)
+			return 1;
+		if(a->endfile.buf && strcmp(a->endfile.buf, b->endfile.buf))
+			return 1;
+	}
+	return 0;
+}
+
+int mjoin(const char *manifest1, const char *manifest2,
+	enum protocol protocol, int compare, mjoin_func *func, void *data)
+{
+	int ret=-1;
+	int pcmp=0;
+	int r1;
+	int r2;
+	struct mside s1;
+	struct mside s2;
+
+	memset(&s1, 0, sizeof(s1));
+	memset(&s2, 0, sizeof(s2));
+	if(mside_open(&s1, manifest1, protocol, compare)
+	  || mside_open(&s2, manifest2, protocol, compare)
+	  || (r1=mside_next(&s1))<0
+	  || (r2=mside_next(&s2))<0)
+		goto end;
+
+	while(!r1 || !r2)
+	{
+		if(!r1 && !r2)
+			pcmp=sbuf_pathcmp(s1.sb, s2.sb);
+		if(r2 || (!r1 && pcmp<0))
+		{
+			if(func(data, s1.sb, NULL, 0)
+			  || (r1=mside_next(&s1))<0)
+				goto end;
+		}
+		else if(r1 || pcmp>0)
+		{
+			if(func(data, NULL, s2.sb, 0)
+			  || (r2=mside_next(&s2))<0)
+				goto end;
+		}
+		else
+		{
+			if(func(data, s1.sb, s2.sb,
+				changed(&s1, &s2, compare))
+			  || (r1=mside_next(&s1))<0
+			  || (r2=mside_next(&s2))<0)
+				goto end;
+		}
+	}
+	ret=0;
+end:
+	mside_close(&s1);
+	mside_close(&s2);
+	return ret;
+}
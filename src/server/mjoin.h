@@ -0,0 +1,23 @@
+#ifndef _MJOIN_H
+#define _MJOIN_H
+
+// Walks two manifests side by side, in path order, like a merge join.
+
+// What to compare when a path is in both manifests.
+#define MJOIN_CMP_MTIME		0x01
+#define MJOIN_CMP_CTIME		0x02
+#define MJOIN_CMP_SIZE		0x04
+// Protocol1 file checksums, or protocol2 block fingerprints.
+#define MJOIN_CMP_DATA		0x08
+
+// Called once for each path, in order. sb1 or sb2 is NULL when the path is
+// only in one of the manifests. When it is in both, changed says whether
+// they differ in the things being compared.
+typedef int mjoin_func(void *data,
+	struct sbuf *sb1, struct sbuf *sb2, int changed);
+
+extern int mjoin_parse_compare(const char *str);
+extern int mjoin(const char *manifest1, const char *manifest2,
+	enum protocol protocol, int compare, mjoin_func *func, void *data);
+
+#endif
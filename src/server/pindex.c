@@ -0,0 +1,506 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../fsops.h"
+#include "../fzp.h"
+#include "../log.h"
+#include "../pathcmp.h"
+#include "../prepend.h"
+#include "../sbuf.h"
+#include "manio.h"
+#include "pindex.h"
+
+#define PINDEX_MAGIC	"PIDX0001"
+#define PINDEX_RUN_MAX	256
+
+static uint32_t trigram(const char *s)
+{
+	return ((uint32_t)(uint8_t)s[0]<<16)
+		|((uint32_t)(uint8_t)s[1]<<8)
+		|(uint32_t)(uint8_t)s[2];
+}
+
+static uint32_t bloom_hash1(uint32_t t)
+{
+	return (t*2654435761U)>>18;
+}
+
+static uint32_t bloom_hash2(uint32_t t)
+{
+	return ((t^0x5bd1e995)*2246822519U)>>18;
+}
+
+static void bloom_add(uint8_t *bloom, uint32_t t)
+{
+	uint32_t h1=bloom_hash1(t);
+	uint32_t h2=bloom_hash2(t);
+	bloom[h1>>3]|=1<<(h1&7);
+	bloom[h2>>3]|=1<<(h2&7);
+}
+
+static int bloom_test(const uint8_t *bloom, uint32_t t)
+{
+	uint32_t h1=bloom_hash1(t);
+	uint32_t h2=bloom_hash2(t);
+	return (bloom[h1>>3] & (1<<(h1&7)))
+	  && (bloom[h2>>3] & (1<<(h2&7)));
+}
+
+static void bloom_add_path(uint8_t *bloom, const char *path)
+{
+	size_t i;
+	size_t len=strlen(path);
+	for(i=0; i+2<len; i++)
+		bloom_add(bloom, trigram(path+i));
+}
+
+static void put_u64(uint8_t *buf, uint64_t val)
+{
+	int i;
+	for(i=7; i>=0; i--)
+	{
+		buf[i]=val&0xFF;
+		val>>=8;
+	}
+}
+
+static uint64_t get_u64(const uint8_t *buf)
+{
+	int i;
+	uint64_t ret=0;
+	for(i=0; i<8; i++)
+		ret=(ret<<8)|buf[i];
+	return ret;
+}
+
+static int write_region(struct fzp *fzp, struct pregion *r)
+{
+	uint8_t buf[24];
+	size_t len=r->first?strlen(r->first):0;
+	put_u64(buf, r->fcount);
+	put_u64(buf+8, r->offset);
+	put_u64(buf+16, len);
+	if(fzp_write(fzp, buf, sizeof(buf))!=sizeof(buf)
+	  || (len && fzp_write(fzp, r->first, len)!=len)
+	  || fzp_write(fzp, r->bloom, sizeof(r->bloom))!=sizeof(r->bloom))
+	{
+		logp("Could not write path index region\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void pregion_reset(struct pregion *r)
+{
+	free_w(&r->first);
+	memset(r, 0, sizeof(*r));
+}
+
+int pindex_build(const char *manifest, const char *path,
+	enum protocol protocol)
+{
+	int ret=-1;
+	uint32_t n=0;
+	uint64_t regions=0;
+	uint8_t buf[16];
+	char *tmp=NULL;
+	struct fzp *fzp=NULL;
+	struct sbuf *sb=NULL;
+	struct manio *manio=NULL;
+	man_off_t *offset=NULL;
+	struct pregion r;
+
+	memset(&r, 0, sizeof(r));
+	if(!(tmp=prepend(path, ".tmp"))
+	  || !(manio=manio_open(manifest, "rb", protocol))
+	  || !(sb=sbuf_alloc(protocol))
+	  || sbuf_use_arena(sb)
+	  || !(fzp=fzp_open(tmp, "wb")))
+		goto end;
+
+	memcpy(buf, PINDEX_MAGIC, 8);
+	put_u64(buf+8, PINDEX_REGION);
+	if(fzp_write(fzp, buf, sizeof(buf))!=sizeof(buf))
+		goto end;
+
+	// The first region starts at the beginning, which is left as zeros.
+	while(1)
+	{
+		if(n==PINDEX_REGION)
+		{
+			if(write_region(fzp, &r)
+			  || !(offset=manio_tell(manio)))
+				goto end;
+			pregion_reset(&r);
+			r.fcount=offset->fcount;
+			r.offset=offset->offset;
+			man_off_t_free(&offset);
+			regions++;
+			n=0;
+		}
+		sbuf_free_content(sb);
+		switch(manio_read(manio, sb))
+		{
+			case 0: break;
+			case 1: goto done;
+			default: goto end;
+		}
+		n++;
+		if(!sb->path.buf)
+			continue;
+		if(!r.first && !(r.first=strdup_w(sb->path.buf, __func__)))
+			goto end;
+		bloom_add_path(r.bloom, sb->path.buf);
+	}
+done:
+	if(n)
+	{
+		if(write_region(fzp, &r))
+			goto end;
+		regions++;
+	}
+	if(fzp_close(&fzp)
+	  || do_rename(tmp, path))
+		goto end;
+	logp("Path index has %" PRIu64 " regions\n", regions);
+	ret=0;
+end:
+	if(ret)
+	{
+		logp("Could not build path index %s\n", path);
+		fzp_close(&fzp);
+		if(tmp) unlink(tmp);
+	}
+	pregion_reset(&r);
+	man_off_t_free(&offset);
+	manio_close(&manio);
+	sbuf_free(&sb);
+	free_w(&tmp);
+	return ret;
+}
+
+static int add_trigram(struct pindex *p, uint32_t t)
+{
+	uint32_t *tmp;
+	if(!(tmp=(uint32_t *)realloc_w(p->trigrams,
+		(p->tcount+1)*sizeof(uint32_t), __func__)))
+			return -1;
+	p->trigrams=tmp;
+	p->trigrams[p->tcount++]=t;
+	return 0;
+}
+
+static int flush_run(struct pindex *p, char *run, size_t *rlen)
+{
+	size_t i;
+	for(i=0; i+2<*rlen; i++)
+		if(add_trigram(p, trigram(run+i)))
+			return -1;
+	*rlen=0;
+	return 0;
+}
+
+static const char *skip_bracket(const char *cp)
+{
+	char t;
+	cp++;
+	if(*cp=='^') cp++;
+	if(*cp==']') cp++;
+	while(*cp && *cp!=']')
+	{
+		if(*cp=='['
+		  && (cp[1]==':' || cp[1]=='=' || cp[1]=='.'))
+		{
+			t=cp[1];
+			cp+=2;
+			while(*cp && !(*cp==t && cp[1]==']'))
+				cp++;
+			if(*cp) cp+=2;
+			continue;
+		}
+		cp++;
+	}
+	return *cp?cp+1:cp;
+}
+
+static const char *skip_group(const char *cp)
+{
+	int depth=0;
+	while(*cp)
+	{
+		switch(*cp)
+		{
+			case '\\':
+				cp+=cp[1]?2:1;
+				continue;
+			case '[':
+				cp=skip_bracket(cp);
+				continue;
+			case '(':
+				depth++;
+				break;
+			case ')':
+				if(!--depth) return cp+1;
+				break;
+		}
+		cp++;
+	}
+	return cp;
+}
+
+static const char *skip_quantifier(const char *cp)
+{
+	while(*cp=='*' || *cp=='+' || *cp=='?' || *cp=='{')
+	{
+		if(*cp=='{')
+		{
+			while(*cp && *cp!='}') cp++;
+			if(!*cp) break;
+		}
+		cp++;
+	}
+	return cp;
+}
+
+// Whether the quantifiers at cp can let the thing before them match
+// nothing. Only a '+' on its own cannot, and stacked ones like "+?" or "+*"
+// are taken as optional.
+static int is_optional(const char *cp)
+{
+	for(; *cp=='*' || *cp=='+' || *cp=='?' || *cp=='{'; cp++)
+		if(*cp!='+') return 1;
+	return 0;
+}
+
+static int has_alternation(const char *cp)
+{
+	int depth=0;
+	while(*cp)
+	{
+		switch(*cp)
+		{
+			case '\\':
+				cp+=cp[1]?2:1;
+				continue;
+			case '[':
+				cp=skip_bracket(cp);
+				continue;
+			case '(': depth++; break;
+			case ')': depth--; break;
+			case '|': if(!depth) return 1; break;
+		}
+		cp++;
+	}
+	return 0;
+}
+
+// Work out the trigrams that anything matching the regex has to contain,
+// from the runs of plain characters in it. Anything awkward just ends the
+// current run, so the result may be less than it could be, but never
+// wrong.
+static int regex_trigrams(struct pindex *p, const char *regex)
+{
+	char c;
+	size_t rlen=0;
+	const char *cp=regex;
+	char run[PINDEX_RUN_MAX];
+
+	if(has_alternation(regex))
+		return 0;
+	while(*cp)
+	{
+		switch(*cp)
+		{
+			case '[':
+				cp=skip_quantifier(skip_bracket(cp));
+				break;
+			case '(':
+				cp=skip_quantifier(skip_group(cp));
+				break;
+			case '.':
+			case '^':
+			case '$':
+			case ')':
+			case '*':
+			case '+':
+			case '?':
+			case '{':
+				cp=skip_quantifier(cp+1);
+				break;
+			case '\\':
+				if(!cp[1] || isalnum((uint8_t)cp[1]))
+				{
+					cp=skip_quantifier(cp+(cp[1]?2:1));
+					break;
+				}
+				cp++;
+				// Fall through.
+			default:
+				c=*cp++;
+				if(is_optional(cp))
+					break;
+				if(rlen==sizeof(run))
+				{
+					if(flush_run(p, run, &rlen))
+						return -1;
+					// Carry on from the end of the run.
+					run[0]=run[sizeof(run)-2];
+					run[1]=run[sizeof(run)-1];
+					rlen=2;
+				}
+				run[rlen++]=c;
+				if(*cp!='+')
+					continue;
+				break;
+		}
+		if(flush_run(p, run, &rlen))
+			return -1;
+	}
+	return flush_run(p, run, &rlen);
+}
+
+static int load_regions(struct pindex *p, struct fzp *fzp)
+{
+	size_t len;
+	uint8_t buf[24];
+	struct pregion *r;
+	struct pregion *tmp;
+
+	if(fzp_read(fzp, buf, 16)!=16
+	  || memcmp(buf, PINDEX_MAGIC, 8))
+		return -1;
+	p->region_entries=(uint32_t)get_u64(buf+8);
+	while(1)
+	{
+		switch(fzp_read(fzp, buf, sizeof(buf)))
+		{
+			case 0: return p->count?0:-1;
+			case sizeof(buf): break;
+			default: return -1;
+		}
+		if(!(tmp=(struct pregion *)realloc_w(p->regions,
+			(p->count+1)*sizeof(struct pregion), __func__)))
+				return -1;
+		p->regions=tmp;
+		r=&p->regions[p->count];
+		memset(r, 0, sizeof(*r));
+		p->count++;
+		r->fcount=get_u64(buf);
+		r->offset=get_u64(buf+8);
+		len=(size_t)get_u64(buf+16);
+		if(len>fs_full_path_max+fs_name_max+4096
+		  || !(r->first=(char *)malloc_w(len+1, __func__))
+		  || (len && fzp_read_ensure(fzp, r->first, len, __func__))
+		  || fzp_read_ensure(fzp, r->bloom,
+			sizeof(r->bloom), __func__))
+				return -1;
+		r->first[len]='\0';
+	}
+}
+
+struct pindex *pindex_open(const char *path,
+	const char *regex, const char *browsedir)
+{
+	struct stat statp;
+	struct fzp *fzp=NULL;
+	struct pindex *p=NULL;
+
+	if(lstat(path, &statp))
+		return NULL;
+	if(!(p=(struct pindex *)calloc_w(1, sizeof(struct pindex), __func__))
+	  || !(fzp=fzp_open(path, "rb"))
+	  || load_regions(p, fzp)
+	  || (regex && regex_trigrams(p, regex)))
+	{
+		logp("Could not load path index %s\n", path);
+		fzp_close(&fzp);
+		pindex_free(&p);
+		return NULL;
+	}
+	fzp_close(&fzp);
+	if(browsedir)
+	{
+		p->browsedir=browsedir;
+		p->bdlen=strlen(browsedir);
+	}
+	return p;
+}
+
+void pindex_free(struct pindex **pindex)
+{
+	size_t i;
+	if(!pindex || !*pindex) return;
+	for(i=0; i<(*pindex)->count; i++)
+		free_w(&(*pindex)->regions[i].first);
+	free_v((void **)&(*pindex)->regions);
+	free_v((void **)&(*pindex)->trigrams);
+	free_v((void **)pindex);
+}
+
+// Paths under the browse directory come in one block, because a slash
+// sorts before everything else.
+static int beyond_browsedir(struct pindex *p, const char *path)
+{
+	if(pathcmp(path, p->browsedir)<=0)
+		return 0;
+	if(strncmp(p->browsedir, path, p->bdlen))
+		return 1;
+	return p->browsedir[p->bdlen-1]!='/'
+		&& path[p->bdlen] && path[p->bdlen]!='/';
+}
+
+// Returns 0 if the region cannot match, 1 if it might, or -1 if neither it
+// nor any later region can.
+static int region_may_match(struct pindex *p, size_t i)
+{
+	size_t t;
+	struct pregion *r=&p->regions[i];
+
+	if(p->bdlen)
+	{
+		if(r->first && beyond_browsedir(p, r->first))
+			return -1;
+		if(i+1<p->count
+		  && p->regions[i+1].first
+		  && pathcmp(p->regions[i+1].first, p->browsedir)<0)
+			return 0;
+	}
+	for(t=0; t<p->tcount; t++)
+		if(!bloom_test(r->bloom, p->trigrams[t]))
+			return 0;
+	return 1;
+}
+
+int pindex_read(struct pindex *p, struct manio *manio, struct sbuf *sb)
+{
+	int r;
+	size_t i;
+	man_off_t offset;
+
+	if(!p->left)
+	{
+		for(i=p->started?p->region+1:0; i<p->count; i++)
+		{
+			if((r=region_may_match(p, i))<0)
+				return 1;
+			if(r)
+				break;
+			p->skipped++;
+		}
+		if(i>=p->count)
+			return 1;
+		if(i && (!p->started || i!=p->region+1))
+		{
+			// Not carrying on from the previous region.
+			memset(&offset, 0, sizeof(offset));
+			offset.fcount=p->regions[i].fcount;
+			offset.offset=p->regions[i].offset;
+			if(manio_seek_fcount(manio, &offset))
+				return -1;
+		}
+		p->region=i;
+		p->left=p->region_entries;
+		p->started=1;
+	}
+	p->left--;
+	return manio_read(manio, sb);
+}
@@ -0,0 +1,53 @@
+#ifndef _PINDEX_H
+#define _PINDEX_H
+
+#include "manio.h"
+
+// A path index for a manifest. The manifest is split into regions of a
+// fixed number of entries, and the index records where each region starts,
+// its first path, and a bloom filter of the trigrams in its paths. This is
+// enough to skip regions that cannot match a list regex or browse
+// directory.
+
+#define PINDEX_REGION		1024
+#define PINDEX_BLOOM_BITS	16384
+
+struct pregion
+{
+	uint64_t fcount;
+	uint64_t offset;
+	char *first;
+	uint8_t bloom[PINDEX_BLOOM_BITS/8];
+};
+
+struct pindex
+{
+	struct pregion *regions;
+	size_t count;
+	uint32_t region_entries;
+
+	// What the current query needs.
+	uint32_t *trigrams;
+	size_t tcount;
+	const char *browsedir;
+	size_t bdlen;
+
+	// Where reading has got to.
+	size_t region;
+	uint32_t left;
+	int started;
+	uint64_t skipped;
+};
+
+extern int pindex_build(const char *manifest, const char *path,
+	enum protocol protocol);
+
+extern struct pindex *pindex_open(const char *path,
+	const char *regex, const char *browsedir);
+extern void pindex_free(struct pindex **pindex);
+
+// Like manio_read(), but skips the regions that cannot match.
+extern int pindex_read(struct pindex *pindex,
+	struct manio *manio, struct sbuf *sb);
+
+#endif
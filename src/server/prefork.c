@@ -0,0 +1,142 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../fsops.h"
+#include "../log.h"
+#include "prefork.h"
+
+// Children that are waiting for a connection, newest first.
+static struct prefork *pool=NULL;
+
+// Pass an accepted connection, and who it came from, down to a child.
+int prefork_send(int ctl, int fd, struct sockaddr_storage *addr)
+{
+	ssize_t w;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base=addr;
+	iov.iov_len=sizeof(*addr);
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=control;
+	msg.msg_controllen=sizeof(control);
+	cmsg=CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level=SOL_SOCKET;
+	cmsg->cmsg_type=SCM_RIGHTS;
+	cmsg->cmsg_len=CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	while((w=sendmsg(ctl, &msg, 0))<0 && errno==EINTR) { }
+	if(w!=(ssize_t)sizeof(*addr))
+	{
+		logp("sendmsg failed in %s: %s\n", __func__,
+			w<0?strerror(errno):"short write");
+		return -1;
+	}
+	return 0;
+}
+
+// Wait for the parent to give us a connection. Returns 1 if the parent
+// closed its end instead, which means that we are no longer wanted.
+int prefork_recv(int ctl, int *fd, struct sockaddr_storage *addr)
+{
+	ssize_t r;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base=addr;
+	iov.iov_len=sizeof(*addr);
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=control;
+	msg.msg_controllen=sizeof(control);
+
+	while((r=recvmsg(ctl, &msg, 0))<0 && errno==EINTR) { }
+	if(!r) return 1;
+	if(r!=(ssize_t)sizeof(*addr))
+	{
+		logp("recvmsg failed in %s: %s\n", __func__,
+			r<0?strerror(errno):"short read");
+		return -1;
+	}
+	if(!(cmsg=CMSG_FIRSTHDR(&msg))
+	  || cmsg->cmsg_level!=SOL_SOCKET
+	  || cmsg->cmsg_type!=SCM_RIGHTS
+	  || cmsg->cmsg_len!=CMSG_LEN(sizeof(int)))
+	{
+		logp("No descriptor received in %s\n", __func__);
+		return -1;
+	}
+	memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	return 0;
+}
+
+int prefork_add(pid_t pid, int ctl, int pipe_rfd)
+{
+	struct prefork *p;
+	if(!(p=(struct prefork *)calloc_w(1, sizeof(struct prefork), __func__)))
+		return -1;
+	p->pid=pid;
+	p->ctl=ctl;
+	p->pipe_rfd=pipe_rfd;
+	p->next=pool;
+	pool=p;
+	return 0;
+}
+
+// The caller owns the result, and should prefork_close() it when done.
+struct prefork *prefork_take(void)
+{
+	struct prefork *p;
+	if(!(p=pool)) return NULL;
+	pool=p->next;
+	p->next=NULL;
+	return p;
+}
+
+// Closing ctl tells a child that is still waiting to exit.
+void prefork_close(struct prefork **p)
+{
+	if(!p || !*p) return;
+	close_fd(&(*p)->ctl);
+	close_fd(&(*p)->pipe_rfd);
+	free_v((void **)p);
+}
+
+// Returns 1 if pid was one of the waiting children.
+int prefork_forget(pid_t pid)
+{
+	struct prefork **p;
+	for(p=&pool; *p; p=&(*p)->next)
+	{
+		struct prefork *f;
+		if((*p)->pid!=pid) continue;
+		f=*p;
+		*p=f->next;
+		prefork_close(&f);
+		return 1;
+	}
+	return 0;
+}
+
+int prefork_count(void)
+{
+	int count=0;
+	struct prefork *p;
+	for(p=pool; p; p=p->next) count++;
+	return count;
+}
+
+void prefork_free_all(void)
+{
+	struct prefork *p;
+	while((p=prefork_take()))
+		prefork_close(&p);
+}
@@ -0,0 +1,24 @@
+#ifndef _PREFORK_H
+#define _PREFORK_H
+
+// A child that has been forked ahead of time and is waiting to be handed
+// a connection.
+struct prefork
+{
+	pid_t pid;
+	int ctl;	// Parent end of the socket that the connection is sent on.
+	int pipe_rfd;	// Read end of the pipe from the child.
+	struct prefork *next;
+};
+
+extern int prefork_send(int ctl, int fd, struct sockaddr_storage *addr);
+extern int prefork_recv(int ctl, int *fd, struct sockaddr_storage *addr);
+
+extern int prefork_add(pid_t pid, int ctl, int pipe_rfd);
+extern struct prefork *prefork_take(void);
+extern void prefork_close(struct prefork **p);
+extern int prefork_forget(pid_t pid);
+extern int prefork_count(void);
+extern void prefork_free_all(void);
+
+#endif
@@ -11,6 +11,7 @@
 #include "../../handy.h"
 #include "../../iobuf.h"
 #include "../../log.h"
+#include "../../prepend.h"
 #include "../../sbuf.h"
 #include "../child.h"
 #include "../compress.h"
@@ -20,6 +21,170 @@
 
 static size_t treepathlen=0;
 
+// Most files that can have finished and be waiting for an earlier one before
+// no more are asked for.
+#define STREAMS_MAX_PENDING	10000
+
+// When the client has several streams, a big file on one of them does not
+// hold up the others. The changed manifest still has to be written in the
+// order that the files were asked for, so finished files wait on the
+// pending list until everything that was asked for before them has finished
+// too.
+struct streams
+{
+	int count;
+	int send; // The stream that the client was last told about.
+	int recv; // The stream that the client last told us about.
+	int sending; // The stream of the file being asked for, or -1.
+	struct sbuf **busy; // What each stream is receiving, or NULL.
+	char **deltmppath;
+	struct sbuf *pending;
+	struct sbuf *pending_tail;
+	int pending_count;
+};
+
+static void streams_free(struct streams **streams)
+{
+	int i;
+	struct sbuf *sb;
+	if(!streams || !*streams) return;
+	for(i=0; (*streams)->deltmppath && i<(*streams)->count; i++)
+	{
+		if(!(*streams)->deltmppath[i]) continue;
+		unlink((*streams)->deltmppath[i]);
+		free_w(&(*streams)->deltmppath[i]);
+	}
+	while((sb=(*streams)->pending))
+	{
+		(*streams)->pending=sb->next;
+		sbuf_free(&sb);
+	}
+	free_v((void **)&(*streams)->busy);
+	free_v((void **)&(*streams)->deltmppath);
+	free_v((void **)streams);
+}
+
+static struct streams *streams_alloc(int count, struct sdirs *sdirs)
+{
+	int i;
+	char tmp[16];
+	struct streams *streams=NULL;
+	if(!(streams=(struct streams *)calloc_w(1,
+		sizeof(struct streams), __func__))
+	  || !(streams->busy=(struct sbuf **)calloc_w(count,
+		sizeof(struct sbuf *), __func__))
+	  || !(streams->deltmppath=(char **)calloc_w(count,
+		sizeof(char *), __func__)))
+			goto error;
+	streams->count=count;
+	streams->send=-1;
+	streams->recv=-1;
+	streams->sending=-1;
+	for(i=0; i<count; i++)
+	{
+		snprintf(tmp, sizeof(tmp), ".%d", i);
+		if(!(streams->deltmppath[i]=prepend(sdirs->deltmppath, tmp)))
+			goto error;
+	}
+	return streams;
+error:
+	streams_free(&streams);
+	return NULL;
+}
+
+static int streams_is_busy(struct streams *streams, struct sbuf *sb)
+{
+	int i;
+	for(i=0; i<streams->count; i++)
+		if(streams->busy[i]==sb) return 1;
+	return 0;
+}
+
+// Returns -1 if nothing else can be asked for at the moment.
+static int streams_get_free(struct streams *streams)
+{
+	int i;
+	if(streams->pending_count>=STREAMS_MAX_PENDING) return -1;
+	for(i=0; i<streams->count; i++)
+		if(!streams->busy[i]) return i;
+	return -1;
+}
+
+// Whether the next thing to be sent has to wait for a stream.
+static int streams_blocked(struct streams *streams, struct sbuf *p1b)
+{
+	return streams->sending<0
+	  && (p1b->flags & SBUF_SEND_PATH)
+	  && streams_get_free(streams)<0;
+}
+
+// Returns 1 if the client could not be told which stream is next.
+static int streams_start(struct asfd *asfd, struct streams *streams)
+{
+	int s;
+	char tmp[16];
+	struct sbuf *sb;
+	struct iobuf wbuf;
+
+	if((s=streams_get_free(streams))<0)
+		return 1;
+	if(streams->send!=s)
+	{
+		snprintf(tmp, sizeof(tmp), "%d", s);
+		iobuf_from_str(&wbuf, CMD_STREAM, tmp);
+		switch(asfd->append_all_to_write_buffer(asfd, &wbuf))
+		{
+			case APPEND_OK: break;
+			case APPEND_BLOCKED: return 1;
+			default: return -1;
+		}
+		streams->send=s;
+	}
+	if(!(sb=sbuf_alloc(PROTO_1)))
+		return -1;
+	if(streams->pending_tail)
+		streams->pending_tail->next=sb;
+	else
+		streams->pending=sb;
+	streams->pending_tail=sb;
+	streams->pending_count++;
+	streams->busy[s]=sb;
+	streams->sending=s;
+	return 0;
+}
+
+static int streams_set_recv(struct streams *streams, struct iobuf *rbuf)
+{
+	int s=atoi(rbuf->buf);
+	if(s<0 || s>=streams->count)
+	{
+		iobuf_log_unexpected(rbuf, __func__);
+		return -1;
+	}
+	streams->recv=s;
+	return 0;
+}
+
+// The stream that the client is sending on has finished with its file.
+// Write out whatever is now at the front of the queue.
+static int streams_done(struct streams *streams, struct manio *chmanio)
+{
+	struct sbuf *sb;
+	streams->busy[streams->recv]=NULL;
+	while((sb=streams->pending)
+	  && !streams_is_busy(streams, sb))
+	{
+		// An interrupted file has had its path freed.
+		if(sb->path.buf && manio_write_sbuf(chmanio, sb))
+			return -1;
+		if(!(streams->pending=sb->next))
+			streams->pending_tail=NULL;
+		streams->pending_count--;
+		sbuf_free(&sb);
+	}
+	return 0;
+}
+
 static int path_length_warn(struct iobuf *path, struct conf **cconfs)
 {
 	if(get_int(cconfs[OPT_PATH_LENGTH_WARN]))
@@ -388,9 +553,20 @@ static int maybe_process_file(struct asfd *asfd,
 // Return 1 if there is still stuff needing to be sent.
 // FIX THIS: lots of repeated code.
 static int do_stuff_to_send(struct asfd *asfd,
-	struct sbuf *p1b, char **last_requested)
+	struct sbuf *p1b, char **last_requested, struct streams *streams)
 {
 	static struct iobuf wbuf;
+	if(streams
+	  && streams->sending<0
+	  && (p1b->flags & SBUF_SEND_PATH))
+	{
+		switch(streams_start(asfd, streams))
+		{
+			case 0: break;
+			case 1: return 1;
+			default: return -1;
+		}
+	}
 	if(p1b->flags & SBUF_SEND_DATAPTH)
 	{
 		iobuf_copy(&wbuf, &p1b->protocol1->datapth);
@@ -404,6 +580,8 @@ static int do_stuff_to_send(struct asfd *asfd,
 	}
 	if(p1b->flags & SBUF_SEND_STAT)
 	{
+		if(attribs_for_peer(p1b))
+			return -1;
 		iobuf_copy(&wbuf, &p1b->attr);
 		switch(asfd->append_all_to_write_buffer(asfd, &wbuf))
 		{
@@ -423,9 +601,12 @@ static int do_stuff_to_send(struct asfd *asfd,
 			default: return -1;
 		}
 		p1b->flags &= ~SBUF_SEND_PATH;
-		free_w(last_requested);
-		if(!(*last_requested=strdup_w(p1b->path.buf, __func__)))
-			return -1;
+		if(!streams)
+		{
+			free_w(last_requested);
+			if(!(*last_requested=strdup_w(p1b->path.buf,
+				__func__))) return -1;
+		}
 	}
 	if(p1b->protocol1->sigjob && !(p1b->flags & SBUF_SEND_ENDOFSIG))
 	{
@@ -458,21 +639,29 @@ static int do_stuff_to_send(struct asfd *asfd,
 		}
 		p1b->flags &= ~SBUF_SEND_ENDOFSIG;
 	}
+	if(streams) streams->sending=-1;
 	return 0;
 }
 
-static int start_to_receive_delta(struct sdirs *sdirs, struct conf **cconfs,
-	struct sbuf *rb)
+static const char *get_deltmppath(struct sdirs *sdirs,
+	struct streams *streams)
+{
+	if(streams) return streams->deltmppath[streams->recv];
+	return sdirs->deltmppath;
+}
+
+static int start_to_receive_delta(const char *deltmppath,
+	struct conf **cconfs, struct sbuf *rb)
 {
 	if(rb->compression)
 	{
-		if(!(rb->protocol1->fzp=fzp_gzopen(sdirs->deltmppath,
-			comp_level(rb->compression))))
+		if(!(rb->protocol1->fzp=compress_open_data(deltmppath,
+			rb->compression)))
 				return -1;
 	}
 	else
 	{
-		if(!(rb->protocol1->fzp=fzp_open(sdirs->deltmppath, "wb")))
+		if(!(rb->protocol1->fzp=fzp_open(deltmppath, "wb")))
 			return -1;
 	}
 	rb->flags |= SBUF_RECV_DELTA;
@@ -480,7 +669,8 @@ static int start_to_receive_delta(struct sdirs *sdirs, struct conf **cconfs,
 	return 0;
 }
 
-static int finish_delta(struct sdirs *sdirs, struct sbuf *rb)
+static int finish_delta(struct sdirs *sdirs, const char *deltmppath,
+	struct sbuf *rb)
 {
 	int ret=0;
 	char *deltmp=NULL;
@@ -490,7 +680,7 @@ static int finish_delta(struct sdirs *sdirs, struct sbuf *rb)
 	  || mkpath(&delpath, sdirs->working)
 	// Rename race condition is of no consequence here, as delpath will
 	// just get recreated.
-	  || do_rename(sdirs->deltmppath, delpath))
+	  || do_rename(deltmppath, delpath))
 		ret=-1;
 	free_w(&delpath);
 	free_w(&deltmp);
@@ -499,7 +689,7 @@ static int finish_delta(struct sdirs *sdirs, struct sbuf *rb)
 
 static int deal_with_receive_end_file(struct asfd *asfd, struct sdirs *sdirs,
 	struct sbuf *rb, struct manio *chmanio, struct conf **cconfs,
-	char **last_requested)
+	char **last_requested, struct streams *streams)
 {
 	int ret=-1;
 	static char *cp=NULL;
@@ -515,10 +705,12 @@ static int deal_with_receive_end_file(struct asfd *asfd, struct sdirs *sdirs,
 		goto end;
 	}
 	iobuf_move(&rb->endfile, rbuf);
-	if(rb->flags & SBUF_RECV_DELTA && finish_delta(sdirs, rb))
+	if(rb->flags & SBUF_RECV_DELTA
+	  && finish_delta(sdirs, get_deltmppath(sdirs, streams), rb))
 		goto end;
 
-	if(manio_write_sbuf(chmanio, rb))
+	// With streams, it goes on the changed manifest when its turn comes.
+	if(!streams && manio_write_sbuf(chmanio, rb))
 		goto end;
 
 	if(rb->flags & SBUF_RECV_DELTA)
@@ -537,6 +729,8 @@ static int deal_with_receive_end_file(struct asfd *asfd, struct sdirs *sdirs,
 		// checksum stuff goes here
 	}
 
+	if(streams) return streams_done(streams, chmanio);
+
 	ret=0;
 end:
 	sbuf_free_content(rb);
@@ -563,14 +757,16 @@ static int deal_with_receive_append(struct asfd *asfd, struct sbuf *rb,
 
 static int deal_with_filedata(struct asfd *asfd,
 	struct sdirs *sdirs, struct sbuf *rb,
-	struct iobuf *rbuf, struct dpth *dpth, struct conf **cconfs)
+	struct iobuf *rbuf, struct dpth *dpth, struct conf **cconfs,
+	struct streams *streams)
 {
 	iobuf_move(&rb->path, rbuf);
 
 	if(rb->protocol1->datapth.buf)
 	{
 		// Receiving a delta.
-		if(start_to_receive_delta(sdirs, cconfs, rb))
+		if(start_to_receive_delta(get_deltmppath(sdirs, streams),
+			cconfs, rb))
 		{
 			logp("error in start_to_receive_delta\n");
 			return -1;
@@ -591,13 +787,15 @@ static int deal_with_filedata(struct asfd *asfd,
 static int do_stuff_to_receive(struct asfd *asfd,
 	struct sdirs *sdirs, struct conf **cconfs,
 	struct sbuf *rb, struct manio *chmanio,
-	struct dpth *dpth, char **last_requested)
+	struct dpth *dpth, char **last_requested,
+	struct streams *streams, int quick)
 {
 	struct iobuf *rbuf=asfd->rbuf;
 
 	iobuf_free_content(rbuf);
 	// This also attempts to write anything in the write buffer.
-	if(asfd->as->read_write(asfd->as))
+	// Do not wait around if there is something else to get on with.
+	if(quick?asfd->as->read_quick(asfd->as):asfd->as->read_write(asfd->as))
 	{
 		logp("error in %s\n", __func__);
 		return -1;
@@ -614,6 +812,26 @@ static int do_stuff_to_receive(struct asfd *asfd,
 		return 0;
 	}
 
+	if(streams)
+	{
+		if(rbuf->cmd==CMD_STREAM)
+			return streams_set_recv(streams, rbuf);
+		if(rbuf->cmd==CMD_GEN
+		  && !strcmp(rbuf->buf, "okbackupphase2end"))
+		{
+			if(!streams->pending) goto end_phase2;
+			logp("Client finished with files still in progress\n");
+			goto error;
+		}
+		// Everything else is about the file on the current stream.
+		if(streams->recv<0
+		  || !(rb=streams->busy[streams->recv]))
+		{
+			iobuf_log_unexpected(rbuf, __func__);
+			goto error;
+		}
+	}
+
 	if(rb->protocol1->fzp)
 	{
 		// Currently writing a file (or meta data)
@@ -625,7 +843,8 @@ static int do_stuff_to_receive(struct asfd *asfd,
 				return 0;
 			case CMD_END_FILE:
 				if(deal_with_receive_end_file(asfd, sdirs, rb,
-					chmanio, cconfs, last_requested))
+					chmanio, cconfs, last_requested,
+					streams))
 						goto error;
 				return 0;
 			default:
@@ -654,6 +873,11 @@ static int do_stuff_to_receive(struct asfd *asfd,
 			// file if it matches. Otherwise, we can get
 			// stuck on the select in the async stuff,
 			// waiting for something that will never arrive.
+			if(streams)
+			{
+				sbuf_free_content(rb);
+				return streams_done(streams, chmanio);
+			}
 			if(*last_requested
 			  && !strcmp(rbuf->buf, *last_requested))
 				free_w(last_requested);
@@ -664,8 +888,9 @@ static int do_stuff_to_receive(struct asfd *asfd,
 	if(iobuf_is_filedata(rbuf)
 	  || iobuf_is_vssdata(rbuf))
 	{
-		if(deal_with_filedata(asfd, sdirs, rb, rbuf, dpth, cconfs))
-			goto error;
+		if(deal_with_filedata(asfd, sdirs, rb, rbuf, dpth, cconfs,
+			streams))
+				goto error;
 		return 0;
 	}
 	iobuf_log_unexpected(rbuf, __func__);
@@ -772,6 +997,7 @@ int backup_phase2_server_protocol1(struct async *as, struct sdirs *sdirs,
 	struct sbuf *p1b=NULL; // file list from client
 	struct sbuf *rb=NULL; // receiving file from client
 	struct asfd *asfd=NULL;
+	struct streams *streams=NULL;
 	int breaking=0;
 	int breakcount=0;
 	struct cntr *cntr=NULL;
@@ -846,6 +1072,15 @@ int backup_phase2_server_protocol1(struct async *as, struct sdirs *sdirs,
 	  || !(chmanio=manio_open_phase2(sdirs->changed, "ab", PROTO_1)))
 		goto error;
 
+	if(get_int(cconfs[OPT_BACKUP_STREAMS])>1)
+	{
+		if(!(streams=streams_alloc(get_int(cconfs[OPT_BACKUP_STREAMS]),
+			sdirs)))
+				goto error;
+		logp("Client is sending up to %d files at once\n",
+			streams->count);
+	}
+
 	while(1)
 	{
 		if(breaking && breakcount--==0)
@@ -854,12 +1089,17 @@ int backup_phase2_server_protocol1(struct async *as, struct sdirs *sdirs,
 		if(write_status(CNTR_STATUS_BACKUP,
 			rb->path.buf?rb->path.buf:p1b->path.buf, cntr))
 				goto error;
-		if(last_requested
+		if((streams?streams->pending!=NULL:last_requested!=NULL)
 		  || !p1manio
 		  || asfd->writebuflen)
 		{
+			int quick=streams
+			  && p1manio
+			  && !asfd->writebuflen
+			  && !streams_blocked(streams, p1b);
 			switch(do_stuff_to_receive(asfd, sdirs,
-				cconfs, rb, chmanio, dpth, &last_requested))
+				cconfs, rb, chmanio, dpth, &last_requested,
+				streams, quick))
 			{
 				case 0: break;
 				case 1: goto end; // Finished ok.
@@ -867,7 +1107,7 @@ int backup_phase2_server_protocol1(struct async *as, struct sdirs *sdirs,
 			}
 		}
 
-		switch(do_stuff_to_send(asfd, p1b, &last_requested))
+		switch(do_stuff_to_send(asfd, p1b, &last_requested, streams))
 		{
 			case 0: break;
 			case 1: continue;
@@ -946,6 +1186,7 @@ end:
 	}
 	free_w(&deltmppath);
 	free_w(&last_requested);
+	streams_free(&streams);
 	sbuf_free(&cb);
 	sbuf_free(&p1b);
 	sbuf_free(&rb);
@@ -14,6 +14,7 @@
 #include "../../strlist.h"
 #include "../child.h"
 #include "../compress.h"
+#include "../manio.h"
 #include "../timestamp.h"
 #include "blocklen.h"
 #include "deleteme.h"
@@ -40,7 +41,7 @@ int do_patch(struct asfd *asfd, const char *dst, const char *del,
 		goto end;
 
 	if(gzupd)
-		upfzp=fzp_gzopen(upd, comp_level(compression));
+		upfzp=compress_open_data(upd, compression);
 	else
 		upfzp=fzp_open(upd, "wb");
 
@@ -120,8 +121,8 @@ static int make_rev_delta(const char *src, const char *sig, const char *del,
 	if(!srcfzp) goto end;
 
 	if(get_int(cconfs[OPT_COMPRESSION]))
-		delfzp=fzp_gzopen(del,
-			comp_level(get_int(cconfs[OPT_COMPRESSION])));
+		delfzp=compress_open_data(del,
+			get_int(cconfs[OPT_COMPRESSION]));
 	else
 		delfzp=fzp_open(del, "wb");
 	if(!delfzp) goto end;
@@ -231,9 +232,11 @@ static int inflate_or_link_oldfile(const char *oldpath, const char *infpath,
 		1 /* allow overwrite of infpath */);
 }
 
+// Returns -1 on error, 0 on success, or 1 if the file could not be patched
+// and needs to be removed from the manifest.
 static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 	int hardlinked_current, const char *deltabdir, const char *deltafdir,
-	const char *sigpath, struct fzp **delfp, struct conf **cconfs)
+	const char *sigpath, const char *infpath, struct conf **cconfs)
 {
 	int ret=-1;
 	struct stat statp;
@@ -284,25 +287,18 @@ static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 	else if(!lstat(deltafpath, &statp) && S_ISREG(statp.st_mode))
 	{
 		int lrs;
-		char *infpath=NULL;
 
 		// Got a forward patch to do.
 		// First, need to gunzip the old file,
 		// otherwise the librsync patch will take
 		// forever, because it will be doing seeks
 		// all over the place, and gzseeks are slow.
-	  	if(!(infpath=prepend_s(deltafdir, "inflate")))
-		{
-			log_out_of_memory(__func__);
-			goto end;
-		}
 
 		//logp("Fixing up: %s\n", datapth);
 		if(inflate_or_link_oldfile(oldpath, infpath,
 			sb->compression, cconfs))
 		{
 			logp("error when inflating old file: %s\n", oldpath);
-			free_w(&infpath);
 			goto end;
 		}
 
@@ -311,38 +307,19 @@ static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 		{
 			logp("WARNING: librsync error when patching %s: %d\n",
 				oldpath, lrs);
-			cntr_add(get_cntr(cconfs), CMD_WARNING, 1);
 			// Try to carry on with the rest of the backup
 			// regardless.
-			//ret=-1;
 			// Remove anything that got written.
 			unlink(newpath);
 			unlink(infpath);
-			free_w(&infpath);
 
-			// First, note that we want to remove this entry from
-			// the manifest.
-			if(!*delfp
-			  && !(*delfp=fzp_open(fdirs->deletionsfile, "ab")))
-			{
-				// Could not mark this file as deleted. Fatal.
-				goto end;
-			}
-			if(sbuf_to_manifest(sb, *delfp))
-				goto end;
-			if(fzp_flush(*delfp))
-			{
-				logp("error fflushing deletions file in %s: %s\n", __func__, strerror(errno));
-				goto end;
-			}
-	
-			ret=0;
+			// The caller will remove this entry from the manifest.
+			ret=1;
 			goto end;
 		}
 
 		// Get rid of the inflated old file.
 		unlink(infpath);
-		free_w(&infpath);
 
 		// Need to generate a reverse diff, unless we are keeping a
 		// hardlinked archive.
@@ -484,7 +461,7 @@ static int maybe_delete_files_from_manifest(const char *manifesttmp,
 
         if(!(dfp=fzp_open(fdirs->deletionsfile, "rb"))
 	  || !(omzp=fzp_gzopen(fdirs->manifest, "rb"))
-	  || !(nmzp=fzp_gzopen(manifesttmp,
+	  || !(nmzp=manio_fzp_open_write(manifesttmp,
 		comp_level(get_int(cconfs[OPT_COMPRESSION]))))
 	  || !(db=sbuf_alloc(PROTO_1))
 	  || !(mb=sbuf_alloc(PROTO_1)))
@@ -564,6 +541,249 @@ end:
 	return ret;
 }
 
+// Deal with a file that jiggle() could not patch.
+static int mark_for_deletion(struct sbuf *sb, struct fdirs *fdirs,
+	struct fzp **delfp, struct conf **cconfs)
+{
+	cntr_add(get_cntr(cconfs), CMD_WARNING, 1);
+
+	// Note that we want to remove this entry from the manifest.
+	// The entries get written in manifest order, which
+	// maybe_delete_files_from_manifest() relies on.
+	if(!*delfp
+	  && !(*delfp=fzp_open(fdirs->deletionsfile, "ab")))
+	{
+		// Could not mark this file as deleted. Fatal.
+		return -1;
+	}
+	if(sbuf_to_manifest(sb, *delfp))
+		return -1;
+	if(fzp_flush(*delfp))
+	{
+		logp("error fflushing deletions file in %s: %s\n",
+			__func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+#ifndef HAVE_WIN32
+
+#define JIGGLE_OK	'o'
+#define JIGGLE_DELETE	'd'
+#define JIGGLE_ERROR	'e'
+
+struct jiggle_worker
+{
+	pid_t pid;
+	int fd;
+};
+
+// Runs in a child process. Opens its own copy of the manifest and does
+// every workers'th data file, starting from the w'th, telling the parent
+// how each one went, in order.
+static int jiggle_worker_run(struct sdirs *sdirs, struct fdirs *fdirs,
+	int hardlinked_current, const char *deltabdir, const char *deltafdir,
+	int w, int workers, int fd, struct conf **cconfs)
+{
+	int ret=-1;
+	uint64_t index=0;
+	char suffix[32]="";
+	char *sigpath=NULL;
+	char *infpath=NULL;
+	struct fzp *zp=NULL;
+	struct sbuf *sb=NULL;
+
+	// Temporary files need to be different for each worker.
+	snprintf(suffix, sizeof(suffix), ".%d", w);
+	if(!(sigpath=prepend_s(fdirs->currentdup, "sig.tmp"))
+	  || astrcat(&sigpath, suffix, __func__)
+	  || !(infpath=prepend_s(deltafdir, "inflate"))
+	  || astrcat(&infpath, suffix, __func__)
+	  || !(sb=sbuf_alloc(PROTO_1)))
+		goto end;
+	if(!(zp=fzp_gzopen(fdirs->manifest, "rb")))
+		goto end;
+
+	while(1)
+	{
+		char status;
+		switch(sbuf_fill_from_file(sb, zp, NULL, NULL))
+		{
+			case 0: break;
+			case 1: ret=0; goto end;
+			default: goto end;
+		}
+		if(sb->protocol1->datapth.buf && (index++)%workers==(uint64_t)w)
+		{
+			switch(jiggle(sdirs, fdirs, sb, hardlinked_current,
+				deltabdir, deltafdir, sigpath, infpath, cconfs))
+			{
+				case 0: status=JIGGLE_OK; break;
+				case 1: status=JIGGLE_DELETE; break;
+				default: status=JIGGLE_ERROR; break;
+			}
+			// If the parent has gone away, stop.
+			if(write(fd, &status, 1)!=1
+			  || status==JIGGLE_ERROR)
+				goto end;
+		}
+		sbuf_free_content(sb);
+	}
+end:
+	fzp_close(&zp);
+	sbuf_free(&sb);
+	free_w(&sigpath);
+	free_w(&infpath);
+	return ret;
+}
+
+static void jiggle_workers_stop(struct jiggle_worker *jw, int workers)
+{
+	int w;
+	for(w=0; w<workers; w++)
+		close_fd(&jw[w].fd);
+}
+
+static int jiggle_workers_wait(struct jiggle_worker *jw, int workers)
+{
+	int w;
+	int ret=0;
+	int status;
+	for(w=0; w<workers; w++)
+	{
+		if(jw[w].pid<=0) continue;
+		if(waitpid(jw[w].pid, &status, 0)<0)
+		{
+			logp("error waiting for phase4 worker %d: %s\n",
+				jw[w].pid, strerror(errno));
+			ret=-1;
+		}
+		else if(!WIFEXITED(status) || WEXITSTATUS(status))
+		{
+			logp("phase4 worker %d failed\n", jw[w].pid);
+			ret=-1;
+		}
+		jw[w].pid=-1;
+	}
+	return ret;
+}
+
+static int jiggle_workers_start(struct jiggle_worker *jw, int workers,
+	struct sdirs *sdirs, struct fdirs *fdirs, int hardlinked_current,
+	const char *deltabdir, const char *deltafdir, struct conf **cconfs)
+{
+	int w;
+	int p[2];
+	for(w=0; w<workers; w++)
+	{
+		if(pipe(p))
+		{
+			logp("pipe failed in %s: %s\n",
+				__func__, strerror(errno));
+			return -1;
+		}
+		switch((jw[w].pid=fork()))
+		{
+			case -1:
+				logp("fork failed in %s: %s\n",
+					__func__, strerror(errno));
+				close(p[0]);
+				close(p[1]);
+				return -1;
+			case 0:
+			{
+				int x;
+				// Child.
+				close(p[0]);
+				for(x=0; x<w; x++)
+					close_fd(&jw[x].fd);
+				_exit(jiggle_worker_run(sdirs, fdirs,
+					hardlinked_current, deltabdir,
+					deltafdir, w, workers, p[1],
+					cconfs)?1:0);
+			}
+			default:
+				// Parent.
+				close(p[1]);
+				jw[w].fd=p[0];
+				break;
+		}
+	}
+	return 0;
+}
+
+// Spread the jiggling of the data files across several processes. The
+// parent still goes through the manifest in order, collecting the result
+// for each file from the worker that did it, so that status updates and
+// the deletions file come out exactly as they would with just one process.
+// Each file is jiggled by exactly one worker, and jiggle() can be
+// interrupted at any point and redone, so resuming works as before.
+static int jiggle_in_parallel(struct sdirs *sdirs, struct fdirs *fdirs,
+	int hardlinked_current, const char *deltabdir, const char *deltafdir,
+	struct fzp *zp, struct sbuf *sb, struct fzp **delfp, int workers,
+	struct conf **cconfs)
+{
+	int w;
+	int ret=-1;
+	uint64_t index=0;
+	struct jiggle_worker *jw=NULL;
+
+	if(!(jw=(struct jiggle_worker *)
+		calloc_w(workers, sizeof(struct jiggle_worker), __func__)))
+			return -1;
+	for(w=0; w<workers; w++)
+	{
+		jw[w].pid=-1;
+		jw[w].fd=-1;
+	}
+	logp("Using %d phase4 workers\n", workers);
+	if(jiggle_workers_start(jw, workers, sdirs, fdirs,
+		hardlinked_current, deltabdir, deltafdir, cconfs))
+			goto end;
+
+	while(1)
+	{
+		char status;
+		ssize_t r;
+		switch(sbuf_fill_from_file(sb, zp, NULL, NULL))
+		{
+			case 0: break;
+			case 1: ret=0; goto end;
+			default: goto end;
+		}
+		if(sb->protocol1->datapth.buf)
+		{
+			if(write_status(CNTR_STATUS_SHUFFLING,
+				sb->protocol1->datapth.buf, get_cntr(cconfs)))
+					goto end;
+			w=(index++)%workers;
+			while((r=read(jw[w].fd, &status, 1))<0
+			  && errno==EINTR) { }
+			if(r!=1 || status==JIGGLE_ERROR)
+			{
+				logp("phase4 worker %d failed on %s\n",
+					jw[w].pid, sb->protocol1->datapth.buf);
+				goto end;
+			}
+			if(status==JIGGLE_DELETE
+			  && mark_for_deletion(sb, fdirs, delfp, cconfs))
+				goto end;
+		}
+		sbuf_free_content(sb);
+	}
+end:
+	// Closing the pipes makes any remaining workers stop after their
+	// current file.
+	jiggle_workers_stop(jw, workers);
+	if(jiggle_workers_wait(jw, workers))
+		ret=-1;
+	free_v((void **)&jw);
+	return ret;
+}
+
+#endif
+
 /* Need to make all the stuff that this does atomic so that existing backups
    never get broken, even if somebody turns the power off on the server. */ 
 static int atomic_data_jiggle(struct sdirs *sdirs, struct fdirs *fdirs,
@@ -577,8 +797,10 @@ static int atomic_data_jiggle(struct sdirs *sdirs, struct fdirs *fdirs,
 	char *deltabdir=NULL;
 	char *deltafdir=NULL;
 	char *sigpath=NULL;
+	char *infpath=NULL;
 	struct fzp *zp=NULL;
 	struct sbuf *sb=NULL;
+	int workers=get_int(cconfs[OPT_PHASE4_WORKERS]);
 
 	struct fzp *delfp=NULL;
 
@@ -601,6 +823,7 @@ static int atomic_data_jiggle(struct sdirs *sdirs, struct fdirs *fdirs,
 	if(!(deltabdir=prepend_s(fdirs->currentdup, "deltas.reverse"))
 	  || !(deltafdir=prepend_s(sdirs->finishing, "deltas.forward"))
 	  || !(sigpath=prepend_s(fdirs->currentdup, "sig.tmp"))
+	  || !(infpath=prepend_s(deltafdir, "inflate"))
 	  || !(sb=sbuf_alloc(PROTO_1)))
 	{
 		log_out_of_memory(__func__);
@@ -609,6 +832,16 @@ static int atomic_data_jiggle(struct sdirs *sdirs, struct fdirs *fdirs,
 
 	mkdir(fdirs->datadir, 0777);
 
+#ifndef HAVE_WIN32
+	if(workers>1)
+	{
+		if(jiggle_in_parallel(sdirs, fdirs, hardlinked_current,
+			deltabdir, deltafdir, zp, sb, &delfp, workers, cconfs))
+				goto error;
+		goto end;
+	}
+#endif
+
 	while(1)
 	{
 		switch(sbuf_fill_from_file(sb, zp, NULL, NULL))
@@ -620,11 +853,20 @@ static int atomic_data_jiggle(struct sdirs *sdirs, struct fdirs *fdirs,
 		if(sb->protocol1->datapth.buf)
 		{
 			if(write_status(CNTR_STATUS_SHUFFLING,
-				sb->protocol1->datapth.buf, get_cntr(cconfs))
-			  || jiggle(sdirs, fdirs, sb, hardlinked_current,
-				deltabdir, deltafdir,
-				sigpath, &delfp, cconfs))
+				sb->protocol1->datapth.buf, get_cntr(cconfs)))
 					goto error;
+			switch(jiggle(sdirs, fdirs, sb, hardlinked_current,
+				deltabdir, deltafdir,
+				sigpath, infpath, cconfs))
+			{
+				case 0: break;
+				case 1:
+					if(mark_for_deletion(sb, fdirs,
+						&delfp, cconfs))
+							goto error;
+					break;
+				default: goto error;
+			}
 		}
 		sbuf_free_content(sb);
 	}
@@ -653,6 +895,7 @@ error:
 	free_w(&deltabdir);
 	free_w(&deltafdir);
 	free_w(&sigpath);
+	free_w(&infpath);
 	free_w(&datapth);
 	free_w(&tmpman);
 	return ret;
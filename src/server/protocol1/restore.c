@@ -2,9 +2,11 @@
 #include "../../alloc.h"
 #include "../../asfd.h"
 #include "../../async.h"
+#include "../../attribs.h"
 #include "../../bu.h"
 #include "../../cmd.h"
 #include "../../cntr.h"
+#include "../../fzp.h"
 #include "../../handy.h"
 #include "../../hexmap.h"
 #include "../../log.h"
@@ -267,6 +269,24 @@ static int process_data_dir_file(struct asfd *asfd,
 		patches++;
 	}
 
+	// Clients only know how to inflate gzip, so data that the server
+	// stored with zstd is inflated here and then sent in the same way
+	// as a patched file.
+	if(act==ACTION_RESTORE && !patches && !sbuf_is_encrypted(sb)
+	  && dpth_protocol1_is_compressed(sb->compression, best)
+	  && fzp_is_zstd(best))
+	{
+		if(inflate_or_link_oldfile(asfd, best, tmp,
+			cconfs, sb->compression))
+		{
+			logw(asfd, cntr, "problem when inflating %s\n", best);
+			ret=0;
+			goto end;
+		}
+		best=tmp;
+		patches++;
+	}
+
 	switch(act)
 	{
 		case ACTION_RESTORE:
@@ -344,6 +364,7 @@ int restore_sbuf_protocol1(struct asfd *asfd, struct sbuf *sb, struct bu *bu,
 {
 	if((sb->protocol1->datapth.buf
 		&& asfd->write(asfd, &(sb->protocol1->datapth)))
+	  || attribs_for_peer(sb)
 	  || asfd->write(asfd, &sb->attr))
 		return -1;
 	else if(sbuf_is_filedata(sb)
@@ -12,6 +12,7 @@
 #include "../../log.h"
 #include "../../server/manio.h"
 #include "../../protocol2/blist.h"
+#include "../../protocol2/flow.h"
 #include "../../slist.h"
 #include "../manios.h"
 #include "../resume.h"
@@ -25,6 +26,8 @@
 
 static int breaking=0;
 static int breakcount=0;
+// Measures the sigs going to the champ chooser and the data coming in.
+static struct flow *flow=NULL;
 
 static int data_needed(struct sbuf *sb)
 {
@@ -190,6 +193,7 @@ static int add_data_to_store(struct cntr *cntr,
 
 	cntr_add(cntr, CMD_DATA, 0);
 	cntr_add_recvbytes(cntr, blk->length);
+	flow_data(flow, blk->length);
 
 	blk->got=BLK_GOT;
 	blk=blk->next;
@@ -637,6 +641,7 @@ static int append_for_champ_chooser(struct asfd *chfd,
 				return 0; // Try again later.
 			default: return -1;
 		}
+		flow_sig_sent(flow, blk->index);
 		blist->blk_for_champ_chooser=blk->next;
 	}
 	if(end_flags&END_SIGS
@@ -688,6 +693,7 @@ static int mark_up_to_index(struct blist *blist,
 		logp("Could not find index from champ chooser: %" PRIu64 "\n", index);
 		return -1;
 	}
+	flow_ack(flow, index);
 //logp("Found index from champ chooser: %lu\n", index);
 //printf("index from cc: %d\n", index);
 	blist->blk_from_champ_chooser=blk;
@@ -838,8 +844,10 @@ int backup_phase2_server_protocol2(struct async *as, struct sdirs *sdirs,
 	}
 
 	logp("Phase 2 begin (recv backup data)\n");
+	blk_pool_set(1);
 
-	if(!(dpth=dpth_alloc())
+	if(!(flow=flow_alloc(0, 0))
+	  || !(dpth=dpth_alloc())
 	  || dpth_protocol2_init(dpth,
 		sdirs->data, get_int(confs[OPT_MAX_STORAGE_SUBDIRS])))
 			goto end;
@@ -901,6 +909,9 @@ int backup_phase2_server_protocol2(struct async *as, struct sdirs *sdirs,
 			if(chfd->parse_readbuf(chfd))
 				goto end;
 		}
+		if(slist->blist->blk_from_champ_chooser)
+			flow_update(flow,
+				slist->blist->blk_from_champ_chooser->index);
 
 		if(write_to_changed_file(asfd, chfd, manios,
 			slist, end_flags))
@@ -939,6 +950,11 @@ int backup_phase2_server_protocol2(struct async *as, struct sdirs *sdirs,
 
 	ret=0;
 end:
+	if(flow)
+	{
+		flow_print_stats(flow, "Phase 2 receive");
+		flow_free(&flow);
+	}
 	logp("End backup\n");
 	sbuf_free(&csb);
 	slist_free(&slist);
@@ -947,5 +963,8 @@ end:
 	dpth_free(&dpth);
 	manios_close(&manios);
 	man_off_t_free(&p1pos);
+	blk_print_alloc_stats();
+	blk_pool_free();
+	blk_pool_set(0);
 	return ret;
 }
@@ -0,0 +1,1185 @@
+#include "../../burp.h"
+#include "../../alloc.h"
+#include "../../bu.h"
+#include "../../cmd.h"
+#include "../../conf.h"
+#include "../../conffile.h"
+#include "../../cntr.h"
+#include "../../fsops.h"
+#include "../../fzp.h"
+#include "../../hexmap.h"
+#include "../../iobuf.h"
+#include "../../lock.h"
+#include "../../log.h"
+#include "../../prepend.h"
+#include "../../protocol2/blk.h"
+#include "../../strlist.h"
+#include "../bu_get.h"
+#include "../manio.h"
+#include "../sdirs.h"
+#include "backup_phase4.h"
+#include "bcompact.h"
+#include "dpth.h"
+
+// Data files are only deleted once nothing refers to any of their blocks,
+// so after old backups are deleted, many of them are mostly dead space.
+// This copies the blocks that are still referred to out of sparsely used
+// data files into new ones, points the manifests at the new copies, and
+// then deletes the old files.
+// The mapping from old to new savepaths is written to data/compact/map
+// before any manifest is touched. If interrupted after that, the next run
+// carries on with the manifests and deletes the old files. Rewriting a
+// manifest a second time changes nothing.
+// Each new data file is noted in data/compact/new before it is created. If
+// interrupted before the map is written, nothing refers to them, so the
+// next run deletes them before starting again.
+// Every client in the dedup group is locked while this happens, as well as
+// the champ chooser, so no backups can run at the same time.
+
+#define COMPACT_DIR		"compact"
+#define COMPACT_MAP		"map"
+#define COMPACT_NEW		"new"
+#define DEFAULT_THRESHOLD	50
+#define SAVEPATH_FILE_MASK	0xFFFFFFFFFFFF0000
+#define SAVEPATH_SIG_MASK	0x000000000000FFFF
+
+static int verbose=0;
+
+static char *get_config_path(void)
+{
+        static char path[256]="";
+        snprintf(path, sizeof(path), "%s", SYSCONFDIR "/burp.conf");
+        return path;
+}
+
+static int usage(void)
+{
+	logf("\nUsage: %s [options]\n", prog);
+	logf("\n");
+	logf(" Options:\n");
+	logf("  -c <path>                Path to config file (default: %s).\n", get_config_path());
+	logf("  -g <list of group names> Only compact the data of the dedup groups\n");
+	logf("                           specified. The list is comma-separated.\n");
+	logf("  -h|-?                    Print this text and exit.\n");
+	logf("  -n                       Dry run. Work out what would be reclaimed and\n");
+	logf("                           how much would need to be read and written,\n");
+	logf("                           without changing anything.\n");
+	logf("  -t <percent>             Rewrite data files that have less than this\n");
+	logf("                           percentage of their bytes still in use\n");
+	logf("                           (default: %d).\n", DEFAULT_THRESHOLD);
+	logf("  -v                       Print the data files that get rewritten.\n");
+	logf("  -V                       Print version and exit.\n");
+	logf("\n");
+	logf("By default, %s will read %s and compact the protocol2 data\n", prog, get_config_path());
+	logf("files of every dedup group in the storage directory.\n");
+	logf("\n");
+	return 1;
+}
+
+static struct dfile *dfile_find(struct compact *c, uint64_t key)
+{
+	struct dfile *dfile=NULL;
+	HASH_FIND(hh, c->dfiles, &key, sizeof(key), dfile);
+	return dfile;
+}
+
+static struct dfile *dfile_add(struct compact *c, uint64_t key)
+{
+	struct dfile *dfile;
+	if(!(dfile=(struct dfile *)calloc_w(1, sizeof(struct dfile), __func__)))
+		return NULL;
+	dfile->key=key;
+	HASH_ADD(hh, c->dfiles, key, sizeof(dfile->key), dfile);
+	return dfile;
+}
+
+static struct remap *remap_find(struct compact *c, uint64_t from)
+{
+	struct remap *remap=NULL;
+	HASH_FIND(hh, c->remaps, &from, sizeof(from), remap);
+	return remap;
+}
+
+static int remap_add(struct compact *c, uint64_t from, uint64_t to)
+{
+	struct remap *remap;
+	if(!(remap=(struct remap *)calloc_w(1, sizeof(struct remap), __func__)))
+		return -1;
+	remap->from=from;
+	remap->to=to;
+	HASH_ADD(hh, c->remaps, from, sizeof(remap->from), remap);
+	return 0;
+}
+
+#ifndef UTEST
+static
+#endif
+struct compact *compact_alloc(int threshold, int dry_run)
+{
+	struct compact *c;
+	if(!(c=(struct compact *)calloc_w(1, sizeof(struct compact), __func__)))
+		return NULL;
+	c->threshold=threshold;
+	c->dry_run=dry_run;
+	return c;
+}
+
+static void compact_free_content(struct compact *c)
+{
+	struct dfile *dfile;
+	struct dfile *dtmp;
+	struct remap *remap;
+	struct remap *rtmp;
+	HASH_ITER(hh, c->dfiles, dfile, dtmp)
+	{
+		HASH_DEL(c->dfiles, dfile);
+		free_v((void **)&dfile);
+	}
+	HASH_ITER(hh, c->remaps, remap, rtmp)
+	{
+		HASH_DEL(c->remaps, remap);
+		free_v((void **)&remap);
+	}
+	free_w(&c->map);
+	free_w(&c->journal);
+}
+
+#ifndef UTEST
+static
+#endif
+void compact_free(struct compact **c)
+{
+	if(!c || !*c) return;
+	compact_free_content(*c);
+	free_v((void **)c);
+}
+
+static void compact_reset(struct compact *c)
+{
+	compact_free_content(c);
+	memset(&c->stats, 0, sizeof(c->stats));
+}
+
+static int is_used(struct dfile *dfile, uint16_t sig)
+{
+	return dfile->used[sig/8] & (1<<(sig%8));
+}
+
+// Note which blocks of which data files a manifest component refers to.
+#ifndef UTEST
+static
+#endif
+int compact_mark_manifest(struct compact *c, const char *path)
+{
+	int ret=-1;
+	uint16_t sig;
+	struct blk blk;
+	struct iobuf rbuf;
+	struct fzp *fzp=NULL;
+	struct dfile *dfile=NULL;
+
+	iobuf_init(&rbuf);
+	if(!(fzp=fzp_gzopen(path, "rb")))
+		goto end;
+	while(1)
+	{
+		iobuf_free_content(&rbuf);
+		switch(iobuf_fill_from_fzp(&rbuf, fzp))
+		{
+			case 0: break;
+			case 1: ret=0; // Finished OK.
+			default: goto end;
+		}
+		if(rbuf.cmd!=CMD_SIG)
+			continue;
+		if(blk_set_from_iobuf_sig_and_savepath(&blk, &rbuf))
+			goto end;
+		sig=blk.savepath & SAVEPATH_SIG_MASK;
+		if(sig>=DATA_FILE_SIG_MAX)
+		{
+			logp("Block %016" PRIX64 " in %s is past the end of a data file\n",
+				blk.savepath, path);
+			goto end;
+		}
+		if((!dfile || dfile->key!=(blk.savepath & SAVEPATH_FILE_MASK))
+		  && !(dfile=dfile_find(c, blk.savepath & SAVEPATH_FILE_MASK))
+		  && !(dfile=dfile_add(c, blk.savepath & SAVEPATH_FILE_MASK)))
+			goto end;
+		if(is_used(dfile, sig))
+			continue;
+		dfile->used[sig/8] |= (1<<(sig%8));
+		dfile->live++;
+	}
+end:
+	iobuf_free_content(&rbuf);
+	fzp_close(&fzp);
+	return ret;
+}
+
+static char *get_data_path(const char *datadir, uint64_t key)
+{
+	return prepend_s(datadir, uint64_to_savepathstr(key));
+}
+
+// Reads just the block headers, to find out how many bytes are in the
+// blocks that are still used. Returns 1 if the file is missing.
+static int scan_data_file(const char *path, struct dfile *dfile,
+	uint64_t *total, uint64_t *live)
+{
+	int ret=-1;
+	uint16_t sig=0;
+	unsigned int len;
+	char tag[6]="";
+	struct fzp *fzp=NULL;
+	struct stat statp;
+
+	*total=0;
+	*live=0;
+	if(lstat(path, &statp))
+	{
+		logp("Data file %s is referred to, but is missing\n", path);
+		return 1;
+	}
+	if(!(fzp=fzp_open(path, "rb")))
+		goto end;
+	while(1)
+	{
+		switch(fzp_read(fzp, tag, 5))
+		{
+			case 5: break;
+			case 0: ret=0; goto end;
+			default:
+				logp("Short read of block header in %s\n",
+					path);
+				goto end;
+		}
+		if(tag[0]!=CMD_DATA
+		  || sscanf(tag+1, "%04X", &len)!=1)
+		{
+			logp("Unexpected block header in %s: %s\n", path, tag);
+			goto end;
+		}
+		if(sig>=DATA_FILE_SIG_MAX)
+		{
+			logp("Too many blocks in %s\n", path);
+			goto end;
+		}
+		*total+=5+len;
+		if(is_used(dfile, sig))
+			*live+=5+len;
+		if(fzp_seek(fzp, len, SEEK_CUR))
+			goto end;
+		sig++;
+	}
+end:
+	fzp_close(&fzp);
+	return ret;
+}
+
+static int dfile_sort(struct dfile *a, struct dfile *b)
+{
+	if(a->key<b->key) return -1;
+	if(a->key>b->key) return 1;
+	return 0;
+}
+
+// Decide which of the data files are worth rewriting.
+#ifndef UTEST
+static
+#endif
+int compact_choose(struct compact *c, const char *datadir)
+{
+	int ret=-1;
+	char *path=NULL;
+	uint64_t total;
+	uint64_t live;
+	struct dfile *dfile;
+
+	HASH_SORT(c->dfiles, dfile_sort);
+	for(dfile=c->dfiles; dfile; dfile=(struct dfile *)dfile->hh.next)
+	{
+		free_w(&path);
+		if(!(path=get_data_path(datadir, dfile->key)))
+			goto end;
+		switch(scan_data_file(path, dfile, &total, &live))
+		{
+			case 0: break;
+			case 1: continue;
+			default: goto end;
+		}
+		c->stats.files_scanned++;
+		c->stats.bytes_scanned+=total;
+		if(!total || live*100>=total*(uint64_t)c->threshold)
+			continue;
+		if(verbose)
+			logp("%s: %" PRIu64 " of %" PRIu64 " bytes in use\n",
+				path, live, total);
+		dfile->compact=1;
+		c->stats.files_chosen++;
+		c->stats.data_read+=total;
+		c->stats.data_written+=live;
+	}
+	ret=0;
+end:
+	free_w(&path);
+	return ret;
+}
+
+// Copy the blocks that are still used into new data files, remembering
+// where each one went.
+static int copy_live_blocks(struct compact *c, const char *path,
+	struct dfile *dfile, struct dpth *dpth, struct fzp *journal)
+{
+	int ret=-1;
+	uint16_t sig=0;
+	const char *savepathstr;
+	struct blk blk;
+	struct iobuf rbuf;
+	struct fzp *fzp=NULL;
+
+	iobuf_init(&rbuf);
+	memset(&blk, 0, sizeof(struct blk));
+	if(!(fzp=fzp_open(path, "rb")))
+		goto end;
+	for(sig=0; ; sig++)
+	{
+		iobuf_free_content(&rbuf);
+		switch(iobuf_fill_from_fzp_data(&rbuf, fzp))
+		{
+			case 0: break;
+			case 1: ret=0; // Finished OK.
+			default: goto end;
+		}
+		if(rbuf.cmd!=CMD_DATA)
+		{
+			logp("unknown cmd in %s: %c\n", __func__, rbuf.cmd);
+			goto end;
+		}
+		if(sig>=DATA_FILE_SIG_MAX)
+		{
+			logp("Too many blocks in %s\n", path);
+			goto end;
+		}
+		if(!is_used(dfile, sig))
+			continue;
+		if(!(savepathstr=dpth_protocol2_mk(dpth)))
+			goto end;
+		blk.savepath=savepathstr_with_sig_to_uint64(savepathstr);
+		if((blk.savepath & SAVEPATH_SIG_MASK)==0)
+		{
+			// Note it before it exists.
+			fzp_printf(journal, "%016" PRIX64 "\n", blk.savepath);
+			if(fzp_flush(journal))
+				goto end;
+			c->stats.files_written++;
+		}
+		if(dpth_protocol2_incr_sig(dpth)
+		  || dpth_protocol2_fwrite(dpth, &rbuf, &blk)
+		  || remap_add(c, dfile->key|sig, blk.savepath))
+			goto end;
+	}
+end:
+	iobuf_free_content(&rbuf);
+	fzp_close(&fzp);
+	return ret;
+}
+
+static int write_map(struct compact *c)
+{
+	int ret=-1;
+	char *tmp=NULL;
+	struct fzp *fzp=NULL;
+	struct remap *remap;
+
+	if(!(tmp=prepend(c->map, ".tmp"))
+	  || build_path_w(tmp)
+	  || !(fzp=fzp_gzopen(tmp, "wb")))
+		goto end;
+	for(remap=c->remaps; remap; remap=(struct remap *)remap->hh.next)
+		fzp_printf(fzp, "%016" PRIX64 " %016" PRIX64 "\n",
+			remap->from, remap->to);
+	if(fzp_close(&fzp)
+	  || do_rename(tmp, c->map))
+		goto end;
+	ret=0;
+end:
+	fzp_close(&fzp);
+	free_w(&tmp);
+	return ret;
+}
+
+static int read_map(struct compact *c)
+{
+	int ret=-1;
+	char buf[64]="";
+	uint64_t from;
+	uint64_t to;
+	struct fzp *fzp=NULL;
+
+	if(!(fzp=fzp_gzopen(c->map, "rb")))
+		goto end;
+	while(fzp_gets(fzp, buf, sizeof(buf)))
+	{
+		if(sscanf(buf, "%" SCNx64 " %" SCNx64, &from, &to)!=2)
+		{
+			logp("Unexpected line in %s: %s\n", c->map, buf);
+			goto end;
+		}
+		if(remap_add(c, from, to))
+			goto end;
+	}
+	ret=0;
+end:
+	fzp_close(&fzp);
+	return ret;
+}
+
+#ifndef UTEST
+static
+#endif
+int compact_copy(struct compact *c, const char *datadir,
+	int max_storage_subdirs)
+{
+	int ret=-1;
+	char *path=NULL;
+	struct dfile *dfile;
+	struct dpth *dpth=NULL;
+	struct fzp *journal=NULL;
+
+	if(build_path_w(c->journal)
+	  || !(journal=fzp_open(c->journal, "wb"))
+	  || !(dpth=dpth_alloc())
+	  || dpth_protocol2_init(dpth, datadir, max_storage_subdirs))
+		goto end;
+	for(dfile=c->dfiles; dfile; dfile=(struct dfile *)dfile->hh.next)
+	{
+		if(!dfile->compact)
+			continue;
+		free_w(&path);
+		if(!(path=get_data_path(datadir, dfile->key))
+		  || copy_live_blocks(c, path, dfile, dpth, journal))
+			goto end;
+	}
+	if(dpth_release_all(dpth)
+	  || fzp_close(&journal))
+		goto end;
+	// Only now are the new copies safe to point to.
+	if(write_map(c))
+		goto end;
+	unlink(c->journal);
+	ret=0;
+end:
+	dpth_free(&dpth);
+	fzp_close(&journal);
+	free_w(&path);
+	return ret;
+}
+
+// Delete the data files that an interrupted run made before it got as far
+// as writing the map.
+#ifndef UTEST
+static
+#endif
+int compact_remove_orphans(struct compact *c, const char *datadir)
+{
+	int ret=-1;
+	char buf[64]="";
+	char *path=NULL;
+	uint64_t key;
+	struct stat statp;
+	struct fzp *fzp=NULL;
+
+	if(lstat(c->journal, &statp))
+		return 0;
+	if(!lstat(c->map, &statp))
+	{
+		// The new files are in use.
+		unlink(c->journal);
+		return 0;
+	}
+	if(!(fzp=fzp_open(c->journal, "rb")))
+		goto end;
+	while(fzp_gets(fzp, buf, sizeof(buf)))
+	{
+		if(sscanf(buf, "%" SCNx64, &key)!=1)
+		{
+			logp("Unexpected line in %s: %s\n", c->journal, buf);
+			goto end;
+		}
+		free_w(&path);
+		if(!(path=get_data_path(datadir, key & SAVEPATH_FILE_MASK)))
+			goto end;
+		errno=0;
+		if(unlink(path) && errno!=ENOENT)
+		{
+			logp("Could not unlink %s: %s\n",
+				path, strerror(errno));
+			goto end;
+		}
+		logp("Deleted %s, left behind by an interrupted run\n", path);
+	}
+	fzp_close(&fzp);
+	if(unlink(c->journal))
+	{
+		logp("Could not unlink %s: %s\n", c->journal, strerror(errno));
+		goto end;
+	}
+	ret=0;
+end:
+	fzp_close(&fzp);
+	free_w(&path);
+	return ret;
+}
+
+static int uint64_t_sort(const void *a, const void *b)
+{
+	uint64_t *x=(uint64_t *)a;
+	uint64_t *y=(uint64_t *)b;
+	if(*x>*y) return 1;
+	if(*x<*y) return -1;
+	return 0;
+}
+
+static int write_dindex(const char *path, uint64_t *dindex, size_t count)
+{
+	int ret=-1;
+	size_t i;
+	char *tmp=NULL;
+	struct fzp *fzp=NULL;
+	struct blk blk;
+	struct iobuf wbuf;
+
+	if(!(tmp=prepend(path, ".tmp"))
+	  || build_path_w(tmp)
+	  || !(fzp=fzp_gzopen(tmp, "wb")))
+		goto end;
+	qsort(dindex, count, sizeof(uint64_t), uint64_t_sort);
+	for(i=0; i<count; i++)
+	{
+		// Do not bother with duplicates.
+		if(i && dindex[i]==dindex[i-1])
+			continue;
+		blk.savepath=dindex[i];
+		blk_to_iobuf_savepath(&blk, &wbuf);
+		if(iobuf_send_msg_fzp(&wbuf, fzp))
+			goto end;
+	}
+	if(fzp_close(&fzp)
+	  || do_rename(tmp, path))
+		goto end;
+	ret=0;
+end:
+	fzp_close(&fzp);
+	free_w(&tmp);
+	return ret;
+}
+
+static int add_to_dindex(uint64_t **dindex, size_t *count, size_t *alloc,
+	uint64_t savepath)
+{
+	savepath &= SAVEPATH_FILE_MASK;
+	// Ignore obvious duplicates.
+	if(*count && (*dindex)[*count-1]==savepath)
+		return 0;
+	if(*count==*alloc)
+	{
+		*alloc=*alloc?*alloc*2:MANIFEST_SIG_MAX;
+		if(!(*dindex=(uint64_t *)realloc_w(*dindex,
+			*alloc*sizeof(uint64_t), __func__)))
+				return -1;
+	}
+	(*dindex)[(*count)++]=savepath;
+	return 0;
+}
+
+// Returns 1 if the sig refers to a block that is being moved.
+static int remap_sig(struct compact *c, struct blk *blk)
+{
+	struct remap *remap;
+	struct dfile *dfile;
+	if(c->dry_run)
+	{
+		dfile=dfile_find(c, blk->savepath & SAVEPATH_FILE_MASK);
+		return dfile && dfile->compact;
+	}
+	if(!(remap=remap_find(c, blk->savepath)))
+		return 0;
+	blk->savepath=remap->to;
+	return 1;
+}
+
+// Point the sigs of a manifest component at the new copies of their
+// blocks. Everything else is copied as it is, so offsets into the
+// uncompressed manifest stay the same. The dindex for the component is
+// regenerated to match. Returns 1 if the component was changed.
+#ifndef UTEST
+static
+#endif
+int compact_rewrite_manifest(struct compact *c, const char *path,
+	const char *dindex_path)
+{
+	int ret=-1;
+	int changed=0;
+	int entries=0;
+	char *tmp=NULL;
+	struct blk blk;
+	struct iobuf rbuf;
+	struct iobuf wbuf;
+	struct stat statp;
+	struct fzp *rzp=NULL;
+	struct fzp *wzp=NULL;
+	int zstd=fzp_is_zstd(path);
+	uint64_t *dindex=NULL;
+	size_t dcount=0;
+	size_t dalloc=0;
+
+	iobuf_init(&rbuf);
+	if(!(rzp=fzp_gzopen(path, "rb")))
+		goto end;
+	if(!c->dry_run)
+	{
+		if(!(tmp=prepend(path, ".tmp")))
+			goto end;
+		if(zstd) wzp=fzp_zstdopen(tmp, "wb");
+		else wzp=fzp_gzopen(tmp, "wb");
+		if(!wzp) goto end;
+	}
+	while(1)
+	{
+		iobuf_free_content(&rbuf);
+		switch(iobuf_fill_from_fzp(&rbuf, rzp))
+		{
+			case 0: break;
+			case 1: goto finished;
+			default: goto end;
+		}
+		if(rbuf.cmd!=CMD_SIG)
+		{
+			// Each entry starts with its attributes. Frame the
+			// entries the same way as when they were first
+			// written.
+			if(wzp && rbuf.cmd==CMD_ATTRIBS
+			  && manio_frame_entry(wzp, &entries))
+				goto end;
+			if(wzp && iobuf_send_msg_fzp(&rbuf, wzp))
+				goto end;
+			continue;
+		}
+		if(blk_set_from_iobuf_sig_and_savepath(&blk, &rbuf))
+			goto end;
+		if(remap_sig(c, &blk))
+		{
+			if(c->dry_run)
+			{
+				changed=1;
+				break;
+			}
+			changed=1;
+		}
+		if(!wzp)
+			continue;
+		if(add_to_dindex(&dindex, &dcount, &dalloc, blk.savepath))
+			goto end;
+		blk_to_iobuf_sig_and_savepath(&blk, &wbuf);
+		if(iobuf_send_msg_fzp(&wbuf, wzp))
+			goto end;
+	}
+finished:
+	if(wzp && fzp_close(&wzp))
+		goto end;
+	if(changed && !lstat(path, &statp))
+	{
+		c->stats.manifests_changed++;
+		c->stats.manifest_bytes+=statp.st_size;
+	}
+	if(!c->dry_run)
+	{
+		if(!changed)
+			unlink(tmp);
+		else if(do_rename(tmp, path)
+		  || write_dindex(dindex_path, dindex, dcount))
+			goto end;
+	}
+	ret=changed;
+end:
+	iobuf_free_content(&rbuf);
+	fzp_close(&rzp);
+	fzp_close(&wzp);
+	if(ret<0 && tmp) unlink(tmp);
+	free_w(&tmp);
+	free_v((void **)&dindex);
+	return ret;
+}
+
+// Manifest components are numbered from zero, with a dindex each.
+static int for_each_component(struct compact *c, const char *manifest_dir,
+	int mark, uint64_t *fcount)
+{
+	int ret=-1;
+	char name[32]="";
+	char dname[48]="";
+	char *path=NULL;
+	char *dindex_path=NULL;
+	struct stat statp;
+	int changed=0;
+
+	for(*fcount=0; ; (*fcount)++)
+	{
+		snprintf(name, sizeof(name), "%08" PRIX64, *fcount);
+		free_w(&path);
+		free_w(&dindex_path);
+		snprintf(dname, sizeof(dname), "dindex/%s", name);
+		if(!(path=prepend_s(manifest_dir, name))
+		  || !(dindex_path=prepend_s(manifest_dir, dname)))
+			goto end;
+		if(lstat(path, &statp))
+			break;
+		if(mark)
+		{
+			if(compact_mark_manifest(c, path))
+				goto end;
+			continue;
+		}
+		switch(compact_rewrite_manifest(c, path, dindex_path))
+		{
+			case 0: break;
+			case 1: changed=1; break;
+			default: goto end;
+		}
+	}
+	ret=changed;
+end:
+	free_w(&path);
+	free_w(&dindex_path);
+	return ret;
+}
+
+static int for_each_backup(struct compact *c, struct sdirs *sdirs, int mark)
+{
+	int ret=-1;
+	int changed=0;
+	uint64_t fcount=0;
+	char *manifest_dir=NULL;
+	char *dfiles=NULL;
+	struct bu *bu=NULL;
+	struct bu *bu_list=NULL;
+
+	if(bu_get_list(sdirs, &bu_list))
+		goto end;
+	for(bu=bu_list; bu; bu=bu->next)
+	{
+		free_w(&manifest_dir);
+		free_w(&dfiles);
+		if(!(manifest_dir=prepend_s(bu->path, "manifest"))
+		  || !(dfiles=prepend_s(manifest_dir, "dfiles")))
+			goto end;
+		switch(for_each_component(c, manifest_dir, mark, &fcount))
+		{
+			case 0: continue;
+			case 1: break;
+			default: goto end;
+		}
+		changed=1;
+		if(c->dry_run)
+			continue;
+		// Regenerate the list of data files used by the backup.
+		if(merge_files_in_dir(dfiles, manifest_dir, "dindex",
+			fcount, merge_dindexes))
+				goto end;
+	}
+	// And the list of data files used by the client.
+	if(changed && !c->dry_run
+	  && regenerate_client_dindex(sdirs))
+		goto end;
+	ret=0;
+end:
+	bu_list_free(&bu_list);
+	free_w(&manifest_dir);
+	free_w(&dfiles);
+	return ret;
+}
+
+#ifndef UTEST
+static
+#endif
+int compact_delete_old(struct compact *c, const char *datadir)
+{
+	int ret=-1;
+	char *path=NULL;
+	struct stat statp;
+	struct remap *remap;
+	// Not a possible data file key, because of the sig bits.
+	uint64_t last=SAVEPATH_SIG_MASK;
+
+	for(remap=c->remaps; remap; remap=(struct remap *)remap->hh.next)
+	{
+		if((remap->from & SAVEPATH_FILE_MASK)==last)
+			continue;
+		last=remap->from & SAVEPATH_FILE_MASK;
+		free_w(&path);
+		if(!(path=get_data_path(datadir, last)))
+			goto end;
+		if(lstat(path, &statp))
+			continue;
+		if(unlink(path))
+		{
+			logp("Could not unlink %s: %s\n",
+				path, strerror(errno));
+			goto end;
+		}
+		c->stats.files_deleted++;
+		c->stats.bytes_deleted+=statp.st_size;
+	}
+	ret=0;
+end:
+	free_w(&path);
+	return ret;
+}
+
+struct client
+{
+	struct sdirs *sdirs;
+	struct client *next;
+};
+
+static void clients_free(struct client **clients)
+{
+	struct client *client;
+	while((client=*clients))
+	{
+		*clients=client->next;
+		if(client->sdirs && client->sdirs->lock)
+			lock_release(client->sdirs->lock);
+		sdirs_free(&client->sdirs);
+		free_v((void **)&client);
+	}
+}
+
+// Get the locks of every client in the group. Returns 1 if any of them
+// are busy.
+static int get_clients(struct conf **globalcs, const char *group,
+	const char *clients_dir, struct client **clients)
+{
+	int ret=-1;
+	DIR *dirp=NULL;
+	char *path=NULL;
+	struct stat statp;
+	struct dirent *dirinfo=NULL;
+	struct client *client=NULL;
+
+	if(!(dirp=opendir(clients_dir)))
+	{
+		logp("Could not opendir '%s': %s\n",
+			clients_dir, strerror(errno));
+		goto end;
+	}
+	while((dirinfo=readdir(dirp)))
+	{
+		if(dirinfo->d_ino==0
+		  || looks_like_tmp_or_hidden_file(dirinfo->d_name))
+			continue;
+		free_w(&path);
+		if(!(path=prepend_s(clients_dir, dirinfo->d_name)))
+			goto end;
+		if(is_dir_lstat(path)<=0)
+			continue;
+		if(!(client=(struct client *)
+			calloc_w(1, sizeof(struct client), __func__))
+		  || !(client->sdirs=sdirs_alloc()))
+			goto end;
+		client->next=*clients;
+		*clients=client;
+		if(sdirs_init(client->sdirs, PROTO_2,
+			get_string(globalcs[OPT_DIRECTORY]),
+			dirinfo->d_name,
+			get_string(globalcs[OPT_CLIENT_LOCKDIR]),
+			group, NULL))
+				goto end;
+		lock_get(client->sdirs->lock);
+		if(client->sdirs->lock->status!=GET_LOCK_GOT)
+		{
+			logp("Could not get %s\n", client->sdirs->lock->path);
+			ret=1;
+			goto end;
+		}
+		if(!lstat(client->sdirs->working, &statp)
+		  || !lstat(client->sdirs->finishing, &statp))
+		{
+			logp("%s has a backup in progress\n",
+				client->sdirs->client);
+			ret=1;
+			goto end;
+		}
+	}
+	ret=0;
+end:
+	if(dirp) closedir(dirp);
+	free_w(&path);
+	return ret;
+}
+
+static void print_stats(struct compact *c, const char *group)
+{
+	struct compact_stats *s=&c->stats;
+	logp("%s: %" PRIu64 " data files in use, %" PRIu64
+		" below %d%% used\n", group, s->files_scanned,
+		s->files_chosen, c->threshold);
+	if(c->dry_run)
+	{
+		logp("%s: would reclaim %" PRIu64 " bytes%s\n", group,
+			s->data_read-s->data_written,
+			bytes_to_human(s->data_read-s->data_written));
+		logp("%s: would read %" PRIu64 " and write %" PRIu64
+			" bytes of data\n", group,
+			s->data_read, s->data_written);
+		logp("%s: would rewrite %" PRIu64 " manifest files, %" PRIu64
+			" bytes%s\n", group, s->manifests_changed,
+			s->manifest_bytes, bytes_to_human(s->manifest_bytes));
+		return;
+	}
+	logp("%s: copied blocks into %" PRIu64 " new data files\n",
+		group, s->files_written);
+	logp("%s: rewrote %" PRIu64 " manifest files, %" PRIu64 " bytes%s\n",
+		group, s->manifests_changed, s->manifest_bytes,
+		bytes_to_human(s->manifest_bytes));
+	logp("%s: deleted %" PRIu64 " old data files, %" PRIu64 " bytes%s\n",
+		group, s->files_deleted, s->bytes_deleted,
+		bytes_to_human(s->bytes_deleted));
+	if(s->bytes_deleted>=s->data_written)
+		logp("%s: reclaimed %" PRIu64 " bytes%s\n", group,
+			s->bytes_deleted-s->data_written,
+			bytes_to_human(s->bytes_deleted-s->data_written));
+}
+
+static int compact_group(struct compact *c, struct conf **globalcs,
+	const char *group)
+{
+	int ret=-1;
+	char *dedup=NULL;
+	char *clients_dir=NULL;
+	char *datadir=NULL;
+	char *champlock=NULL;
+	struct stat statp;
+	struct lock *lock=NULL;
+	struct client *client=NULL;
+	struct client *clients=NULL;
+
+	compact_reset(c);
+	if(!(dedup=prepend_s(get_string(globalcs[OPT_DIRECTORY]), group))
+	  || !(clients_dir=prepend_s(dedup, "clients"))
+	  || !(datadir=prepend_s(dedup, DATA_DIR))
+	  || !(champlock=prepend_s(datadir, "cc.lock"))
+	  || !(c->map=prepend_s(datadir, COMPACT_DIR "/" COMPACT_MAP))
+	  || !(c->journal=prepend_s(datadir, COMPACT_DIR "/" COMPACT_NEW)))
+		goto end;
+	if(lstat(clients_dir, &statp) || lstat(datadir, &statp))
+	{
+		logp("%s does not look like a protocol2 dedup group\n", dedup);
+		ret=0;
+		goto end;
+	}
+
+	// Stop a champ chooser from starting, and then make sure that no
+	// backups are running.
+	if(!(lock=lock_alloc_and_init(champlock)))
+		goto end;
+	lock_get(lock);
+	if(lock->status!=GET_LOCK_GOT)
+	{
+		logp("%s: could not get %s, skipping\n", group, lock->path);
+		ret=0;
+		goto end;
+	}
+	switch(get_clients(globalcs, group, clients_dir, &clients))
+	{
+		case 0: break;
+		case 1:
+			logp("%s: clients are busy, skipping\n", group);
+			ret=0;
+			goto end;
+		default: goto end;
+	}
+
+	if(!lstat(c->map, &statp))
+	{
+		logp("%s: carrying on from %s\n", group, c->map);
+		if(c->dry_run)
+		{
+			ret=0;
+			goto end;
+		}
+		if(read_map(c))
+			goto end;
+	}
+	else
+	{
+		if(!c->dry_run && compact_remove_orphans(c, datadir))
+			goto end;
+		logp("%s: looking for sparsely used data files\n", group);
+		for(client=clients; client; client=client->next)
+			if(for_each_backup(c, client->sdirs, 1 /* mark */))
+				goto end;
+		if(compact_choose(c, datadir))
+			goto end;
+		if(!c->stats.files_chosen)
+		{
+			print_stats(c, group);
+			ret=0;
+			goto end;
+		}
+		if(!c->dry_run && compact_copy(c, datadir,
+			get_int(globalcs[OPT_MAX_STORAGE_SUBDIRS])))
+				goto end;
+	}
+
+	for(client=clients; client; client=client->next)
+		if(for_each_backup(c, client->sdirs, 0 /* rewrite */))
+			goto end;
+
+	if(!c->dry_run)
+	{
+		if(compact_delete_old(c, datadir))
+			goto end;
+		// The journal has to go first, or the next run would take the
+		// new files for orphans.
+		unlink(c->journal);
+		unlink(c->map);
+	}
+	print_stats(c, group);
+	ret=0;
+end:
+	clients_free(&clients);
+	lock_release(lock);
+	lock_free(&lock);
+	free_w(&dedup);
+	free_w(&clients_dir);
+	free_w(&datadir);
+	free_w(&champlock);
+	return ret;
+}
+
+static int add_all_groups(const char *directory, struct strlist **grouplist)
+{
+	int ret=-1;
+	DIR *dirp=NULL;
+	struct dirent *dirinfo=NULL;
+
+	if(!(dirp=opendir(directory)))
+	{
+		logp("Could not opendir '%s': %s\n",
+			directory, strerror(errno));
+		goto end;
+	}
+	while((dirinfo=readdir(dirp)))
+	{
+		if(dirinfo->d_ino==0
+		  || looks_like_tmp_or_hidden_file(dirinfo->d_name))
+			continue;
+		if(strlist_add_sorted(grouplist, dirinfo->d_name, 1))
+			goto end;
+	}
+	ret=0;
+end:
+	if(dirp) closedir(dirp);
+	return ret;
+}
+
+int run_bcompact(int argc, char *argv[])
+{
+	int ret=1;
+	int option=0;
+	int dry_run=0;
+	int threshold=DEFAULT_THRESHOLD;
+	char *groups=NULL;
+	const char *configfile=get_config_path();
+	struct conf **globalcs=NULL;
+	struct strlist *g=NULL;
+	struct strlist *grouplist=NULL;
+	struct compact *c=NULL;
+
+	optind=1;
+	while((option=getopt(argc, argv, "c:g:hnt:vV?"))!=-1)
+	{
+		switch(option)
+		{
+			case 'c':
+				configfile=optarg;
+				break;
+			case 'g':
+				groups=optarg;
+				break;
+			case 'n':
+				dry_run=1;
+				break;
+			case 't':
+				threshold=atoi(optarg);
+				break;
+			case 'V':
+				logf("%s-%s\n", prog, VERSION);
+				return 0;
+			case 'v':
+				verbose=1;
+				break;
+			case 'h':
+			case '?':
+				return usage();
+		}
+	}
+	if(optind<argc)
+	{
+		logp("Do not specify extra arguments.\n");
+		return 1;
+	}
+	if(threshold<1 || threshold>100)
+	{
+		logp("The argument to -t needs to be between 1 and 100.\n");
+		return 1;
+	}
+
+	hexmap_init();
+
+	if(groups)
+	{
+		char *tok=NULL;
+		if((tok=strtok(groups, ",\n")))
+		{
+			do
+			{
+				if(strlist_add(&grouplist, tok, 1))
+					goto end;
+			} while((tok=strtok(NULL, ",\n")));
+		}
+		if(!grouplist)
+		{
+			logp("unable to read list of groups\n");
+			goto end;
+		}
+	}
+
+	if(!(globalcs=confs_alloc())
+	  || confs_init(globalcs)
+	  || conf_load_global_only(configfile, globalcs))
+		goto end;
+	if(get_e_burp_mode(globalcs[OPT_BURP_MODE])!=BURP_MODE_SERVER)
+	{
+		logp("%s is not a server config file\n", configfile);
+		goto end;
+	}
+	manio_set_zstd(get_int(globalcs[OPT_MANIFEST_ZSTD]),
+		get_int(globalcs[OPT_MANIFEST_ZSTD_FRAME]));
+	if(!grouplist && add_all_groups(
+		get_string(globalcs[OPT_DIRECTORY]), &grouplist))
+			goto end;
+	if(!(c=compact_alloc(threshold, dry_run)))
+		goto end;
+
+	for(g=grouplist; g; g=g->next)
+		if(compact_group(c, globalcs, g->path))
+			goto end;
+	ret=0;
+end:
+	compact_free(&c);
+	confs_free(&globalcs);
+	strlists_free(&grouplist);
+	return ret;
+}
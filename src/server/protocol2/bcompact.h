@@ -0,0 +1,65 @@
+#ifndef _BCOMPACT_H
+#define _BCOMPACT_H
+
+#include <uthash.h>
+#include "../../protocol2/blk.h"
+
+// A data file that some manifest refers to, and which of its blocks.
+struct dfile
+{
+	uint64_t key;
+	uint16_t live;
+	uint8_t compact;
+	uint8_t used[DATA_FILE_SIG_MAX/8];
+	UT_hash_handle hh;
+};
+
+// Where a block that is still in use got copied to.
+struct remap
+{
+	uint64_t from;
+	uint64_t to;
+	UT_hash_handle hh;
+};
+
+struct compact_stats
+{
+	uint64_t files_scanned;
+	uint64_t bytes_scanned;
+	uint64_t files_chosen;
+	uint64_t files_written;
+	uint64_t files_deleted;
+	uint64_t bytes_deleted;
+	uint64_t data_read;
+	uint64_t data_written;
+	uint64_t manifests_changed;
+	uint64_t manifest_bytes;
+};
+
+struct compact
+{
+	int threshold;
+	int dry_run;
+	char *map;
+	char *journal;
+	struct dfile *dfiles;
+	struct remap *remaps;
+	struct compact_stats stats;
+};
+
+extern int run_bcompact(int argc, char *argv[]);
+
+#ifdef UTEST
+extern struct compact *compact_alloc(int threshold, int dry_run);
+extern void compact_free(struct compact **c);
+extern int compact_mark_manifest(struct compact *c, const char *path);
+extern int compact_choose(struct compact *c, const char *datadir);
+extern int compact_copy(struct compact *c, const char *datadir,
+	int max_storage_subdirs);
+extern int compact_rewrite_manifest(struct compact *c, const char *path,
+	const char *dindex_path);
+extern int compact_delete_old(struct compact *c, const char *datadir);
+extern int compact_remove_orphans(struct compact *c, const char *datadir);
+#endif
+
+#endif
@@ -255,6 +255,7 @@ int champ_chooser_server(struct sdirs *sdirs, struct conf **confs)
 		goto end;
 	}
 	set_non_blocking(s);
+	blk_pool_set(1);
 
 	if(!(as=async_alloc())
 	  || !(asfd=asfd_alloc())
@@ -267,8 +268,10 @@ int champ_chooser_server(struct sdirs *sdirs, struct conf **confs)
 
 	// I think that this is probably the best point at which to run a
 	// cleanup job to delete unused data files, because no other process
-	// can fiddle with the dedup_group at this point.
-	if(delete_unused_data_files(sdirs))
+	// can fiddle with the dedup_group at this point. The job carries on
+	// from where it got to last time, and does not need backups of other
+	// clients to be finished before it can start.
+	if(delete_unused_data_files(sdirs, confs))
 		goto end;
 
 	// Load the sparse indexes for this dedup group.
@@ -346,6 +349,7 @@ int champ_chooser_server(struct sdirs *sdirs, struct conf **confs)
 	}
 
 end:
+	blk_print_alloc_stats();
 	logp("champ chooser exiting: %d\n", ret);
 	log_fzp_set(NULL, confs);
 	async_free(&as);
@@ -356,6 +360,8 @@ end:
 	lock_release(lock);
 	lock_free(&lock);
 	scores_free(&scores);
+	blk_pool_free();
+	blk_pool_set(0);
 	return ret;
 }
 
@@ -1,7 +1,9 @@
 #include "../../../burp.h"
 #include "../../../alloc.h"
 #include "../../../fsops.h"
+#include "../../../fzp.h"
 #include "../../../hexmap.h"
+#include "../../../iobuf.h"
 #include "../../../log.h"
 #include "../../../prepend.h"
 #include "../../../protocol2/blk.h"
@@ -9,35 +11,187 @@
 #include "../../../strlist.h"
 #include "../../sdirs.h"
 #include "../backup_phase4.h"
+#include "dindex.h"
 
-static int backup_in_progress(const char *fullpath)
+// Unused data files are cleaned up in two stages, which can be spread over
+// any number of champ chooser starts.
+// Mark: merge the dfiles of every client into a new dindex. Whatever was in
+// the previous dindex and is not in the new one is a candidate for
+// deletion. Backups that are in progress at the time are noted as pending,
+// because they might refer to candidates in ways that are not in any
+// dfiles yet.
+// Sweep: once none of the pending backups are still in progress, unlink the
+// candidates, apart from any that are in dfiles written since the mark.
+// This can be rate limited, and stopped part way and carried on next time.
+// If a backup gets deleted after the mark, the backups in progress at that
+// point become pending too, because they might have deduplicated against
+// the deleted one.
+
+#define GC_DIR		"gc"
+#define GC_STATE	"state"
+#define GC_PENDING	"pending"
+#define GC_CANDIDATES	"candidates"
+#define GC_DELETED	"deleted"
+#define GC_SAVE_EVERY	1000
+
+#ifndef UTEST
+static
+#endif
+void gc_free(struct gc **gc)
+{
+	if(!gc || !*gc) return;
+	free_w(&(*gc)->dir);
+	free_w(&(*gc)->state);
+	free_w(&(*gc)->pending);
+	free_w(&(*gc)->candidates);
+	free_w(&(*gc)->deleted);
+	free_v((void **)gc);
+}
+
+#ifndef UTEST
+static
+#endif
+struct gc *gc_alloc(const char *datadir)
+{
+	struct gc *gc;
+	if(!(gc=(struct gc *)calloc_w(1, sizeof(struct gc), __func__)))
+		return NULL;
+	if(!(gc->dir=prepend_s(datadir, GC_DIR))
+	  || !(gc->state=prepend_s(gc->dir, GC_STATE))
+	  || !(gc->pending=prepend_s(gc->dir, GC_PENDING))
+	  || !(gc->candidates=prepend_s(gc->dir, GC_CANDIDATES))
+	  || !(gc->deleted=prepend_s(gc->dir, GC_DELETED)))
+		gc_free(&gc);
+	return gc;
+}
+
+// Most of the files are usually not there, so do not complain about that.
+static struct fzp *open_if_exists(const char *path)
+{
+	struct stat statp;
+	if(lstat(path, &statp))
+		return NULL;
+	return fzp_open(path, "rb");
+}
+
+static uint64_t read_stamp(const char *path)
+{
+	char buf[32]="";
+	uint64_t stamp=0;
+	struct fzp *fzp=NULL;
+	if(!(fzp=open_if_exists(path)))
+		return 0;
+	if(fzp_gets(fzp, buf, sizeof(buf)))
+		stamp=strtoull(buf, NULL, 10);
+	fzp_close(&fzp);
+	return stamp;
+}
+
+static int write_file_atomically(const char *path, const char *str)
 {
 	int ret=-1;
+	char *tmp=NULL;
+	struct fzp *fzp=NULL;
+	if(!(tmp=prepend(path, ".tmp"))
+	  || build_path_w(tmp)
+	  || !(fzp=fzp_open(tmp, "wb")))
+		goto end;
+	fzp_printf(fzp, "%s", str);
+	if(fzp_close(&fzp)
+	  || do_rename(tmp, path))
+		goto end;
+	ret=0;
+end:
+	fzp_close(&fzp);
+	free_w(&tmp);
+	return ret;
+}
+
+static int gc_load(struct gc *gc)
+{
+	char buf[256]="";
+	struct fzp *fzp=NULL;
+	if(!(fzp=open_if_exists(gc->state)))
+		return 0;
+	if(!fzp_gets(fzp, buf, sizeof(buf))
+	  || sscanf(buf, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+		" %" SCNu64 " %" SCNu64, &gc->generation, &gc->marked,
+		&gc->checked, &gc->done, &gc->files, &gc->bytes)!=6)
+	{
+		logp("Could not read %s, starting again\n", gc->state);
+		gc->generation=0;
+		gc->done=0;
+		unlink(gc->candidates);
+	}
+	fzp_close(&fzp);
+	return 0;
+}
+
+static int gc_save(struct gc *gc)
+{
+	char buf[256]="";
+	snprintf(buf, sizeof(buf), "%" PRIu64 " %" PRIu64 " %" PRIu64
+		" %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+		gc->generation, gc->marked, gc->checked,
+		gc->done, gc->files, gc->bytes);
+	return write_file_atomically(gc->state, buf);
+}
+
+// So that a sweep knows that a backup that it might have been relying on
+// has gone.
+int dindex_note_deleted_backup(const char *datadir)
+{
+	int ret=-1;
+	char buf[32]="";
+	struct gc *gc=NULL;
+	if(!(gc=gc_alloc(datadir)))
+		return -1;
+	snprintf(buf, sizeof(buf), "%" PRIu64 "\n", (uint64_t)time(NULL));
+	ret=write_file_atomically(gc->deleted, buf);
+	gc_free(&gc);
+	return ret;
+}
+
+// Returns the directory that a backup in progress is in, if there is one.
+static int backup_in_progress(const char *fullpath, char **target)
+{
+	int ret=-1;
+	ssize_t len;
+	char real[256]="";
 	struct stat statp;
 	char *working=NULL;
 	char *finishing=NULL;
+	const char *p=NULL;
 
 	if(!(working=prepend_s(fullpath, "working"))
 	  || !(finishing=prepend_s(fullpath, "finishing")))
 		goto end;
 
-	if(!lstat(working, &statp)
-	  || !lstat(finishing, &statp))
+	if(!lstat(working, &statp))
+		p=working;
+	else if(!lstat(finishing, &statp))
+		p=finishing;
+	if(!p)
 	{
-		logp("%s looks like it has a backup in progress.\n",
-				fullpath);
-		logp("Give up clean up attempt.\n");
-		ret=1;
+		ret=0;
 		goto end;
 	}
-	ret=0;
+	if((len=readlink(p, real, sizeof(real)-1))<0)
+		snprintf(real, sizeof(real), "%s", p+strlen(fullpath)+1);
+	else
+		real[len]='\0';
+	if(!(*target=prepend_s(fullpath, real)))
+		goto end;
+	ret=1;
 end:
 	free_w(&working);
 	free_w(&finishing);
 	return ret;
 }
 
-static int get_dfiles_to_merge(struct sdirs *sdirs, struct strlist **s)
+static int get_dfiles_and_in_progress(struct sdirs *sdirs,
+	struct strlist **dfiles_list, struct strlist **in_progress,
+	uint64_t newer_than)
 {
 	int i=0;
 	int n=0;
@@ -45,10 +199,9 @@ static int get_dfiles_to_merge(struct sdirs *sdirs, struct strlist **s)
 	struct stat statp;
 	char *fullpath=NULL;
 	char *dfiles=NULL;
+	char *target=NULL;
 	struct dirent **dir=NULL;
 
-	logp("Attempting to clean up unused data files %s\n", sdirs->clients);
-
 	if(entries_in_directory_no_sort(sdirs->clients, &dir, &n, 1 /*atime*/))
 	{
 		logp("scandir failed for %s in %s: %s\n",
@@ -69,23 +222,29 @@ static int get_dfiles_to_merge(struct sdirs *sdirs, struct strlist **s)
 				goto end;
 		}
 
-		if(strcmp(sdirs->client, fullpath))
+		if(in_progress)
 		{
-			switch(backup_in_progress(fullpath))
+			switch(backup_in_progress(fullpath, &target))
 			{
 				case 0: break;
-				case 1: ret=0;
+				case 1: if(strlist_add(in_progress, target, 0))
+						goto end;
+					free_w(&target);
+					break;
 				default: goto end;
 			}
 		}
 
+		if(!dfiles_list)
+			continue;
 		free_w(&dfiles);
 		if(!(dfiles=prepend_s(fullpath, "dfiles"))
-		  || lstat(dfiles, &statp))
+		  || lstat(dfiles, &statp)
+		  || (uint64_t)statp.st_mtime<newer_than)
 			continue;
 
 		// Have a good entry. Add it to the list.
-		if(strlist_add(s, dfiles, 0))
+		if(strlist_add(dfiles_list, dfiles, 0))
 			goto end;
 	}
 
@@ -93,6 +252,7 @@ static int get_dfiles_to_merge(struct sdirs *sdirs, struct strlist **s)
 end:
 	free_w(&fullpath);
 	free_w(&dfiles);
+	free_w(&target);
 	if(dir)
 	{
 		for(i=0; i<n; i++) free_v((void **)&dir[i]);
@@ -101,35 +261,94 @@ end:
 	return ret;
 }
 
-static int do_unlink(struct blk *oblk, const char *datadir)
+// Merge a list of dfiles into one sorted dindex in tmpdir. Returns 1 if
+// there was nothing to merge.
+static int merge_dfiles(struct strlist *slist, const char *tmpdir,
+	const char *dindex)
 {
 	int ret=-1;
+	uint64_t fcount=0;
+	char hfile[32];
+	char *hlinks=NULL;
 	char *fullpath=NULL;
-	char *savepath=uint64_to_savepathstr(oblk->savepath);
-	if(!(fullpath=prepend_s(datadir, savepath)))
+	struct strlist *s=NULL;
+	struct stat statp;
+
+	if(!(hlinks=prepend_s(tmpdir, "hlinks"))
+	  || recursive_delete(tmpdir)
+	  || build_path_w(tmpdir)
+	  || mkdir(tmpdir, 0777)
+	  || mkdir(hlinks, 0777))
 		goto end;
-	errno=0;
-	if(unlink(fullpath) && errno!=ENOENT)
+
+	for(s=slist; s; s=s->next)
 	{
-		logp("Could not unlink %s: %s\n", fullpath, strerror(errno));
-		goto end;
+		snprintf(hfile, sizeof(hfile), "%08"PRIX64, fcount++);
+		free_w(&fullpath);
+		if(!(fullpath=prepend_s(hlinks, hfile)))
+			goto end;
+		if(link(s->path, fullpath))
+		{
+			logp("Could not hardlink %s to %s: %s\n",
+				fullpath, s->path, strerror(errno));
+			goto end;
+		}
 	}
-	logp("Deleted %s\n", savepath);
-	ret=0;
+
+	if(merge_files_in_dir(dindex,
+		tmpdir, "hlinks", fcount, merge_dindexes))
+			goto end;
+
+	ret=lstat(dindex, &statp)?1:0;
 end:
 	free_w(&fullpath);
+	free_w(&hlinks);
 	return ret;
 }
 
+// Return 0 for OK, 1 for finished reading the file, -1 for error.
+static int next_savepath(struct fzp **fzp, struct iobuf *buf, struct blk *blk)
+{
+	if(!*fzp || buf->buf)
+		return 0;
+	switch(iobuf_fill_from_fzp(buf, *fzp))
+	{
+		case 1:
+			fzp_close(fzp);
+			return 1;
+		case 0:
+			if(buf->cmd!=CMD_SAVE_PATH)
+			{
+				logp("unknown cmd in %s: %c\n",
+					__func__, buf->cmd);
+				return -1;
+			}
+			return blk_set_from_iobuf_savepath(blk, buf);
+		default:
+			return -1;
+	}
+}
+
+static int savepath_to_fzp(struct fzp *fzp, uint64_t savepath)
+{
+	struct blk blk;
+	struct iobuf wbuf;
+	blk.savepath=savepath;
+	blk_to_iobuf_savepath(&blk, &wbuf);
+	return iobuf_send_msg_fzp(&wbuf, fzp);
+}
+
+// Write out everything in the old dindex that is not in the new one.
 #ifndef UTEST
 static
 #endif
-int compare_dindexes_and_unlink_datafiles(const char *dindex_old,
-	const char *dindex_new, const char *datadir)
+int compare_dindexes(const char *dindex_old,
+	const char *dindex_new, const char *candidates)
 {
 	int ret=-1;
 	struct fzp *nzp=NULL;
 	struct fzp *ozp=NULL;
+	struct fzp *czp=NULL;
 	struct iobuf nbuf;
 	struct iobuf obuf;
 	struct blk nblk;
@@ -139,52 +358,17 @@ int compare_dindexes_and_unlink_datafiles(const char *dindex_old,
 	iobuf_init(&obuf);
 	memset(&nblk, 0, sizeof(struct blk));
 	memset(&oblk, 0, sizeof(struct blk));
-	
+
 	if(!(nzp=fzp_gzopen(dindex_new, "rb"))
-	  || !(ozp=fzp_gzopen(dindex_old, "rb")))
+	  || !(ozp=fzp_gzopen(dindex_old, "rb"))
+	  || !(czp=fzp_gzopen(candidates, "wb")))
 		goto end;
 
 	while(nzp || ozp)
 	{
-		if(nzp
-		  && !nbuf.buf)
-		{
-			switch(iobuf_fill_from_fzp(&nbuf, nzp))
-			{
-				case 1: fzp_close(&nzp);
-					break;
-				case 0: if(nbuf.cmd!=CMD_SAVE_PATH)
-					{
-						logp("unknown cmd in %s: %c\n",
-							__func__, nbuf.cmd);
-						goto end;
-					}
-					if(blk_set_from_iobuf_savepath(&nblk,
-						&nbuf)) goto end;
-					break;
-				default: goto end; // Error;
-			}
-		}
-
-		if(ozp
-		  && !obuf.buf)
-		{
-			switch(iobuf_fill_from_fzp(&obuf, ozp))
-			{
-				case 1: fzp_close(&ozp);
-					break;
-				case 0: if(obuf.cmd!=CMD_SAVE_PATH)
-					{
-						logp("unknown cmd in %s: %c\n",
-							__func__, obuf.cmd);
-						goto end;
-					}
-					if(blk_set_from_iobuf_savepath(&oblk,
-						&obuf)) goto end;
-					break;
-				default: goto end; // Error;
-			}
-		}
+		if(next_savepath(&nzp, &nbuf, &nblk)<0
+		  || next_savepath(&ozp, &obuf, &oblk)<0)
+			goto end;
 
 		if(nbuf.buf && !obuf.buf)
 		{
@@ -193,8 +377,8 @@ int compare_dindexes_and_unlink_datafiles(const char *dindex_old,
 		}
 		else if(!nbuf.buf && obuf.buf)
 		{
-			// No more in the new file. Delete old entry.
-			if(do_unlink(&oblk, datadir))
+			// No more in the new file. Old entry is a candidate.
+			if(savepath_to_fzp(czp, oblk.savepath))
 				goto end;
 			iobuf_free_content(&obuf);
 		}
@@ -216,84 +400,394 @@ int compare_dindexes_and_unlink_datafiles(const char *dindex_old,
 		else
 		{
 			// Only in the old file.
-			if(do_unlink(&oblk, datadir))
+			if(savepath_to_fzp(czp, oblk.savepath))
 				goto end;
 			iobuf_free_content(&obuf);
 		}
 	}
 
-
+	if(fzp_close(&czp))
+		goto end;
 	ret=0;
 end:
 	iobuf_free_content(&nbuf);
 	iobuf_free_content(&obuf);
 	fzp_close(&nzp);
 	fzp_close(&ozp);
+	fzp_close(&czp);
 	return ret;
 }
 
-int delete_unused_data_files(struct sdirs *sdirs)
+static int do_unlink(uint64_t savepath, const char *datadir,
+	uint64_t *bytes)
 {
 	int ret=-1;
-	uint64_t fcount=0;
-	char hfile[32];
-	char *tmpdir=NULL;
-	char *hlinks=NULL;
-	char *fullpath=NULL;
-	char *dindex_new=NULL;
-	char *dindex_old=NULL;
-	struct strlist *s=NULL;
-	struct strlist *slist=NULL;
 	struct stat statp;
+	char *fullpath=NULL;
+	if(!(fullpath=prepend_s(datadir, uint64_to_savepathstr(savepath))))
+		goto end;
+	if(!lstat(fullpath, &statp))
+		*bytes+=statp.st_size;
+	errno=0;
+	if(unlink(fullpath) && errno!=ENOENT)
+	{
+		logp("Could not unlink %s: %s\n", fullpath, strerror(errno));
+		goto end;
+	}
+	ret=0;
+end:
+	free_w(&fullpath);
+	return ret;
+}
 
-	if(get_dfiles_to_merge(sdirs, &slist)
-	  || !(dindex_old=prepend_s(sdirs->data, "dindex"))
-	  || !(tmpdir=prepend_s(sdirs->data, "dindex.new"))
-	  || !(hlinks=prepend_s(tmpdir, "hlinks"))
-	  || recursive_delete(tmpdir)
-	  || mkdir(tmpdir, 0777)
-	  || mkdir(hlinks, 0777))
+static uint64_t now_usec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000000+tv.tv_usec;
+}
+
+// Unlink candidates that are not in 'keep' (which may be NULL), carrying on
+// from gc->done. Gives up after time_limit seconds, if set, and does not
+// unlink more than rate files a second, if set.
+// Returns 0 when all candidates are dealt with, 1 when stopped early.
+#ifndef UTEST
+static
+#endif
+int sweep_candidates(struct gc *gc, const char *keep, const char *datadir,
+	int rate, int time_limit)
+{
+	int ret=-1;
+	uint64_t skip=gc->done;
+	uint64_t deleted=0;
+	uint64_t start=now_usec();
+	struct fzp *czp=NULL;
+	struct fzp *kzp=NULL;
+	struct iobuf cbuf;
+	struct iobuf kbuf;
+	struct blk cblk;
+	struct blk kblk;
+
+	iobuf_init(&cbuf);
+	iobuf_init(&kbuf);
+	memset(&cblk, 0, sizeof(struct blk));
+	memset(&kblk, 0, sizeof(struct blk));
+
+	if(!(czp=fzp_gzopen(gc->candidates, "rb"))
+	  || (keep && !(kzp=fzp_gzopen(keep, "rb"))))
 		goto end;
 
-	for(s=slist; s; s=s->next)
+	while(1)
 	{
-		snprintf(hfile, sizeof(hfile), "%08"PRIX64, fcount++);
-		free_w(&fullpath);
-		if(!(fullpath=prepend_s(hlinks, hfile)))
+		switch(next_savepath(&czp, &cbuf, &cblk))
+		{
+			case 0: break;
+			case 1: ret=0; goto end;
+			default: goto end;
+		}
+		if(skip)
+		{
+			skip--;
+			iobuf_free_content(&cbuf);
+			continue;
+		}
+		while(1)
+		{
+			if(next_savepath(&kzp, &kbuf, &kblk)<0)
+				goto end;
+			if(!kbuf.buf || kblk.savepath>=cblk.savepath)
+				break;
+			iobuf_free_content(&kbuf);
+		}
+		if(!kbuf.buf || kblk.savepath!=cblk.savepath)
+		{
+			if(do_unlink(cblk.savepath, datadir, &gc->bytes))
+				goto end;
+			gc->files++;
+			deleted++;
+		}
+		iobuf_free_content(&cbuf);
+		gc->done++;
+
+		if(!(gc->done%GC_SAVE_EVERY) && gc_save(gc))
 			goto end;
-		if(link(s->path, fullpath))
+		if(time_limit
+		  && now_usec()-start>=(uint64_t)time_limit*1000000)
 		{
-			logp("Could not hardlink %s to %s: %s\n",
-				fullpath, s->path, strerror(errno));
+			ret=1;
 			goto end;
 		}
+		if(rate)
+		{
+			uint64_t due=start+deleted*1000000/rate;
+			uint64_t now=now_usec();
+			if(due>now) usleep(due-now);
+		}
 	}
+end:
+	iobuf_free_content(&cbuf);
+	iobuf_free_content(&kbuf);
+	fzp_close(&czp);
+	fzp_close(&kzp);
+	return ret;
+}
 
-	if(!(dindex_new=prepend_s(tmpdir, "dindex")))
+static int pending_to_file(struct gc *gc, struct strlist *pending)
+{
+	int ret=-1;
+	char *tmp=NULL;
+	struct fzp *fzp=NULL;
+	struct strlist *s;
+	if(!(tmp=prepend(gc->pending, ".tmp"))
+	  || !(fzp=fzp_open(tmp, "wb")))
+		goto end;
+	for(s=pending; s; s=s->next)
+		fzp_printf(fzp, "%s\n", s->path);
+	if(fzp_close(&fzp)
+	  || do_rename(tmp, gc->pending))
 		goto end;
+	ret=0;
+end:
+	fzp_close(&fzp);
+	free_w(&tmp);
+	return ret;
+}
 
-	if(merge_files_in_dir(dindex_new,
-		tmpdir, "hlinks", fcount, merge_dindexes))
-			goto end;
+static int still_in_progress(const char *path)
+{
+	int ret=0;
+	char *client=NULL;
+	char *target=NULL;
+	char *p;
+	if(!(client=strdup_w(path, __func__)))
+		return -1;
+	if((p=strrchr(client, '/')))
+	{
+		*p='\0';
+		switch(backup_in_progress(client, &target))
+		{
+			case 0: break;
+			case 1: ret=!strcmp(target, path); break;
+			default: ret=-1; break;
+		}
+	}
+	free_w(&client);
+	free_w(&target);
+	return ret;
+}
+
+// Returns the number of pending backups that are still in progress. Those
+// that have finished are dropped from the file, and any extra ones are
+// added.
+static int update_pending(struct gc *gc, struct strlist *extra)
+{
+	int ret=-1;
+	int count=0;
+	char buf[4096]="";
+	struct fzp *fzp=NULL;
+	struct strlist *s=NULL;
+	struct strlist *pending=NULL;
 
-	if(!lstat(dindex_new, &statp))
+	if((fzp=open_if_exists(gc->pending)))
 	{
-		if(!lstat(dindex_old, &statp)
-		  && compare_dindexes_and_unlink_datafiles(dindex_old,
-			dindex_new, sdirs->data))
+		while(fzp_gets(fzp, buf, sizeof(buf)))
+		{
+			size_t len=strlen(buf);
+			if(len && buf[len-1]=='\n') buf[len-1]='\0';
+			if(!*buf) continue;
+			switch(still_in_progress(buf))
+			{
+				case 0: continue;
+				case 1: break;
+				default: goto end;
+			}
+			if(strlist_add_sorted(&pending, buf, 0))
 				goto end;
-		if(do_rename(dindex_new, dindex_old))
+		}
+		fzp_close(&fzp);
+	}
+	for(s=extra; s; s=s->next)
+		if(!strlist_find(pending, s->path, 0)
+		  && strlist_add_sorted(&pending, s->path, 0))
 			goto end;
+	for(s=pending; s; s=s->next)
+	{
+		logp("Data file clean up is waiting for %s\n", s->path);
+		count++;
 	}
+	if(pending_to_file(gc, pending))
+		goto end;
+	ret=count;
+end:
+	fzp_close(&fzp);
+	strlists_free(&pending);
+	return ret;
+}
+
+static int gc_mark(struct gc *gc, struct sdirs *sdirs)
+{
+	int ret=-1;
+	char *tmpdir=NULL;
+	char *dindex_new=NULL;
+	char *dindex_old=NULL;
+	char *candidates_tmp=NULL;
+	struct strlist *slist=NULL;
+	struct strlist *in_progress=NULL;
+	struct stat statp;
+	uint64_t marked=(uint64_t)time(NULL);
+
+	logp("Working out unused data files in %s\n", sdirs->data);
+
+	if(get_dfiles_and_in_progress(sdirs, &slist, &in_progress, 0)
+	  || !(dindex_old=prepend_s(sdirs->data, "dindex"))
+	  || !(tmpdir=prepend_s(sdirs->data, "dindex.new"))
+	  || !(dindex_new=prepend_s(tmpdir, "dindex"))
+	  || !(candidates_tmp=prepend(gc->candidates, ".tmp")))
+		goto end;
+
+	switch(merge_dfiles(slist, tmpdir, dindex_new))
+	{
+		case 0: break;
+		case 1: ret=0; goto end; // Nothing to do.
+		default: goto end;
+	}
+
+	if(!lstat(dindex_old, &statp))
+	{
+		if(build_path_w(candidates_tmp)
+		  || compare_dindexes(dindex_old, dindex_new, candidates_tmp)
+		  || do_rename(candidates_tmp, gc->candidates))
+			goto end;
+		unlink(gc->pending);
+		if(update_pending(gc, in_progress)<0)
+			goto end;
+		gc->generation++;
+		gc->marked=marked;
+		gc->checked=marked;
+		gc->done=0;
+		gc->files=0;
+		gc->bytes=0;
+		if(gc_save(gc))
+			goto end;
+	}
+	if(do_rename(dindex_new, dindex_old))
+		goto end;
 
 	ret=0;
 end:
 	strlists_free(&slist);
+	strlists_free(&in_progress);
 	if(tmpdir) recursive_delete(tmpdir);
-	free_w(&fullpath);
-	free_w(&hlinks);
 	free_w(&tmpdir);
 	free_w(&dindex_new);
 	free_w(&dindex_old);
+	free_w(&candidates_tmp);
+	return ret;
+}
+
+static int gc_sweep(struct gc *gc, struct sdirs *sdirs,
+	int rate, int time_limit)
+{
+	int ret=-1;
+	char *tmpdir=NULL;
+	char *keep=NULL;
+	const char *k=NULL;
+	struct strlist *recent=NULL;
+
+	if(!(tmpdir=prepend_s(gc->dir, "recent"))
+	  || !(keep=prepend_s(tmpdir, "dindex"))
+	  || get_dfiles_and_in_progress(sdirs, &recent, NULL, gc->marked))
+		goto end;
+	// Keep anything that backups since the mark refer to.
+	switch(merge_dfiles(recent, tmpdir, keep))
+	{
+		case 0: k=keep; break;
+		case 1: break;
+		default: goto end;
+	}
+
+	switch(sweep_candidates(gc, k, sdirs->data, rate, time_limit))
+	{
+		case 0:
+			logp("Data file clean up %" PRIu64 " finished\n",
+				gc->generation);
+			unlink(gc->candidates);
+			unlink(gc->pending);
+			ret=0;
+			break;
+		case 1:
+			logp("Data file clean up %" PRIu64
+				" stopped after %" PRIu64 " candidates\n",
+				gc->generation, gc->done);
+			ret=0;
+			break;
+		default:
+			break;
+	}
+	logp("Deleted %" PRIu64 " unused data files, reclaimed %" PRIu64
+		" bytes\n", gc->files, gc->bytes);
+	if(gc_save(gc))
+		ret=-1;
+end:
+	strlists_free(&recent);
+	if(tmpdir) recursive_delete(tmpdir);
+	free_w(&tmpdir);
+	free_w(&keep);
+	return ret;
+}
+
+int delete_unused_data_files(struct sdirs *sdirs, struct conf **confs)
+{
+	int ret=-1;
+	int pending=0;
+	uint64_t deleted=0;
+	struct gc *gc=NULL;
+	struct stat statp;
+	struct strlist *in_progress=NULL;
+	int rate=confs?get_int(confs[OPT_GC_RATE]):0;
+	int time_limit=confs?get_int(confs[OPT_GC_TIME_LIMIT]):0;
+
+	logp("Attempting to clean up unused data files %s\n", sdirs->clients);
+
+	if(!(gc=gc_alloc(sdirs->data))
+	  || gc_load(gc))
+		goto end;
+
+	if(lstat(gc->candidates, &statp))
+	{
+		if(gc_mark(gc, sdirs))
+			goto end;
+		if(lstat(gc->candidates, &statp))
+		{
+			ret=0;
+			goto end;
+		}
+	}
+
+	if((deleted=read_stamp(gc->deleted))>=gc->checked)
+	{
+		// A backup was deleted since the last look. Anything in
+		// progress now might have deduplicated against it.
+		if(get_dfiles_and_in_progress(sdirs, NULL, &in_progress, 0))
+			goto end;
+		gc->checked=(uint64_t)time(NULL)+1;
+		if(gc_save(gc))
+			goto end;
+	}
+	if((pending=update_pending(gc, in_progress))<0)
+		goto end;
+	if(pending)
+	{
+		logp("Data file clean up %" PRIu64
+			" waiting for %d backups to finish\n",
+			gc->generation, pending);
+		ret=0;
+		goto end;
+	}
+
+	ret=gc_sweep(gc, sdirs, rate, time_limit);
+end:
+	strlists_free(&in_progress);
+	gc_free(&gc);
 	return ret;
 }
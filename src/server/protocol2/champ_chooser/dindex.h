@@ -1,11 +1,33 @@
 #ifndef _DINDEX_H
 #define _DINDEX_H
 
-extern int delete_unused_data_files(struct sdirs *sdirs);
+// Where a clean up of unused data files has got to.
+struct gc
+{
+	char *dir;
+	char *state;
+	char *pending;
+	char *candidates;
+	char *deleted;
+
+	uint64_t generation;
+	uint64_t marked;	// When the candidates were worked out.
+	uint64_t checked;	// When deleted backups were last checked for.
+	uint64_t done;		// Candidates dealt with so far.
+	uint64_t files;		// Data files deleted this generation.
+	uint64_t bytes;		// Bytes reclaimed this generation.
+};
+
+extern int delete_unused_data_files(struct sdirs *sdirs, struct conf **confs);
+extern int dindex_note_deleted_backup(const char *datadir);
 
 #ifdef UTEST
-extern int compare_dindexes_and_unlink_datafiles(const char *dindex_old,
-	const char *dindex_new, const char *datadir);
+extern struct gc *gc_alloc(const char *datadir);
+extern void gc_free(struct gc **gc);
+extern int compare_dindexes(const char *dindex_old,
+	const char *dindex_new, const char *candidates);
+extern int sweep_candidates(struct gc *gc, const char *keep,
+	const char *datadir, int rate, int time_limit);
 #endif
 
 #endif
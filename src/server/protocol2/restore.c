@@ -2,6 +2,7 @@
 #include "../../action.h"
 #include "../../asfd.h"
 #include "../../async.h"
+#include "../../attribs.h"
 #include "../../cmd.h"
 #include "../../cntr.h"
 #include "../../hexmap.h"
@@ -61,7 +62,8 @@ int restore_sbuf_protocol2(struct asfd *asfd, struct sbuf *sb, enum action act,
 	enum cntr_status cntr_status,
 	struct cntr *cntr, struct sbuf *need_data)
 {
-	if(asfd->write(asfd, &sb->attr)
+	if(attribs_for_peer(sb)
+	  || asfd->write(asfd, &sb->attr)
 	  || asfd->write(asfd, &sb->path))
 		return -1;
 	if(sbuf_is_link(sb)
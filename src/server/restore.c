@@ -5,8 +5,10 @@
 #include "../bu.h"
 #include "../cmd.h"
 #include "../cntr.h"
+#include "../fzp.h"
 #include "../handy.h"
 #include "../linkhash.h"
+#include "../lock.h"
 #include "../log.h"
 #include "../pathcmp.h"
 #include "../prepend.h"
@@ -25,6 +27,180 @@
 #include "protocol2/restore_spool.h"
 #include "sdirs.h"
 
+// A protocol2 restore can be spread over several connections from the same
+// client, because one stream cannot fill a fast link. The client's main
+// connection is part 0. It has the lock, and looks after directories, soft
+// links and specials. Files, and the hard links to them, are shared out
+// between all the parts by a hash of their path.
+static int restore_streams=1;
+static int restore_part=0;
+
+void restore_set_streams(int streams, int part)
+{
+	restore_streams=streams;
+	restore_part=part;
+}
+
+int restore_get_part(void)
+{
+	return restore_part;
+}
+
+int restore_get_streams(void)
+{
+	return restore_streams;
+}
+
+// Given what came after "restore_streams=" in extra_comms. Part 0 asks for
+// how many streams it would like, and gets no more than max. The others say
+// which one they are, out of how many.
+int restore_parse_streams(const char *str, int max)
+{
+	int part=0;
+	int streams=0;
+	if(max<1) max=1;
+	if(sscanf(str, "%d/%d", &part, &streams)!=2
+	  || part<0 || streams<1
+	  || (part && (part>=streams || streams>max)))
+		return -1;
+	if(streams>max) streams=max;
+	restore_set_streams(streams, part);
+	return 0;
+}
+
+// Part 0 leaves a note of what it is restoring next to its lock. The other
+// parts only go ahead if the note is from whoever holds the lock right now,
+// and is for the same backup and number of streams, so that they cannot
+// join in with some other job, or with a restore that has already gone.
+static char *restore_token_path(const char *lockpath)
+{
+	return prepend(lockpath, ".restore");
+}
+
+static int restore_token_read_line(const char *path, char *buf, int len)
+{
+	struct fzp *fzp;
+	if(!(fzp=fzp_open(path, "rb")))
+		return -1;
+	if(!fzp_gets(fzp, buf, len))
+	{
+		fzp_close(&fzp);
+		return -1;
+	}
+	return fzp_close(&fzp);
+}
+
+#ifndef UTEST
+static
+#endif
+int restore_token_write(const char *lockpath, unsigned long bno)
+{
+	int ret=-1;
+	char *path=NULL;
+	struct fzp *fzp=NULL;
+	if(!(path=restore_token_path(lockpath))
+	  || !(fzp=fzp_open(path, "wb")))
+		goto end;
+	if(fzp_printf(fzp, "%d %lu %d\n",
+		(int)getpid(), bno, restore_streams)<0)
+			goto end;
+	ret=fzp_close(&fzp);
+end:
+	fzp_close(&fzp);
+	free_w(&path);
+	return ret;
+}
+
+static void restore_token_remove(const char *lockpath)
+{
+	char *path;
+	if(!(path=restore_token_path(lockpath)))
+		return;
+	unlink(path);
+	free_w(&path);
+}
+
+// A bno of zero matches any backup, for when it is not known yet.
+int restore_token_check(const char *lockpath, unsigned long bno)
+{
+	int ret=-1;
+	int pid=0;
+	int streams=0;
+	int lockpid=0;
+	unsigned long tbno=0;
+	char buf[64]="";
+	char *path=NULL;
+	if(!(path=restore_token_path(lockpath))
+	  || restore_token_read_line(path, buf, sizeof(buf))
+	  || sscanf(buf, "%d %lu %d", &pid, &tbno, &streams)!=3
+	  || restore_token_read_line(lockpath, buf, sizeof(buf))
+	  || sscanf(buf, "%d", &lockpid)!=1)
+		goto end;
+	if(pid!=lockpid
+	  || !lock_test(lockpath)
+	  || streams!=restore_streams
+	  || (bno && tbno!=bno))
+		goto end;
+	ret=0;
+end:
+	free_w(&path);
+	return ret;
+}
+
+static uint32_t restore_path_hash(const char *path)
+{
+	// FNV-1a.
+	uint32_t h=2166136261U;
+	for(; *path; path++)
+	{
+		h^=(uint8_t)*path;
+		h*=16777619U;
+	}
+	return h;
+}
+
+#ifndef UTEST
+static
+#endif
+int restore_stream_owns(struct sbuf *sb, int streams, int part)
+{
+	if(streams<=1) return 1;
+	// Hard links go with the file that they link to, so that the file
+	// is there by the time the link is made.
+	if(sb->path.cmd==CMD_HARD_LINK && sb->link.buf)
+		return restore_path_hash(sb->link.buf)%streams==(uint32_t)part;
+	if(sbuf_is_filedata(sb) || sbuf_is_vssdata(sb))
+		return restore_path_hash(sb->path.buf)%streams==(uint32_t)part;
+	return !part;
+}
+
+static enum asl_ret restore_streams_wait_func(struct asfd *asfd,
+	struct conf **confs, void *param)
+{
+	if(!strcmp(asfd->rbuf->buf, "restore_streams_done"))
+		return ASL_END_OK;
+	iobuf_log_unexpected(asfd->rbuf, __func__);
+	return ASL_END_ERROR;
+}
+
+// The directories have been held back until the other streams have finished
+// writing into them, so that their times and permissions come out right.
+// The client says nothing until then, which can take as long as the rest of
+// the restore, so the network timeout is off while waiting.
+static int restore_streams_wait(struct asfd *asfd, struct conf **confs)
+{
+	int ret;
+	int max_network_timeout=asfd->max_network_timeout;
+	if(asfd->write_str(asfd, CMD_GEN, "restore_streams_wait"))
+		return -1;
+	asfd->max_network_timeout=0;
+	ret=asfd->simple_loop(asfd, confs, NULL, __func__,
+		restore_streams_wait_func);
+	asfd->max_network_timeout=max_network_timeout;
+	asfd->network_timeout=max_network_timeout;
+	return ret;
+}
+
 static enum asl_ret restore_end_func(struct asfd *asfd,
 	struct conf **confs, void *param)
 {
@@ -278,7 +454,8 @@ int restore_ent(struct asfd *asfd,
 	}
 
 	// Check if we have any directories waiting to be restored.
-	while((xb=slist->head))
+	// With several streams, they all wait until the end.
+	while(restore_streams<=1 && (xb=slist->head))
 	{
 		if(is_subdir(xb->path.buf, (*sb)->path.buf))
 		{
@@ -383,9 +560,13 @@ static int restore_stream(struct asfd *asfd, struct sdirs *sdirs,
 			goto end;
 		if(!rs_sent)
 		{
+			char msg[32]="restore_stream";
 			rs_sent=1;
-			if(asfd->write_str(asfd,
-				CMD_GEN, "restore_stream")
+			// Tells the client how many streams to start.
+			if(!restore_part && restore_streams>1)
+				snprintf(msg, sizeof(msg), "restore_stream:%d",
+					restore_streams);
+			if(asfd->write_str(asfd, CMD_GEN, msg)
 			  || asfd_read_expect(asfd,
 				CMD_GEN, "restore_stream_ok"))
 					goto end;
@@ -442,7 +623,10 @@ static int restore_stream(struct asfd *asfd, struct sdirs *sdirs,
 		{
 			if(sb->endfile.buf)
 			{
+				// No need to send it for files that are
+				// not being restored.
 				if(act==ACTION_RESTORE
+				  && need_data->path.buf
 				  && asfd->write(asfd, &sb->endfile))
 					goto end;
 				sbuf_free_content(sb);
@@ -473,7 +657,11 @@ static int restore_stream(struct asfd *asfd, struct sdirs *sdirs,
 			sbuf_free_content(need_data);
 		}
 
-		if(want_to_restore(srestore, sb, regex, cconfs))
+		if(!restore_stream_owns(sb, restore_streams, restore_part))
+		{
+			// Another stream is doing this one.
+		}
+		else if(want_to_restore(srestore, sb, regex, cconfs))
 		{
 			if(restore_ent(asfd, &sb, slist,
 				bu, act, sdirs, cntr_status, cconfs,
@@ -508,10 +696,12 @@ static int actual_restore(struct asfd *asfd, struct bu *bu,
 {
         int ret=-1;
 	int do_restore_stream=1;
+	int token=0;
         // For out-of-sequence directory restoring so that the
         // timestamps come out right:
         struct slist *slist=NULL;
 	struct cntr *cntr=NULL;
+	const char *backup=get_string(cconfs[OPT_BACKUP]);
 
 	if(linkhash_init()
           || !(slist=slist_alloc()))
@@ -529,18 +719,53 @@ static int actual_restore(struct asfd *asfd, struct bu *bu,
 			default: goto end; // Error;
 		}
 	}
+
+	// Extra streams are only for a straightforward restore of one backup.
+	if(get_protocol(cconfs)!=PROTO_2
+	  || act!=ACTION_RESTORE
+	  || srestore
+	  || !do_restore_stream
+	  || (backup && *backup=='a'))
+	{
+		if(restore_part)
+		{
+			log_and_send(asfd, "restore streams not available");
+			goto end;
+		}
+		restore_streams=1;
+	}
+
+	// Written before the client is told to start the other streams.
+	if(restore_streams>1 && !restore_part)
+	{
+		if(restore_token_write(sdirs->lock->path, bu->bno))
+		{
+			log_and_send(asfd, "could not write restore token");
+			goto end;
+		}
+		token=1;
+	}
+
 	if(do_restore_stream && restore_stream(asfd, sdirs, slist,
 		bu, manifest, regex,
 		srestore, cconfs, act, cntr_status))
 			goto end;
 
+	if(restore_streams>1 && !restore_part
+	  && restore_streams_wait(asfd, cconfs))
+		goto end;
+
 	if(restore_remaining_dirs(asfd, bu, slist,
 		act, sdirs, cntr_status, cconfs)) goto end;
 
 	if(cconfs) cntr=get_cntr(cconfs);
 	cntr_print(cntr, act);
-	cntr_stats_to_file(cntr, bu->path, act, cconfs);
+	// The main stream keeps the stats and logs for the whole restore.
+	if(!restore_part)
+		cntr_stats_to_file(cntr, bu->path, act, cconfs);
 end:
+	if(token)
+		restore_token_remove(sdirs->lock->path);
         slist_free(&slist);
 	linkhash_free();
 	rblk_free();
@@ -570,8 +795,8 @@ static int restore_manifest(struct asfd *asfd, struct bu *bu,
 	if(act==ACTION_RESTORE) cntr_status=CNTR_STATUS_RESTORING;
 	else if(act==ACTION_VERIFY) cntr_status=CNTR_STATUS_VERIFYING;
 
-	if((act==ACTION_RESTORE && get_logpaths(bu, "restorelog",
-		&logpath, &logpathz))
+	if((!restore_part && act==ACTION_RESTORE
+		&& get_logpaths(bu, "restorelog", &logpath, &logpathz))
 	  || (act==ACTION_VERIFY && get_logpaths(bu, "verifylog",
 		&logpath, &logpathz))
 	  || !(manifest=prepend_s(bu->path,
@@ -582,7 +807,7 @@ static int restore_manifest(struct asfd *asfd, struct bu *bu,
 		goto end;
 	}
 
-	if(log_fzp_set(logpath, cconfs))
+	if(logpath && log_fzp_set(logpath, cconfs))
 	{
 		char msg[256]="";
 		snprintf(msg, sizeof(msg),
@@ -591,7 +816,8 @@ static int restore_manifest(struct asfd *asfd, struct bu *bu,
 		goto end;
 	}
 
-	*dir_for_notify=strdup_w(bu->path, __func__);
+	if(!restore_part)
+		*dir_for_notify=strdup_w(bu->path, __func__);
 
 	log_restore_settings(cconfs, srestore);
 
@@ -611,13 +837,31 @@ static int restore_manifest(struct asfd *asfd, struct bu *bu,
 		  regex, srestore, act, sdirs, cntr_status, cconfs);
 end:
 	log_fzp_set(NULL, cconfs);
-	compress_file(logpath, logpathz, get_int(cconfs[OPT_COMPRESSION]));
+	if(logpath)
+		compress_file(logpath, logpathz,
+			get_int(cconfs[OPT_COMPRESSION]));
 	free_w(&manifest);
 	free_w(&logpath);
 	free_w(&logpathz);
 	return ret;
 }
 
+// The extra streams must be joining in with the restore that part 0 is doing
+// right now.
+static int restore_part_refused(struct asfd *asfd, struct sdirs *sdirs,
+	struct bu *bu, const char *backup)
+{
+	if(!restore_part)
+		return 0;
+	if((backup && *backup=='a')
+	  || restore_token_check(sdirs->lock->path, bu->bno))
+	{
+		log_and_send(asfd, "no restore in progress");
+		return -1;
+	}
+	return 0;
+}
+
 int do_restore_server(struct asfd *asfd, struct sdirs *sdirs,
 	enum action act, int srestore,
 	char **dir_for_notify, struct conf **confs)
@@ -655,6 +899,8 @@ int do_restore_server(struct asfd *asfd, struct sdirs *sdirs,
 		found=1;
 		// No backup specified, do the most recent.
 		for(bu=bu_list; bu && bu->next; bu=bu->next) { }
+		if(restore_part_refused(asfd, sdirs, bu, backup))
+			goto end;
 		ret=restore_manifest(asfd, bu, regex, srestore,
 				act, sdirs, dir_for_notify, confs);
 	}
@@ -665,6 +911,11 @@ int do_restore_server(struct asfd *asfd, struct sdirs *sdirs,
 		  || bu->bno==bno || (backup && *backup=='a'))
 		{
 			found=1;
+			if(restore_part_refused(asfd, sdirs, bu, backup))
+			{
+				ret=-1;
+				goto end;
+			}
 			//logp("got: %s\n", bu->path);
 			ret|=restore_manifest(asfd, bu, regex, srestore,
 				act, sdirs, dir_for_notify, confs);
@@ -674,9 +925,6 @@ int do_restore_server(struct asfd *asfd, struct sdirs *sdirs,
 		}
 	}
 
-	bu_list_free(&bu_list);
-
-
 	if(found)
 	{
 		// Restore has nearly completed OK.
@@ -689,6 +937,7 @@ int do_restore_server(struct asfd *asfd, struct sdirs *sdirs,
 		ret=-1;
 	}
 end:
+	bu_list_free(&bu_list);
 	regex_free(&regex);
 	return ret;
 }
@@ -16,8 +16,19 @@ extern int restore_ent(struct asfd *asfd,
 	int *last_ent_was_dir,
 	const char *manifest);
 
+extern void restore_set_streams(int streams, int part);
+extern int restore_get_part(void);
+extern int restore_parse_streams(const char *str, int max);
+extern int restore_token_check(const char *lockpath, unsigned long bno);
+
 extern int do_restore_server(struct asfd *asfd, struct sdirs *sdirs,
 	enum action act, int srestore,
 	char **dir_for_notify, struct conf **confs);
 
+#ifdef UTEST
+extern int restore_stream_owns(struct sbuf *sb, int streams, int part);
+extern int restore_get_streams(void);
+extern int restore_token_write(const char *lockpath, unsigned long bno);
+#endif
+
 #endif
@@ -2,6 +2,7 @@
 #include "../action.h"
 #include "../asfd.h"
 #include "../async.h"
+#include "../budget.h"
 #include "../cmd.h"
 #include "../cntr.h"
 #include "../handy.h"
@@ -9,12 +10,16 @@
 #include "../iobuf.h"
 #include "../lock.h"
 #include "../log.h"
+#include "../pdeflate.h"
 #include "../regexp.h"
 #include "../run_script.h"
+#include "../sbuf.h"
 #include "backup.h"
+#include "compress.h"
 #include "delete.h"
 #include "diff.h"
 #include "list.h"
+#include "manio.h"
 #include "protocol2/restore.h"
 #include "restore.h"
 #include "rubble.h"
@@ -285,6 +290,7 @@ static int run_list(struct asfd *asfd,
 		get_protocol(cconfs), backupno, listregex, browsedir))
 			goto end;
 	ret=do_list_server();
+	sbuf_print_alloc_stats();
 end:
 	free_w(&backupno);
 	free_w(&browsedir);
@@ -326,7 +332,9 @@ static int run_diff(struct asfd *asfd,
 	iobuf_free_content(asfd->rbuf);
 
 	ret=do_diff_server(asfd, sdirs,
-		get_cntr(cconfs), get_protocol(cconfs), backup1, backup2);
+		get_cntr(cconfs), get_protocol(cconfs), backup1, backup2,
+		get_string(cconfs[OPT_DIFF_COMPARE]));
+	sbuf_print_alloc_stats();
 end:
 	return ret;
 }
@@ -376,6 +384,21 @@ static int run_action_server_do(struct async *as, struct sdirs *sdirs,
 	if(!strncmp_w(rbuf->buf, "diff "))
 		return run_diff(as->asfd, sdirs, cconfs);
 
+	// Extra restore streams work under the lock that the main connection
+	// of the client already has, and only for the restore that it is
+	// doing.
+	if(restore_get_part())
+	{
+		if(strncmp_w(rbuf->buf, "restore ")
+		  || restore_token_check(sdirs->lock->path, 0))
+		{
+			log_and_send(as->asfd, "no restore in progress");
+			return -1;
+		}
+		budget_set_weight(get_float(cconfs[OPT_RESTORE_BUDGET_WEIGHT]));
+		return run_restore(as->asfd, sdirs, cconfs, srestore);
+	}
+
 	switch((ret=get_lock_sdirs(as->asfd, sdirs)))
 	{
 		case 0: break; // OK.
@@ -413,7 +436,11 @@ static int run_action_server_do(struct async *as, struct sdirs *sdirs,
 
 	if(!strncmp_w(rbuf->buf, "restore ")
 	  || !strncmp_w(rbuf->buf, "verify "))
+	{
+		// Somebody is probably waiting for these.
+		budget_set_weight(get_float(cconfs[OPT_RESTORE_BUDGET_WEIGHT]));
 		return run_restore(as->asfd, sdirs, cconfs, srestore);
+	}
 
 	if(!strncmp_w(rbuf->buf, "Delete "))
 		return run_delete(as->asfd, sdirs, cconfs);
@@ -438,11 +465,20 @@ int run_action_server(struct async *as,
 {
 	int ret=-1;
         struct sdirs *sdirs=NULL;
+	manio_set_readahead(get_int(cconfs[OPT_MANIFEST_READAHEAD]),
+		(unsigned int)get_uint64_t(cconfs[OPT_MANIFEST_GZBUFFER]));
+	manio_set_zstd(get_int(cconfs[OPT_MANIFEST_ZSTD]),
+		get_int(cconfs[OPT_MANIFEST_ZSTD_FRAME]));
+	compress_set_zstd(get_int(cconfs[OPT_DATA_ZSTD]));
+	pdeflate_set_workers(get_int(cconfs[OPT_COMPRESSION_WORKERS]),
+		get_uint64_t(cconfs[OPT_COMPRESSION_WORKERS_MIN_SIZE]));
+	budget_set_weight(get_float(cconfs[OPT_BUDGET_WEIGHT]));
         if((sdirs=sdirs_alloc())
           && !sdirs_init_from_confs(sdirs, cconfs))
 		ret=run_action_server_do(as,
 			sdirs, incexc, srestore, timer_ret, cconfs);
         if(sdirs) lock_release(sdirs->lock);
         sdirs_free(&sdirs);
+	budget_set_weight(0);
 	return ret;
 }
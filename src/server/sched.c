@@ -0,0 +1,333 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../asfd.h"
+#include "../cntr.h"
+#include "../conf.h"
+#include "../fsops.h"
+#include "../fzp.h"
+#include "../lock.h"
+#include "../log.h"
+#include "../prepend.h"
+#include "child.h"
+#include "sdirs.h"
+#include "timer.h"
+#include "sched.h"
+
+// Children are separate processes, so the scheduler state lives on disk,
+// next to the client storage directories:
+//
+//   .sched/<kind>.<n>                   - one lock per running job, n<max
+//   .sched/<kind>_queue/<priority>.<cname> - one lock per waiting job
+//
+// Queue entries are named so that the one that should go next sorts last,
+// and a waiter only tries for a slot when there is no live entry after its
+// own. An entry is locked under a hidden name first and then renamed into
+// place, so it is never seen unlocked while it is in use. Entries that
+// nobody holds a lock on were left by a child that died, and are removed by
+// whoever notices them, once they are old enough that they cannot be one
+// that is just being replaced.
+
+#define SCHED_DIR	".sched"
+// Seconds before an unlocked queue entry is removed.
+#define SCHED_GRACE	10
+// Seconds between messages to a client that is waiting in the queue.
+#define SCHED_KEEPALIVE	60
+
+// Clients that have gone longest without a backup go first. Amongst those
+// that are equally overdue, the ones expected to send the least go first,
+// so that a few big clients do not hold up all the small ones.
+#ifndef UTEST
+static
+#endif
+uint64_t sched_priority(time_t last, uint64_t expected, time_t now)
+{
+	uint64_t hours=0xFFFFFFFF;
+	uint64_t mb=expected/(1024*1024);
+
+	if(last && now>last)
+	{
+		hours=(uint64_t)(now-last)/(60*60);
+		if(hours>0xFFFFFFFF) hours=0xFFFFFFFF;
+	}
+	else if(last)
+		hours=0;
+	if(mb>0xFFFFFFFF) mb=0xFFFFFFFF;
+	return (hours<<32)|(0xFFFFFFFF-mb);
+}
+
+// Bytes received during the previous backup, from its backup_stats.
+// Returns 0 if that cannot be found out.
+#ifndef UTEST
+static
+#endif
+uint64_t sched_expected_bytes(const char *current)
+{
+	int len=0;
+	char *cp=NULL;
+	char *path=NULL;
+	struct fzp *fzp=NULL;
+	uint64_t expected=0;
+	char buf[16384]="";
+
+	if(!(path=prepend_s(current, "backup_stats"))
+	  || !(fzp=fzp_open(path, "rb")))
+		goto end;
+	if((len=fzp_read(fzp, buf, sizeof(buf)-1))<=0)
+		goto end;
+	buf[len]='\0';
+	if(!(cp=strstr(buf, "\"bytes_received\""))
+	  || !(cp=strstr(cp, "\"count\""))
+	  || !(cp=strchr(cp, ':')))
+		goto end;
+	expected=strtoull(cp+1, NULL, 10);
+end:
+	fzp_close(&fzp);
+	free_w(&path);
+	return expected;
+}
+
+// Counts the live entries in the queue, including our own, and how many of
+// them are ahead of us.
+#ifndef UTEST
+static
+#endif
+int sched_queue_scan(const char *qdir, const char *mine,
+	int *ahead, int *total)
+{
+	DIR *dirp;
+	char *path=NULL;
+	struct dirent *d;
+	struct stat statp;
+	time_t now=time(NULL);
+
+	*ahead=0;
+	*total=1;
+	if(!(dirp=opendir(qdir)))
+	{
+		logp("Could not opendir %s in %s: %s\n",
+			qdir, __func__, strerror(errno));
+		return -1;
+	}
+	while((d=readdir(dirp)))
+	{
+		if(!strcmp(d->d_name, ".")
+		  || !strcmp(d->d_name, "..")
+		  || !strcmp(d->d_name, mine))
+			continue;
+		if(!(path=prepend_s(qdir, d->d_name)))
+		{
+			closedir(dirp);
+			return -1;
+		}
+		if(lock_test(path))
+		{
+			// Hidden ones are still joining.
+			if(d->d_name[0]!='.')
+			{
+				(*total)++;
+				if(strcmp(d->d_name, mine)>0)
+					(*ahead)++;
+			}
+		}
+		else if(!lstat(path, &statp)
+		  && now-statp.st_mtime>=SCHED_GRACE)
+			unlink(path);
+		free_w(&path);
+	}
+	closedir(dirp);
+	return 0;
+}
+
+// Returns 0 if a slot was got, 1 if they were all taken, -1 on error.
+static int sched_get_slot(const char *dir, const char *kind, int max,
+	struct lock **slot)
+{
+	int i;
+	char name[64]="";
+	char *path=NULL;
+
+	for(i=0; i<max; i++)
+	{
+		snprintf(name, sizeof(name), "%s.%d", kind, i);
+		if(!(path=prepend_s(dir, name))
+		  || !(*slot=lock_alloc_and_init(path)))
+			goto error;
+		free_w(&path);
+		lock_get(*slot);
+		switch((*slot)->status)
+		{
+			case GET_LOCK_GOT:
+				return 0;
+			case GET_LOCK_NOT_GOT:
+				close_fd(&(*slot)->fd);
+				lock_free(slot);
+				continue;
+			default:
+				goto error;
+		}
+	}
+	return 1;
+error:
+	if(*slot) close_fd(&(*slot)->fd);
+	lock_free(slot);
+	free_w(&path);
+	return -1;
+}
+
+#ifndef UTEST
+static
+#endif
+int sched_wait(struct asfd *asfd, const char *dir, const char *kind,
+	int max, time_t timeout, uint64_t priority, const char *cname,
+	struct cntr *cntr, struct lock **slot)
+{
+	int ret=-1;
+	int ahead=0;
+	int total=0;
+	int waited=0;
+	time_t start=time(NULL);
+	time_t keepalive=0;
+	char name[256]="";
+	char tmpname[300]="";
+	char msg[128]="";
+	char *qdir=NULL;
+	char *qpath=NULL;
+	char *tmppath=NULL;
+	struct lock *entry=NULL;
+
+	*slot=NULL;
+	if(max<=0) return 0;
+
+	if(mkdir(dir, 0777) && errno!=EEXIST)
+	{
+		logp("Could not mkdir %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	snprintf(name, sizeof(name), "%s_queue", kind);
+	if(!(qdir=prepend_s(dir, name)))
+		goto end;
+	snprintf(name, sizeof(name), "%016"PRIx64".%s", priority, cname);
+	snprintf(tmpname, sizeof(tmpname), ".%d.%s", (int)getpid(), name);
+	if(!(qpath=prepend_s(qdir, name))
+	  || !(tmppath=prepend_s(qdir, tmpname))
+	  || !(entry=lock_alloc_and_init(tmppath)))
+		goto end;
+	lock_get(entry);
+	if(entry->status!=GET_LOCK_GOT
+	  || do_rename(tmppath, qpath)
+	  || lock_init(entry, qpath))
+	{
+		logp("Could not join the %s queue as %s\n", kind, qpath);
+		goto end;
+	}
+
+	while(1)
+	{
+		if(sched_queue_scan(qdir, name, &ahead, &total))
+			goto end;
+		if(!ahead)
+		{
+			switch(sched_get_slot(dir, kind, max, slot))
+			{
+				case 0:
+					if(waited)
+						logp("Got %s slot after %ds\n",
+							kind,
+							(int)(time(NULL)-start));
+					ret=0;
+					goto end;
+				case 1:
+					break;
+				default:
+					goto end;
+			}
+		}
+		if(timeout && time(NULL)-start>=timeout)
+		{
+			logp("No free %s slot after %ds\n",
+				kind, (int)(time(NULL)-start));
+			ret=1;
+			goto end;
+		}
+		if(!waited)
+		{
+			logp("Waiting for a %s slot, %d ahead in the queue\n",
+				kind, ahead);
+			waited=1;
+		}
+		snprintf(msg, sizeof(msg), "%s queue position %d of %d",
+			kind, ahead+1, total);
+		if(cntr && write_status(CNTR_STATUS_QUEUED, msg, cntr))
+			goto end;
+		// The client is waiting for an answer, and would give up on a
+		// quiet connection.
+		if(asfd && time(NULL)-keepalive>=SCHED_KEEPALIVE)
+		{
+			if(asfd->write_str(asfd, CMD_MESSAGE, msg)
+			  || asfd_flush_asio(asfd))
+				goto end;
+			keepalive=time(NULL);
+		}
+		sleep(1);
+	}
+end:
+	if(entry && entry->status==GET_LOCK_GOT)
+		lock_release(entry);
+	lock_free(&entry);
+	free_w(&qdir);
+	free_w(&qpath);
+	free_w(&tmppath);
+	return ret;
+}
+
+static int sched_start(struct asfd *asfd, struct sdirs *sdirs,
+	struct conf **cconfs, const char *kind, int max, time_t timeout,
+	struct lock **slot)
+{
+	int ret=-1;
+	time_t last=0;
+	char *dir=NULL;
+	uint64_t priority;
+	const char *cname=get_string(cconfs[OPT_CNAME]);
+
+	*slot=NULL;
+	if(max<=0) return 0;
+
+	if(timer_last_backup(cname, sdirs->current,
+		get_string(cconfs[OPT_TIMESTAMP_FORMAT]), &last)<0)
+		return -1;
+	priority=sched_priority(last,
+		sched_expected_bytes(sdirs->current), time(NULL));
+	if(!(dir=prepend_s(sdirs->base, SCHED_DIR)))
+		return -1;
+	ret=sched_wait(asfd, dir, kind, max, timeout, priority, cname,
+		get_cntr(cconfs), slot);
+	free_w(&dir);
+	return ret;
+}
+
+// Limits the number of clients sending data at the same time.
+int sched_backup_start(struct asfd *asfd, struct sdirs *sdirs,
+	struct conf **cconfs, struct lock **slot)
+{
+	return sched_start(asfd, sdirs, cconfs, "backup",
+		get_int(cconfs[OPT_MAX_BACKUPS]),
+		get_int(cconfs[OPT_BACKUP_QUEUE_TIMEOUT]), slot);
+}
+
+// Limits the number of phase4 jobs shuffling files around at the same
+// time. Nobody is waiting on the other end any more, so there is no
+// timeout.
+int sched_phase4_start(struct sdirs *sdirs, struct conf **cconfs,
+	struct lock **slot)
+{
+	return sched_start(NULL, sdirs, cconfs, "phase4",
+		get_int(cconfs[OPT_MAX_BACKUP_PHASE4]), 0, slot);
+}
+
+void sched_release(struct lock **slot)
+{
+	if(!slot || !*slot) return;
+	lock_release(*slot);
+	lock_free(slot);
+}
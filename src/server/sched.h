@@ -0,0 +1,25 @@
+#ifndef _SERVER_SCHED_H
+#define _SERVER_SCHED_H
+
+#include "../lock.h"
+#include "sdirs.h"
+
+// Returns 0 with *slot set (or left NULL if there is no limit), 1 if the
+// queue timeout ran out first, or -1 on error.
+extern int sched_backup_start(struct asfd *asfd, struct sdirs *sdirs,
+	struct conf **cconfs, struct lock **slot);
+extern int sched_phase4_start(struct sdirs *sdirs, struct conf **cconfs,
+	struct lock **slot);
+extern void sched_release(struct lock **slot);
+
+#ifdef UTEST
+extern uint64_t sched_priority(time_t last, uint64_t expected, time_t now);
+extern uint64_t sched_expected_bytes(const char *current);
+extern int sched_queue_scan(const char *qdir, const char *mine,
+	int *ahead, int *total);
+extern int sched_wait(struct asfd *asfd, const char *dir, const char *kind,
+	int max, time_t timeout, uint64_t priority, const char *cname,
+	struct cntr *cntr, struct lock **slot);
+#endif
+
+#endif
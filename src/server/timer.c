@@ -0,0 +1,205 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../conf.h"
+#include "../log.h"
+#include "../prepend.h"
+#include "../strlist.h"
+#include "sdirs.h"
+#include "timestamp.h"
+#include "timer.h"
+
+// Does the same job as the example timer_script, without forking a shell for
+// every client that asks.
+
+#ifndef UTEST
+static
+#endif
+int timer_parse_interval(const char *str, time_t *secs)
+{
+	char *cp=NULL;
+	unsigned long i;
+
+	if(!str || !isdigit(*str)) return -1;
+	i=strtoul(str, &cp, 10);
+	if(!cp || !*cp || *(cp+1)) return -1;
+	switch(*cp)
+	{
+		case 's': *secs=i; break;
+		case 'm': *secs=i*60; break;
+		case 'h': *secs=i*60*60; break;
+		case 'd': *secs=i*60*60*24; break;
+		case 'w': *secs=i*60*60*24*7; break;
+		case 'n': *secs=i*60*60*24*30; break;
+		default: return -1;
+	}
+	return 0;
+}
+
+// A timeband like 'Mon,Tue,19,20,21' matches if it has the current day,
+// followed somewhere later by the current hour.
+#ifndef UTEST
+static
+#endif
+int timer_in_timeband(const char *timeband, struct tm *tm)
+{
+	char day[8]="";
+	char hour[8]="";
+	const char *cp;
+	const char *days[]={"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+
+	if(tm->tm_wday<0 || tm->tm_wday>6) return 0;
+	snprintf(day, sizeof(day), "%s", days[tm->tm_wday]);
+	snprintf(hour, sizeof(hour), "%02d", tm->tm_hour);
+	if(!(cp=strstr(timeband, day))) return 0;
+	return strstr(cp+strlen(day), hour)?1:0;
+}
+
+// Returns 0 and sets *last if there is a previous backup, 1 if a backup
+// should just go ahead. The timestamp is written with the timestamp_format
+// of the client, and if it cannot be read back with that, the time that the
+// file was written will do.
+int timer_last_backup(const char *cname, const char *current,
+	const char *format, time_t *last)
+{
+	int ret=-1;
+	char *cp=NULL;
+	char *rest=NULL;
+	struct tm tm;
+	struct stat statp;
+	char buf[64]="";
+	char *timestamp=NULL;
+
+	if(lstat(current, &statp))
+	{
+		logp("No prior backup of %s\n", cname);
+		return 1;
+	}
+	if(!(timestamp=prepend_s(current, "timestamp")))
+		return -1;
+	if(timestamp_read(timestamp, buf, sizeof(buf)))
+	{
+		logp("Timestamp file missing for %s.\n", cname);
+		ret=1;
+		goto end;
+	}
+	// The file has the backup number, then the time.
+	memset(&tm, 0, sizeof(tm));
+	if(!format)
+		format=DEFAULT_TIMESTAMP_FORMAT;
+	if(!(cp=strchr(buf, ' '))
+	  || !(rest=strptime(cp+1, format, &tm))
+	  || *rest)
+	{
+		if(lstat(timestamp, &statp))
+		{
+			logp("Could not understand timestamp for %s: %s\n",
+				cname, buf);
+			ret=1;
+			goto end;
+		}
+		*last=statp.st_mtime;
+		ret=0;
+		goto end;
+	}
+	tm.tm_isdst=-1;
+	*last=mktime(&tm);
+	ret=0;
+end:
+	free_w(&timestamp);
+	return ret;
+}
+
+#ifndef UTEST
+static
+#endif
+int timer_check(const char *cname, const char *client_dir,
+	const char *current, const char *format, struct strlist *args,
+	time_t now)
+{
+	int ret=-1;
+	time_t last=0;
+	time_t intervalsecs=0;
+	int intimeband=0;
+	char *manual_file=NULL;
+	struct stat statp;
+	struct strlist *s;
+	struct tm *tm;
+	const char *interval=args?args->path:NULL;
+
+	// A 'backup' file placed in the client storage directory asks for a
+	// backup right now. This gives the 'server initiates a manual backup'
+	// feature.
+	if(!(manual_file=prepend_s(client_dir, "backup")))
+		goto end;
+	if(!lstat(manual_file, &statp))
+	{
+		logp("Found %s\n", manual_file);
+		logp("Do a backup of %s now\n", cname);
+		unlink(manual_file);
+		ret=0;
+		goto end;
+	}
+
+	tm=localtime(&now);
+	for(s=args?args->next:NULL; s; s=s->next)
+	{
+		if((intimeband=timer_in_timeband(s->path, tm)))
+		{
+			logp("In timeband: %s\n", s->path);
+			break;
+		}
+		logp("Out of timeband: %s\n", s->path);
+	}
+	if(!intimeband)
+	{
+		ret=1;
+		goto end;
+	}
+
+	if(!interval)
+	{
+		logp("No time interval given for %s.\n", cname);
+		ret=0;
+		goto end;
+	}
+	if(timer_parse_interval(interval, &intervalsecs))
+	{
+		logp("interval %s not understood for %s.\n", interval, cname);
+		ret=0;
+		goto end;
+	}
+	switch(timer_last_backup(cname, current, format, &last))
+	{
+		case 0: break;
+		case 1:
+			logp("Do a backup of %s now.\n", cname);
+			ret=0;
+			goto end;
+		default:
+			goto end;
+	}
+
+	if(last+intervalsecs<now)
+	{
+		logp("Last backup of %s was more than %s ago.\n",
+			cname, interval);
+		logp("Do a backup of %s now.\n", cname);
+		ret=0;
+		goto end;
+	}
+	logp("Not yet time for a backup of %s\n", cname);
+	ret=1;
+end:
+	free_w(&manual_file);
+	return ret;
+}
+
+// Returns 0 if it is time for a backup, 1 if not, or -1 on error, like the
+// exit code of a timer_script.
+int timer_run_builtin(struct sdirs *sdirs, struct conf **cconfs)
+{
+	return timer_check(get_string(cconfs[OPT_CNAME]),
+		sdirs->client, sdirs->current,
+		get_string(cconfs[OPT_TIMESTAMP_FORMAT]),
+		get_strlist(cconfs[OPT_TIMER_ARG]), time(NULL));
+}
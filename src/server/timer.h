@@ -0,0 +1,16 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+extern int timer_run_builtin(struct sdirs *sdirs, struct conf **cconfs);
+extern int timer_last_backup(const char *cname, const char *current,
+	const char *format, time_t *last);
+
+#ifdef UTEST
+extern int timer_parse_interval(const char *str, time_t *secs);
+extern int timer_in_timeband(const char *timeband, struct tm *tm);
+extern int timer_check(const char *cname, const char *client_dir,
+	const char *current, const char *format, struct strlist *args,
+	time_t now);
+#endif
+
+#endif
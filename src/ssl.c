@@ -1,7 +1,9 @@
 #include "burp.h"
 #include "alloc.h"
 #include "conf.h"
+#include "fsops.h"
 #include "log.h"
+#include "prepend.h"
 #include "server/ca.h"
 
 static const char *pass=NULL;
@@ -158,6 +160,87 @@ void ssl_destroy_ctx(SSL_CTX *ctx)
 	SSL_CTX_free(ctx);
 }
 
+static int session_id_context=1;
+
+// The server forks a child for each connection, so any session that a child
+// remembers is lost when it exits. Session tickets are kept by the client
+// instead, and any child can accept them because they all share the ticket
+// keys that were made with the ctx before forking.
+void ssl_server_sessions(SSL_CTX *ctx, int timeout)
+{
+	SSL_CTX_set_session_id_context(ctx,
+		(const uint8_t *)&session_id_context,
+		sizeof(session_id_context));
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	if(timeout>0)
+		SSL_CTX_set_timeout(ctx, timeout);
+	else
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+}
+
+// Offer the session saved by a previous run, if there is one.
+int ssl_session_load(SSL *ssl, const char *path)
+{
+	BIO *bio=NULL;
+	SSL_SESSION *session=NULL;
+
+	if(!path || !(bio=BIO_new_file(path, "r")))
+		return 0;
+	session=PEM_read_bio_SSL_SESSION(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if(!session)
+	{
+		logp("Ignoring unreadable ssl_session_cache: %s\n", path);
+		unlink(path);
+		return 0;
+	}
+	SSL_set_session(ssl, session);
+	SSL_SESSION_free(session);
+	return 1;
+}
+
+// The session holds the secret needed to resume it, so keep it private.
+int ssl_session_save(SSL *ssl, const char *path)
+{
+	int fd=-1;
+	int ret=-1;
+	BIO *bio=NULL;
+	char *tmp=NULL;
+	SSL_SESSION *session=NULL;
+
+	if(!path || !(session=SSL_get1_session(ssl)))
+		return 0;
+	if(!(tmp=prepend(path, ".tmp")))
+		goto end;
+	unlink(tmp);
+	if((fd=open(tmp, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR))<0)
+	{
+		logp("Could not open %s: %s\n", tmp, strerror(errno));
+		goto end;
+	}
+	if(!(bio=BIO_new_fd(fd, BIO_CLOSE)))
+	{
+		close(fd);
+		goto end;
+	}
+	if(!PEM_write_bio_SSL_SESSION(bio, session))
+	{
+		logp_ssl_err("Could not write ssl session to %s\n", tmp);
+		goto end;
+	}
+	BIO_free(bio);
+	bio=NULL;
+	if(do_rename(tmp, path))
+		goto end;
+	ret=0;
+end:
+	if(bio) BIO_free(bio);
+	if(ret && tmp) unlink(tmp);
+	free_w(&tmp);
+	SSL_SESSION_free(session);
+	return ret;
+}
+
 #ifndef HAVE_WIN32
 static void sanitise(char *buf)
 {
@@ -7,6 +7,9 @@
 extern int ssl_do_accept(SSL *ssl);
 extern SSL_CTX *ssl_initialise_ctx(struct conf **confs);
 extern void ssl_destroy_ctx(SSL_CTX *ctx);
+extern void ssl_server_sessions(SSL_CTX *ctx, int timeout);
+extern int ssl_session_load(SSL *ssl, const char *path);
+extern int ssl_session_save(SSL *ssl, const char *path);
 extern int ssl_load_dh_params(SSL_CTX *ctx, struct conf **confs);
 extern void ssl_load_globals(void);
 extern int ssl_check_cert(SSL *ssl, struct conf **confs, struct conf **cconfs);
@@ -0,0 +1,14 @@
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include "../../src/burp.h"
+
+// Benchmarks that are too slow for the unit tests. They are not run by
+// 'make check', but by 'make bench'.
+
+extern double bench_now(void);
+
+extern int bench_attribs(void);
+extern int bench_mjoin(int entries);
+
+#endif
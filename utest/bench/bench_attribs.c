@@ -0,0 +1,78 @@
+#include "bench.h"
+#include "../prng.h"
+#include "../../src/alloc.h"
+#include "../../src/attribs.h"
+#include "../../src/base64.h"
+#include "../../src/sbuf.h"
+
+#define ITERATIONS	1000000
+
+// Numbers of the sort that turn up on a real file system, rather than
+// random 64 bit ones, which would make the text form look worse than it
+// usually is.
+static struct sbuf *build(enum protocol protocol)
+{
+	struct sbuf *sb;
+	struct stat *statp;
+	if(!(sb=sbuf_alloc(protocol)))
+		return NULL;
+	statp=&sb->statp;
+	statp->st_dev=2049;
+	statp->st_ino=prng_next()%10000000;
+	statp->st_mode=S_IFREG|0644;
+	statp->st_nlink=1;
+	statp->st_uid=1000;
+	statp->st_gid=1000;
+	statp->st_size=prng_next()%1000000;
+	statp->st_blksize=4096;
+	statp->st_blocks=statp->st_size/512+1;
+	statp->st_atime=1500000000+prng_next()%100000000;
+	statp->st_mtime=1500000000+prng_next()%100000000;
+	statp->st_ctime=statp->st_mtime;
+	sb->compression=9;
+	if(protocol==PROTO_2)
+		sb->protocol2->index=prng_next()%1000000;
+	return sb;
+}
+
+static int bench_one(enum protocol protocol, int binary)
+{
+	int i;
+	int ret=-1;
+	double start;
+	double encode_time;
+	struct sbuf *sb;
+
+	attribs_set_binary(binary);
+	if(!(sb=build(protocol)))
+		goto end;
+	start=bench_now();
+	for(i=0; i<ITERATIONS; i++)
+		if(attribs_encode(sb))
+			goto end;
+	encode_time=bench_now()-start;
+	start=bench_now();
+	for(i=0; i<ITERATIONS; i++)
+		attribs_decode(sb);
+	printf("attribs protocol%d %s: %d bytes, "
+		"%d encodes %.2fs, %d decodes %.2fs\n",
+		(int)protocol, binary?"binary":"text", (int)sb->attr.len,
+		ITERATIONS, encode_time, ITERATIONS, bench_now()-start);
+	ret=0;
+end:
+	attribs_set_binary(0);
+	sbuf_free(&sb);
+	return ret;
+}
+
+int bench_attribs(void)
+{
+	prng_init(0);
+	base64_init();
+	if(bench_one(PROTO_1, 0)
+	  || bench_one(PROTO_1, 1)
+	  || bench_one(PROTO_2, 0)
+	  || bench_one(PROTO_2, 1))
+		return -1;
+	return 0;
+}
@@ -0,0 +1,147 @@
+#include "bench.h"
+#include "../prng.h"
+#include "../../src/alloc.h"
+#include "../../src/attribs.h"
+#include "../../src/base64.h"
+#include "../../src/fsops.h"
+#include "../../src/protocol1/handy.h"
+#include "../../src/sbuf.h"
+#include "../../src/server/manio.h"
+#include "../../src/server/mjoin.h"
+
+#define BASE		"bench_mjoin"
+#define MANIFEST1	BASE "/manifest1"
+#define MANIFEST2	BASE "/manifest2"
+
+struct counts
+{
+	int entries;
+	int changed;
+};
+
+static void set_entry(struct sbuf *sb, int i, char *path, char *datapth)
+{
+	struct stat *statp=&sb->statp;
+	uint8_t checksum[MD5_DIGEST_LENGTH];
+
+	snprintf(path, 64, "/bench/d%05d/f%05d", i/1000, i%1000);
+	snprintf(datapth, 80, "t%s", path);
+	statp->st_dev=2049;
+	statp->st_ino=i+1;
+	statp->st_mode=S_IFREG|0644;
+	statp->st_nlink=1;
+	statp->st_uid=1000;
+	statp->st_gid=1000;
+	statp->st_size=prng_next()%1000000;
+	statp->st_blksize=4096;
+	statp->st_blocks=statp->st_size/512+1;
+	statp->st_atime=1500000000+prng_next()%100000000;
+	statp->st_mtime=1500000000+prng_next()%100000000;
+	statp->st_ctime=statp->st_mtime;
+	prng_md5sum(checksum);
+	iobuf_from_str(&sb->path, CMD_FILE, path);
+	iobuf_from_str(&sb->protocol1->datapth, CMD_DATAPTH, datapth);
+	iobuf_from_str(&sb->endfile, CMD_END_FILE,
+		get_endfile_str(statp->st_size, checksum));
+}
+
+// The second backup is the first one with a tenth of the files touched,
+// half of those with new contents, one in a hundred deleted and one in a
+// hundred new.
+static int write_manifest(const char *manifest, int entries, int second)
+{
+	int i;
+	int ret=-1;
+	char path[64];
+	char datapth[80];
+	struct sbuf *sb=NULL;
+	struct manio *manio=NULL;
+
+	prng_init(0);
+	if(!(sb=sbuf_alloc(PROTO_1))
+	  || !(manio=manio_open(manifest, "wb", PROTO_1)))
+		goto end;
+	for(i=0; i<entries; i++)
+	{
+		set_entry(sb, i, path, datapth);
+		if(i%100==(second?50:0))
+			continue;
+		if(second && !(i%10))
+		{
+			sb->statp.st_mtime++;
+			sb->statp.st_ctime++;
+			if(!(i%20))
+			{
+				sb->statp.st_size++;
+				iobuf_from_str(&sb->endfile, CMD_END_FILE,
+					get_endfile_str(sb->statp.st_size,
+					(uint8_t *)"0123456789abcdef"));
+			}
+		}
+		if(attribs_encode(sb)
+		  || manio_write_sbuf(manio, sb))
+			goto end;
+	}
+	ret=manio_close(&manio);
+end:
+	manio_close(&manio);
+	if(sb)
+	{
+		// These point at buffers on the stack.
+		iobuf_init(&sb->path);
+		iobuf_init(&sb->protocol1->datapth);
+		iobuf_init(&sb->endfile);
+	}
+	sbuf_free(&sb);
+	return ret;
+}
+
+static int count_entry(void *data,
+	struct sbuf *sb1, struct sbuf *sb2, int changed)
+{
+	struct counts *c=(struct counts *)data;
+	c->entries++;
+	if(changed || !sb1 || !sb2)
+		c->changed++;
+	return 0;
+}
+
+static int run(const char *what, int readahead, int compare)
+{
+	double start;
+	struct counts c;
+
+	memset(&c, 0, sizeof(c));
+	manio_set_readahead(readahead, 0);
+	start=bench_now();
+	if(mjoin(MANIFEST1, MANIFEST2, PROTO_1, compare, count_entry, &c))
+		return -1;
+	printf("mjoin %s%s: %d entries, %d changed, %.2fs\n",
+		what, readahead?" with manifest_readahead":"",
+		c.entries, c.changed, bench_now()-start);
+	return 0;
+}
+
+int bench_mjoin(int entries)
+{
+	int ret=-1;
+	int all=MJOIN_CMP_MTIME|MJOIN_CMP_CTIME|MJOIN_CMP_SIZE|MJOIN_CMP_DATA;
+
+	base64_init();
+	if(recursive_delete(BASE)
+	  || build_path_w(MANIFEST1)
+	  || write_manifest(MANIFEST1, entries, 0)
+	  || write_manifest(MANIFEST2, entries, 1))
+		goto end;
+
+	if(run("mtime", 0, MJOIN_CMP_MTIME)
+	  || run("mtime", 1, MJOIN_CMP_MTIME)
+	  || run("mtime,ctime,size,data", 0, all)
+	  || run("mtime,ctime,size,data", 1, all))
+		goto end;
+	ret=0;
+end:
+	manio_set_readahead(0, 0);
+	recursive_delete(BASE);
+	return ret;
+}
@@ -0,0 +1,35 @@
+#include "bench.h"
+
+#define MJOIN_ENTRIES	2000000
+
+double bench_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [attribs|mjoin [entries]]\n", prog);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int entries=MJOIN_ENTRIES;
+	const char *which=argc>1?argv[1]:NULL;
+
+	if(argc>3
+	  || (which && strcmp(which, "attribs") && strcmp(which, "mjoin"))
+	  || (argc>2 && (entries=atoi(argv[2]))<=0))
+		return usage(argv[0]);
+
+	if((!which || !strcmp(which, "attribs"))
+	  && bench_attribs())
+		return 1;
+	if((!which || !strcmp(which, "mjoin"))
+	  && bench_mjoin(entries))
+		return 1;
+	return 0;
+}
@@ -0,0 +1,183 @@
+#include "../../test.h"
+#include "../../../src/alloc.h"
+#include "../../../src/asfd.h"
+#include "../../../src/async.h"
+#include "../../../src/cmd.h"
+#include "../../../src/conf.h"
+#include "../../../src/iobuf.h"
+#include "../../../src/client/protocol1/backup_streams.h"
+#include "../../builders/build_asfd_mock.h"
+
+#define STREAMS		2
+#define MAX_READS	32
+
+static struct ioevent_list reads;
+static struct ioevent_list writes;
+
+// The server only says the next thing once everything that it is waiting
+// for has come back from the streams, so the order of what it is sent
+// does not depend on which stream child happens to be quickest.
+static int gates[MAX_READS];
+static struct asfd *server=NULL;
+static int (*async_read_write)(struct async *as)=NULL;
+
+static int async_rw_streams(struct async *as)
+{
+	if(!server->rbuf->buf
+	  && reads.cursor<reads.size
+	  && writes.cursor>=(unsigned int)gates[reads.cursor]
+	  && server->read(server))
+		return -1;
+	return async_read_write(as);
+}
+
+// Runs in each stream child. Sends back each file that it is asked for,
+// then does its half of the end of phase2.
+static int stream_func(struct asfd *sfd, struct conf **confs)
+{
+	int ret=-1;
+	struct iobuf *rbuf=sfd->rbuf;
+	while(1)
+	{
+		iobuf_free_content(rbuf);
+		if(sfd->read(sfd))
+			break;
+		if(rbuf->cmd==CMD_GEN
+		  && !strcmp(rbuf->buf, "backupphase2end"))
+		{
+			if(!sfd->write_str(sfd, CMD_GEN, "okbackupphase2end")
+			  && !asfd_flush_asio(sfd))
+				ret=0;
+			break;
+		}
+		if(rbuf->cmd!=CMD_FILE
+		  || sfd->write(sfd, rbuf)
+		  || sfd->write_str(sfd, CMD_APPEND, "data")
+		  || sfd->write_str(sfd, CMD_END_FILE, "4:0"))
+			break;
+	}
+	iobuf_free_content(rbuf);
+	return ret;
+}
+
+static void server_says(struct asfd *asfd, int *r, int w,
+	enum cmd cmd, const char *str)
+{
+	fail_unless(*r<MAX_READS);
+	gates[*r]=w;
+	asfd_mock_read(asfd, r, 0, cmd, str);
+}
+
+static void stream_sends(struct asfd *asfd, int *w,
+	const char *stream, const char *file, int switched)
+{
+	if(switched)
+		asfd_assert_write(asfd, w, 0, CMD_STREAM, stream);
+	asfd_assert_write(asfd, w, 0, CMD_FILE, file);
+	asfd_assert_write(asfd, w, 0, CMD_APPEND, "data");
+	asfd_assert_write(asfd, w, 0, CMD_END_FILE, "4:0");
+}
+
+static void setup_asfds_switching(struct asfd *asfd)
+{
+	int r=0; int w=0;
+
+	server_says(asfd, &r, w, CMD_STREAM, "0");
+	server_says(asfd, &r, w, CMD_FILE, "a");
+	stream_sends(asfd, &w, "0", "a", 1);
+
+	// Still the same stream, so no marker going back.
+	server_says(asfd, &r, w, CMD_FILE, "b");
+	stream_sends(asfd, &w, "0", "b", 0);
+
+	server_says(asfd, &r, w, CMD_STREAM, "1");
+	server_says(asfd, &r, w, CMD_FILE, "c");
+	stream_sends(asfd, &w, "1", "c", 1);
+
+	server_says(asfd, &r, w, CMD_STREAM, "0");
+	server_says(asfd, &r, w, CMD_FILE, "d");
+	stream_sends(asfd, &w, "0", "d", 1);
+
+	// The server only hears that phase2 is over once every stream has
+	// said so.
+	server_says(asfd, &r, w, CMD_GEN, "backupphase2end");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "okbackupphase2end");
+}
+
+static void setup_asfds_bad_stream(struct asfd *asfd)
+{
+	int r=0;
+	server_says(asfd, &r, 0, CMD_STREAM, "2");
+}
+
+static void setup_asfds_no_stream(struct asfd *asfd)
+{
+	int r=0;
+	server_says(asfd, &r, 0, CMD_FILE, "a");
+}
+
+static void run_test(int expected_ret,
+	void setup_asfds_callback(struct asfd *asfd))
+{
+	struct async *as;
+	struct conf **confs;
+
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	fail_unless((as=async_alloc())!=NULL);
+	fail_unless(!as->init(as, 0 /* estimate */));
+	async_read_write=as->read_write;
+	as->read_write=async_rw_streams;
+
+	server=asfd_mock_setup(&reads, &writes);
+	server->as=as;
+	server->fd=-1;
+	setup_asfds_callback(server);
+
+	fail_unless(backup_streams_client(server, confs,
+		STREAMS, stream_func)==expected_ret);
+	fail_unless(writes.cursor==writes.size);
+
+	asfd_free(&server);
+	asfd_mock_teardown(&reads, &writes);
+	async_free(&as);
+	confs_free(&confs);
+	alloc_check();
+}
+
+START_TEST(test_backup_streams_switching)
+{
+	run_test(0, setup_asfds_switching);
+}
+END_TEST
+
+START_TEST(test_backup_streams_bad_stream)
+{
+	run_test(-1, setup_asfds_bad_stream);
+}
+END_TEST
+
+START_TEST(test_backup_streams_no_stream)
+{
+	run_test(-1, setup_asfds_no_stream);
+}
+END_TEST
+
+Suite *suite_client_protocol1_backup_streams(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("client_protocol1_backup_streams");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 30);
+
+	tcase_add_test(tc_core, test_backup_streams_switching);
+	tcase_add_test(tc_core, test_backup_streams_bad_stream);
+	tcase_add_test(tc_core, test_backup_streams_no_stream);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -7,6 +7,7 @@
 #include "../../../src/async.h"
 #include "../../../src/attribs.h"
 #include "../../../src/base64.h"
+#include "../../../src/bfile.h"
 #include "../../../src/client/protocol2/backup_phase2.h"
 #include "../../../src/server/protocol2/backup_phase2.h"
 #include "../../../src/fsops.h"
@@ -360,6 +361,15 @@ START_TEST(test_phase2_happy_path_missing_file_2)
 }
 END_TEST
 
+START_TEST(test_phase2_happy_path_read_ahead)
+{
+	bfile_set_read_ahead(3, 1024*1024);
+	run_test(0, 10, setup_asfds_happy_path);
+	run_test(0, 10, setup_asfds_happy_path_missing_file_2);
+	bfile_set_read_ahead(0, 0);
+}
+END_TEST
+
 Suite *suite_client_protocol2_backup_phase2(void)
 {
 	Suite *s;
@@ -378,6 +388,7 @@ Suite *suite_client_protocol2_backup_phase2(void)
 	tcase_add_test(tc_core, test_phase2_happy_path);
 	tcase_add_test(tc_core, test_phase2_happy_path_missing_file_1);
 	tcase_add_test(tc_core, test_phase2_happy_path_missing_file_2);
+	tcase_add_test(tc_core, test_phase2_happy_path_read_ahead);
 
 	suite_add_tcase(s, tc_core);
 
@@ -3,6 +3,8 @@
 #include "../../src/alloc.h"
 #include "config.h"
 #include "../../src/client/find.h"
+#include "../../src/client/journal.h"
+#include "../../src/client/scanahead.h"
 #include "../../src/conffile.h"
 #include "../../src/fsops.h"
 #include "../../src/prepend.h"
@@ -10,6 +12,8 @@
 
 #define BASE		"utest_find"
 #define CONFBASE	"utest_find_conf"
+#define JOURNAL		"utest_find_journal"
+#define JLINK		"utest_find_jlink"
 
 static char fullpath[4096]; // absolute path to base
 static struct strlist *e=NULL;
@@ -187,14 +191,16 @@ static void run_find(const char *buf, FF_PKT *ff, struct conf **confs)
 	fail_unless(!recursive_delete(CONFBASE));
 	build_file(conffile, buf);
 	fail_unless(!conf_load_global_only(conffile, confs));
+	fail_unless(!journal_scan_begin(confs));
 	for(l=get_strlist(confs[OPT_STARTDIR]); l; l=l->next) if(l->flag)
                 fail_unless(!find_files_begin(NULL, ff, confs, l->path));
+	fail_unless(!journal_scan_end(1));
 	fail_unless(!recursive_delete(CONFBASE));
 }
 
 static char extra_config[1024]="";
 
-static void do_test(void setup_entries(void))
+static void do_test_workers(void setup_entries(void), int workers)
 {
 	FF_PKT *ff;
 	char buf[4096];
@@ -206,11 +212,18 @@ static void do_test(void setup_entries(void))
 
 	snprintf(buf, sizeof(buf), "%s%s", MIN_CLIENT_CONF, extra_config);
 
+	fail_unless(!scanahead_start(workers, 0));
 	run_find(buf, ff, confs);
+	scanahead_stop();
 
 	tear_down(&ff, &confs);
 }
 
+static void do_test(void setup_entries(void))
+{
+	do_test_workers(setup_entries, 0);
+}
+
 static void simple_entries(void)
 {
 	add_dir( FOUND, "");
@@ -426,6 +439,157 @@ START_TEST(test_find)
 }
 END_TEST
 
+static void journal_entries(void)
+{
+	simple_entries();
+	snprintf(extra_config, sizeof(extra_config),
+		"include=%s\njournal=%s\ncname=utestclient\n",
+		fullpath, JOURNAL);
+}
+
+static void journal_entries_unseen(void)
+{
+	journal_entries();
+	// Nothing in the journal says that this was added, so the scan
+	// should use what it found last time, and not see it.
+	add_file(NOT_FOUND, "j", 1);
+}
+
+static void journal_entries_seen(void)
+{
+	journal_entries();
+	add_file(FOUND, "j", 1);
+}
+
+static void journal_add(const char *line)
+{
+	FILE *fp;
+	fail_unless((fp=fopen(JOURNAL, "ab"))!=NULL);
+	fail_unless(fprintf(fp, "%s\n", line)>0);
+	fail_unless(!fclose(fp));
+}
+
+static char cwd[4096];
+
+// The same, but with a symlink on the way to the include.
+static void journal_link_entries(void)
+{
+	snprintf(fullpath, sizeof(fullpath), "%s/%s/%s", cwd, JLINK, BASE);
+	journal_entries();
+}
+
+static void journal_link_entries_seen(void)
+{
+	journal_link_entries();
+	add_file(FOUND, "j", 1);
+}
+
+// Stands in for 'burp -a j', which keeps a lock on the journal for as long
+// as it runs.
+static int watcher=-1;
+
+static void watcher_start(void)
+{
+	fail_unless((watcher=open(JOURNAL, O_RDONLY))>=0);
+	fail_unless(!flock(watcher, LOCK_EX|LOCK_NB));
+}
+
+static void watcher_stop(void)
+{
+	fail_unless(!close(watcher));
+	watcher=-1;
+}
+
+// A new journal, watching the file system that the tests are on, or
+// somewhere else.
+static void journal_new(int gen, int here)
+{
+	char line[64];
+	struct stat statp;
+	fail_unless(!lstat(".", &statp));
+	unlink(JOURNAL);
+	snprintf(line, sizeof(line), "burp journal %d %llu", gen,
+		here?(unsigned long long)statp.st_dev:
+		(unsigned long long)statp.st_dev+1);
+	journal_add(line);
+}
+
+START_TEST(test_find_journal)
+{
+	char line[4096+8];
+	unlink(JOURNAL ".utestclient");
+	journal_new(1, 1);
+	watcher_start();
+
+	// No cache yet, so everything gets walked.
+	do_test(journal_entries);
+	do_test(journal_entries_unseen);
+
+	snprintf(line, sizeof(line), "d %s", fullpath);
+	journal_add(line);
+	do_test(journal_entries_seen);
+
+	// A new journal means that changes may have been missed.
+	watcher_stop();
+	journal_new(2, 1);
+	watcher_start();
+	do_test(journal_entries_seen);
+
+	// Nothing is keeping the journal up to date any more.
+	do_test(journal_entries);
+	watcher_stop();
+	do_test(journal_entries_seen);
+
+	// Changes on a file system that is not being watched do not get
+	// into the journal.
+	journal_new(3, 0);
+	watcher_start();
+	do_test(journal_entries);
+	do_test(journal_entries_seen);
+	watcher_stop();
+
+	unlink(JOURNAL);
+	unlink(JOURNAL ".utestclient");
+}
+END_TEST
+
+// The journal has real paths in it, so an include with a symlink on the way
+// to it has to be matched up with those.
+START_TEST(test_find_journal_symlinked_include)
+{
+	char line[4096+8];
+	fail_unless(realpath(".", cwd)!=NULL);
+	unlink(JLINK);
+	fail_unless(!symlink(cwd, JLINK));
+	unlink(JOURNAL ".utestclient");
+	journal_new(1, 1);
+	watcher_start();
+
+	do_test(journal_link_entries);
+	do_test(journal_entries_unseen);
+
+	snprintf(line, sizeof(line), "d %s/%s", cwd, BASE);
+	journal_add(line);
+	do_test(journal_link_entries_seen);
+
+	watcher_stop();
+	unlink(JLINK);
+	unlink(JOURNAL);
+	unlink(JOURNAL ".utestclient");
+}
+END_TEST
+
+START_TEST(test_find_scanahead)
+{
+	// The scan ahead workers must not change what gets found, or the
+	// order it is found in.
+	do_test_workers(simple_entries, 3);
+	do_test_workers(exclude_dir, 3);
+	do_test_workers(include_inside_exclude, 3);
+	do_test_workers(multi_includes, 3);
+}
+END_TEST
+
 START_TEST(test_large_file_support)
 {
 	// 32 bit machines need the correct build parameters to support
@@ -444,6 +608,9 @@ Suite *suite_client_find(void)
 	tc_core=tcase_create("Core");
 
 	tcase_add_test(tc_core, test_find);
+	tcase_add_test(tc_core, test_find_scanahead);
+	tcase_add_test(tc_core, test_find_journal);
+	tcase_add_test(tc_core, test_find_journal_symlinked_include);
 	tcase_add_test(tc_core, test_large_file_support);
 	suite_add_tcase(s, tc_core);
 
@@ -11,6 +11,7 @@
 #include "../../src/conffile.h"
 #include "../../src/client/restore.h"
 #include "../../src/fsops.h"
+#include "../../src/fzp.h"
 #include "../../src/iobuf.h"
 #include "../../src/slist.h"
 #include "../builders/build_asfd_mock.h"
@@ -26,6 +27,7 @@ static void tear_down(struct asfd **asfd, struct conf ***confs)
 	asfd_free(asfd);
 	confs_free(confs);
 	asfd_mock_teardown(&reads, &writes);
+	bfile_set_restore_writes(0, 0);
 //printf("%d %d\n", alloc_count, free_count);
 	alloc_check();
 	fail_unless(recursive_delete(BASE)==0);
@@ -146,10 +148,11 @@ static struct conf **setup_conf(void)
 	return confs;
 }
 
-static void run_test(int expected_ret,
+static void run_test_and_check(int expected_ret,
 	int slist_entries,
 	enum protocol protocol,
-	void setup_callback(struct asfd *asfd, struct slist *slist))
+	void setup_callback(struct asfd *asfd, struct slist *slist),
+	void check_callback(struct slist *slist))
 {
 	int result;
 	struct slist *slist=NULL;
@@ -181,11 +184,22 @@ static void run_test(int expected_ret,
 	result=do_restore_client(asfd, confs,
 		ACTION_RESTORE, 0 /* vss_restore */);
 	fail_unless(result==expected_ret);
+	if(check_callback)
+		check_callback(slist);
 
 	slist_free(&slist);
 	tear_down(&asfd, &confs);
 }
 
+static void run_test(int expected_ret,
+	int slist_entries,
+	enum protocol protocol,
+	void setup_callback(struct asfd *asfd, struct slist *slist))
+{
+	run_test_and_check(expected_ret, slist_entries, protocol,
+		setup_callback, NULL);
+}
+
 START_TEST(test_restore_proto1_bad_read)
 {
 	run_test(-1, 0, PROTO_1, setup_bad_read);
@@ -360,6 +374,141 @@ START_TEST(test_restore_proto2_interrupt)
 }
 END_TEST
 
+// Smaller than the data for each file, so that the buffer fills up and
+// gets flushed, and the big pieces go straight to the file.
+#define WRITE_BUFFER	16
+#define BIG_PIECE	"0123456789abcdefghijklmnopqrstuvwxyzABCD"
+
+// What the server sends for each file, in order. The path makes each file
+// different, and is usually longer than the buffer too.
+static const char *piece(struct sbuf *s, int i)
+{
+	if(!i) return s->path.buf;
+	if(i<=10) return "data";
+	if(i==11) return BIG_PIECE;
+	if(i<=14) return "tail";
+	return NULL;
+}
+
+static void setup_proto2_write_buffer(struct asfd *asfd, struct slist *slist)
+{
+	int i;
+	struct sbuf *s;
+	struct stat statp_dir;
+	struct stat statp_file;
+	int r=0; int w=0;
+	fail_unless(!lstat(BASE, &statp_dir));
+	fail_unless(!lstat(BASE "/burp.conf", &statp_file));
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "restore :");
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "ok");
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "restore_stream");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "restore_stream_ok");
+	for(s=slist->head; s; s=s->next)
+	{
+		if(!sbuf_is_filedata(s) || sbuf_is_link(s))
+			continue;
+		s->winattr=0;
+		s->compression=0;
+		memcpy(&s->statp, &statp_file, sizeof(statp_file));
+		attribs_encode(s);
+		asfd_mock_read_iobuf(asfd, &r, 0, &s->attr);
+		asfd_mock_read_iobuf(asfd, &r, 0, &s->path);
+		for(i=0; piece(s, i); i++)
+			asfd_mock_read(asfd, &r, 0, CMD_DATA, piece(s, i));
+	}
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "restoreend");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "restoreend_ok");
+}
+
+static void check_proto2_write_buffer(struct slist *slist)
+{
+	int i;
+	int files=0;
+	size_t len;
+	struct sbuf *s;
+	struct fzp *fzp;
+	char expected[512];
+	char got[512];
+	for(s=slist->head; s; s=s->next)
+	{
+		if(!sbuf_is_filedata(s) || sbuf_is_link(s))
+			continue;
+		*expected='\0';
+		for(i=0; piece(s, i); i++)
+			strcat(expected, piece(s, i));
+		len=strlen(expected);
+		fail_unless((fzp=fzp_open(s->path.buf, "rb"))!=NULL);
+		fail_unless(fzp_read(fzp, got, sizeof(got))==(int)len);
+		fail_unless(!memcmp(expected, got, len));
+		fail_unless(!fzp_close(&fzp));
+		files++;
+	}
+	fail_unless(files>0);
+}
+
+START_TEST(test_restore_proto2_write_buffer)
+{
+	bfile_set_restore_writes(WRITE_BUFFER, 1);
+	run_test_and_check(0, 10, PROTO_2, setup_proto2_write_buffer,
+		check_proto2_write_buffer);
+	bfile_set_restore_writes(WRITE_BUFFER, 1);
+	run_test(0, 10, PROTO_2, setup_proto2_interrupt);
+}
+END_TEST
+
+static BFILE *open_for_write(const char *path)
+{
+	BFILE *bfd;
+	fail_unless((bfd=bfile_alloc())!=NULL);
+	bfile_init(bfd, 0, NULL);
+	fail_unless(!bfd->open(bfd, NULL, path,
+		O_WRONLY|O_CREAT|O_TRUNC, 0600));
+	fail_unless(!lstat(path, &bfd->statp));
+	return bfd;
+}
+
+static void assert_content(const char *path, const char *expected)
+{
+	char got[64];
+	struct fzp *fzp;
+	fail_unless((fzp=fzp_open(path, "rb"))!=NULL);
+	fail_unless(fzp_read(fzp, got, sizeof(got))==(int)strlen(expected));
+	fail_unless(!memcmp(expected, got, strlen(expected)));
+	fail_unless(!fzp_close(&fzp));
+}
+
+START_TEST(test_restore_write_buffer_taken_over)
+{
+	BFILE *a;
+	BFILE *b;
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!mkdir(BASE, 0777));
+	bfile_set_restore_writes(WRITE_BUFFER, 0);
+
+	// What was written to a is still in the buffer when b takes it over,
+	// and has to end up in a's file.
+	a=open_for_write(BASE "/a");
+	fail_unless(a->write(a, (void *)"data", 4)==4);
+	assert_content(BASE "/a", "");
+	b=open_for_write(BASE "/b");
+	assert_content(BASE "/a", "data");
+
+	// If it cannot be written out, the open fails rather than losing it.
+	fail_unless(b->write(b, (void *)"more", 4)==4);
+	fail_unless(!close(b->fd));
+	fail_unless(a->open(a, NULL, BASE "/c",
+		O_WRONLY|O_CREAT|O_TRUNC, 0600)==-1);
+	fail_unless(a->mode==BF_CLOSED);
+	fail_unless(b->close(b, NULL)==-1);
+
+	bfile_free(&a);
+	bfile_free(&b);
+	bfile_set_restore_writes(0, 0);
+	alloc_check();
+	fail_unless(!recursive_delete(BASE));
+}
+END_TEST
+
 Suite *suite_client_restore(void)
 {
 	Suite *s;
@@ -378,6 +527,8 @@ Suite *suite_client_restore(void)
 	tcase_add_test(tc_core, test_restore_proto2_bad_read);
 	tcase_add_test(tc_core, test_restore_proto2_some_things);
 	tcase_add_test(tc_core, test_restore_proto2_interrupt);
+	tcase_add_test(tc_core, test_restore_proto2_write_buffer);
+	tcase_add_test(tc_core, test_restore_write_buffer_taken_over);
 
 	suite_add_tcase(s, tc_core);
 
@@ -10,13 +10,16 @@ int main(void)
 	sr=srunner_create(NULL);
 
 	srunner_add_suite(sr, suite_alloc());
+	srunner_add_suite(sr, suite_arena());
 	srunner_add_suite(sr, suite_attribs());
 	srunner_add_suite(sr, suite_base64());
+	srunner_add_suite(sr, suite_budget());
 	srunner_add_suite(sr, suite_client_auth());
 	srunner_add_suite(sr, suite_client_find());
 	srunner_add_suite(sr, suite_client_monitor_json_input());
 	srunner_add_suite(sr, suite_client_monitor_lline());
 	srunner_add_suite(sr, suite_client_protocol1_backup_phase2());
+	srunner_add_suite(sr, suite_client_protocol1_backup_streams());
 	srunner_add_suite(sr, suite_client_protocol2_backup_phase2());
 	srunner_add_suite(sr, suite_client_restore());
 #ifdef HAVE_XATTR
@@ -25,13 +28,17 @@ int main(void)
 	srunner_add_suite(sr, suite_cmd());
 	srunner_add_suite(sr, suite_conf());
 	srunner_add_suite(sr, suite_conffile());
+	srunner_add_suite(sr, suite_fsops());
 	srunner_add_suite(sr, suite_fzp());
 	srunner_add_suite(sr, suite_hexmap());
 	srunner_add_suite(sr, suite_lock());
 	srunner_add_suite(sr, suite_pathcmp());
+	srunner_add_suite(sr, suite_pdeflate());
+	srunner_add_suite(sr, suite_protocol1_dirdigest());
 	srunner_add_suite(sr, suite_protocol1_handy());
 	srunner_add_suite(sr, suite_protocol1_rs_buf());
 	srunner_add_suite(sr, suite_protocol2_blist());
+	srunner_add_suite(sr, suite_protocol2_flow());
 	srunner_add_suite(sr, suite_protocol2_rabin_rconf());
 	srunner_add_suite(sr, suite_protocol2_rabin_win());
 	srunner_add_suite(sr, suite_protocol2_sbuf_protocol2());
@@ -39,16 +46,22 @@ int main(void)
 	srunner_add_suite(sr, suite_server_delete());
 	srunner_add_suite(sr, suite_server_list());
 	srunner_add_suite(sr, suite_server_manio());
+	srunner_add_suite(sr, suite_server_mjoin());
+	srunner_add_suite(sr, suite_server_pindex());
+	srunner_add_suite(sr, suite_server_prefork());
 	srunner_add_suite(sr, suite_server_monitor_browse());
 	srunner_add_suite(sr, suite_server_monitor_cstat());
 	srunner_add_suite(sr, suite_server_monitor_json_output());
 	srunner_add_suite(sr, suite_server_protocol1_backup_phase2());
+	srunner_add_suite(sr, suite_server_protocol1_backup_phase4());
 	srunner_add_suite(sr, suite_server_protocol1_bedup());
 	srunner_add_suite(sr, suite_server_protocol1_blocklen());
 	srunner_add_suite(sr, suite_server_protocol1_dpth());
 	srunner_add_suite(sr, suite_server_protocol1_fdirs());
+	srunner_add_suite(sr, suite_server_protocol1_zlibio());
 	srunner_add_suite(sr, suite_server_protocol2_backup_phase2());
 	srunner_add_suite(sr, suite_server_protocol2_backup_phase4());
+	srunner_add_suite(sr, suite_server_protocol2_bcompact());
 	srunner_add_suite(sr, suite_server_protocol2_champ_chooser_candidate());
 	srunner_add_suite(sr,
 		suite_server_protocol2_champ_chooser_champ_server());
@@ -59,7 +72,9 @@ int main(void)
 	srunner_add_suite(sr, suite_server_protocol2_dpth());
 	srunner_add_suite(sr, suite_server_restore());
 	srunner_add_suite(sr, suite_server_resume());
+	srunner_add_suite(sr, suite_server_sched());
 	srunner_add_suite(sr, suite_server_sdirs());
+	srunner_add_suite(sr, suite_server_timer());
 	srunner_add_suite(sr, suite_slist());
 
 	srunner_run_all(sr, CK_ENV);
@@ -0,0 +1,122 @@
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/attribs.h"
+#include "../../src/base64.h"
+#include "../../src/sbuf.h"
+#include "../../src/protocol1/dirdigest.h"
+
+static void tear_down(void)
+{
+	alloc_check();
+}
+
+START_TEST(test_dirdigest_parent_len)
+{
+	fail_unless(dirdigest_parent_len("/a/b/c")==4);
+	fail_unless(dirdigest_parent_len("/a")==1);
+	fail_unless(dirdigest_parent_len("C:/a")==2);
+	fail_unless(dirdigest_parent_len("/")==0);
+	fail_unless(dirdigest_parent_len("/a/")==0);
+	fail_unless(dirdigest_parent_len("a")==0);
+}
+END_TEST
+
+START_TEST(test_dirdigest_path)
+{
+	fail_unless(dirdigest_path("/a/b", 4)==dirdigest_path("/a/b/c", 4));
+	fail_unless(dirdigest_path("/a/b", 4)!=dirdigest_path("/a/c", 4));
+}
+END_TEST
+
+static uint64_t digest_of(struct stat *statp, const char *name,
+	const char *link)
+{
+	MD5_CTX md5;
+	fail_unless(!dirdigest_init(&md5));
+	dirdigest_add(&md5, name, statp, link);
+	return dirdigest_final(&md5);
+}
+
+// The server works out the digests from decoded attributes, and the client
+// from lstat, so they have to agree.
+START_TEST(test_dirdigest_attribs)
+{
+	struct stat statp;
+	struct sbuf *encode;
+	struct sbuf *decode;
+	uint64_t digest;
+
+	base64_init();
+	fail_unless(!lstat(".", &statp));
+	fail_unless((encode=sbuf_alloc(PROTO_1))!=NULL);
+	fail_unless((decode=sbuf_alloc(PROTO_1))!=NULL);
+	encode->statp=statp;
+	encode->compression=9;
+	fail_unless(!attribs_encode(encode));
+	fail_unless((decode->attr.buf=strdup_w(encode->attr.buf,
+		__func__))!=NULL);
+	decode->attr.len=encode->attr.len;
+	attribs_decode(decode);
+
+	digest=digest_of(&statp, "name", NULL);
+	fail_unless(digest==digest_of(&decode->statp, "name", NULL));
+	fail_unless(digest!=digest_of(&decode->statp, "other", NULL));
+	fail_unless(digest!=digest_of(&decode->statp, "name", "target"));
+	statp.st_mtime++;
+	fail_unless(digest!=digest_of(&statp, "name", NULL));
+
+	sbuf_free(&encode);
+	sbuf_free(&decode);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_dirdigest_find)
+{
+	size_t i;
+	struct dirdigest d;
+	struct dirdigest list[100];
+	uint8_t buf[DIRDIGEST_WIRE_LEN];
+
+	for(i=0; i<100; i++)
+	{
+		list[i].path=(i*7919)%100;
+		list[i].digest=i;
+	}
+	dirdigest_sort(list, 100);
+	for(i=0; i<100; i++)
+	{
+		fail_unless(list[i].path==i);
+		fail_unless(dirdigest_find(list, 100, i)==&list[i]);
+	}
+	fail_unless(dirdigest_find(list, 100, 100)==NULL);
+	fail_unless(dirdigest_find(list, 0, 1)==NULL);
+
+	list[0].path=0x0102030405060708ULL;
+	list[0].digest=0xF1F2F3F4F5F6F7F8ULL;
+	dirdigest_to_wire(&list[0], buf);
+	fail_unless(buf[0]==0x01 && buf[15]==0xF8);
+	dirdigest_from_wire(&d, buf);
+	fail_unless(d.path==list[0].path);
+	fail_unless(d.digest==list[0].digest);
+}
+END_TEST
+
+Suite *suite_protocol1_dirdigest(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("protocol1_dirdigest");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_dirdigest_parent_len);
+	tcase_add_test(tc_core, test_dirdigest_path);
+	tcase_add_test(tc_core, test_dirdigest_attribs);
+	tcase_add_test(tc_core, test_dirdigest_find);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -31,6 +31,54 @@ START_TEST(test_protocol2_blist)
 }
 END_TEST
 
+START_TEST(test_protocol2_blist_pooled)
+{
+	int i;
+	struct blk *blk;
+	struct blk *blks[10];
+	struct blist *blist;
+	char *data;
+	base64_init();
+	hexmap_init();
+	blk_pool_set(1);
+
+	blist=build_blist(3000);
+	blk=blist->head;
+	blist_free(&blist);
+	// Freed blks are handed out again.
+	blist=build_blist(3000);
+	fail_unless(blist->tail==blk);
+	blist_free(&blist);
+
+	fail_unless((blk=blk_alloc_with_data(BLK_POOL_DATA_SIZE))!=NULL);
+	fail_unless(blk->pooled==(BLK_POOLED|BLK_POOLED_DATA));
+	data=blk->data;
+	blk_free(&blk);
+	fail_unless((blk=blk_alloc_with_data(100))!=NULL);
+	fail_unless(blk->data==data);
+	blk_free(&blk);
+
+	// Too big to pool.
+	fail_unless((blk=blk_alloc_with_data(BLK_POOL_DATA_SIZE+1))!=NULL);
+	fail_unless(blk->pooled==BLK_POOLED);
+	blk_free(&blk);
+
+	for(i=0; i<10; i++)
+		fail_unless((blks[i]=blk_alloc_with_data(100))!=NULL);
+	for(i=0; i<10; i++)
+		blk_free(&blks[i]);
+
+	// Not from a slab, even though there are slabs about.
+	blk_pool_set(0);
+	fail_unless((blk=blk_alloc())!=NULL);
+	fail_unless(!blk->pooled);
+	blk_free(&blk);
+
+	blk_pool_free();
+	tear_down();
+}
+END_TEST
+
 Suite *suite_protocol2_blist(void)
 {
 	Suite *s;
@@ -41,6 +89,7 @@ Suite *suite_protocol2_blist(void)
 	tc_core=tcase_create("Core");
 
 	tcase_add_test(tc_core, test_protocol2_blist);
+	tcase_add_test(tc_core, test_protocol2_blist_pooled);
 	suite_add_tcase(s, tc_core);
 
 	return s;
@@ -0,0 +1,154 @@
+#include <check.h>
+#include "../../src/burp.h"
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/protocol2/flow.h"
+#include "../../src/protocol2/rabin/rconf.h"
+
+static uint64_t clock_usec=0;
+
+static uint64_t test_clock(void)
+{
+	return clock_usec;
+}
+
+static struct flow *setup(uint64_t memory, uint32_t blk_max)
+{
+	struct flow *flow;
+	alloc_counters_reset();
+	fail_unless((flow=flow_alloc(memory, blk_max))!=NULL);
+	clock_usec=1000000;
+	flow_set_clock(flow, test_clock);
+	return flow;
+}
+
+START_TEST(test_protocol2_flow_measure_only)
+{
+	struct flow *flow;
+	alloc_counters_reset();
+	fail_unless((flow=flow_alloc(0, 0))!=NULL);
+	fail_unless(flow->max==0);
+	flow_sig_sent(flow, 1);
+	flow_ack(flow, 1);
+	flow_data(flow, 100);
+	flow_update(flow, 1);
+	fail_unless(flow->sigs==1);
+	fail_unless(flow->blks==1);
+	fail_unless(flow->bytes==100);
+	fail_unless(flow->rtt_samples==1);
+	fail_unless(flow->window==0);
+	flow_free(&flow);
+	fail_unless(flow==NULL);
+	alloc_check();
+}
+END_TEST
+
+START_TEST(test_protocol2_flow_bounds)
+{
+	struct flow *flow;
+	alloc_counters_reset();
+
+	// Budget too small for the minimum window.
+	fail_unless((flow=flow_alloc(RABIN_MAX, RABIN_MAX))!=NULL);
+	fail_unless(flow->max==FLOW_WINDOW_MIN);
+	fail_unless(flow->window==FLOW_WINDOW_MIN);
+	flow_free(&flow);
+
+	fail_unless((flow=flow_alloc(
+		(uint64_t)FLOW_WINDOW_MIN*RABIN_MAX*4, RABIN_MAX))!=NULL);
+	fail_unless(flow->max==FLOW_WINDOW_MIN*4);
+	fail_unless(flow->window==FLOW_WINDOW_MIN);
+	fail_unless(flow_is_open(flow, FLOW_WINDOW_MIN-1));
+	fail_unless(!flow_is_open(flow, FLOW_WINDOW_MIN));
+	flow_free(&flow);
+	alloc_check();
+}
+END_TEST
+
+START_TEST(test_protocol2_flow_rtt)
+{
+	struct flow *flow;
+	flow=setup(0, 0);
+	flow_sig_sent(flow, 10);
+	// Only one sig is timed at once.
+	flow_sig_sent(flow, 11);
+	fail_unless(flow->probe_index==10);
+	// Something about an earlier block does not count.
+	flow_ack(flow, 9);
+	fail_unless(flow->rtt_samples==0);
+	clock_usec+=20000;
+	flow_ack(flow, 12);
+	fail_unless(flow->rtt_samples==1);
+	fail_unless(flow->srtt==20000);
+
+	// Smoothed.
+	flow_sig_sent(flow, 13);
+	clock_usec+=100000;
+	flow_ack(flow, 13);
+	fail_unless(flow->rtt_samples==2);
+	fail_unless(flow->srtt==(20000*7+100000)/8);
+	fail_unless(flow->probe_index==0);
+	flow_free(&flow);
+	alloc_check();
+}
+END_TEST
+
+START_TEST(test_protocol2_flow_window_follows_bdp)
+{
+	struct flow *flow;
+	uint64_t max=FLOW_WINDOW_MIN*100;
+	flow=setup(max*RABIN_MAX, RABIN_MAX);
+
+	flow_sig_sent(flow, 1);
+	clock_usec+=100000;
+	flow_ack(flow, 1);
+	fail_unless(flow->srtt==100000);
+
+	// Not time to recalculate yet.
+	flow_update(flow, 100000);
+	fail_unless(flow->window==FLOW_WINDOW_MIN);
+
+	// 100000 blocks a second, with a round trip time of 0.1s, wants a
+	// window of 20000.
+	clock_usec+=FLOW_INTERVAL-100000;
+	flow_update(flow, 100000);
+	fail_unless(flow->rate==100000);
+	fail_unless(flow->window==20000);
+
+	// Nothing acknowledged since, so the smoothed rate drops by a
+	// quarter, and the window with it.
+	clock_usec+=FLOW_INTERVAL;
+	flow_update(flow, 100000);
+	fail_unless(flow->rate==75000);
+	fail_unless(flow->window==15000);
+
+	// No rate at all, so back to the minimum.
+	flow->rate=0;
+	clock_usec+=FLOW_INTERVAL;
+	flow_update(flow, 100000);
+	fail_unless(flow->window==FLOW_WINDOW_MIN);
+	fail_unless(flow->window_low==FLOW_WINDOW_MIN);
+	fail_unless(flow->window_high>FLOW_WINDOW_MIN);
+
+	flow_free(&flow);
+	alloc_check();
+}
+END_TEST
+
+Suite *suite_protocol2_flow(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("protocol2_flow");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_protocol2_flow_measure_only);
+	tcase_add_test(tc_core, test_protocol2_flow_bounds);
+	tcase_add_test(tc_core, test_protocol2_flow_rtt);
+	tcase_add_test(tc_core, test_protocol2_flow_window_follows_bdp);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -10,6 +10,7 @@
 #include "../../../src/hexmap.h"
 #include "../../../src/fsops.h"
 #include "../../../src/iobuf.h"
+#include "../../../src/server/manio.h"
 #include "../../../src/server/protocol1/backup_phase2.h"
 #include "../../../src/server/sdirs.h"
 #include "../../../src/slist.h"
@@ -415,6 +416,139 @@ START_TEST(test_phase2_happy_path_changed_files)
 }
 END_TEST
 
+static void asfd_assert_write_stream(struct asfd *asfd,
+	int *w, int *send, int stream, struct sbuf *sb)
+{
+	char tmp[16];
+	if(*send!=stream)
+	{
+		snprintf(tmp, sizeof(tmp), "%d", stream);
+		asfd_assert_write(asfd, w, 0, CMD_STREAM, tmp);
+		*send=stream;
+	}
+	asfd_assert_write_iobuf(asfd, w, 0, &sb->attr);
+	asfd_assert_write_iobuf(asfd, w, 0, &sb->path);
+}
+
+// Two streams. The server asks for a new file on whichever stream is free,
+// and the client finishes the newer or the older of the two files in turn.
+static void setup_asfds_happy_path_streams(struct asfd *asfd,
+	struct slist *slist)
+{
+	int r=0, w=0;
+	int n=0, next=0, step=0, send=-1, recv=-1, st, newer;
+	int busy[2]={-1, -1};
+	char tmp[16];
+	struct sbuf *s;
+	struct sbuf *f[64];
+
+	for(s=slist->head; s; s=s->next)
+	{
+		if(!sbuf_is_filedata(s))
+			continue;
+		fail_unless(n<(int)ARR_LEN(f));
+		f[n++]=s;
+	}
+	for(st=0; st<2 && next<n; st++)
+	{
+		asfd_assert_write_stream(asfd, &w, &send, st, f[next]);
+		busy[st]=next++;
+	}
+	while(busy[0]>=0 || busy[1]>=0)
+	{
+		if(busy[0]>=0 && busy[1]>=0)
+		{
+			newer=busy[0]>busy[1]?0:1;
+			st=(step++%2)?!newer:newer;
+		}
+		else
+			st=busy[0]>=0?0:1;
+		// Give the server time to get to the next file it wants.
+		asfd_mock_read_no_op(asfd, &r, 50);
+		if(recv!=st)
+		{
+			snprintf(tmp, sizeof(tmp), "%d", st);
+			asfd_mock_read(asfd, &r, 0, CMD_STREAM, tmp);
+			recv=st;
+		}
+		s=f[busy[st]];
+		asfd_mock_read_iobuf(asfd, &r, 0, &s->attr);
+		asfd_mock_read_iobuf(asfd, &r, 0, &s->path);
+		asfd_mock_read(asfd, &r, 0, CMD_APPEND, "some data");
+		asfd_mock_read(asfd, &r, 0, CMD_END_FILE,
+			"0:d41d8cd98f00b204e9800998ecf8427e");
+		busy[st]=-1;
+		if(next<n)
+		{
+			asfd_assert_write_stream(asfd, &w, &send, st, f[next]);
+			busy[st]=next++;
+		}
+	}
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "backupphase2end");
+	asfd_mock_read_no_op(asfd, &r, 20);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "okbackupphase2end");
+}
+
+static void assert_changed_in_order(struct sdirs *sdirs, struct slist *slist)
+{
+	struct sbuf *s;
+	struct sbuf *sb;
+	struct manio *manio;
+	fail_unless((manio=manio_open_phase2(sdirs->changed,
+		"rb", PROTO_1))!=NULL);
+	fail_unless((sb=sbuf_alloc(PROTO_1))!=NULL);
+	for(s=slist->head; s; s=s->next)
+	{
+		if(!sbuf_is_filedata(s))
+			continue;
+		fail_unless(!manio_read(manio, sb));
+		fail_unless(!strcmp(sb->path.buf, s->path.buf));
+		sbuf_free_content(sb);
+	}
+	fail_unless(manio_read(manio, sb)==1);
+	sbuf_free(&sb);
+	fail_unless(!manio_close(&manio));
+}
+
+START_TEST(test_phase2_happy_path_streams)
+{
+	struct asfd *asfd;
+	struct async *as;
+	struct sdirs *sdirs;
+	struct conf **confs;
+	struct slist *slist=NULL;
+	prng_init(0);
+	base64_init();
+	hexmap_init();
+	setup(&as, &sdirs, &confs);
+	set_int(confs[OPT_BACKUP_STREAMS], 2);
+	asfd=asfd_mock_setup(&reads, &writes);
+	as->asfd_add(as, asfd);
+	as->read_write=async_rw_simple;
+	as->read_quick=async_rw_simple;
+	asfd->as=as;
+
+	build_storage_dirs(sdirs, sd1, ARR_LEN(sd1));
+	fail_unless(!sdirs_get_real_working_from_symlink(sdirs));
+	slist=build_manifest(sdirs->phase1data, PROTO_1, 20, 1 /*phase*/);
+	setup_asfds_happy_path_streams(asfd, slist);
+
+	fail_unless(!backup_phase2_server_protocol1(
+		as,
+		sdirs,
+		NULL, // incexc
+		0, // resume
+		confs
+	));
+	assert_changed_in_order(sdirs, slist);
+
+	asfd_free(&asfd);
+	asfd_mock_teardown(&reads, &writes);
+	slist_free(&slist);
+	tear_down(&as, &sdirs, &confs);
+}
+END_TEST
+
 Suite *suite_server_protocol1_backup_phase2(void)
 {
 	Suite *s;
@@ -437,6 +571,7 @@ Suite *suite_server_protocol1_backup_phase2(void)
 
 	tcase_add_test(tc_core, test_phase2_happy_path_no_files);
 	tcase_add_test(tc_core, test_phase2_happy_path_changed_files);
+	tcase_add_test(tc_core, test_phase2_happy_path_streams);
 
 	suite_add_tcase(s, tc_core);
 
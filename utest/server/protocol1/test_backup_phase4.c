@@ -0,0 +1,277 @@
+#include "../../test.h"
+#include "../../builders/build.h"
+#include "../../builders/build_file.h"
+#include "../../../src/alloc.h"
+#include "../../../src/attribs.h"
+#include "../../../src/base64.h"
+#include "../../../src/bu.h"
+#include "../../../src/fsops.h"
+#include "../../../src/fzp.h"
+#include "../../../src/iobuf.h"
+#include "../../../src/log.h"
+#include "../../../src/prepend.h"
+#include "../../../src/sbuf.h"
+#include "../../../src/server/protocol1/backup_phase4.h"
+#include "../../../src/server/sdirs.h"
+
+#define BASE	"utest_server_protocol1_backup_phase4"
+#define FILES	30
+
+// Each file is one of these, going round in turn.
+enum jiggle_kind
+{
+	KIND_NEW=0,	// Received whole, waiting in data.tmp.
+	KIND_UNCHANGED,	// Only in the previous backup.
+	KIND_BAD_DELTA,	// A forward delta that will not apply.
+	KIND_MAX
+};
+
+static struct sd sd1[] = {
+	{ "0000001 1970-01-01 00:00:00", 1, 1, BU_CURRENT },
+	{ "0000002 1970-01-01 00:00:00", 2, 2, BU_FINISHING },
+};
+
+static struct sdirs *setup_sdirs(void)
+{
+	struct sdirs *sdirs;
+	fail_unless((sdirs=sdirs_alloc())!=NULL);
+	fail_unless(!sdirs_init(sdirs, PROTO_1,
+		BASE, // directory
+		"utestclient", // cname
+		NULL, // client_lockdir
+		"a_group", // dedup_group
+		NULL // manual_delete
+	));
+	return sdirs;
+}
+
+static struct conf **setup_conf(int workers)
+{
+	struct conf **confs=NULL;
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	set_int(confs[OPT_PHASE4_WORKERS], workers);
+	return confs;
+}
+
+static enum jiggle_kind kind(int i)
+{
+	return (enum jiggle_kind)(i%KIND_MAX);
+}
+
+static char *datapth(int i)
+{
+	static char buf[32];
+	snprintf(buf, sizeof(buf), "t/d%d/f%02d", i%4, i);
+	return buf;
+}
+
+static void build_in(const char *dir, int i, const char *content)
+{
+	char *path;
+	fail_unless((path=prepend_s(dir, datapth(i)))!=NULL);
+	build_file(path, content);
+	free_w(&path);
+}
+
+static void build_entry(struct fzp *fzp, int i)
+{
+	char tmp[32];
+	struct sbuf *sb;
+	fail_unless((sb=sbuf_alloc(PROTO_1))!=NULL);
+	snprintf(tmp, sizeof(tmp), "/d%d/f%02d", i%4, i);
+	iobuf_from_str(&sb->path, CMD_FILE, tmp);
+	sb->statp.st_mode=S_IFREG|0644;
+	sb->compression=0;
+	fail_unless(!attribs_encode(sb));
+	iobuf_from_str(&sb->protocol1->datapth, CMD_DATAPTH, datapth(i));
+	iobuf_from_str(&sb->endfile, CMD_END_FILE,
+		(char *)"5:00000000000000000000000000000000");
+	fail_unless(!sbuf_to_manifest(sb, fzp));
+	// The iobufs point at stack and static buffers.
+	iobuf_init(&sb->path);
+	iobuf_init(&sb->protocol1->datapth);
+	iobuf_init(&sb->endfile);
+	sbuf_free(&sb);
+}
+
+// A manifest in pathcmp order, with the data files that phase2 would have
+// left behind.
+static void build_finishing(struct sdirs *sdirs)
+{
+	int i;
+	int d;
+	char content[16];
+	char *manifest;
+	char *datadirtmp;
+	char *deltafdir;
+	struct fzp *fzp;
+
+	fail_unless((manifest=prepend_s(sdirs->finishing,
+		"manifest.gz"))!=NULL);
+	fail_unless((datadirtmp=prepend_s(sdirs->finishing,
+		"data.tmp"))!=NULL);
+	fail_unless((deltafdir=prepend_s(sdirs->finishing,
+		"deltas.forward"))!=NULL);
+	fail_unless((fzp=fzp_gzopen(manifest, "wb"))!=NULL);
+	// Entries are in pathcmp order, so go by directory first.
+	for(d=0; d<4; d++) for(i=0; i<FILES; i++)
+		if(i%4==d) build_entry(fzp, i);
+	fail_unless(!fzp_close(&fzp));
+
+	for(i=0; i<FILES; i++)
+	{
+		switch(kind(i))
+		{
+			case KIND_NEW:
+				snprintf(content, sizeof(content),
+					"new%02d", i);
+				build_in(datadirtmp, i, content);
+				break;
+			case KIND_BAD_DELTA:
+				build_in(deltafdir, i, "not a delta");
+				// Fall through.
+			case KIND_UNCHANGED:
+				snprintf(content, sizeof(content),
+					"old%02d", i);
+				build_in(sdirs->currentdata, i, content);
+				break;
+			default:
+				break;
+		}
+	}
+	free_w(&manifest);
+	free_w(&datadirtmp);
+	free_w(&deltafdir);
+}
+
+static void assert_file(const char *dir, int i, const char *expected)
+{
+	char buf[32]="";
+	char *path;
+	struct fzp *fzp;
+	fail_unless((path=prepend_s(dir, datapth(i)))!=NULL);
+	if(!expected)
+	{
+		fail_unless(!fzp_open(path, "rb"));
+		free_w(&path);
+		return;
+	}
+	fail_unless((fzp=fzp_open(path, "rb"))!=NULL);
+	fail_unless(fzp_read(fzp, buf, sizeof(buf)-1)==(int)strlen(expected));
+	ck_assert_str_eq(expected, buf);
+	fail_unless(!fzp_close(&fzp));
+	free_w(&path);
+}
+
+// The files that could not be patched are gone from the manifest, and the
+// rest are in the same order as before.
+static void assert_manifest(struct sdirs *sdirs)
+{
+	int i;
+	int d;
+	char *manifest;
+	struct fzp *fzp;
+	struct sbuf *sb;
+	fail_unless((manifest=prepend_s(sdirs->finishing,
+		"manifest.gz"))!=NULL);
+	fail_unless((fzp=fzp_gzopen(manifest, "rb"))!=NULL);
+	fail_unless((sb=sbuf_alloc(PROTO_1))!=NULL);
+	for(d=0; d<4; d++) for(i=0; i<FILES; i++)
+	{
+		if(i%4!=d || kind(i)==KIND_BAD_DELTA)
+			continue;
+		fail_unless(!sbuf_fill_from_file(sb, fzp, NULL, NULL));
+		ck_assert_str_eq(datapth(i), sb->protocol1->datapth.buf);
+		sbuf_free_content(sb);
+	}
+	fail_unless(sbuf_fill_from_file(sb, fzp, NULL, NULL)==1);
+	sbuf_free(&sb);
+	fail_unless(!fzp_close(&fzp));
+	free_w(&manifest);
+}
+
+static void run_test(int workers)
+{
+	int i;
+	char content[16];
+	char *datadir;
+	struct sdirs *sdirs;
+	struct conf **confs;
+
+	base64_init();
+	sdirs=setup_sdirs();
+	confs=setup_conf(workers);
+	fail_unless(!recursive_delete(BASE));
+	build_storage_dirs(sdirs, sd1, ARR_LEN(sd1));
+	build_finishing(sdirs);
+
+	fail_unless(!backup_phase4_server_protocol1(sdirs, confs));
+	log_fzp_set(NULL, confs);
+
+	assert_manifest(sdirs);
+	fail_unless((datadir=prepend_s(sdirs->finishing, "data"))!=NULL);
+	for(i=0; i<FILES; i++)
+	{
+		switch(kind(i))
+		{
+			case KIND_NEW:
+				snprintf(content, sizeof(content),
+					"new%02d", i);
+				assert_file(datadir, i, content);
+				break;
+			case KIND_UNCHANGED:
+				snprintf(content, sizeof(content),
+					"old%02d", i);
+				assert_file(datadir, i, content);
+				break;
+			default:
+				assert_file(datadir, i, NULL);
+				break;
+		}
+	}
+	free_w(&datadir);
+
+	sdirs_free(&sdirs);
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+START_TEST(test_phase4_serial)
+{
+	run_test(1);
+}
+END_TEST
+
+// The workers must come up with exactly what the serial run does.
+START_TEST(test_phase4_workers)
+{
+	run_test(3);
+}
+END_TEST
+
+START_TEST(test_phase4_more_workers_than_files)
+{
+	run_test(FILES+5);
+}
+END_TEST
+
+Suite *suite_server_protocol1_backup_phase4(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol1_backup_phase4");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_phase4_serial);
+	tcase_add_test(tc_core, test_phase4_workers);
+	tcase_add_test(tc_core, test_phase4_more_workers_than_files);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
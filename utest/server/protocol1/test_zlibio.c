@@ -0,0 +1,108 @@
+#include "../../test.h"
+#include "../../prng.h"
+#include "../../../src/alloc.h"
+#include "../../../src/async.h"
+#include "../../../src/fsops.h"
+#include "../../../src/fzp.h"
+#include "../../../src/server/compress.h"
+#include "../../../src/server/protocol1/zlibio.h"
+
+#define BASE		"utest_server_protocol1_zlibio"
+#define STORED		BASE "/stored.gz"
+#define INFLATED	BASE "/inflated"
+
+// Bigger than a ZCHUNK, so that both ends go round their loops.
+#define DATA_LEN	300000
+
+static uint8_t *build_data(void)
+{
+	size_t i;
+	uint8_t *data;
+	fail_unless((data=(uint8_t *)malloc_w(DATA_LEN, __func__))!=NULL);
+	prng_init(0);
+	// Something compressible.
+	for(i=0; i<DATA_LEN; i++)
+		data[i]='a'+prng_next()%8;
+	return data;
+}
+
+static void tear_down(uint8_t **data)
+{
+	free_v((void **)data);
+	compress_set_zstd(0);
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void store(const uint8_t *data, int zstd)
+{
+	struct fzp *fzp;
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!mkdir(BASE, 0777));
+	compress_set_zstd(zstd);
+	fail_unless((fzp=compress_open_data(STORED, 9))!=NULL);
+	fail_unless(fzp_write(fzp, data, DATA_LEN)==DATA_LEN);
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void assert_contents(struct fzp *fzp, const uint8_t *data)
+{
+	int got;
+	size_t total=0;
+	uint8_t buf[ZCHUNK];
+	fail_unless(fzp!=NULL);
+	while((got=fzp_read(fzp, buf, sizeof(buf)))>0)
+	{
+		fail_unless(total+got<=DATA_LEN);
+		fail_unless(!memcmp(buf, data+total, got));
+		total+=got;
+	}
+	fail_unless(fzp_eof(fzp));
+	fail_unless(total==DATA_LEN);
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void run_test(int zstd)
+{
+	uint8_t *data=build_data();
+	store(data, zstd);
+	fail_unless(fzp_is_zstd(STORED)==zstd);
+	// What verify and the delta code read the stored file with.
+	assert_contents(fzp_gzopen(STORED, "rb"), data);
+	// What restore inflates the stored file with.
+	fail_unless(!zlib_inflate(NULL, STORED, INFLATED, NULL));
+	assert_contents(fzp_open(INFLATED, "rb"), data);
+	tear_down(&data);
+}
+
+START_TEST(test_zlibio_gzip)
+{
+	run_test(0);
+}
+END_TEST
+
+#ifdef HAVE_ZSTD
+START_TEST(test_zlibio_zstd)
+{
+	run_test(1);
+}
+END_TEST
+#endif
+
+Suite *suite_server_protocol1_zlibio(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol1_zlibio");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_zlibio_gzip);
+#ifdef HAVE_ZSTD
+	tcase_add_test(tc_core, test_zlibio_zstd);
+#endif
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -8,13 +8,16 @@
 #include "../../../../src/fsops.h"
 #include "../../../../src/hexmap.h"
 #include "../../../../src/prepend.h"
+#include "../../../../src/server/sdirs.h"
 #include "../../../../src/server/protocol2/champ_chooser/dindex.h"
 
 #define PATH	"utest_dindex"
+#define GROUP	"a_group"
 
 static const char *dold_path=PATH "/dindex.old";
 static const char *dnew_path=PATH "/dindex.new";
-static const char *data_path=PATH "/data";
+static const char *data_path=PATH "/" GROUP "/data";
+static const char *keep_path=PATH "/dindex.keep";
 
 static void tear_down(void)
 {
@@ -25,7 +28,7 @@ static void tear_down(void)
 static void setup(void)
 {
 	fail_unless(recursive_delete(PATH)==0);
-	fail_unless(!mkdir(PATH, 0777));
+	fail_unless(!build_path_w(data_path));
 	fail_unless(!mkdir(data_path, 0777));
 }
 
@@ -80,22 +83,37 @@ static void assert_existences(uint64_t *arr, size_t len, int exists)
 		assert_existence(arr[l], exists);
 }
 
+static struct gc *setup_gc(void)
+{
+	struct gc *gc;
+	fail_unless((gc=gc_alloc(data_path))!=NULL);
+	fail_unless(!build_path_w(gc->candidates));
+	return gc;
+}
+
 static void common_di(uint64_t *dold, size_t dolen,
 	uint64_t *dnew, size_t dnlen,
 	uint64_t *deleted, size_t deletedlen)
 {
+	struct gc *gc;
 	setup();
+	gc=setup_gc();
 	build_dindex(dold, dolen, dold_path);
 	build_dindex(dnew, dnlen, dnew_path);
 
 	create_data_files(dold, dolen);
 	create_data_files(dnew, dnlen);
 
-	fail_unless(!compare_dindexes_and_unlink_datafiles(dold_path,
-		dnew_path, data_path));
+	fail_unless(!compare_dindexes(dold_path, dnew_path, gc->candidates));
+	// Nothing gets deleted until the sweep.
+	assert_existences(dold, dolen, 1 /* does exist */);
+	fail_unless(!sweep_candidates(gc, NULL, data_path, 0, 0));
+	fail_unless(gc->files==deletedlen);
+	fail_unless(gc->done==deletedlen);
 	assert_existences(deleted, deletedlen, 0 /* does not exist */);
 	assert_existences(dnew, dnlen, 1 /* does exist */);
 
+	gc_free(&gc);
 	tear_down();
 }
 
@@ -134,6 +152,211 @@ START_TEST(test_dindex)
 }
 END_TEST
 
+START_TEST(test_dindex_sweep_keeps_recent)
+{
+	struct gc *gc;
+	hexmap_init();
+	setup();
+	gc=setup_gc();
+	build_dindex(din1, ARR_LEN(din1), dold_path);
+	build_dindex(NULL, 0, dnew_path);
+	// Something backed up since the mark uses one of the candidates.
+	build_dindex(del1, ARR_LEN(del1), keep_path);
+	create_data_files(din1, ARR_LEN(din1));
+
+	fail_unless(!compare_dindexes(dold_path, dnew_path, gc->candidates));
+	fail_unless(!sweep_candidates(gc, keep_path, data_path, 0, 0));
+	fail_unless(gc->done==ARR_LEN(din1));
+	fail_unless(gc->files==ARR_LEN(din2));
+	assert_existences(din2, ARR_LEN(din2), 0 /* does not exist */);
+	assert_existences(del1, ARR_LEN(del1), 1 /* does exist */);
+
+	gc_free(&gc);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_dindex_sweep_resumes)
+{
+	struct gc *gc;
+	hexmap_init();
+	setup();
+	gc=setup_gc();
+	build_dindex(din1, ARR_LEN(din1), dold_path);
+	build_dindex(NULL, 0, dnew_path);
+	create_data_files(din1, ARR_LEN(din1));
+
+	fail_unless(!compare_dindexes(dold_path, dnew_path, gc->candidates));
+	// Pretend that an earlier sweep got through the first candidate.
+	gc->done=1;
+	fail_unless(!sweep_candidates(gc, NULL, data_path, 0, 0));
+	fail_unless(gc->done==ARR_LEN(din1));
+	fail_unless(gc->files==ARR_LEN(din1)-1);
+	assert_existence(din1[0], 1 /* does exist */);
+	assert_existence(din1[1], 0 /* does not exist */);
+	assert_existence(din1[2], 0 /* does not exist */);
+
+	gc_free(&gc);
+	tear_down();
+}
+END_TEST
+
+// The whole clean up, as the champ chooser runs it, with clients in
+// the same dedup group as the data files.
+
+static struct sdirs *setup_sdirs(void)
+{
+	struct sdirs *sdirs;
+	fail_unless((sdirs=sdirs_alloc())!=NULL);
+	fail_unless(!sdirs_init(sdirs, PROTO_2,
+		PATH, // directory
+		"utestclient", // cname
+		NULL, // client_lockdir
+		GROUP, // dedup_group
+		NULL // manual_delete
+	));
+	return sdirs;
+}
+
+static char *client_path(struct sdirs *sdirs, const char *cname,
+	const char *file)
+{
+	char *client;
+	char *path;
+	fail_unless((client=prepend_s(sdirs->clients, cname))!=NULL);
+	fail_unless((path=prepend_s(client, file))!=NULL);
+	free_w(&client);
+	return path;
+}
+
+// What a finished backup leaves for the clean up to find.
+static void build_dfiles(struct sdirs *sdirs, const char *cname,
+	uint64_t *arr, size_t len)
+{
+	char *dfiles;
+	dfiles=client_path(sdirs, cname, "dfiles");
+	fail_unless(!build_path_w(dfiles));
+	unlink(dfiles);
+	build_dindex(arr, len, dfiles);
+	free_w(&dfiles);
+}
+
+static void backup_start(struct sdirs *sdirs, const char *cname)
+{
+	char *working;
+	working=client_path(sdirs, cname, "working");
+	fail_unless(!build_path_w(working));
+	fail_unless(!symlink("0000002 1970-01-01 00:00:00", working));
+	free_w(&working);
+}
+
+static void backup_finish(struct sdirs *sdirs, const char *cname)
+{
+	char *working;
+	working=client_path(sdirs, cname, "working");
+	fail_unless(!unlink(working));
+	free_w(&working);
+}
+
+static void assert_candidates(struct sdirs *sdirs, int exists)
+{
+	struct gc *gc;
+	struct stat statp;
+	fail_unless((gc=gc_alloc(sdirs->data))!=NULL);
+	fail_unless((lstat(gc->candidates, &statp)?0:1)==exists);
+	gc_free(&gc);
+}
+
+// Marks del1 as a candidate while client b has a backup in progress.
+static struct sdirs *setup_marked_with_b_in_progress(void)
+{
+	struct sdirs *sdirs;
+	hexmap_init();
+	setup();
+	sdirs=setup_sdirs();
+	create_data_files(din1, ARR_LEN(din1));
+
+	// The first run only records what is in use.
+	build_dfiles(sdirs, "a", din1, ARR_LEN(din1));
+	fail_unless(!delete_unused_data_files(sdirs, NULL));
+	assert_candidates(sdirs, 0);
+
+	build_dfiles(sdirs, "a", din2, ARR_LEN(din2));
+	backup_start(sdirs, "b");
+	fail_unless(!delete_unused_data_files(sdirs, NULL));
+	assert_candidates(sdirs, 1);
+	assert_existences(din1, ARR_LEN(din1), 1 /* does exist */);
+	return sdirs;
+}
+
+static void tear_down_sdirs(struct sdirs **sdirs)
+{
+	sdirs_free(sdirs);
+	tear_down();
+}
+
+START_TEST(test_dindex_gc_waits_for_backup_in_progress)
+{
+	struct sdirs *sdirs;
+	sdirs=setup_marked_with_b_in_progress();
+
+	// Still going.
+	fail_unless(!delete_unused_data_files(sdirs, NULL));
+	assert_existences(din1, ARR_LEN(din1), 1 /* does exist */);
+
+	// It finished, and it used the candidate.
+	build_dfiles(sdirs, "b", del1, ARR_LEN(del1));
+	backup_finish(sdirs, "b");
+	fail_unless(!delete_unused_data_files(sdirs, NULL));
+	assert_candidates(sdirs, 0);
+	assert_existences(din1, ARR_LEN(din1), 1 /* does exist */);
+
+	tear_down_sdirs(&sdirs);
+}
+END_TEST
+
+START_TEST(test_dindex_gc_sweeps_after_backup_in_progress)
+{
+	struct sdirs *sdirs;
+	sdirs=setup_marked_with_b_in_progress();
+
+	// It finished, without using the candidate.
+	backup_finish(sdirs, "b");
+	fail_unless(!delete_unused_data_files(sdirs, NULL));
+	assert_candidates(sdirs, 0);
+	assert_existences(del1, ARR_LEN(del1), 0 /* does not exist */);
+	assert_existences(din2, ARR_LEN(din2), 1 /* does exist */);
+
+	tear_down_sdirs(&sdirs);
+}
+END_TEST
+
+START_TEST(test_dindex_gc_backup_deleted_after_mark)
+{
+	struct sdirs *sdirs;
+	sdirs=setup_marked_with_b_in_progress();
+
+	// A backup gets deleted, and client c starts one that might have
+	// deduplicated against it, before b finishes.
+	fail_unless(!dindex_note_deleted_backup(sdirs->data));
+	backup_start(sdirs, "c");
+	backup_finish(sdirs, "b");
+	fail_unless(!delete_unused_data_files(sdirs, NULL));
+	assert_candidates(sdirs, 1);
+	assert_existences(din1, ARR_LEN(din1), 1 /* does exist */);
+
+	// The note has been dealt with, so c is not picked up a second time
+	// once it has finished.
+	backup_finish(sdirs, "c");
+	fail_unless(!delete_unused_data_files(sdirs, NULL));
+	assert_candidates(sdirs, 0);
+	assert_existences(del1, ARR_LEN(del1), 0 /* does not exist */);
+	assert_existences(din2, ARR_LEN(din2), 1 /* does exist */);
+
+	tear_down_sdirs(&sdirs);
+}
+END_TEST
+
 Suite *suite_server_protocol2_champ_chooser_dindex(void)
 {
 	Suite *s;
@@ -144,6 +367,11 @@ Suite *suite_server_protocol2_champ_chooser_dindex(void)
 	tc_core=tcase_create("Core");
 
 	tcase_add_test(tc_core, test_dindex);
+	tcase_add_test(tc_core, test_dindex_sweep_keeps_recent);
+	tcase_add_test(tc_core, test_dindex_sweep_resumes);
+	tcase_add_test(tc_core, test_dindex_gc_waits_for_backup_in_progress);
+	tcase_add_test(tc_core, test_dindex_gc_sweeps_after_backup_in_progress);
+	tcase_add_test(tc_core, test_dindex_gc_backup_deleted_after_mark);
 	suite_add_tcase(s, tc_core);
 
 	return s;
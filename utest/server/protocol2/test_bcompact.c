@@ -0,0 +1,397 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "../../test.h"
+#include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
+#include "../../../src/fsops.h"
+#include "../../../src/fzp.h"
+#include "../../../src/hexmap.h"
+#include "../../../src/iobuf.h"
+#include "../../../src/prepend.h"
+#include "../../../src/protocol2/blk.h"
+#include "../../../src/server/dpth.h"
+#include "../../../src/server/manio.h"
+#include "../../../src/server/protocol2/bcompact.h"
+
+#define BASE		"utest_bcompact"
+#define DATADIR		BASE "/data"
+#define MANIFEST	BASE "/manifest/00000000"
+#define DINDEX		BASE "/manifest/dindex/00000000"
+#define OLD_FILE	DATADIR "/0000/0000/0000"
+#define NEW_FILE	DATADIR "/0000/0000/0001"
+
+#define JOURNAL		DATADIR "/compact/new"
+#define MAP		DATADIR "/compact/map"
+
+static const char *blocks[]={"aaaa", "bb", "cccccccc", "d"};
+
+static void write_data_file_with(const char *path, size_t extra)
+{
+	size_t i;
+	struct fzp *fzp;
+	fail_unless(!build_path_w(path));
+	fail_unless((fzp=fzp_open(path, "wb"))!=NULL);
+	for(i=0; i<ARR_LEN(blocks); i++)
+		fzp_printf(fzp, "%c%04X%s", CMD_DATA,
+			(unsigned int)strlen(blocks[i]), blocks[i]);
+	for(i=0; i<extra; i++)
+		fzp_printf(fzp, "%c%04Xe", CMD_DATA, 1);
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void write_data_file(void)
+{
+	write_data_file_with(OLD_FILE, 0);
+}
+
+static void write_sig(struct fzp *fzp, uint64_t savepath)
+{
+	struct blk blk;
+	struct iobuf wbuf;
+	memset(&blk, 0, sizeof(blk));
+	blk.fingerprint=savepath+1;
+	blk.savepath=savepath;
+	blk_to_iobuf_sig_and_savepath(&blk, &wbuf);
+	fail_unless(!iobuf_send_msg_fzp(&wbuf, fzp));
+}
+
+// A manifest that uses the first and third blocks.
+static void write_manifest(void)
+{
+	struct fzp *fzp;
+	struct iobuf wbuf;
+	fail_unless(!build_path_w(MANIFEST));
+	fail_unless((fzp=fzp_gzopen(MANIFEST, "wb"))!=NULL);
+	iobuf_from_str(&wbuf, CMD_FILE, (char *)"/some/file");
+	fail_unless(!iobuf_send_msg_fzp(&wbuf, fzp));
+	write_sig(fzp, 0);
+	write_sig(fzp, 2);
+	write_sig(fzp, 0);
+	fail_unless(!fzp_close(&fzp));
+}
+
+static struct compact *setup_compact(int threshold, int dry_run)
+{
+	struct compact *c;
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+	fail_unless((c=compact_alloc(threshold, dry_run))!=NULL);
+	fail_unless((c->map=strdup_w(MAP, __func__))!=NULL);
+	fail_unless((c->journal=strdup_w(JOURNAL, __func__))!=NULL);
+	return c;
+}
+
+static struct compact *setup(int threshold, int dry_run)
+{
+	struct compact *c;
+	c=setup_compact(threshold, dry_run);
+	write_data_file();
+	write_manifest();
+	fail_unless(!compact_mark_manifest(c, MANIFEST));
+	fail_unless(!compact_choose(c, DATADIR));
+	return c;
+}
+
+static void tear_down(struct compact **c)
+{
+	compact_free(c);
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void assert_savepaths(const char *path, uint64_t *expected, size_t len)
+{
+	size_t i=0;
+	struct blk blk;
+	struct iobuf rbuf;
+	struct fzp *fzp;
+	iobuf_init(&rbuf);
+	fail_unless((fzp=fzp_gzopen(path, "rb"))!=NULL);
+	while(!iobuf_fill_from_fzp(&rbuf, fzp))
+	{
+		if(rbuf.cmd==CMD_SIG)
+		{
+			fail_unless(!blk_set_from_iobuf_sig_and_savepath(&blk,
+				&rbuf));
+			fail_unless(i<len);
+			fail_unless(blk.savepath==expected[i++]);
+		}
+		else if(rbuf.cmd==CMD_SAVE_PATH)
+		{
+			fail_unless(!blk_set_from_iobuf_savepath(&blk, &rbuf));
+			fail_unless(i<len);
+			fail_unless(blk.savepath==expected[i++]);
+		}
+		iobuf_free_content(&rbuf);
+	}
+	fail_unless(i==len);
+	fzp_close(&fzp);
+}
+
+static void assert_blocks(const char *path, const char **expected, size_t len)
+{
+	size_t i=0;
+	struct iobuf rbuf;
+	struct fzp *fzp;
+	iobuf_init(&rbuf);
+	fail_unless((fzp=fzp_open(path, "rb"))!=NULL);
+	while(!iobuf_fill_from_fzp_data(&rbuf, fzp))
+	{
+		fail_unless(i<len);
+		fail_unless(rbuf.len==strlen(expected[i]));
+		fail_unless(!memcmp(rbuf.buf, expected[i++], rbuf.len));
+		iobuf_free_content(&rbuf);
+	}
+	fail_unless(i==len);
+	fzp_close(&fzp);
+}
+
+START_TEST(test_bcompact_above_threshold)
+{
+	struct compact *c;
+	// 22 of the 35 bytes are used.
+	c=setup(60, 0);
+	fail_unless(c->stats.files_scanned==1);
+	fail_unless(c->stats.bytes_scanned==35);
+	fail_unless(c->stats.files_chosen==0);
+	tear_down(&c);
+}
+END_TEST
+
+START_TEST(test_bcompact_dry_run)
+{
+	struct compact *c;
+	uint64_t old[]={0, 2, 0};
+	c=setup(75, 1);
+	fail_unless(c->stats.files_chosen==1);
+	fail_unless(c->stats.data_read==35);
+	fail_unless(c->stats.data_written==22);
+	fail_unless(compact_rewrite_manifest(c, MANIFEST, DINDEX)==1);
+	fail_unless(c->stats.manifests_changed==1);
+	assert_savepaths(MANIFEST, old, ARR_LEN(old));
+	assert_blocks(OLD_FILE, blocks, ARR_LEN(blocks));
+	tear_down(&c);
+}
+END_TEST
+
+START_TEST(test_bcompact)
+{
+	struct compact *c;
+	struct stat statp;
+	const char *live[]={"aaaa", "cccccccc"};
+	uint64_t sigs[]={0x10000, 0x10001, 0x10000};
+	uint64_t dindex[]={0x10000};
+
+	c=setup(75, 0);
+	fail_unless(c->stats.files_chosen==1);
+	fail_unless(!compact_copy(c, DATADIR, MAX_STORAGE_SUBDIRS));
+	fail_unless(c->stats.files_written==1);
+	fail_unless(!lstat(c->map, &statp));
+	// The map has taken over from the journal.
+	fail_unless(lstat(c->journal, &statp));
+	assert_blocks(NEW_FILE, live, ARR_LEN(live));
+
+	fail_unless(compact_rewrite_manifest(c, MANIFEST, DINDEX)==1);
+	assert_savepaths(MANIFEST, sigs, ARR_LEN(sigs));
+	assert_savepaths(DINDEX, dindex, ARR_LEN(dindex));
+	// Doing it again changes nothing.
+	fail_unless(compact_rewrite_manifest(c, MANIFEST, DINDEX)==0);
+	assert_savepaths(MANIFEST, sigs, ARR_LEN(sigs));
+
+	fail_unless(!compact_delete_old(c, DATADIR));
+	fail_unless(c->stats.files_deleted==1);
+	fail_unless(c->stats.bytes_deleted==35);
+	fail_unless(lstat(OLD_FILE, &statp));
+	assert_blocks(NEW_FILE, live, ARR_LEN(live));
+	tear_down(&c);
+}
+END_TEST
+
+START_TEST(test_bcompact_sig_past_end_of_data_file)
+{
+	struct compact *c;
+	struct fzp *fzp;
+	c=setup_compact(75, 0);
+	fail_unless(!build_path_w(MANIFEST));
+	fail_unless((fzp=fzp_gzopen(MANIFEST, "wb"))!=NULL);
+	write_sig(fzp, 1);
+	write_sig(fzp, DATA_FILE_SIG_MAX);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless(compact_mark_manifest(c, MANIFEST)==-1);
+	tear_down(&c);
+}
+END_TEST
+
+START_TEST(test_bcompact_too_many_blocks)
+{
+	struct compact *c;
+	c=setup_compact(75, 0);
+	write_data_file_with(OLD_FILE, DATA_FILE_SIG_MAX);
+	write_manifest();
+	fail_unless(!compact_mark_manifest(c, MANIFEST));
+	fail_unless(compact_choose(c, DATADIR)==-1);
+	// Had it been chosen anyway, copying would stop at the same point.
+	c->dfiles->compact=1;
+	fail_unless(compact_copy(c, DATADIR, MAX_STORAGE_SUBDIRS)==-1);
+	tear_down(&c);
+}
+END_TEST
+
+// Copies that were made before an interrupted run got as far as the map.
+static void build_orphan(void)
+{
+	struct fzp *fzp;
+	write_data_file_with(NEW_FILE, 0);
+	fail_unless(!build_path_w(JOURNAL));
+	fail_unless((fzp=fzp_open(JOURNAL, "wb"))!=NULL);
+	fzp_printf(fzp, "%016" PRIX64 "\n", (uint64_t)0x10000);
+	fail_unless(!fzp_close(&fzp));
+}
+
+START_TEST(test_bcompact_remove_orphans)
+{
+	struct compact *c;
+	struct stat statp;
+	c=setup_compact(75, 0);
+	write_data_file();
+	build_orphan();
+	fail_unless(!compact_remove_orphans(c, DATADIR));
+	fail_unless(lstat(NEW_FILE, &statp));
+	fail_unless(lstat(JOURNAL, &statp));
+	assert_blocks(OLD_FILE, blocks, ARR_LEN(blocks));
+	// Nothing to do.
+	fail_unless(!compact_remove_orphans(c, DATADIR));
+	tear_down(&c);
+}
+END_TEST
+
+START_TEST(test_bcompact_remove_orphans_with_map)
+{
+	struct compact *c;
+	struct stat statp;
+	struct fzp *fzp;
+	c=setup_compact(75, 0);
+	build_orphan();
+	fail_unless((fzp=fzp_gzopen(MAP, "wb"))!=NULL);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless(!compact_remove_orphans(c, DATADIR));
+	fail_unless(!lstat(NEW_FILE, &statp));
+	fail_unless(lstat(JOURNAL, &statp));
+	tear_down(&c);
+}
+END_TEST
+
+#ifdef HAVE_ZSTD
+// Five entries that use the first and third blocks, all in one zstd frame.
+static void write_zstd_manifest(void)
+{
+	int i;
+	struct fzp *fzp;
+	struct iobuf wbuf;
+	fail_unless(!build_path_w(MANIFEST));
+	fail_unless((fzp=fzp_zstdopen(MANIFEST, "wb"))!=NULL);
+	for(i=0; i<5; i++)
+	{
+		iobuf_from_str(&wbuf, CMD_ATTRIBS, (char *)"attribs");
+		fail_unless(!iobuf_send_msg_fzp(&wbuf, fzp));
+		iobuf_from_str(&wbuf, CMD_FILE, (char *)"/some/file");
+		fail_unless(!iobuf_send_msg_fzp(&wbuf, fzp));
+		write_sig(fzp, 0);
+		write_sig(fzp, 2);
+		iobuf_from_str(&wbuf, CMD_END_FILE, (char *)"0:0");
+		fail_unless(!iobuf_send_msg_fzp(&wbuf, fzp));
+	}
+	fail_unless(!fzp_close(&fzp));
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+	uint64_t v=0;
+	while(bytes-->0) v=(v<<8)|p[bytes];
+	return v;
+}
+
+// The index on the end of a zstd manifest says where each frame starts.
+// Each one should start at the attributes of an entry.
+static void assert_zstd_frames(const char *path, uint64_t expected)
+{
+	uint64_t i;
+	uint64_t n;
+	uint64_t uoff;
+	int len;
+	char buf[4096];
+	uint8_t foot[8];
+	uint8_t entry[16];
+	FILE *fp;
+	struct fzp *fzp;
+
+	fail_unless((fzp=fzp_gzopen(path, "rb"))!=NULL);
+	fail_unless((len=fzp_read(fzp, buf, sizeof(buf)))>0);
+	fail_unless(!fzp_close(&fzp));
+
+	fail_unless((fp=fopen(path, "rb"))!=NULL);
+	fail_unless(!fseek(fp, -(long)sizeof(foot), SEEK_END));
+	fail_unless(fread(foot, 1, sizeof(foot), fp)==sizeof(foot));
+	fail_unless((n=get_le(foot, 4))==expected);
+	fail_unless(!fseek(fp, -(long)(sizeof(foot)+n*sizeof(entry)),
+		SEEK_END));
+	for(i=0; i<n; i++)
+	{
+		fail_unless(fread(entry, 1, sizeof(entry), fp)==sizeof(entry));
+		uoff=get_le(entry, 8);
+		fail_unless(uoff<(uint64_t)len);
+		fail_unless(buf[uoff]==CMD_ATTRIBS);
+	}
+	fail_unless(!fclose(fp));
+}
+
+START_TEST(test_bcompact_zstd_frames)
+{
+	struct compact *c;
+	uint64_t sigs[]={0x10000, 0x10001, 0x10000, 0x10001, 0x10000,
+		0x10001, 0x10000, 0x10001, 0x10000, 0x10001};
+
+	// Two entries to a frame, whatever the sigs in between.
+	manio_set_zstd(1, 2);
+	c=setup_compact(75, 0);
+	write_data_file();
+	write_zstd_manifest();
+	assert_zstd_frames(MANIFEST, 1);
+	fail_unless(!compact_mark_manifest(c, MANIFEST));
+	fail_unless(!compact_choose(c, DATADIR));
+	fail_unless(c->stats.files_chosen==1);
+	fail_unless(!compact_copy(c, DATADIR, MAX_STORAGE_SUBDIRS));
+	fail_unless(compact_rewrite_manifest(c, MANIFEST, DINDEX)==1);
+	assert_savepaths(MANIFEST, sigs, ARR_LEN(sigs));
+	assert_zstd_frames(MANIFEST, 3);
+	manio_set_zstd(0, 0);
+	tear_down(&c);
+}
+END_TEST
+#endif
+
+Suite *suite_server_protocol2_bcompact(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol2_bcompact");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_bcompact_above_threshold);
+	tcase_add_test(tc_core, test_bcompact_dry_run);
+	tcase_add_test(tc_core, test_bcompact);
+	tcase_add_test(tc_core, test_bcompact_sig_past_end_of_data_file);
+	tcase_add_test(tc_core, test_bcompact_too_many_blocks);
+	tcase_add_test(tc_core, test_bcompact_remove_orphans);
+	tcase_add_test(tc_core, test_bcompact_remove_orphans_with_map);
+#ifdef HAVE_ZSTD
+	tcase_add_test(tc_core, test_bcompact_zstd_frames);
+#endif
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,200 @@
+#include "../test.h"
+#include "../builders/build.h"
+#include "../prng.h"
+#include "../../src/alloc.h"
+#include "../../src/attribs.h"
+#include "../../src/base64.h"
+#include "../../src/fsops.h"
+#include "../../src/pathcmp.h"
+#include "../../src/sbuf.h"
+#include "../../src/slist.h"
+#include "../../src/server/manio.h"
+#include "../../src/server/mjoin.h"
+
+#define BASE		"utest_mjoin"
+#define MANIFEST1	BASE "/manifest1"
+#define MANIFEST2	BASE "/manifest2"
+
+struct counts
+{
+	int only1;
+	int only2;
+	int both;
+	int changed;
+	char *last;
+};
+
+static void setup(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!build_path_w(MANIFEST1));
+	prng_init(0);
+	base64_init();
+}
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static int count_entry(void *data,
+	struct sbuf *sb1, struct sbuf *sb2, int changed)
+{
+	struct sbuf *sb=sb1?sb1:sb2;
+	struct counts *c=(struct counts *)data;
+
+	fail_unless(sb!=NULL);
+	if(c->last)
+		fail_unless(pathcmp(c->last, sb->path.buf)<0);
+	free_w(&c->last);
+	fail_unless((c->last=strdup_w(sb->path.buf, __func__))!=NULL);
+
+	if(sb1 && sb2)
+	{
+		fail_unless(!strcmp(sb1->path.buf, sb2->path.buf));
+		c->both++;
+		if(changed) c->changed++;
+	}
+	else if(sb1) c->only1++;
+	else c->only2++;
+	return 0;
+}
+
+static void run_mjoin(const char *manifest1, const char *manifest2,
+	enum protocol protocol, int compare, struct counts *c)
+{
+	memset(c, 0, sizeof(*c));
+	fail_unless(!mjoin(manifest1, manifest2,
+		protocol, compare, count_entry, c));
+	free_w(&c->last);
+}
+
+static void do_test_mjoin_same(enum protocol protocol)
+{
+	struct counts c;
+	struct slist *slist;
+
+	setup();
+	slist=build_manifest(MANIFEST1, protocol, 200, 0);
+	run_mjoin(MANIFEST1, MANIFEST1, protocol,
+		MJOIN_CMP_MTIME|MJOIN_CMP_CTIME|MJOIN_CMP_SIZE|MJOIN_CMP_DATA,
+		&c);
+	fail_unless(c.only1==0);
+	fail_unless(c.only2==0);
+	fail_unless(c.both==200);
+	fail_unless(c.changed==0);
+	slist_free(&slist);
+	tear_down();
+}
+
+START_TEST(test_mjoin_same_protocol1)
+{
+	do_test_mjoin_same(PROTO_1);
+}
+END_TEST
+
+START_TEST(test_mjoin_same_protocol2)
+{
+	do_test_mjoin_same(PROTO_2);
+}
+END_TEST
+
+static void do_test_mjoin_different(enum protocol protocol)
+{
+	struct counts c;
+	struct slist *slist1;
+	struct slist *slist2;
+
+	setup();
+	slist1=build_manifest(MANIFEST1, protocol, 100, 0);
+	slist2=build_manifest(MANIFEST2, protocol, 150, 0);
+	run_mjoin(MANIFEST1, MANIFEST2, protocol, MJOIN_CMP_DATA, &c);
+	fail_unless(c.only1+c.both==100);
+	fail_unless(c.only2+c.both==150);
+	slist_free(&slist1);
+	slist_free(&slist2);
+	tear_down();
+}
+
+START_TEST(test_mjoin_different_protocol1)
+{
+	do_test_mjoin_different(PROTO_1);
+}
+END_TEST
+
+START_TEST(test_mjoin_different_protocol2)
+{
+	do_test_mjoin_different(PROTO_2);
+}
+END_TEST
+
+START_TEST(test_mjoin_changed)
+{
+	int i=0;
+	struct counts c;
+	struct sbuf *sb;
+	struct slist *slist;
+	struct manio *manio;
+
+	setup();
+	slist=build_manifest(MANIFEST1, PROTO_1, 100, 0);
+	fail_unless((manio=manio_open_phase3(MANIFEST2, "wb", PROTO_1,
+		RMANIFEST_RELATIVE))!=NULL);
+	for(sb=slist->head; sb; sb=sb->next)
+	{
+		if(!(i++%10))
+		{
+			sb->statp.st_mtime++;
+			fail_unless(!attribs_encode(sb));
+		}
+		fail_unless(!manio_write_sbuf(manio, sb));
+	}
+	fail_unless(!manio_close(&manio));
+
+	run_mjoin(MANIFEST1, MANIFEST2, PROTO_1, MJOIN_CMP_MTIME, &c);
+	fail_unless(c.both==100);
+	fail_unless(c.changed==10);
+	run_mjoin(MANIFEST1, MANIFEST2, PROTO_1,
+		MJOIN_CMP_SIZE|MJOIN_CMP_DATA, &c);
+	fail_unless(c.both==100);
+	fail_unless(c.changed==0);
+
+	slist_free(&slist);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_mjoin_parse_compare)
+{
+	fail_unless(mjoin_parse_compare(NULL)==MJOIN_CMP_MTIME);
+	fail_unless(mjoin_parse_compare("")==MJOIN_CMP_MTIME);
+	fail_unless(mjoin_parse_compare("size")==MJOIN_CMP_SIZE);
+	fail_unless(mjoin_parse_compare("mtime, ctime,data")
+		==(MJOIN_CMP_MTIME|MJOIN_CMP_CTIME|MJOIN_CMP_DATA));
+	fail_unless(mjoin_parse_compare("mtime,sizes")==-1);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_mjoin(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_mjoin");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 30);
+
+	tcase_add_test(tc_core, test_mjoin_same_protocol1);
+	tcase_add_test(tc_core, test_mjoin_same_protocol2);
+	tcase_add_test(tc_core, test_mjoin_different_protocol1);
+	tcase_add_test(tc_core, test_mjoin_different_protocol2);
+	tcase_add_test(tc_core, test_mjoin_changed);
+	tcase_add_test(tc_core, test_mjoin_parse_compare);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
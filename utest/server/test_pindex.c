@@ -0,0 +1,209 @@
+#include "../test.h"
+#include "../builders/build.h"
+#include "../prng.h"
+#include "../../src/alloc.h"
+#include "../../src/base64.h"
+#include "../../src/fsops.h"
+#include "../../src/regexp.h"
+#include "../../src/sbuf.h"
+#include "../../src/slist.h"
+#include "../../src/server/manio.h"
+#include "../../src/server/pindex.h"
+
+#define BASE		"utest_pindex"
+#define MANIFEST	BASE "/manifest"
+#define PINDEX		BASE "/pindex"
+#define ENTRIES		20000
+
+static void setup(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!build_path_w(MANIFEST));
+	prng_init(0);
+	base64_init();
+}
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static int under(const char *browsedir, const char *path)
+{
+	size_t len=strlen(browsedir);
+	return !strncmp(browsedir, path, len)
+		&& (path[len]=='/' || path[len]=='\0');
+}
+
+static int matches(struct sbuf *sb, regex_t *regex, const char *browsedir)
+{
+	if(!sb->path.buf)
+		return 0;
+	if(regex && !regex_check(regex, sb->path.buf))
+		return 0;
+	if(browsedir && !under(browsedir, sb->path.buf))
+		return 0;
+	return 1;
+}
+
+// Returns how many entries matched, with and without the index.
+static void count_matches(enum protocol protocol,
+	const char *regex_str, const char *browsedir, int *linear, int *indexed)
+{
+	int r;
+	double start;
+	regex_t *regex=NULL;
+	struct sbuf *sb;
+	struct manio *manio;
+	struct pindex *pindex;
+
+	*linear=0;
+	*indexed=0;
+	if(regex_str)
+		fail_unless((regex=regex_compile(regex_str))!=NULL);
+	fail_unless((sb=sbuf_alloc(protocol))!=NULL);
+
+	start=now();
+	fail_unless((manio=manio_open(MANIFEST, "rb", protocol))!=NULL);
+	while(!(r=manio_read(manio, sb)))
+	{
+		if(matches(sb, regex, browsedir)) (*linear)++;
+		sbuf_free_content(sb);
+	}
+	fail_unless(r==1);
+	fail_unless(!manio_close(&manio));
+	printf("linear read: %fs\n", now()-start);
+
+	start=now();
+	fail_unless((pindex=pindex_open(PINDEX, regex_str, browsedir))!=NULL);
+	fail_unless((manio=manio_open(MANIFEST, "rb", protocol))!=NULL);
+	while(!(r=pindex_read(pindex, manio, sb)))
+	{
+		if(matches(sb, regex, browsedir)) (*indexed)++;
+		sbuf_free_content(sb);
+	}
+	fail_unless(r==1);
+	fail_unless(!manio_close(&manio));
+	printf("indexed read: %fs, skipped %d of %d regions\n", now()-start,
+		(int)pindex->skipped, (int)pindex->count);
+	fail_unless(pindex->skipped>0);
+	pindex_free(&pindex);
+
+	sbuf_free(&sb);
+	regex_free(&regex);
+}
+
+// Pick an entry from the middle that is a few directories deep.
+static struct sbuf *pick_entry(struct slist *slist, int n)
+{
+	struct sbuf *sb;
+	for(sb=slist->head; sb; sb=sb->next)
+	{
+		if(!sb->path.buf) continue;
+		if(--n<0 && strchr(sb->path.buf+1, '/'))
+			break;
+	}
+	fail_unless(sb!=NULL);
+	return sb;
+}
+
+static void do_test_pindex(enum protocol protocol)
+{
+	int linear;
+	int indexed;
+	char *cp;
+	char regex[64];
+	char *dir;
+	struct sbuf *sb;
+	struct slist *slist;
+
+	setup();
+	slist=build_manifest(MANIFEST, protocol, ENTRIES, 0);
+	fail_unless(!pindex_build(MANIFEST, PINDEX, protocol));
+	sb=pick_entry(slist, ENTRIES/2);
+
+	// The generated paths are all alphanumeric, so the file name can be
+	// used as a regex as it is.
+	fail_unless((cp=strrchr(sb->path.buf, '/'))!=NULL);
+	count_matches(protocol, cp+1, NULL, &linear, &indexed);
+	fail_unless(linear>0);
+	fail_unless(linear==indexed);
+
+	fail_unless((dir=strdup_w(sb->path.buf, __func__))!=NULL);
+	*(strrchr(dir, '/'))='\0';
+	count_matches(protocol, NULL, dir, &linear, &indexed);
+	fail_unless(linear>0);
+	fail_unless(linear==indexed);
+
+	// Bits of regex syntax around the literal parts.
+	snprintf(regex, sizeof(regex), "^.*/%c+%s[ab]?$", cp[1], cp+2);
+	count_matches(protocol, regex, NULL, &linear, &indexed);
+	fail_unless(linear>0);
+	fail_unless(linear==indexed);
+
+	// A '+' with another quantifier after it leaves the character
+	// optional, so it must not end up in the trigrams.
+	snprintf(regex, sizeof(regex), "^.*/%.2s_+?%s$", cp+1, cp+3);
+	count_matches(protocol, regex, NULL, &linear, &indexed);
+	fail_unless(linear>0);
+	fail_unless(linear==indexed);
+	snprintf(regex, sizeof(regex), "^.*/%.2s_+*%s$", cp+1, cp+3);
+	count_matches(protocol, regex, NULL, &linear, &indexed);
+	fail_unless(linear>0);
+	fail_unless(linear==indexed);
+	snprintf(regex, sizeof(regex), "^.*/%.2s_+{0,1}%s$", cp+1, cp+3);
+	count_matches(protocol, regex, NULL, &linear, &indexed);
+	fail_unless(linear>0);
+	fail_unless(linear==indexed);
+
+	free_w(&dir);
+	slist_free(&slist);
+	tear_down();
+}
+
+START_TEST(test_pindex_protocol1)
+{
+	do_test_pindex(PROTO_1);
+}
+END_TEST
+
+START_TEST(test_pindex_protocol2)
+{
+	do_test_pindex(PROTO_2);
+}
+END_TEST
+
+START_TEST(test_pindex_no_index)
+{
+	setup();
+	fail_unless(pindex_open(PINDEX, "abc", NULL)==NULL);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_pindex(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_pindex");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_pindex_protocol1);
+	tcase_add_test(tc_core, test_pindex_protocol2);
+	tcase_add_test(tc_core, test_pindex_no_index);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
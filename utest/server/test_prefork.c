@@ -0,0 +1,87 @@
+#include <check.h>
+#include "../../src/burp.h"
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/fsops.h"
+#include "../../src/server/prefork.h"
+
+START_TEST(test_prefork_send_recv)
+{
+	int fd=-1;
+	int ctl[2];
+	int pipefd[2];
+	char buf[8]="";
+	struct sockaddr_storage addr;
+	struct sockaddr_storage got;
+
+	fail_unless(!socketpair(AF_UNIX, SOCK_STREAM, 0, ctl));
+	fail_unless(!pipe(pipefd));
+	memset(&addr, 0, sizeof(addr));
+	memset(&got, 0, sizeof(got));
+	addr.ss_family=AF_INET;
+
+	fail_unless(!prefork_send(ctl[0], pipefd[1], &addr));
+	fail_unless(!prefork_recv(ctl[1], &fd, &got));
+	fail_unless(fd>=0);
+	fail_unless(fd!=pipefd[1]);
+	fail_unless(!memcmp(&addr, &got, sizeof(addr)));
+
+	// The descriptor received is the same pipe.
+	fail_unless(write(fd, "abc", 3)==3);
+	fail_unless(read(pipefd[0], buf, sizeof(buf))==3);
+	fail_unless(!strcmp(buf, "abc"));
+
+	// Closing the parent end tells the child to go away.
+	close_fd(&ctl[0]);
+	fail_unless(prefork_recv(ctl[1], &fd, &got)==1);
+
+	close_fd(&fd);
+	close_fd(&ctl[1]);
+	close_fd(&pipefd[0]);
+	close_fd(&pipefd[1]);
+}
+END_TEST
+
+START_TEST(test_prefork_pool)
+{
+	struct prefork *p;
+	alloc_counters_reset();
+
+	fail_unless(prefork_count()==0);
+	fail_unless(prefork_take()==NULL);
+	fail_unless(!prefork_add(100, -1, -1));
+	fail_unless(!prefork_add(101, -1, -1));
+	fail_unless(!prefork_add(102, -1, -1));
+	fail_unless(prefork_count()==3);
+
+	fail_unless(prefork_forget(101)==1);
+	fail_unless(prefork_forget(101)==0);
+	fail_unless(prefork_count()==2);
+
+	fail_unless((p=prefork_take())!=NULL);
+	fail_unless(p->pid==102);
+	prefork_close(&p);
+	fail_unless(p==NULL);
+	fail_unless(prefork_count()==1);
+
+	prefork_free_all();
+	fail_unless(prefork_count()==0);
+	alloc_check();
+}
+END_TEST
+
+Suite *suite_server_prefork(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_prefork");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_prefork_send_recv);
+	tcase_add_test(tc_core, test_prefork_pool);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -437,6 +437,165 @@ START_TEST(test_proto2_interrupt_on_non_filedata)
 }
 END_TEST
 
+// Returns the one stream that looks after an entry.
+static int owner(enum cmd cmd, const char *path, const char *link,
+	int streams)
+{
+	int p;
+	int found=-1;
+	struct sbuf sb;
+	memset(&sb, 0, sizeof(sb));
+	iobuf_from_str(&sb.path, cmd, (char *)path);
+	if(link) iobuf_from_str(&sb.link, cmd, (char *)link);
+	for(p=0; p<streams; p++)
+	{
+		if(!restore_stream_owns(&sb, streams, p)) continue;
+		fail_unless(found==-1);
+		found=p;
+	}
+	fail_unless(found>=0);
+	return found;
+}
+
+START_TEST(test_restore_stream_owns)
+{
+	int i;
+	char path[32];
+	int counts[4]={0, 0, 0, 0};
+
+	fail_unless(owner(CMD_FILE, "/a/file", NULL, 1)==0);
+	fail_unless(owner(CMD_DIRECTORY, "/a/dir", NULL, 4)==0);
+	fail_unless(owner(CMD_SOFT_LINK, "/a/soft", "file", 4)==0);
+	fail_unless(owner(CMD_SPECIAL, "/a/fifo", NULL, 4)==0);
+	for(i=0; i<1000; i++)
+	{
+		snprintf(path, sizeof(path), "/a/file%d", i);
+		counts[owner(CMD_FILE, path, NULL, 4)]++;
+		// Hard links go with the file that they link to.
+		fail_unless(owner(CMD_HARD_LINK, "/b/link", path, 4)
+			==owner(CMD_FILE, path, NULL, 4));
+	}
+	for(i=0; i<4; i++)
+		fail_unless(counts[i]>150);
+}
+END_TEST
+
+static void assert_parse_streams(const char *str, int max,
+	int expected_ret, int expected_streams, int expected_part)
+{
+	restore_set_streams(1, 0);
+	fail_unless(restore_parse_streams(str, max)==expected_ret);
+	fail_unless(restore_get_streams()==expected_streams);
+	fail_unless(restore_get_part()==expected_part);
+}
+
+START_TEST(test_restore_parse_streams)
+{
+	// Part 0 gets no more than the server allows.
+	assert_parse_streams("0/4", 4, 0, 4, 0);
+	assert_parse_streams("0/8", 4, 0, 4, 0);
+	assert_parse_streams("0/4", 0, 0, 1, 0);
+	assert_parse_streams("2/4", 4, 0, 4, 2);
+	assert_parse_streams("3/4", 4, 0, 4, 3);
+	// The others have to fit within what part 0 was given.
+	assert_parse_streams("4/4", 4, -1, 1, 0);
+	assert_parse_streams("1/8", 4, -1, 1, 0);
+	assert_parse_streams("-1/4", 4, -1, 1, 0);
+	assert_parse_streams("0/0", 4, -1, 1, 0);
+	assert_parse_streams("1", 4, -1, 1, 0);
+	assert_parse_streams("", 4, -1, 1, 0);
+	assert_parse_streams("blah", 4, -1, 1, 0);
+	restore_set_streams(1, 0);
+}
+END_TEST
+
+#define LOCKFILE	BASE "/utestclient/lockfile"
+#define TOKEN		LOCKFILE ".restore"
+
+static void setup_asfds_refused(struct asfd *asfd, struct slist *slist)
+{
+	int w=0;
+	asfd_assert_write(asfd, &w, 0, CMD_ERROR, "no restore in progress");
+}
+
+// Without a restore going on, an extra stream gets nothing.
+START_TEST(test_restore_part_refused)
+{
+	restore_set_streams(2, 1);
+	run_test(-1, PROTO_2, 10, 5, setup_asfds_refused);
+	restore_set_streams(1, 0);
+}
+END_TEST
+
+static void setup_asfds_refused_stale(struct asfd *asfd, struct slist *slist)
+{
+	// A token from a restore that has gone, and nobody has the lock.
+	fail_unless(!restore_token_write(LOCKFILE, 1));
+	setup_asfds_refused(asfd, slist);
+}
+
+START_TEST(test_restore_part_refused_stale_token)
+{
+	restore_set_streams(2, 1);
+	run_test(-1, PROTO_2, 10, 5, setup_asfds_refused_stale);
+	restore_set_streams(1, 0);
+}
+END_TEST
+
+// With several streams, part 0 sends everything else that it looks after
+// first, and the directories only once the client says that the other
+// streams are done.
+static void setup_asfds_dirs_held_back(struct asfd *asfd, struct slist *slist)
+{
+	int r=0; int w=0;
+	int held=0;
+	struct sbuf *s;
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "restore_stream:2");
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "restore_stream_ok");
+	for(s=slist->head; s; s=s->next)
+	{
+		fail_unless(restore_stream_owns(s, 2, 0));
+		if(S_ISDIR(s->statp.st_mode))
+		{
+			held++;
+			continue;
+		}
+		asfd_assert_write_iobuf(asfd, &w, 0, &s->attr);
+		asfd_assert_write_iobuf(asfd, &w, 0, &s->path);
+	}
+	fail_unless(held>0);
+	asfd_mock_read_no_op(asfd, &r, 150);
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "restore_streams_wait");
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "restore_streams_done");
+	// They come out in reverse order.
+	for(; held; held--)
+	{
+		int i=0;
+		for(s=slist->head; s; s=s->next)
+			if(S_ISDIR(s->statp.st_mode) && ++i==held)
+				break;
+		asfd_assert_write_iobuf(asfd, &w, 0, &s->attr);
+		asfd_assert_write_iobuf(asfd, &w, 0, &s->path);
+	}
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "restoreend");
+	asfd_mock_read_no_op(asfd, &r, 10);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "restoreend_ok");
+}
+
+START_TEST(test_restore_dirs_held_back)
+{
+	size_t s;
+	struct stat statp;
+	for(s=0; s<SIZEOF_MANIFEST_CMDS; s++)
+		manifest_cmds[s]=CMD_DIRECTORY;
+	restore_set_streams(2, 0);
+	run_test(0, PROTO_2, 100, 1, setup_asfds_dirs_held_back);
+	// The token goes when part 0 is done.
+	fail_unless(lstat(TOKEN, &statp)==-1);
+	restore_set_streams(1, 0);
+}
+END_TEST
+
 Suite *suite_server_restore(void)
 {
 	Suite *s;
@@ -453,6 +612,11 @@ Suite *suite_server_restore(void)
 	tcase_add_test(tc_core, test_proto2_interrupt);
 	tcase_add_test(tc_core, test_proto2_interrupt_no_match);
 	tcase_add_test(tc_core, test_proto2_interrupt_on_non_filedata);
+	tcase_add_test(tc_core, test_restore_stream_owns);
+	tcase_add_test(tc_core, test_restore_parse_streams);
+	tcase_add_test(tc_core, test_restore_part_refused);
+	tcase_add_test(tc_core, test_restore_part_refused_stale_token);
+	tcase_add_test(tc_core, test_restore_dirs_held_back);
 
 	suite_add_tcase(s, tc_core);
 
@@ -0,0 +1,279 @@
+#include <check.h>
+#include "../../src/burp.h"
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/asfd.h"
+#include "../../src/cmd.h"
+#include "../../src/fsops.h"
+#include "../../src/iobuf.h"
+#include "../../src/lock.h"
+#include "../../src/server/sched.h"
+#include "../builders/build_asfd_mock.h"
+#include "../builders/build_file.h"
+
+#define BASE		"utest_sched"
+#define SCHED		BASE "/.sched"
+#define QUEUE		SCHED "/backup_queue"
+#define CURRENT		BASE "/current"
+#define MB		(1024*1024)
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void setup(void)
+{
+	alloc_counters_reset();
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!mkdir(BASE, 0777));
+}
+
+// Another child holding a lock, until it is killed.
+static pid_t hold_lock(const char *path)
+{
+	pid_t pid;
+	char c=0;
+	int pipefd[2];
+	fail_unless(!pipe(pipefd));
+	fail_unless((pid=fork())>=0);
+	if(!pid)
+	{
+		struct lock *lock;
+		close(pipefd[0]);
+		if(!(lock=lock_alloc_and_init(path))) _exit(1);
+		lock_get(lock);
+		if(lock->status!=GET_LOCK_GOT) _exit(1);
+		if(write(pipefd[1], "x", 1)!=1) _exit(1);
+		while(1) pause();
+	}
+	close(pipefd[1]);
+	fail_unless(read(pipefd[0], &c, 1)==1);
+	close(pipefd[0]);
+	return pid;
+}
+
+static void release_lock(pid_t pid)
+{
+	fail_unless(!kill(pid, SIGTERM));
+	fail_unless(waitpid(pid, NULL, 0)==pid);
+}
+
+START_TEST(test_sched_priority)
+{
+	time_t now=time(NULL);
+	uint64_t never=sched_priority(0, 10*MB, now);
+	uint64_t week=sched_priority(now-7*24*60*60, 10*MB, now);
+	uint64_t day_small=sched_priority(now-24*60*60, 1*MB, now);
+	uint64_t day_big=sched_priority(now-24*60*60, 100*MB, now);
+
+	fail_unless(never>week);
+	fail_unless(week>day_small);
+	fail_unless(day_small>day_big);
+	// A clock that went backwards.
+	fail_unless(sched_priority(now+60, 0, now)<day_big);
+}
+END_TEST
+
+START_TEST(test_sched_expected_bytes)
+{
+	setup();
+	fail_unless(sched_expected_bytes(CURRENT)==0);
+	build_file(CURRENT "/backup_stats",
+		"{\"counters\": [\n"
+		"{\"name\": \"files\", \"type\": \"f\", \"count\": 5},\n"
+		"{\"name\": \"bytes_received\", \"type\": \"r\", \"count\": 12345}"
+		"\n]}\n");
+	fail_unless(sched_expected_bytes(CURRENT)==12345);
+	tear_down();
+}
+END_TEST
+
+static void build_old_file(const char *path)
+{
+	struct utimbuf times;
+	build_file(path, "");
+	times.actime=time(NULL)-60;
+	times.modtime=times.actime;
+	fail_unless(!utime(path, &times));
+}
+
+START_TEST(test_sched_queue_stale)
+{
+	int ahead=0;
+	int total=0;
+	struct stat statp;
+	setup();
+	build_old_file(QUEUE "/00000000ffffffff.dead");
+	build_old_file(QUEUE "/.123.00000000ffffffff.dead");
+	build_file(QUEUE "/0000000000000001.mine", "");
+	fail_unless(!sched_queue_scan(QUEUE, "0000000000000001.mine",
+		&ahead, &total));
+	fail_unless(ahead==0);
+	fail_unless(total==1);
+	fail_unless(lstat(QUEUE "/00000000ffffffff.dead", &statp)==-1);
+	fail_unless(lstat(QUEUE "/.123.00000000ffffffff.dead", &statp)==-1);
+	tear_down();
+}
+END_TEST
+
+// An unlocked entry that has only just turned up might be in the middle of
+// being replaced, so it is left alone for a while, but not counted.
+START_TEST(test_sched_queue_stale_grace)
+{
+	int ahead=0;
+	int total=0;
+	struct stat statp;
+	setup();
+	build_file(QUEUE "/00000000ffffffff.dead", "");
+	build_file(QUEUE "/0000000000000001.mine", "");
+	fail_unless(!sched_queue_scan(QUEUE, "0000000000000001.mine",
+		&ahead, &total));
+	fail_unless(ahead==0);
+	fail_unless(total==1);
+	fail_unless(!lstat(QUEUE "/00000000ffffffff.dead", &statp));
+	tear_down();
+}
+END_TEST
+
+// Somebody locking their entry before renaming it into place is not in the
+// queue yet.
+START_TEST(test_sched_queue_joining)
+{
+	int ahead=0;
+	int total=0;
+	pid_t pid;
+	struct stat statp;
+	setup();
+	build_file(QUEUE "/0000000000000001.mine", "");
+	pid=hold_lock(QUEUE "/.123.00000000ffffffff.other");
+	fail_unless(!sched_queue_scan(QUEUE, "0000000000000001.mine",
+		&ahead, &total));
+	fail_unless(ahead==0);
+	fail_unless(total==1);
+	fail_unless(!lstat(QUEUE "/.123.00000000ffffffff.other", &statp));
+	release_lock(pid);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sched_no_limit)
+{
+	struct lock *slot=NULL;
+	struct stat statp;
+	setup();
+	fail_unless(!sched_wait(NULL, SCHED, "backup", 0, 1, 1, "cli", NULL, &slot));
+	fail_unless(slot==NULL);
+	fail_unless(lstat(SCHED, &statp)==-1);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sched_free_slot)
+{
+	struct lock *slot=NULL;
+	struct stat statp;
+	pid_t pid;
+	setup();
+	pid=hold_lock(SCHED "/backup.0");
+	fail_unless(!sched_wait(NULL, SCHED, "backup", 2, 1, 1, "cli", NULL, &slot));
+	fail_unless(slot!=NULL);
+	fail_unless(!strcmp(slot->path, SCHED "/backup.1"));
+	sched_release(&slot);
+	fail_unless(slot==NULL);
+	fail_unless(lstat(SCHED "/backup.1", &statp)==-1);
+	// Nothing left behind in the queue.
+	fail_unless(lstat(QUEUE "/0000000000000001.cli", &statp)==-1);
+	release_lock(pid);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sched_all_busy)
+{
+	struct lock *slot=NULL;
+	pid_t pid;
+	setup();
+	pid=hold_lock(SCHED "/backup.0");
+	fail_unless(sched_wait(NULL, SCHED, "backup", 1, 1, 1, "cli", NULL,
+		&slot)==1);
+	fail_unless(slot==NULL);
+	release_lock(pid);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sched_queue_order)
+{
+	struct lock *slot=NULL;
+	pid_t pid;
+	setup();
+	fail_unless(!mkdir(SCHED, 0777));
+	// Somebody more important is waiting, so we do not get the free slot.
+	pid=hold_lock(QUEUE "/0000000000000002.other");
+	fail_unless(sched_wait(NULL, SCHED, "backup", 1, 1, 1, "cli", NULL,
+		&slot)==1);
+	fail_unless(slot==NULL);
+	release_lock(pid);
+	// Somebody less important is waiting, so we do.
+	pid=hold_lock(QUEUE "/0000000000000000.other");
+	fail_unless(!sched_wait(NULL, SCHED, "backup", 1, 1, 1, "cli", NULL,
+		&slot));
+	fail_unless(slot!=NULL);
+	sched_release(&slot);
+	release_lock(pid);
+	tear_down();
+}
+END_TEST
+
+// The client is told where it is in the queue, so that the connection does
+// not go quiet.
+START_TEST(test_sched_keepalive)
+{
+	int w=0;
+	pid_t pid;
+	struct asfd *asfd;
+	struct lock *slot=NULL;
+	struct ioevent_list reads;
+	struct ioevent_list writes;
+	setup();
+	asfd=asfd_mock_setup(&reads, &writes);
+	asfd_assert_write(asfd, &w, 0, CMD_MESSAGE,
+		"backup queue position 1 of 1");
+	pid=hold_lock(SCHED "/backup.0");
+	fail_unless(sched_wait(asfd, SCHED, "backup", 1, 1, 1, "cli", NULL,
+		&slot)==1);
+	fail_unless(slot==NULL);
+	fail_unless(writes.cursor==1);
+	release_lock(pid);
+	asfd_free(&asfd);
+	asfd_mock_teardown(&reads, &writes);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_sched(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_sched");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 30);
+
+	tcase_add_test(tc_core, test_sched_priority);
+	tcase_add_test(tc_core, test_sched_expected_bytes);
+	tcase_add_test(tc_core, test_sched_queue_stale);
+	tcase_add_test(tc_core, test_sched_queue_stale_grace);
+	tcase_add_test(tc_core, test_sched_queue_joining);
+	tcase_add_test(tc_core, test_sched_no_limit);
+	tcase_add_test(tc_core, test_sched_free_slot);
+	tcase_add_test(tc_core, test_sched_all_busy);
+	tcase_add_test(tc_core, test_sched_queue_order);
+	tcase_add_test(tc_core, test_sched_keepalive);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,219 @@
+#include <check.h>
+#include "../../src/burp.h"
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/fsops.h"
+#include "../../src/strlist.h"
+#include "../../src/server/timestamp.h"
+#include "../../src/server/timer.h"
+#include "../builders/build_file.h"
+
+#define BASE		"utest_timer"
+#define CLIENT		BASE "/client"
+#define CURRENT		CLIENT "/current"
+
+static const char *days[]={"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+
+static void tear_down(struct strlist **args)
+{
+	strlists_free(args);
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void setup_format(struct strlist **args, const char *interval,
+	time_t last, const char *format)
+{
+	char buf[64]="";
+	char tstmp[32]="";
+	alloc_counters_reset();
+	fail_unless(!recursive_delete(BASE));
+	*args=NULL;
+	if(interval) fail_unless(!strlist_add(args, interval, 0));
+	if(!last) return;
+	strftime(tstmp, sizeof(tstmp), format, localtime(&last));
+	snprintf(buf, sizeof(buf), "0000001 %s\n", tstmp);
+	build_file(CURRENT "/timestamp", buf);
+}
+
+static void setup(struct strlist **args, const char *interval, time_t last)
+{
+	setup_format(args, interval, last, DEFAULT_TIMESTAMP_FORMAT);
+}
+
+// A timeband for right now.
+static void add_timeband(struct strlist **args, time_t now)
+{
+	char buf[32]="";
+	struct tm *tm=localtime(&now);
+	snprintf(buf, sizeof(buf), "%s,%02d", days[tm->tm_wday], tm->tm_hour);
+	fail_unless(!strlist_add(args, buf, 0));
+}
+
+START_TEST(test_timer_parse_interval)
+{
+	time_t secs=0;
+	fail_unless(!timer_parse_interval("30s", &secs));
+	fail_unless(secs==30);
+	fail_unless(!timer_parse_interval("20h", &secs));
+	fail_unless(secs==20*60*60);
+	fail_unless(!timer_parse_interval("2w", &secs));
+	fail_unless(secs==2*7*24*60*60);
+	fail_unless(!timer_parse_interval("1n", &secs));
+	fail_unless(secs==30*24*60*60);
+	fail_unless(timer_parse_interval("h", &secs)==-1);
+	fail_unless(timer_parse_interval("20", &secs)==-1);
+	fail_unless(timer_parse_interval("20x", &secs)==-1);
+	fail_unless(timer_parse_interval("20hh", &secs)==-1);
+	fail_unless(timer_parse_interval(NULL, &secs)==-1);
+}
+END_TEST
+
+START_TEST(test_timer_in_timeband)
+{
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_wday=1;
+	tm.tm_hour=5;
+	fail_unless(timer_in_timeband("Mon,Tue,00,05,19", &tm)==1);
+	fail_unless(timer_in_timeband("Tue,Wed,00,05,19", &tm)==0);
+	fail_unless(timer_in_timeband("Mon,Tue,00,06,19", &tm)==0);
+	// The hour has to come after the day.
+	fail_unless(timer_in_timeband("05,Mon", &tm)==0);
+}
+END_TEST
+
+START_TEST(test_timer_not_in_timeband)
+{
+	struct strlist *args;
+	time_t now=time(NULL);
+	setup(&args, "20h", 0);
+	fail_unless(!strlist_add(&args, "Never", 0));
+	fail_unless(timer_check("cli", CLIENT, CURRENT, NULL, args, now)==1);
+	tear_down(&args);
+}
+END_TEST
+
+START_TEST(test_timer_no_timebands)
+{
+	struct strlist *args;
+	time_t now=time(NULL);
+	setup(&args, "20h", 0);
+	fail_unless(timer_check("cli", CLIENT, CURRENT, NULL, args, now)==1);
+	tear_down(&args);
+}
+END_TEST
+
+START_TEST(test_timer_no_prior_backup)
+{
+	struct strlist *args;
+	time_t now=time(NULL);
+	setup(&args, "20h", 0);
+	add_timeband(&args, now);
+	fail_unless(timer_check("cli", CLIENT, CURRENT, NULL, args, now)==0);
+	tear_down(&args);
+}
+END_TEST
+
+START_TEST(test_timer_interval)
+{
+	struct strlist *args;
+	time_t now=time(NULL);
+
+	setup(&args, "20h", now-60*60);
+	add_timeband(&args, now);
+	fail_unless(timer_check("cli", CLIENT, CURRENT, NULL, args, now)==1);
+	tear_down(&args);
+
+	setup(&args, "20h", now-21*60*60);
+	add_timeband(&args, now);
+	fail_unless(timer_check("cli", CLIENT, CURRENT, NULL, args, now)==0);
+	tear_down(&args);
+}
+END_TEST
+
+#define OTHER_FORMAT	"%Y%m%d.%H%M%S"
+
+START_TEST(test_timer_timestamp_format)
+{
+	struct strlist *args;
+	time_t now=time(NULL);
+
+	setup_format(&args, "20h", now-60*60, OTHER_FORMAT);
+	add_timeband(&args, now);
+	fail_unless(timer_check("cli", CLIENT, CURRENT,
+		OTHER_FORMAT, args, now)==1);
+	tear_down(&args);
+
+	setup_format(&args, "20h", now-21*60*60, OTHER_FORMAT);
+	add_timeband(&args, now);
+	fail_unless(timer_check("cli", CLIENT, CURRENT,
+		OTHER_FORMAT, args, now)==0);
+	tear_down(&args);
+}
+END_TEST
+
+// When the timestamp cannot be read back, the time that it was written
+// is used instead.
+START_TEST(test_timer_timestamp_not_understood)
+{
+	time_t last=0;
+	struct strlist *args;
+	struct utimbuf times;
+	time_t now=time(NULL);
+
+	setup(&args, "20h", 0);
+	add_timeband(&args, now);
+	build_file(CURRENT "/timestamp", "0000001 not a time\n");
+	times.actime=now-60*60;
+	times.modtime=now-60*60;
+	fail_unless(!utime(CURRENT "/timestamp", &times));
+	fail_unless(!timer_last_backup("cli", CURRENT, NULL, &last));
+	fail_unless(last==now-60*60);
+	fail_unless(timer_check("cli", CLIENT, CURRENT, NULL, args, now)==1);
+
+	times.actime=now-21*60*60;
+	times.modtime=now-21*60*60;
+	fail_unless(!utime(CURRENT "/timestamp", &times));
+	fail_unless(timer_check("cli", CLIENT, CURRENT, NULL, args, now)==0);
+	tear_down(&args);
+}
+END_TEST
+
+START_TEST(test_timer_manual_backup)
+{
+	struct stat statp;
+	struct strlist *args;
+	time_t now=time(NULL);
+	setup(&args, "20h", now-60);
+	build_file(CLIENT "/backup", "");
+	fail_unless(timer_check("cli", CLIENT, CURRENT, NULL, args, now)==0);
+	fail_unless(lstat(CLIENT "/backup", &statp)==-1);
+	// Only once.
+	fail_unless(timer_check("cli", CLIENT, CURRENT, NULL, args, now)==1);
+	tear_down(&args);
+}
+END_TEST
+
+Suite *suite_server_timer(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_timer");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_timer_parse_interval);
+	tcase_add_test(tc_core, test_timer_in_timeband);
+	tcase_add_test(tc_core, test_timer_not_in_timeband);
+	tcase_add_test(tc_core, test_timer_no_timebands);
+	tcase_add_test(tc_core, test_timer_no_prior_backup);
+	tcase_add_test(tc_core, test_timer_interval);
+	tcase_add_test(tc_core, test_timer_timestamp_format);
+	tcase_add_test(tc_core, test_timer_timestamp_not_understood);
+	tcase_add_test(tc_core, test_timer_manual_backup);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
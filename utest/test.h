@@ -44,26 +44,33 @@ extern struct manio *do_manio_open(const char *path, const char *mode,
 extern void assert_bu_list(struct sdirs *sdirs, struct sd *s, unsigned int len);
 
 Suite *suite_alloc(void);
+Suite *suite_arena(void);
 Suite *suite_attribs(void);
 Suite *suite_base64(void);
+Suite *suite_budget(void);
 Suite *suite_client_auth(void);
 Suite *suite_client_find(void);
 Suite *suite_client_monitor_json_input(void);
 Suite *suite_client_monitor_lline(void);
 Suite *suite_client_protocol1_backup_phase2(void);
+Suite *suite_client_protocol1_backup_streams(void);
 Suite *suite_client_protocol2_backup_phase2(void);
 Suite *suite_client_restore(void);
 Suite *suite_client_xattr(void);
 Suite *suite_cmd(void);
 Suite *suite_conf(void);
 Suite *suite_conffile(void);
+Suite *suite_fsops(void);
 Suite *suite_fzp(void);
 Suite *suite_hexmap(void);
 Suite *suite_lock(void);
 Suite *suite_pathcmp(void);
+Suite *suite_pdeflate(void);
+Suite *suite_protocol1_dirdigest(void);
 Suite *suite_protocol1_handy(void);
 Suite *suite_protocol1_rs_buf(void);
 Suite *suite_protocol2_blist(void);
+Suite *suite_protocol2_flow(void);
 Suite *suite_protocol2_rabin_rconf(void);
 Suite *suite_protocol2_rabin_win(void);
 Suite *suite_protocol2_sbuf_protocol2(void);
@@ -71,19 +78,27 @@ Suite *suite_server_bu_get(void);
 Suite *suite_server_delete(void);
 Suite *suite_server_list(void);
 Suite *suite_server_manio(void);
+Suite *suite_server_mjoin(void);
+Suite *suite_server_pindex(void);
+Suite *suite_server_prefork(void);
 Suite *suite_server_monitor_browse(void);
 Suite *suite_server_monitor_cstat(void);
 Suite *suite_server_monitor_json_output(void);
 Suite *suite_server_resume(void);
 Suite *suite_server_restore(void);
+Suite *suite_server_sched(void);
 Suite *suite_server_sdirs(void);
+Suite *suite_server_timer(void);
 Suite *suite_server_protocol1_backup_phase2(void);
+Suite *suite_server_protocol1_backup_phase4(void);
 Suite *suite_server_protocol1_bedup(void);
 Suite *suite_server_protocol1_blocklen(void);
 Suite *suite_server_protocol1_dpth(void);
 Suite *suite_server_protocol1_fdirs(void);
+Suite *suite_server_protocol1_zlibio(void);
 Suite *suite_server_protocol2_backup_phase2(void);
 Suite *suite_server_protocol2_backup_phase4(void);
+Suite *suite_server_protocol2_bcompact(void);
 Suite *suite_server_protocol2_champ_chooser_candidate(void);
 Suite *suite_server_protocol2_champ_chooser_champ_server(void);
 Suite *suite_server_protocol2_champ_chooser_dindex(void);
@@ -0,0 +1,97 @@
+#include <check.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "test.h"
+#include "../src/alloc.h"
+#include "../src/arena.h"
+
+START_TEST(test_arena_alloc_free)
+{
+	struct arena *arena;
+	alloc_counters_reset();
+	fail_unless((arena=arena_alloc())!=NULL);
+	arena_free(&arena);
+	fail_unless(arena==NULL);
+	arena_free(&arena);
+	alloc_check();
+}
+END_TEST
+
+START_TEST(test_arena_malloc)
+{
+	int i;
+	char *a;
+	char *b;
+	char *big;
+	struct arena *arena;
+	alloc_counters_reset();
+	fail_unless((arena=arena_alloc())!=NULL);
+	fail_unless((a=(char *)arena_malloc(arena, 3))!=NULL);
+	fail_unless((b=(char *)arena_malloc(arena, 10))!=NULL);
+	fail_unless(!((uintptr_t)a%8));
+	fail_unless(!((uintptr_t)b%8));
+	fail_unless(b>=a+3);
+	fail_unless(arena_owns(arena, a));
+	fail_unless(arena_owns(arena, b+9));
+	fail_unless(!arena_owns(arena, &i));
+
+	// Bigger than a block.
+	fail_unless((big=(char *)arena_malloc(arena, ARENA_BLOCK_SIZE*2))!=NULL);
+	memset(big, 'x', ARENA_BLOCK_SIZE*2);
+	fail_unless(arena_owns(arena, big+ARENA_BLOCK_SIZE*2-1));
+
+	// Lots of small ones spill into new blocks.
+	for(i=0; i<10000; i++)
+		fail_unless(arena_malloc(arena, 100)!=NULL);
+
+	arena_free(&arena);
+	alloc_check();
+}
+END_TEST
+
+START_TEST(test_arena_reset)
+{
+	int i;
+	char *a;
+	char *b;
+	uint64_t allocs;
+	struct arena *arena;
+	alloc_counters_reset();
+	fail_unless((arena=arena_alloc())!=NULL);
+	fail_unless((a=(char *)arena_malloc(arena, 100))!=NULL);
+	for(i=0; i<10000; i++)
+		fail_unless(arena_malloc(arena, 100)!=NULL);
+	allocs=alloc_count;
+	arena_reset(arena);
+	fail_unless((b=(char *)arena_malloc(arena, 100))!=NULL);
+	fail_unless(a==b);
+
+	// Filling up again after a reset reuses the existing blocks.
+	for(i=0; i<10000; i++)
+	{
+		fail_unless((b=(char *)arena_malloc(arena, 100))!=NULL);
+		memset(b, 'x', 100);
+	}
+	fail_unless(alloc_count==allocs);
+
+	arena_free(&arena);
+	alloc_check();
+}
+END_TEST
+
+Suite *suite_arena(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("arena");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_arena_alloc_free);
+	tcase_add_test(tc_core, test_arena_malloc);
+	tcase_add_test(tc_core, test_arena_reset);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
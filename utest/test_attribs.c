@@ -43,11 +43,22 @@ void assert_sbuf(struct sbuf *a, struct sbuf *b, enum protocol protocol)
 	}
 }
 
-static void test_attribs(enum protocol protocol)
+// Binary attributes can contain zeros, so do not use strdup.
+static void copy_attr(struct sbuf *dst, struct sbuf *src)
+{
+	free_w(&dst->attr.buf);
+	fail_unless((dst->attr.buf
+		=(char *)malloc_w(src->attr.len+1, __func__))!=NULL);
+	memcpy(dst->attr.buf, src->attr.buf, src->attr.len+1);
+	dst->attr.len=src->attr.len;
+}
+
+static void test_attribs(enum protocol protocol, int binary)
 {
 	int i=0;
 	prng_init(0);
 	base64_init();
+	attribs_set_binary(binary);
 	for(i=0; i<10000; i++)
 	{
 		struct sbuf *encode;
@@ -56,27 +67,71 @@ static void test_attribs(enum protocol protocol)
 		decode=sbuf_alloc(protocol);
 
 		fail_unless(!attribs_encode(encode));
-		free_w(&decode->attr.buf);
-		fail_unless((decode->attr.buf
-			=strdup_w(encode->attr.buf, __func__))!=NULL);
-		decode->attr.len=encode->attr.len;
+		fail_unless(attribs_is_binary(&encode->attr)==binary);
+		copy_attr(decode, encode);
 		attribs_decode(decode);
 		assert_sbuf(encode, decode, protocol);
+		if(protocol==PROTO_2)
+			fail_unless(decode_file_no(&encode->attr)
+				==encode->protocol2->index);
 		sbuf_free(&encode);
 		sbuf_free(&decode);
 	}
+	attribs_set_binary(0);
 	tear_down();
 }
 
 START_TEST(test_attribs_protocol1)
 {
-	test_attribs(PROTO_1);
+	test_attribs(PROTO_1, 0);
 }
 END_TEST
 
 START_TEST(test_attribs_protocol2)
 {
-	test_attribs(PROTO_2);
+	test_attribs(PROTO_2, 0);
+}
+END_TEST
+
+START_TEST(test_attribs_binary_protocol1)
+{
+	test_attribs(PROTO_1, 1);
+}
+END_TEST
+
+START_TEST(test_attribs_binary_protocol2)
+{
+	test_attribs(PROTO_2, 1);
+}
+END_TEST
+
+// Binary attributes from a manifest go back to text for a peer that has
+// not asked for binary.
+START_TEST(test_attribs_for_peer)
+{
+	struct sbuf *sb;
+	struct sbuf *decode;
+	prng_init(0);
+	base64_init();
+	sb=build_attribs_reduce(PROTO_1);
+	decode=sbuf_alloc(PROTO_1);
+	attribs_set_binary(1);
+	fail_unless(!attribs_encode(sb));
+	// A buffer read from a manifest is only as big as what was in it, so
+	// the text form needs room of its own.
+	copy_attr(decode, sb);
+	copy_attr(sb, decode);
+	fail_unless(!attribs_for_peer(sb));
+	fail_unless(attribs_is_binary(&sb->attr));
+	attribs_set_binary(0);
+	fail_unless(!attribs_for_peer(sb));
+	fail_unless(!attribs_is_binary(&sb->attr));
+	copy_attr(decode, sb);
+	attribs_decode(decode);
+	assert_sbuf(sb, decode, PROTO_1);
+	sbuf_free(&sb);
+	sbuf_free(&decode);
+	tear_down();
 }
 END_TEST
 
@@ -93,6 +148,9 @@ Suite *suite_attribs(void)
 
 	tcase_add_test(tc_core, test_attribs_protocol1);
 	tcase_add_test(tc_core, test_attribs_protocol2);
+	tcase_add_test(tc_core, test_attribs_binary_protocol1);
+	tcase_add_test(tc_core, test_attribs_binary_protocol2);
+	tcase_add_test(tc_core, test_attribs_for_peer);
 	suite_add_tcase(s, tc_core);
 
 	return s;
@@ -0,0 +1,122 @@
+#include "test.h"
+#include "../src/budget.h"
+
+static void setup(float weight)
+{
+	fail_unless(!budget_init());
+	budget_set_weight(weight);
+}
+
+static void tear_down(void)
+{
+	budget_set_weight(0);
+	budget_free();
+}
+
+START_TEST(test_budget_not_initialised)
+{
+	budget_set_weight(1);
+	budget_set_rate(BUDGET_NETWORK, 1000);
+	budget_charge(BUDGET_NETWORK, 1000000);
+	fail_unless(!budget_wait(BUDGET_NETWORK));
+	budget_set_weight(0);
+}
+END_TEST
+
+START_TEST(test_budget_no_limit)
+{
+	setup(1);
+	budget_charge(BUDGET_NETWORK, 1000000);
+	fail_unless(!budget_wait(BUDGET_NETWORK));
+	fail_unless(budget_tokens(BUDGET_NETWORK)==0);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_budget_no_weight)
+{
+	setup(0);
+	budget_set_rate(BUDGET_NETWORK, 1000);
+	budget_charge(BUDGET_NETWORK, 1000000);
+	fail_unless(budget_tokens(BUDGET_NETWORK)==1000);
+	fail_unless(!budget_wait(BUDGET_NETWORK));
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_budget_empty_bucket)
+{
+	setup(1);
+	budget_set_rate(BUDGET_STORAGE, 1000000);
+	fail_unless(budget_tokens(BUDGET_STORAGE)==1000000);
+	fail_unless(!budget_wait(BUDGET_STORAGE));
+	budget_charge(BUDGET_STORAGE, 1050000);
+	fail_unless(budget_tokens(BUDGET_STORAGE)<0);
+	fail_unless(budget_wait(BUDGET_STORAGE)==1);
+	// The other bucket is not affected.
+	fail_unless(!budget_wait(BUDGET_NETWORK));
+	// Filled up again after a while, but not over the top.
+	budget_block(BUDGET_STORAGE);
+	fail_unless(budget_tokens(BUDGET_STORAGE)>0);
+	usleep(1100000);
+	fail_unless(!budget_wait(BUDGET_STORAGE));
+	fail_unless(budget_tokens(BUDGET_STORAGE)==1000000);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_budget_weight)
+{
+	// Weight does not change what gets charged, so the total stays
+	// within the rate.
+	setup(4);
+	budget_set_rate(BUDGET_NETWORK, 1000000);
+	budget_charge(BUDGET_NETWORK, 1000000);
+	fail_unless(budget_tokens(BUDGET_NETWORK)<=0);
+	// It only changes how long to wait before trying again.
+	fail_unless(budget_sleep_time(-39999, 1000000)==10000);
+	budget_set_weight(1);
+	fail_unless(budget_sleep_time(-39999, 1000000)==40000);
+	fail_unless(budget_sleep_time(0, 1000000)==1000);
+	fail_unless(budget_sleep_time(-1000000, 1000000)==100000);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_budget_shared)
+{
+	pid_t pid;
+	setup(1);
+	budget_set_rate(BUDGET_NETWORK, 1000000);
+	fail_unless((pid=fork())>=0);
+	if(!pid)
+	{
+		budget_charge(BUDGET_NETWORK, 600000);
+		_exit(0);
+	}
+	fail_unless(waitpid(pid, NULL, 0)==pid);
+	fail_unless(budget_tokens(BUDGET_NETWORK)<=400000);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_budget(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("budget");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 30);
+
+	tcase_add_test(tc_core, test_budget_not_initialised);
+	tcase_add_test(tc_core, test_budget_no_limit);
+	tcase_add_test(tc_core, test_budget_no_weight);
+	tcase_add_test(tc_core, test_budget_empty_bucket);
+	tcase_add_test(tc_core, test_budget_weight);
+	tcase_add_test(tc_core, test_budget_shared);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -25,6 +25,7 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_SSL_PEER_CN:
 		case OPT_SSL_CIPHERS:
 		case OPT_SSL_DHFILE:
+		case OPT_SSL_SESSION_CACHE:
 		case OPT_CA_CONF:
 		case OPT_CA_NAME:
 		case OPT_CA_SERVER_NAME:
@@ -70,12 +71,22 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_DEDUP_GROUP:
 		case OPT_VSS_DRIVES:
 		case OPT_REGEX:
+		case OPT_DIFF_COMPARE:
 		case OPT_RESTORE_CLIENT:
+		case OPT_JOURNAL:
 			fail_unless(get_string(c[o])==NULL);
 			break;
 		case OPT_RATELIMIT:
+		case OPT_NETWORK_BUDGET:
+		case OPT_STORAGE_BUDGET:
 			fail_unless(get_float(c[o])==0);
 			break;
+		case OPT_BUDGET_WEIGHT:
+			fail_unless(get_float(c[o])==1);
+			break;
+		case OPT_RESTORE_BUDGET_WEIGHT:
+			fail_unless(get_float(c[o])==2);
+			break;
 		case OPT_CLIENT_IS_WINDOWS:
 		case OPT_RANDOMISE:
 		case OPT_B_SCRIPT_POST_RUN_ON_FAIL:
@@ -99,10 +110,26 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_STRIP_VSS:
 		case OPT_ATIME:
 		case OPT_SCAN_PROBLEM_RAISES_ERROR:
+		case OPT_SCAN_WORKERS:
+		case OPT_READ_AHEAD_FILES:
+		case OPT_RESTORE_PREALLOCATE:
 		case OPT_OVERWRITE:
 		case OPT_STRIP:
 		case OPT_MESSAGE:
 		case OPT_CA_CRL_CHECK:
+		case OPT_MANIFEST_READAHEAD:
+		case OPT_MANIFEST_ZSTD:
+		case OPT_COMPRESSION_WORKERS:
+		case OPT_DATA_ZSTD:
+		case OPT_PHASE4_WORKERS:
+		case OPT_DIR_DIGESTS:
+		case OPT_PATH_INDEX:
+		case OPT_BINARY_ATTRIBS:
+		case OPT_GC_RATE:
+		case OPT_GC_TIME_LIMIT:
+		case OPT_PREFORK_CHILDREN:
+		case OPT_MAX_BACKUPS:
+		case OPT_MAX_BACKUP_PHASE4:
 			fail_unless(get_int(c[o])==0);
 			break;
 		case OPT_DAEMON:
@@ -124,9 +151,14 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_R_SCRIPT_RESERVED_ARGS:
 		case OPT_ACL:
 		case OPT_XATTR:
+		case OPT_MAX_RESTORE_STREAMS:
+		case OPT_RESTORE_STREAMS:
+		case OPT_MAX_BACKUP_STREAMS:
+		case OPT_BACKUP_STREAMS:
 			fail_unless(get_int(c[o])==1);
 			break;
 		case OPT_NETWORK_TIMEOUT:
+		case OPT_SSL_SESSION_TIMEOUT:
 			fail_unless(get_int(c[o])==60*60*2);
 			break;
 		case OPT_SSL_COMPRESSION:
@@ -140,6 +172,9 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_MAX_STORAGE_SUBDIRS:
 			fail_unless(get_int(c[o])==30000);
 			break;
+		case OPT_BACKUP_QUEUE_TIMEOUT:
+			fail_unless(get_int(c[o])==60*10);
+			break;
 		case OPT_MAX_HARDLINKS:
 			fail_unless(get_int(c[o])==10000);
 			break;
@@ -162,6 +197,7 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_RESTORE_CLIENTS:
 		case OPT_KEEP:
 		case OPT_INCEXCDIR:
+		case OPT_CONF_FILES:
 		case OPT_INCLUDE:
 		case OPT_EXCLUDE:
 		case OPT_FSCHGDIR:
@@ -184,6 +220,22 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_SOFT_QUOTA:
 		case OPT_MIN_FILE_SIZE:
 		case OPT_MAX_FILE_SIZE:
+		case OPT_MANIFEST_GZBUFFER:
+			fail_unless(get_uint64_t(c[o])==0);
+			break;
+		case OPT_MANIFEST_ZSTD_FRAME:
+			fail_unless(get_int(c[o])==1000);
+			break;
+		case OPT_COMPRESSION_WORKERS_MIN_SIZE:
+			fail_unless(get_uint64_t(c[o])==16*1024*1024);
+			break;
+		case OPT_BLK_WINDOW_MEMORY:
+			fail_unless(get_uint64_t(c[o])==256*1024*1024);
+			break;
+		case OPT_READ_AHEAD_SIZE:
+			fail_unless(get_uint64_t(c[o])==8*1024*1024);
+			break;
+		case OPT_RESTORE_WRITE_BUFFER:
 			fail_unless(get_uint64_t(c[o])==0);
 			break;
         	case OPT_WORKING_DIR_RECOVERY_METHOD:
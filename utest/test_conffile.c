@@ -1,6 +1,7 @@
 #include <check.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <utime.h>
 #include "test.h"
 #include "builders/build_file.h"
 #include "../src/alloc.h"
@@ -174,6 +175,34 @@ START_TEST(test_client_includes_excludes)
 }
 END_TEST
 
+START_TEST(test_conf_files_changed)
+{
+	struct utimbuf times;
+	struct conf **confs=NULL;
+	setup(&confs, NULL);
+	build_file(CONFFILE, MIN_SERVER_CONF ". extra.conf\n");
+	build_file(BASE "/extra.conf", "max_children=10\n");
+	// Nothing known yet.
+	fail_unless(conf_files_changed(confs)==1);
+	fail_unless(!conf_load_global_only(CONFFILE, confs));
+	fail_unless(get_int(confs[OPT_MAX_CHILDREN])==10);
+	fail_unless(conf_files_changed(confs)==0);
+
+	// Changing an included file counts.
+	times.actime=times.modtime=1000;
+	fail_unless(!utime(BASE "/extra.conf", &times));
+	fail_unless(conf_files_changed(confs)==1);
+
+	confs_free_content(confs);
+	fail_unless(!confs_init(confs));
+	fail_unless(!conf_load_global_only(CONFFILE, confs));
+	fail_unless(conf_files_changed(confs)==0);
+	fail_unless(!unlink(BASE "/extra.conf"));
+	fail_unless(conf_files_changed(confs)==1);
+	tear_down(NULL, &confs);
+}
+END_TEST
+
 static const char *include_failures[] = {
 	MIN_CLIENT_CONF "include=not_absolute\n",
 	MIN_CLIENT_CONF "include=/\ninclude=/\n"
@@ -650,6 +679,7 @@ Suite *suite_conffile(void)
 	tcase_add_test(tc_core, test_client_includes_excludes);
 	tcase_add_test(tc_core, test_client_include_failures);
 	tcase_add_test(tc_core, test_server_conf);
+	tcase_add_test(tc_core, test_conf_files_changed);
 	tcase_add_test(tc_core, test_server_script_pre_post);
 	tcase_add_test(tc_core, test_server_script);
 	tcase_add_test(tc_core, test_backup_script_pre_post);
@@ -0,0 +1,153 @@
+#include "test.h"
+#include "builders/build_file.h"
+#include "../src/alloc.h"
+#include "../src/fsops.h"
+#include "../src/prepend.h"
+
+#define BASE		"utest_fsops"
+#define NAME_MAX_LEN	255
+
+// Long names make the getdents() records big, so that reading them all
+// takes more than one call and the buffer has to grow between calls.
+static char *long_name(int i)
+{
+	static char buf[NAME_MAX_LEN+1];
+	snprintf(buf, sizeof(buf), "%05d", i);
+	memset(buf+5, 'x', NAME_MAX_LEN-5);
+	buf[NAME_MAX_LEN]='\0';
+	return buf;
+}
+
+static char *short_name(int i)
+{
+	static char buf[16];
+	snprintf(buf, sizeof(buf), "%05d", i);
+	return buf;
+}
+
+// Every other entry has a long name, and every tenth one is a directory.
+static char *entry_name(int i)
+{
+	return i%2?long_name(i):short_name(i);
+}
+
+static int entry_is_dir(int i)
+{
+	return !(i%10);
+}
+
+static void build_dir(int entries)
+{
+	int i;
+	char *path;
+	char *file;
+	fail_unless(!recursive_delete(BASE));
+	for(i=0; i<entries; i++)
+	{
+		fail_unless((path=prepend_s(BASE, entry_name(i)))!=NULL);
+		if(entry_is_dir(i))
+		{
+			fail_unless((file=prepend_s(path, "file"))!=NULL);
+			build_file(file, NULL);
+			free_w(&file);
+		}
+		else
+			build_file(path, "");
+		free_w(&path);
+	}
+}
+
+static void assert_entry(struct dentries *d, int x, int i)
+{
+	unsigned char type=dentries_type(d, x);
+	ck_assert_str_eq(entry_name(i), d->name[x]);
+	// Some file systems do not say.
+	if(type==DT_UNKNOWN)
+		return;
+	fail_unless(type==(entry_is_dir(i)?DT_DIR:DT_REG));
+}
+
+static void do_test_dentries_read(int entries)
+{
+	int x;
+	int i;
+	char *seen;
+	struct dentries d;
+
+	build_dir(entries);
+
+	fail_unless(!dentries_read(BASE, &d, 0, 1));
+	fail_unless(d.count==entries);
+	for(x=0; x<d.count; x++)
+		assert_entry(&d, x, x);
+	dentries_free(&d);
+	fail_unless(!d.buf);
+	fail_unless(!d.count);
+
+	// Without sorting, they come back in whatever order the file system
+	// likes, but all of them and only once each.
+	fail_unless((seen=(char *)calloc_w(entries, 1, __func__))!=NULL);
+	fail_unless(!dentries_read(BASE, &d, 0, 0));
+	fail_unless(d.count==entries);
+	for(x=0; x<d.count; x++)
+	{
+		i=atoi(d.name[x]);
+		fail_unless(i>=0 && i<entries);
+		fail_unless(!seen[i]);
+		seen[i]=1;
+		assert_entry(&d, x, i);
+	}
+	dentries_free(&d);
+	free_v((void **)&seen);
+
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+START_TEST(test_dentries_read_empty)
+{
+	do_test_dentries_read(0);
+}
+END_TEST
+
+START_TEST(test_dentries_read_few)
+{
+	do_test_dentries_read(5);
+}
+END_TEST
+
+START_TEST(test_dentries_read_refills)
+{
+	do_test_dentries_read(1000);
+}
+END_TEST
+
+START_TEST(test_dentries_read_no_directory)
+{
+	struct dentries d;
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!init_fs_max("."));
+	fail_unless(dentries_read(BASE, &d, 0, 1)==1);
+	fail_unless(!d.buf);
+	fail_unless(!d.count);
+	alloc_check();
+}
+END_TEST
+
+Suite *suite_fsops(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("fsops");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_dentries_read_empty);
+	tcase_add_test(tc_core, test_dentries_read_few);
+	tcase_add_test(tc_core, test_dentries_read_refills);
+	tcase_add_test(tc_core, test_dentries_read_no_directory);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -166,6 +166,57 @@ START_TEST(test_fzp_gzread)
 }
 END_TEST
 
+static struct fzp *gzopen_readahead(const char *path, const char *mode)
+{
+	return fzp_gzopen_readahead(path, 0 /* bufsize */);
+}
+
+START_TEST(test_fzp_gzread_readahead)
+{
+	setup_for_read(fzp_gzopen, content);
+	FOREACH(rd) read_checks(gzopen_readahead, &rd[i]);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_fzp_gzread_readahead_tell)
+{
+	char buf[32]="";
+	struct fzp *fzp;
+	setup_for_read(fzp_gzopen, content);
+	fail_unless((fzp=fzp_gzopen_readahead(file, 4096))!=NULL);
+	fail_unless(fzp_tell(fzp)==0);
+	fail_unless(fzp_read(fzp, buf, 5)==5);
+	fail_unless(fzp_tell(fzp)==5);
+	fail_unless(fzp_seek(fzp, 0, SEEK_SET)==-1);
+	fail_unless(fzp_write(fzp, buf, 1)==0);
+	fail_unless(!fzp_close(&fzp));
+
+	// The position given can be used to seek on a normal open.
+	fail_unless((fzp=fzp_gzopen(file, "rb"))!=NULL);
+	fail_unless(!fzp_seek(fzp, 5, SEEK_SET));
+	fail_unless(fzp_read(fzp, buf, 3)==3);
+	buf[3]='\0';
+	ck_assert_str_eq("567", buf);
+	fail_unless(!fzp_close(&fzp));
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_fzp_gzread_readahead_corrupt)
+{
+	char buf[32]="";
+	struct fzp *fzp;
+	// A gzip header followed by rubbish.
+	setup_for_read(fzp_open, "\x1f\x8b\x08\x00rubbishrubbish");
+	fail_unless((fzp=fzp_gzopen_readahead(file, 0))!=NULL);
+	fzp_read(fzp, buf, sizeof(buf));
+	fail_unless(fzp_eof(fzp));
+	fail_unless(fzp_close(&fzp)==-1);
+	tear_down();
+}
+END_TEST
+
 START_TEST(test_fzp_seek)
 {
 	do_seek_tests(fzp_open);
@@ -192,6 +243,113 @@ START_TEST(test_fzp_gztruncate)
 }
 END_TEST
 
+#ifdef HAVE_ZSTD
+START_TEST(test_fzp_zstdread)
+{
+	do_read_tests(fzp_zstdopen);
+}
+END_TEST
+
+START_TEST(test_fzp_zstdread_detected)
+{
+	// Normal gzip and readahead opens notice the zstd magic.
+	setup_for_read(fzp_zstdopen, content);
+	fail_unless(fzp_is_zstd(file));
+	FOREACH(rd) read_checks(fzp_gzopen, &rd[i]);
+	FOREACH(rd) read_checks(gzopen_readahead, &rd[i]);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_fzp_zstdseek)
+{
+	do_seek_tests(fzp_zstdopen);
+}
+END_TEST
+
+START_TEST(test_fzp_zstdtruncate)
+{
+	do_truncate_tests(fzp_zstdopen, FZP_ZSTD);
+}
+END_TEST
+
+// Write the content three characters to a frame.
+static void setup_zstd_frames(void)
+{
+	struct fzp *fzp;
+	size_t i;
+	size_t len=strlen(content);
+	unlink(file);
+	fail_unless((fzp=fzp_zstdopen(file, "wb"))!=NULL);
+	for(i=0; i<len; i+=3)
+	{
+		size_t w=len-i<3?len-i:3;
+		fail_unless(fzp_write(fzp, content+i, w)==w);
+		fail_unless(!fzp_end_frame(fzp));
+	}
+	fail_unless(!fzp_close(&fzp));
+}
+
+START_TEST(test_fzp_zstdseek_frames)
+{
+	char buf[32]="";
+	struct fzp *fzp;
+	setup_zstd_frames();
+	fail_unless((fzp=fzp_zstdopen(file, "rb"))!=NULL);
+	fail_unless(fzp_read(fzp, buf, 10)==10);
+	fail_unless(!fzp_seek(fzp, 7, SEEK_SET));
+	fail_unless(fzp_tell(fzp)==7);
+	fail_unless(fzp_read(fzp, buf, 4)==4);
+	buf[4]='\0';
+	ck_assert_str_eq("789a", buf);
+	fail_unless(!fzp_seek(fzp, 1, SEEK_SET));
+	fail_unless(fzp_read(fzp, buf, 2)==2);
+	buf[2]='\0';
+	ck_assert_str_eq("12", buf);
+	fail_unless(!fzp_close(&fzp));
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_fzp_zstdtruncate_frames)
+{
+	FOREACH(td)
+	{
+		setup_zstd_frames();
+		truncate_checks(fzp_zstdopen, FZP_ZSTD, &td[i]);
+		tear_down();
+	}
+	// Truncate twice, once at a frame boundary.
+	setup_zstd_frames();
+	fail_unless(!fzp_truncate(file, FZP_ZSTD, 9, 9 /* compression */));
+	truncate_checks(fzp_zstdopen, FZP_ZSTD, &td[1]);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_fzp_zstdgets)
+{
+	char buf[32]="";
+	struct fzp *fzp;
+	setup_for_read(fzp_zstdopen, "0123\n456789abcdef\ng");
+	fail_unless((fzp=fzp_zstdopen(file, "rb"))!=NULL);
+	ck_assert_str_eq("0123\n", fzp_gets(fzp, buf, sizeof(buf)));
+	// A line longer than the buffer comes back in pieces.
+	ck_assert_str_eq("45678", fzp_gets(fzp, buf, 6));
+	ck_assert_str_eq("9abcdef\n", fzp_gets(fzp, buf, sizeof(buf)));
+	ck_assert_str_eq("g", fzp_gets(fzp, buf, sizeof(buf)));
+	fail_unless(fzp_gets(fzp, buf, sizeof(buf))==NULL);
+	fail_unless(fzp_tell(fzp)==19);
+	// The skip from a seek happens before the next line is read.
+	fail_unless(!fzp_seek(fzp, 2, SEEK_SET));
+	ck_assert_str_eq("23\n", fzp_gets(fzp, buf, sizeof(buf)));
+	fail_unless(fzp_tell(fzp)==5);
+	fail_unless(!fzp_close(&fzp));
+	tear_down();
+}
+END_TEST
+#endif
+
 START_TEST(test_fzp_null_pointer)
 {
 	struct fzp *fzp=NULL;
@@ -205,6 +363,8 @@ START_TEST(test_fzp_null_pointer)
 	fail_unless(fzp_tell(NULL)==-1);
 	fail_unless(fzp_truncate(NULL, FZP_FILE, 1, 9 /* compression */)==-1);
 	fail_unless(fzp_printf(NULL, "%s", "blah")==-1);
+	fail_unless(fzp_gzbuffer(NULL, 0)==-1);
+	fail_unless(fzp_end_frame(NULL)==-1);
 	fzp_setlinebuf(NULL);
 	fail_unless(fzp_gets(NULL, NULL, 0)==NULL);
 	fail_unless(fzp_fileno(NULL)==-1);
@@ -226,10 +386,22 @@ Suite *suite_fzp(void)
 
 	tcase_add_test(tc_core, test_fzp_read);
 	tcase_add_test(tc_core, test_fzp_gzread);
+	tcase_add_test(tc_core, test_fzp_gzread_readahead);
+	tcase_add_test(tc_core, test_fzp_gzread_readahead_tell);
+	tcase_add_test(tc_core, test_fzp_gzread_readahead_corrupt);
 	tcase_add_test(tc_core, test_fzp_seek);
 	tcase_add_test(tc_core, test_fzp_gzseek);
 	tcase_add_test(tc_core, test_fzp_truncate);
 	tcase_add_test(tc_core, test_fzp_gztruncate);
+#ifdef HAVE_ZSTD
+	tcase_add_test(tc_core, test_fzp_zstdread);
+	tcase_add_test(tc_core, test_fzp_zstdread_detected);
+	tcase_add_test(tc_core, test_fzp_zstdseek);
+	tcase_add_test(tc_core, test_fzp_zstdtruncate);
+	tcase_add_test(tc_core, test_fzp_zstdseek_frames);
+	tcase_add_test(tc_core, test_fzp_zstdtruncate_frames);
+	tcase_add_test(tc_core, test_fzp_zstdgets);
+#endif
 	tcase_add_test(tc_core, test_fzp_null_pointer);
 	suite_add_tcase(s, tc_core);
 
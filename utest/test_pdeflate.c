@@ -0,0 +1,150 @@
+#include "test.h"
+#include "../src/alloc.h"
+#include "../src/async.h"
+#include "../src/pdeflate.h"
+#include "prng.h"
+
+#include <zlib.h>
+
+static uint8_t *obuf=NULL;
+static size_t olen=0;
+
+static void tear_down(void)
+{
+	free_v((void **)&obuf);
+	olen=0;
+	pdeflate_set_workers(0, 0);
+	alloc_check();
+}
+
+static int collect_func(void *ctx, uint8_t *buf, size_t len)
+{
+	fail_unless(len<=ZCHUNK);
+	fail_unless((obuf=(uint8_t *)realloc_w(obuf, olen+len, __func__))
+		!=NULL);
+	memcpy(obuf+olen, buf, len);
+	olen+=len;
+	return 0;
+}
+
+static int stop_func(void *ctx, uint8_t *buf, size_t len)
+{
+	return 1;
+}
+
+// Inflate what was produced with plain zlib, and compare.
+static void check_inflates_to(uint8_t *expected, size_t len)
+{
+	z_stream strm;
+	uint8_t *got;
+	fail_unless((got=(uint8_t *)malloc_w(len+1, __func__))!=NULL);
+	memset(&strm, 0, sizeof(strm));
+	fail_unless(inflateInit2(&strm, 15+16)==Z_OK);
+	strm.next_in=obuf;
+	strm.avail_in=olen;
+	strm.next_out=got;
+	strm.avail_out=len+1;
+	fail_unless(inflate(&strm, Z_FINISH)==Z_STREAM_END);
+	fail_unless(strm.total_out==len);
+	fail_unless(!strm.avail_in);
+	fail_unless(!memcmp(got, expected, len));
+	inflateEnd(&strm);
+	free_v((void **)&got);
+}
+
+static void run_test(int workers, size_t len, size_t piece)
+{
+	size_t i;
+	size_t l;
+	uint8_t *in;
+	struct pdeflate *pd;
+
+	pdeflate_set_workers(workers, 0);
+	fail_unless((in=(uint8_t *)malloc_w(len+1, __func__))!=NULL);
+	prng_init(0);
+	// Something compressible.
+	for(i=0; i<len; i++)
+		in[i]='a'+prng_next()%8;
+
+	fail_unless((pd=pdeflate_alloc(9))!=NULL);
+	for(i=0; i<len; i+=l)
+	{
+		l=len-i<piece?len-i:piece;
+		fail_unless(!pdeflate_write(pd, in+i, l, collect_func, NULL));
+	}
+	fail_unless(!pdeflate_finish(pd, collect_func, NULL));
+	pdeflate_free(&pd);
+	fail_unless(pd==NULL);
+
+	check_inflates_to(in, len);
+	free_v((void **)&in);
+	tear_down();
+}
+
+START_TEST(test_pdeflate_empty)
+{
+	run_test(2, 0, 1);
+}
+END_TEST
+
+START_TEST(test_pdeflate_small)
+{
+	run_test(2, 100, 7);
+}
+END_TEST
+
+START_TEST(test_pdeflate_many_blocks)
+{
+	run_test(3, 1000000, ZCHUNK);
+}
+END_TEST
+
+START_TEST(test_pdeflate_more_workers_than_blocks)
+{
+	run_test(8, 200000, 1000);
+}
+END_TEST
+
+START_TEST(test_pdeflate_stop)
+{
+	struct pdeflate *pd;
+	pdeflate_set_workers(2, 0);
+	fail_unless((pd=pdeflate_alloc(9))!=NULL);
+	fail_unless(pdeflate_write(pd, (uint8_t *)"a", 1, stop_func, NULL)==1);
+	pdeflate_free(&pd);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_pdeflate_wanted)
+{
+	pdeflate_set_workers(0, 0);
+	fail_unless(!pdeflate_wanted(1000));
+	pdeflate_set_workers(1, 0);
+	fail_unless(!pdeflate_wanted(1000));
+	pdeflate_set_workers(4, 1000);
+	fail_unless(!pdeflate_wanted(999));
+	fail_unless(pdeflate_wanted(1000));
+	tear_down();
+}
+END_TEST
+
+Suite *suite_pdeflate(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("pdeflate");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_pdeflate_empty);
+	tcase_add_test(tc_core, test_pdeflate_small);
+	tcase_add_test(tc_core, test_pdeflate_many_blocks);
+	tcase_add_test(tc_core, test_pdeflate_more_workers_than_blocks);
+	tcase_add_test(tc_core, test_pdeflate_stop);
+	tcase_add_test(tc_core, test_pdeflate_wanted);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}